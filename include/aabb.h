@@ -2,6 +2,7 @@
 #define AABB_H
 
 #include "utils.h"
+#include "stats.h"
 
 class aabb {
   public:
@@ -45,6 +46,7 @@ class aabb {
     }
 
     bool hit(const ray& r, interval ray_t) const {
+        RT_STAT(aabb_tests);
         for (int a = 0; a < 3; a++) {
             auto invD = 1 / r.direction()[a];
             auto orig = r.origin()[a];
@@ -64,6 +66,27 @@ class aabb {
         return true;
     }
 
+    bool hit_span(const ray& r, interval& span) const {
+        // Clips span to the part of the ray inside the box. Returns false if that part is empty.
+        for (int a = 0; a < 3; a++) {
+            auto invD = 1 / r.direction()[a];
+            auto orig = r.origin()[a];
+
+            auto t0 = (axis(a).min - orig) * invD;
+            auto t1 = (axis(a).max - orig) * invD;
+
+            if (invD < 0)
+                std::swap(t0, t1);
+
+            if (t0 > span.min) span.min = t0;
+            if (t1 < span.max) span.max = t1;
+
+            if (span.max <= span.min)
+                return false;
+        }
+        return true;
+    }
+
     int longest_axis() const {
         // Returns the index of the longest axis of the bounding box.
 
@@ -0,0 +1,312 @@
+#ifndef ANIMATION_H
+#define ANIMATION_H
+
+#include "utils.h"
+#include "hittable.h"
+#include "camera.h"
+#include "motion_bvh.h"
+
+#include <algorithm>
+#include <vector>
+
+/**
+ * @brief Piecewise linear track of rigid transforms over time: a rotation about the y axis
+ * followed by a translation, the same pair every scene file object takes. Before the first key
+ * and after the last the track holds still.
+ *
+ */
+class keyframe_track {
+  public:
+    struct key {
+        double time;
+        vec3 offset;
+        double angle;   // Degrees about the y axis
+    };
+
+    void add(double time, const vec3& offset, double angle) {
+        key k{time, offset, angle};
+        auto at = std::upper_bound(keys.begin(), keys.end(), time,
+                                   [](double t, const key& other) { return t < other.time; });
+        keys.insert(at, k);
+    }
+
+    bool empty() const { return keys.empty(); }
+    const std::vector<key>& all() const { return keys; }
+
+    key sample(double time) const {
+        if (keys.empty()) return key{time, vec3(0,0,0), 0};
+        if (time <= keys.front().time) return keys.front();
+        if (time >= keys.back().time) return keys.back();
+
+        auto hi = std::upper_bound(keys.begin(), keys.end(), time,
+                                   [](double t, const key& other) { return t < other.time; });
+        auto lo = hi - 1;
+        auto f = (time - lo->time) / (hi->time - lo->time);
+        return key{time, (1-f)*lo->offset + f*hi->offset, (1-f)*lo->angle + f*hi->angle};
+    }
+
+  private:
+    std::vector<key> keys;     // Sorted by time
+};
+
+
+/**
+ * @brief An object moved by a keyframe_track. The world time seen by a ray is picked from the
+ * shutter interval set for the current frame, so fast objects blur the way moving spheres do.
+ * The object itself, with its materials and textures, is shared by every frame.
+ *
+ */
+class animated : public hittable {
+  public:
+    animated(shared_ptr<hittable> object, keyframe_track track)
+      : object(object), track(std::move(track))
+    {
+        set_shutter(0, 0);
+    }
+
+    // Sets the world time interval rays with time 0..1 map to, and updates the bounding box
+    void set_shutter(double open, double close) {
+        shutter_open = open;
+        shutter_close = close;
+
+        auto first = track.sample(open);
+        auto last = track.sample(close);
+        moving = first.angle != last.angle || first.offset[0] != last.offset[0]
+              || first.offset[1] != last.offset[1] || first.offset[2] != last.offset[2];
+        for (const auto& k : track.all())
+            moving = moving || (k.time > open && k.time < close);
+        set_pose(first);
+
+        bbox = swept_box(open, close);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        auto cos_theta = pose_cos, sin_theta = pose_sin;
+        auto offset = pose_offset;
+        if (moving) {
+            auto k = track.sample(shutter_open + r.time() * (shutter_close - shutter_open));
+            auto radians = degrees_to_radians(k.angle);
+            cos_theta = cos(radians);
+            sin_theta = sin(radians);
+            offset = k.offset;
+        }
+
+        // World to object space: undo the translation, then the rotation
+        auto o = r.origin() - offset;
+        auto d = r.direction();
+        point3 origin(cos_theta*o[0] - sin_theta*o[2], o[1], sin_theta*o[0] + cos_theta*o[2]);
+        vec3 direction(cos_theta*d[0] - sin_theta*d[2], d[1], sin_theta*d[0] + cos_theta*d[2]);
+        ray object_r(origin, direction, r.time());
+        object_r.set_cone(r.cone_width(), r.cone_spread());
+
+        if (!object->hit(object_r, ray_t, rec))
+            return false;
+
+        auto p = rec.p, n = rec.normal;
+        rec.p = point3(cos_theta*p[0] + sin_theta*p[2], p[1], -sin_theta*p[0] + cos_theta*p[2]) + offset;
+        rec.normal = vec3(cos_theta*n[0] + sin_theta*n[2], n[1], -sin_theta*n[0] + cos_theta*n[2]);
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        auto from = shutter_open + t0 * (shutter_close - shutter_open);
+        auto to = shutter_open + t1 * (shutter_close - shutter_open);
+        auto first = track.sample(from), last = track.sample(to);
+
+        // Between two keys without rotation the object slides linearly, so the boxes at both
+        // ends are exact; anything else gets the box over the whole interval
+        bool linear = first.angle == last.angle;
+        for (const auto& k : track.all())
+            linear = linear && !(k.time > from && k.time < to);
+
+        if (linear) {
+            b0 = posed_box(first);
+            b1 = posed_box(last);
+        } else {
+            b0 = b1 = swept_box(from, to);
+        }
+    }
+
+  private:
+    shared_ptr<hittable> object;
+    keyframe_track track;
+    double shutter_open = 0, shutter_close = 0;
+    bool moving = false;
+
+    // Transform at shutter open, used for every ray while the object holds still
+    double pose_cos = 1, pose_sin = 0;
+    vec3 pose_offset;
+    aabb bbox;
+
+    void set_pose(const keyframe_track::key& k) {
+        auto radians = degrees_to_radians(k.angle);
+        pose_cos = cos(radians);
+        pose_sin = sin(radians);
+        pose_offset = k.offset;
+    }
+
+    // Bounds the object over the world time interval from..to
+    aabb swept_box(double from, double to) const {
+        // Translation is linear between keys, so the poses at both ends and at every key inside
+        // the interval bound the sweep. Rotation can bulge out between them; the object's
+        // bounding cylinder about the y axis covers any angle.
+        auto first = track.sample(from);
+        std::vector<keyframe_track::key> poses{ first, track.sample(to) };
+        for (const auto& k : track.all())
+            if (k.time > from && k.time < to) poses.push_back(k);
+
+        bool rotating = false;
+        for (const auto& k : poses) rotating = rotating || k.angle != first.angle;
+
+        auto box = object->bounding_box();
+        double radius = 0;
+        for (auto x : { box.x.min, box.x.max })
+            for (auto z : { box.z.min, box.z.max })
+                radius = fmax(radius, sqrt(x*x + z*z));
+
+        auto swept = aabb::empty;
+        for (const auto& k : poses) {
+            auto posed = rotating ? aabb(interval(k.offset.x() - radius, k.offset.x() + radius),
+                                         box.y + k.offset.y(),
+                                         interval(k.offset.z() - radius, k.offset.z() + radius))
+                                  : posed_box(k);
+            swept = aabb(swept, posed);
+        }
+        return swept;
+    }
+
+    aabb posed_box(const keyframe_track::key& k) const {
+        auto box = object->bounding_box();
+        auto radians = degrees_to_radians(k.angle);
+        auto c = cos(radians), s = sin(radians);
+
+        point3 min( infinity,  infinity,  infinity);
+        point3 max(-infinity, -infinity, -infinity);
+        for (auto x : { box.x.min, box.x.max }) {
+            for (auto z : { box.z.min, box.z.max }) {
+                auto nx =  c*x + s*z;
+                auto nz = -s*x + c*z;
+                min[0] = fmin(min[0], nx); max[0] = fmax(max[0], nx);
+                min[2] = fmin(min[2], nz); max[2] = fmax(max[2], nz);
+            }
+        }
+        min[1] = box.y.min;
+        max[1] = box.y.max;
+        return aabb(min + k.offset, max + k.offset);
+    }
+};
+
+
+/**
+ * @brief motion_bvh over objects whose bounds change from frame to frame. Refitting keeps the
+ * old grouping, which gets worse as objects drift away from their neighbours, so update()
+ * measures the tree with the surface area heuristic after every refit and rebuilds it from
+ * scratch once the cost has grown past rebuild_threshold times its cost right after the last
+ * build.
+ *
+ */
+class refit_bvh : public motion_bvh {
+  public:
+    double rebuild_threshold = 1.5;
+    int refits = 0;
+    int rebuilds = 0;
+
+    refit_bvh(std::vector<shared_ptr<hittable>> objects, int segments = 1)
+      : motion_bvh(std::move(objects), segments), built_cost(cost()) {}
+
+    // Refits the tree to the objects' current bounds, rebuilding it if it degraded too much.
+    // Returns true if it was rebuilt.
+    bool update() {
+        if (objects.empty()) return false;
+
+        refit();
+        if (cost() <= rebuild_threshold * built_cost) {
+            refits++;
+            return false;
+        }
+        build();
+        built_cost = cost();
+        rebuilds++;
+        return true;
+    }
+
+    double last_build_cost() const { return built_cost; }
+
+  private:
+    double built_cost;
+};
+
+
+/**
+ * @brief Everything that changes between the frames of a sequence: the animated objects, the
+ * BVH over them and the camera path. Static objects stay in their own BVH, built once.
+ *
+ */
+class animation_sequence {
+  public:
+    int frames = 1;
+    double fps = 24;
+    double shutter = 0;             // Fraction of a frame the shutter stays open
+    double rebuild_threshold = 1.5; // See refit_bvh
+    int motion_segments = 1;        // See motion_bvh
+
+    struct camera_key {
+        double time;
+        point3 lookfrom;
+        point3 lookat;
+    };
+    std::vector<camera_key> camera_keys;
+
+    std::vector<shared_ptr<animated>> objects;
+    shared_ptr<refit_bvh> bvh;      // Over `objects`, null if there are none
+
+    bool empty() const { return objects.empty() && camera_keys.empty(); }
+
+    void add_camera_key(const camera_key& k) {
+        auto at = std::upper_bound(camera_keys.begin(), camera_keys.end(), k.time,
+                                   [](double t, const camera_key& other) { return t < other.time; });
+        camera_keys.insert(at, k);
+    }
+
+    // Builds the BVH over the animated objects, posed at frame 0
+    shared_ptr<hittable> finish() {
+        if (objects.empty()) return nullptr;
+        for (auto& object : objects) object->set_shutter(0, shutter / fps);
+        bvh = make_shared<refit_bvh>(std::vector<shared_ptr<hittable>>(objects.begin(), objects.end()),
+                                     motion_segments);
+        bvh->rebuild_threshold = rebuild_threshold;
+        return bvh;
+    }
+
+    // Moves the objects and camera to frame `frame`. Returns true if the BVH had to be rebuilt.
+    bool set_frame(int frame, camera& cam) {
+        auto open = frame / fps;
+        auto close = (frame + shutter) / fps;
+
+        if (!camera_keys.empty()) {
+            auto k = camera_at(open);
+            cam.lookfrom = k.lookfrom;
+            cam.lookat = k.lookat;
+        }
+
+        if (!bvh) return false;
+        for (auto& object : objects) object->set_shutter(open, close);
+        return bvh->update();
+    }
+
+  private:
+    camera_key camera_at(double time) const {
+        if (time <= camera_keys.front().time) return camera_keys.front();
+        if (time >= camera_keys.back().time) return camera_keys.back();
+
+        auto hi = std::upper_bound(camera_keys.begin(), camera_keys.end(), time,
+                                   [](double t, const camera_key& other) { return t < other.time; });
+        auto lo = hi - 1;
+        auto f = (time - lo->time) / (hi->time - lo->time);
+        return camera_key{time, (1-f)*lo->lookfrom + f*hi->lookfrom, (1-f)*lo->lookat + f*hi->lookat};
+    }
+};
+
+#endif
@@ -0,0 +1,492 @@
+#ifndef BDPT_H
+#define BDPT_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+#include "lights.h"
+#include "grid_medium.h"
+
+#include <atomic>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief The part of the camera the bidirectional integrator needs: how the crop window lies on
+ * the focus plane, so that points can be projected onto pixels and camera rays weighed by their
+ * density. Rays start anywhere on the lens (the camera center for a pinhole) and pass through a
+ * point spread uniformly over the crop window on the focus plane.
+ *
+ */
+struct bdpt_camera {
+    point3 center;
+    vec3   w;                       // The camera looks along -w
+    point3 pixel00_loc;
+    vec3   pixel_delta_u, pixel_delta_v;
+    vec3   defocus_disk_u, defocus_disk_v;
+    bool   thin_lens = false;
+    double focus_dist = 1;
+    int    frame_x = 0, frame_y = 0, frame_width = 0, frame_height = 0;
+
+    // A pinhole is a delta in position, which counts as an area of one
+    double lens_area() const {
+        return thin_lens ? pi * defocus_disk_u.length_squared() : 1;
+    }
+
+    double film_area() const {
+        return frame_width * pixel_delta_u.length() * frame_height * pixel_delta_v.length();
+    }
+
+    point3 sample_lens() const {
+        if (!thin_lens) return center;
+        auto p = random_in_unit_disk();
+        return center + p[0]*defocus_disk_u + p[1]*defocus_disk_v;
+    }
+
+    // Crop window pixel that the ray from `lens` along `direction` passes through, if any
+    bool project(const point3& lens, const vec3& direction, int& i, int& j) const {
+        auto forward = dot(direction, -w);
+        if (forward <= 0) return false;
+        auto offset = lens + (focus_dist / forward) * direction
+                    - (pixel00_loc - 0.5 * (pixel_delta_u + pixel_delta_v));
+        auto x = dot(offset, pixel_delta_u) / pixel_delta_u.length_squared();
+        auto y = dot(offset, pixel_delta_v) / pixel_delta_v.length_squared();
+        i = static_cast<int>(floor(x)) - frame_x;
+        j = static_cast<int>(floor(y)) - frame_y;
+        return i >= 0 && i < frame_width && j >= 0 && j < frame_height;
+    }
+
+    // Solid angle density of a camera ray leaving `lens` along `direction`
+    double pdf_direction(const point3& lens, const vec3& direction) const {
+        int i, j;
+        if (!project(lens, direction, i, j)) return 0;
+        auto cos_theta = dot(unit_vector(direction), -w);
+        return focus_dist * focus_dist / (film_area() * cos_theta * cos_theta * cos_theta);
+    }
+
+    // Importance emitted along `direction`, normalized so that a camera ray carries a weight of one
+    double importance(const point3& lens, const vec3& direction) const {
+        auto cos_theta = dot(unit_vector(direction), -w);
+        return pdf_direction(lens, direction) / (cos_theta * lens_area());
+    }
+};
+
+
+/**
+ * @brief Sums of the light tracing contributions for every pixel of the crop window. Paths of
+ * any thread may land on any pixel, so each channel is added to with a compare-and-swap loop.
+ *
+ */
+class splat_film {
+  public:
+    explicit splat_film(size_t pixels) : data(3 * pixels) {
+        for (auto& value : data) value.store(0, std::memory_order_relaxed);
+    }
+
+    void add(size_t pixel, const color& c) {
+        for (int k = 0; k < 3; k++) {
+            auto& value = data[3*pixel + k];
+            auto current = value.load(std::memory_order_relaxed);
+            while (!value.compare_exchange_weak(current, current + c[k], std::memory_order_relaxed)) {}
+        }
+    }
+
+    color at(size_t pixel) const {
+        return color(data[3*pixel].load(), data[3*pixel + 1].load(), data[3*pixel + 2].load());
+    }
+
+  private:
+    std::vector<std::atomic<double>> data;
+};
+
+
+/**
+ * @brief Bidirectional path tracer (Veach 1997, structured like PBRT's). For every camera ray
+ * a camera subpath and a light subpath, started on a light picked from a light_list, are traced
+ * the same way ray_color traces paths. Every prefix of one is then joined to every prefix of
+ * the other, giving one estimate of the pixel per way of sampling a path of that length:
+ * hitting a light, connecting to a point sampled on a light, joining two surface vertices, or
+ * connecting a light subpath to the lens. The last kind lands on any pixel and is splatted into
+ * a splat_film. Estimates are combined with the balance heuristic, computed from the area
+ * densities with which each subpath would have sampled every vertex in either direction.
+ *
+ * Glass, mirrors and lights can't be connected to; paths through them are only found by
+ * sampling. Fuzzy metal is treated the same way, its attenuation standing in for its BSDF over
+ * its density. Light reaching the background is only found by camera subpaths, and so is light
+ * from emitters the light_list doesn't know. Free-flight distances are left out of the
+ * densities, as in PBRT, so MIS weighs media a little less well than surfaces, without bias.
+ *
+ * Not thread-safe: each render thread runs its own integrator, sharing the splat film.
+ *
+ */
+class bdpt_integrator {
+  public:
+    bdpt_integrator(const hittable& world, const light_list& lights, const bdpt_camera& lens,
+                    const color& background, const homogeneous_fog& fog, int max_depth, splat_film& splats)
+      : world(world), lights(lights), lens(lens), background(background), fog(fog),
+        max_depth(max_depth), splats(splats),
+        camera_path(std::max(max_depth, 0) + 1), light_path(std::max(max_depth, 1))
+    {}
+
+    /**
+     * @brief Radiance estimate for the camera ray r. Light subpaths that reach the lens add their
+     * share to the splat film instead.
+     *
+     */
+    color sample(const ray& r) {
+        time = r.time();
+        escaped = color(0,0,0);
+        auto camera_count = camera_subpath(r);
+        auto light_count = light_subpath();
+
+        color L = escaped;
+        for (int t = 1; t <= camera_count; t++) {
+            for (int s = 0; s <= light_count; s++) {
+                // A lone camera vertex sees nothing, and a camera vertex joined to a point on a
+                // light is the light seen directly, which camera rays already find
+                if (s + t - 1 > max_depth || s + t < 2 || (s == 1 && t == 1)) continue;
+
+                size_t pixel = 0;
+                auto contribution = connect(s, t, pixel);
+                if (t == 1) {
+                    if (!is_black(contribution)) splats.add(pixel, contribution);
+                } else {
+                    L += contribution;
+                }
+            }
+        }
+        return L;
+    }
+
+  private:
+    enum vertex_type { camera_vertex, light_vertex, surface_vertex, medium_vertex };
+
+    struct path_vertex {
+        vertex_type type = camera_vertex;
+        color beta;                 // Throughput of the subpath up to this vertex
+        hit_record rec;             // The lens point for the camera; a null material in the fog
+        bool delta = false;         // Scattered into a direction no other strategy can pick
+        double pdf_fwd = 0;         // Area density of sampling this vertex along its own subpath
+        double pdf_rev = 0;         // ... and along the other one, in reverse
+        double pdf_origin = 0;      // Area density of a light subpath starting here, 0 if none can
+
+        const point3& p() const { return rec.p; }
+        bool on_surface() const { return type == light_vertex || type == surface_vertex; }
+        bool connectible() const { return type != surface_vertex || rec.mat->connectible(); }
+    };
+
+    const hittable& world;
+    const light_list& lights;
+    const bdpt_camera& lens;
+    color background;
+    const homogeneous_fog& fog;
+    int max_depth;                  // Most segments in a path, as for ray_color
+    splat_film& splats;
+
+    std::vector<path_vertex> camera_path, light_path;
+    double time = 0;                // Of the current camera ray, shared by both subpaths
+    color escaped;                  // Background reached by the current camera subpath
+
+    static bool is_black(const color& c) {
+        return c.x() == 0 && c.y() == 0 && c.z() == 0;
+    }
+
+    int camera_subpath(const ray& r) {
+        auto& camera = camera_path[0];
+        camera = path_vertex();
+        camera.rec.p = r.origin();
+        camera.beta = color(1,1,1);
+        return 1 + random_walk(r, color(1,1,1), lens.pdf_direction(r.origin(), r.direction()),
+                               max_depth, false, camera_path);
+    }
+
+    int light_subpath() {
+        if (lights.empty() || max_depth < 1) return 0;
+
+        double pmf;
+        const auto& light = lights.pick(random_double(), pmf);
+        auto sample = light_list::sample(light, time);
+
+        // Cosine distributed about the normal of a random face, both faces being lit
+        auto normal = random_double() < 0.5 ? sample.normal : -sample.normal;
+        auto direction = normal + random_unit_vector();
+        if (direction.near_zero()) direction = normal;
+        auto pdf_direction = dot(unit_vector(direction), normal) / (2*pi);
+
+        auto& origin = light_path[0];
+        origin = path_vertex();
+        origin.type = light_vertex;
+        origin.rec.p = sample.p;
+        origin.rec.normal = sample.normal;
+        origin.beta = sample.emitted;
+        origin.pdf_fwd = origin.pdf_origin = pmf / light.area;
+        if (pdf_direction <= 0) return 1;
+
+        auto beta = sample.emitted * (dot(unit_vector(direction), normal) / (origin.pdf_fwd * pdf_direction));
+        return 1 + random_walk(ray(sample.p, direction, time), beta, pdf_direction, max_depth - 1, true, light_path);
+    }
+
+    /**
+     * @brief Extends the subpath in path[0] by up to `max_vertices` vertices, scattering the way
+     * ray_color does, and returns how many were added. pdf_fwd is the solid angle density of r.
+     *
+     */
+    int random_walk(ray r, color beta, double pdf_fwd, int max_vertices, bool from_light,
+                    std::vector<path_vertex>& path) {
+        int count = 0;
+        while (count < max_vertices) {
+            auto& prev = path[count];
+            auto& v = path[count + 1];
+            v = path_vertex();
+            v.beta = beta;
+            double pdf_rev;
+
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                v.type = medium_vertex;
+                v.rec.p = r.at(t_fog);
+                v.pdf_fwd = convert_density(pdf_fwd, prev, v);
+                if (++count == max_vertices) break;
+
+                // Isotropic, so the phase function over its density leaves only the albedo
+                ray scattered(v.p(), random_unit_vector(), r.time());
+                scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+                beta = beta * fog.albedo;
+                pdf_fwd = pdf_rev = 1 / (4*pi);
+                r = scattered;
+            } else if (!hit_anything) {
+                if (!from_light) escaped += beta * background;
+                break;
+            } else {
+                v.type = rec.mat->is_volumetric() ? medium_vertex : surface_vertex;
+                v.rec = rec;
+                double pmf;
+                if (auto light = lights.find(rec.object, pmf))
+                    v.pdf_origin = pmf / light->area;
+                v.pdf_fwd = convert_density(pdf_fwd, prev, v);
+                if (++count == max_vertices) break;
+
+                color attenuation;
+                ray scattered;
+                if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                    break;
+                scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+
+                if (rec.mat->connectible()) {
+                    pdf_fwd = rec.mat->scattering_pdf(rec, scattered.direction());
+                    pdf_rev = rec.mat->scattering_pdf(rec, -r.direction());
+                } else {
+                    v.delta = true;
+                    pdf_fwd = pdf_rev = 0;
+                    if (from_light) attenuation *= rec.mat->importance_scale(rec, scattered.direction());
+                }
+                beta = beta * attenuation;
+                r = scattered;
+            }
+            prev.pdf_rev = convert_density(pdf_rev, v, prev);
+        }
+        return count;
+    }
+
+    /* Densities */
+
+    // Solid angle density at `from` turned into area density at `to`
+    static double convert_density(double pdf, const path_vertex& from, const path_vertex& to) {
+        auto d = to.p() - from.p();
+        auto distance_squared = d.length_squared();
+        if (distance_squared == 0) return 0;
+        if (to.on_surface()) pdf *= fabs(dot(to.rec.normal, d)) / sqrt(distance_squared);
+        return pdf / distance_squared;
+    }
+
+    // Area density at `next` of the subpath through v scattering towards it
+    double pdf(const path_vertex& v, const path_vertex& next) const {
+        if (v.type == light_vertex) return pdf_light(v, next);
+
+        auto direction = next.p() - v.p();
+        double density;
+        if (v.type == camera_vertex) density = lens.pdf_direction(v.p(), direction);
+        else if (!v.rec.mat) density = 1 / (4*pi);
+        else density = v.rec.mat->scattering_pdf(v.rec, direction);
+        return convert_density(density, v, next);
+    }
+
+    // Area density at `next` of a light subpath leaving the light point v towards it
+    static double pdf_light(const path_vertex& v, const path_vertex& next) {
+        auto d = next.p() - v.p();
+        auto distance = d.length();
+        if (distance == 0) return 0;
+        auto pdf_direction = fabs(dot(v.rec.normal, d)) / distance / (2*pi);
+        return convert_density(pdf_direction, v, next);
+    }
+
+    /* Connections */
+
+    // BSDF or phase function at v for light between v and `next`
+    color scattering(const path_vertex& v, const path_vertex& next) const {
+        if (!v.rec.mat) return fog.albedo / (4*pi);
+        return v.rec.mat->scattering(v.rec, next.p() - v.p());
+    }
+
+    // Fraction of the light that gets from a to b
+    double transmittance(const path_vertex& a, const path_vertex& b) const {
+        auto d = b.p() - a.p();
+        auto distance = d.length();
+        ray r(a.p(), d / distance, time);
+
+        // Constant media occlude at random, which estimates their transmittance; grid media
+        // are ratio tracked
+        hit_record rec;
+        shadow_ray_scope media;
+        RT_STAT(rays);
+        RT_STAT(shadow_rays);
+        if (world.hit(r, interval(0.001, distance - 0.001), rec)) return 0;
+        return media.transmittance() * fog.transmittance(r, interval(0, distance));
+    }
+
+    double geometry(const path_vertex& a, const path_vertex& b) const {
+        auto d = b.p() - a.p();
+        auto g = 1 / d.length_squared();
+        auto direction = unit_vector(d);
+        if (a.on_surface()) g *= fabs(dot(a.rec.normal, direction));
+        if (b.on_surface()) g *= fabs(dot(b.rec.normal, direction));
+        return g * transmittance(a, b);
+    }
+
+    /**
+     * @brief MIS-weighted contribution of the path made of the first s light subpath vertices and
+     * the first t camera subpath vertices. For t == 1 a new lens point is sampled and `pixel`
+     * set to where the path lands; for s == 1 a new point on a light is sampled.
+     *
+     */
+    color connect(int s, int t, size_t& pixel) {
+        color L(0,0,0);
+        path_vertex sampled;
+
+        if (s == 0) {
+            // The camera subpath hit a light
+            const auto& pt = camera_path[t-1];
+            if (pt.type != surface_vertex) return L;
+            L = pt.beta * pt.rec.mat->emitted(pt.rec.u, pt.rec.v, pt.p());
+        } else if (t == 1) {
+            // Light tracing: connect the light subpath to a point on the lens
+            const auto& qs = light_path[s-1];
+            if (!qs.connectible()) return L;
+
+            sampled.rec.p = lens.sample_lens();
+            auto d = qs.p() - sampled.p();
+            int i, j;
+            if (!lens.project(sampled.p(), d, i, j)) return L;
+            pixel = static_cast<size_t>(j) * lens.frame_width + i;
+
+            auto distance_squared = d.length_squared();
+            auto direction = d / sqrt(distance_squared);
+            auto pdf_solid_angle = distance_squared / (dot(direction, -lens.w) * lens.lens_area());
+            sampled.beta = color(1,1,1) * (lens.importance(sampled.p(), d) / pdf_solid_angle);
+
+            L = qs.beta * scattering(qs, sampled) * sampled.beta;
+            if (qs.on_surface()) L *= fabs(dot(direction, qs.rec.normal));
+            if (!is_black(L)) L *= transmittance(qs, sampled);
+        } else if (s == 1) {
+            // Next event estimation: connect the camera subpath to a point on a light
+            const auto& pt = camera_path[t-1];
+            if (!pt.connectible()) return L;
+
+            double pmf;
+            const auto& light = lights.pick(random_double(), pmf);
+            auto sample = light_list::sample(light, time);
+            auto d = sample.p - pt.p();
+            auto distance_squared = d.length_squared();
+            auto direction = d / sqrt(distance_squared);
+            auto cos_light = fabs(dot(sample.normal, direction));
+            if (cos_light == 0) return L;
+
+            sampled.type = light_vertex;
+            sampled.rec.p = sample.p;
+            sampled.rec.normal = sample.normal;
+            sampled.pdf_fwd = sampled.pdf_origin = pmf / light.area;
+            auto pdf_solid_angle = sampled.pdf_fwd * distance_squared / cos_light;
+            sampled.beta = sample.emitted / pdf_solid_angle;
+
+            L = pt.beta * scattering(pt, sampled) * sampled.beta;
+            if (pt.on_surface()) L *= fabs(dot(direction, pt.rec.normal));
+            if (!is_black(L)) L *= transmittance(pt, sampled);
+        } else {
+            const auto& qs = light_path[s-1];
+            const auto& pt = camera_path[t-1];
+            if (!qs.connectible() || !pt.connectible()) return L;
+            L = qs.beta * scattering(qs, pt) * scattering(pt, qs) * pt.beta;
+            if (!is_black(L)) L *= geometry(qs, pt);
+        }
+
+        if (is_black(L)) return L;
+        return L * mis_weight(s, t, sampled);
+    }
+
+    /**
+     * @brief Balance heuristic weight of the (s, t) strategy: its density over the sum of the
+     * densities of every strategy that could have sampled the same path, found as a running
+     * product of density ratios walking out from the connection along each subpath. The sampled
+     * endpoint and the reverse densities around the connection are swapped in for the duration.
+     *
+     */
+    double mis_weight(int s, int t, path_vertex& sampled) {
+        if (s + t == 2) return 1;
+
+        // A light the light_list doesn't know is only ever hit by camera subpaths
+        if (s == 0 && camera_path[t-1].pdf_origin == 0) return 1;
+
+        if (s == 1) std::swap(light_path[0], sampled);
+        else if (t == 1) std::swap(camera_path[0], sampled);
+
+        auto* qs = s > 0 ? &light_path[s-1] : nullptr;
+        auto* pt = &camera_path[t-1];
+        auto* qs_minus = s > 1 ? &light_path[s-2] : nullptr;
+        auto* pt_minus = t > 1 ? &camera_path[t-2] : nullptr;
+
+        struct saved_vertex { path_vertex* v; bool delta; double pdf_rev; };
+        saved_vertex saved[4];
+        int saved_count = 0;
+        for (auto* v : { qs, pt, qs_minus, pt_minus })
+            if (v) saved[saved_count++] = { v, v->delta, v->pdf_rev };
+
+        pt->delta = false;
+        pt->pdf_rev = s > 0 ? pdf(*qs, *pt) : pt->pdf_origin;
+        if (pt_minus) pt_minus->pdf_rev = s > 0 ? pdf(*pt, *pt_minus) : pdf_light(*pt, *pt_minus);
+        if (qs) {
+            qs->delta = false;
+            qs->pdf_rev = pdf(*pt, *qs);
+        }
+        if (qs_minus) qs_minus->pdf_rev = pdf(*qs, *qs_minus);
+
+        // Zero densities belong to delta vertices, which the checks below skip
+        auto remap = [](double pdf) { return pdf != 0 ? pdf : 1; };
+        double sum = 0, ratio = 1;
+        for (int i = t - 1; i > 0; i--) {
+            ratio *= remap(camera_path[i].pdf_rev) / remap(camera_path[i].pdf_fwd);
+            if (!camera_path[i].delta && !camera_path[i-1].delta) sum += ratio;
+        }
+        ratio = 1;
+        for (int i = s - 1; i >= 0; i--) {
+            ratio *= remap(light_path[i].pdf_rev) / remap(light_path[i].pdf_fwd);
+            if (!light_path[i].delta && !(i > 0 && light_path[i-1].delta)) sum += ratio;
+        }
+
+        for (int k = 0; k < saved_count; k++) {
+            saved[k].v->delta = saved[k].delta;
+            saved[k].v->pdf_rev = saved[k].pdf_rev;
+        }
+        if (s == 1) std::swap(light_path[0], sampled);
+        else if (t == 1) std::swap(camera_path[0], sampled);
+
+        return 1 / (1 + sum);
+    }
+};
+
+#endif
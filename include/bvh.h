@@ -4,6 +4,7 @@
 #include "hittable.h"
 #include "hittable_list.h"
 #include "utils.h"
+#include "stats.h"
 
 #include <algorithm>
 
@@ -39,6 +40,7 @@ class bvh_node : public hittable {
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            RT_STAT(bvh_nodes);
             if (!bbox.hit(r, ray_t)) return false;
 
             bool hit_left = left->hit(r, ray_t, rec);
@@ -49,6 +51,26 @@ class bvh_node : public hittable {
 
         aabb bounding_box() const override {return bbox;}
 
+        void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+            aabb r0, r1;
+            left->motion_bounds(t0, t1, b0, b1);
+            right->motion_bounds(t0, t1, r0, r1);
+            b0 = aabb(b0, r0);
+            b1 = aabb(b1, r1);
+        }
+
+        aabb clipped_box(int axis, double lo, double hi) const override {
+            auto box = aabb::empty;
+            for (const auto& child : { left, right }) {
+                auto part = child->clipped_box(axis, lo, hi);
+                if (part.axis_interval(axis).size() >= 0) box = aabb(box, part);
+            }
+            return box;
+        }
+
+        const shared_ptr<hittable>& get_left() const { return left; }
+        const shared_ptr<hittable>& get_right() const { return right; }
+
     private:
         shared_ptr<hittable> left;
         shared_ptr<hittable> right;
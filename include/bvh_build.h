@@ -0,0 +1,710 @@
+#ifndef BVH_BUILD_H
+#define BVH_BUILD_H
+
+#include "utils.h"
+#include "aabb.h"
+#include "profiler.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <functional>
+#include <future>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Runs body(i) for i in [0, count), split evenly over `threads` threads (0 for one per
+ * hardware thread). Small counts run on the calling thread.
+ *
+ */
+template <typename F>
+void parallel_for(size_t count, int threads, const F& body) {
+    auto workers = static_cast<size_t>(threads > 0 ? threads : std::thread::hardware_concurrency());
+    if (workers <= 1 || count < 65536) {
+        for (size_t i = 0; i < count; i++) body(i);
+        return;
+    }
+
+    std::vector<std::thread> pool;
+    for (size_t t = 0; t < workers; t++) {
+        pool.emplace_back([&, t] {
+            for (auto i = count * t / workers; i < count * (t+1) / workers; i++) body(i);
+        });
+    }
+    for (auto& thread : pool) thread.join();
+}
+
+
+enum class bvh_method { median, sah, lbvh, sbvh };
+
+struct bvh_build_options {
+    bvh_method method = bvh_method::sah;
+    int threads = 0;            // 0 for one per hardware thread
+    int max_leaf_size = 4;      // SAH and LBVH leaves hold up to this many primitives
+    bool compressed = false;    // Scenes build compressed_bvh for static geometry
+    double duplication_budget = 0.3;    // SBVH may add this fraction of extra references
+
+    static bool parse_method(const std::string& name, bvh_method& method) {
+        if      (name == "median")  method = bvh_method::median;
+        else if (name == "sah")     method = bvh_method::sah;
+        else if (name == "lbvh")    method = bvh_method::lbvh;
+        else if (name == "sbvh")    method = bvh_method::sbvh;
+        else return false;
+        return true;
+    }
+
+    static const char* method_name(bvh_method method) {
+        switch (method) {
+            case bvh_method::median: return "median";
+            case bvh_method::lbvh:   return "lbvh";
+            case bvh_method::sbvh:   return "sbvh";
+            default:                 return "sah";
+        }
+    }
+};
+
+struct bvh_build_stats {
+    size_t primitives = 0;
+    size_t references = 0;      // Primitives plus SBVH duplicates
+    size_t nodes = 0;
+    size_t bytes = 0;           // Memory held by the finished BVHs' nodes and object lists
+    double seconds = 0;
+
+    void add(const bvh_build_stats& other) {
+        primitives += other.primitives;
+        references += other.references;
+        nodes += other.nodes;
+        bytes += other.bytes;
+        seconds += other.seconds;
+    }
+
+    double primitives_per_second() const { return seconds > 0 ? primitives / seconds : 0; }
+};
+
+
+/**
+ * @brief Builds a binary BVH over an array of primitive boxes. It only ever looks at the boxes
+ * and their centers, precomputed into flat arrays, so the objects themselves are never touched
+ * and nothing is sorted through shared_ptrs.
+ *
+ * - median: the split bvh_node uses, on the longest axis at the middle primitive.
+ * - sah: binned surface area heuristic, 16 bins per axis, with leaves of up to max_leaf_size.
+ * - lbvh: sorts the primitives along a 30-bit Morton curve and splits each range where the
+ *   highest differing bit of its codes flips. Fastest to build, slowest to trace.
+ * - sbvh: SAH that also tries spatial splits, which cut primitives straddling a plane into a
+ *   reference on each side, clipped to their part on that side. Large or thin primitives then
+ *   stop inflating the boxes of everything near them. Spatial splits are only tried where the
+ *   children of the best object split overlap, and stop once duplication_budget is used up.
+ *
+ * The top levels are built as parallel tasks, each subtree on its own thread, and large ranges
+ * are binned in parallel chunks. The result is a set of nodes in no particular order, with the
+ * root at 0, plus the order primitives must be stored in for leaves to index ranges of it. With
+ * sbvh a primitive can appear in `order` more than once.
+ *
+ */
+class bvh_builder {
+  public:
+    struct node {
+        aabb box;
+        int left = -1, right = -1;      // Children, -1 for leaves
+        int first = 0, count = 0;       // Range of `order` a leaf holds
+    };
+
+    // Clips primitive `index` to the slab lo <= p[axis] <= hi and returns the box of what is
+    // left in `box` (empty if nothing). Returns false if the primitive can't be clipped, e.g.
+    // because it moves.
+    using clip_function = std::function<bool(int index, int axis, double lo, double hi, aabb& box)>;
+
+    std::vector<node> nodes;
+    std::vector<int> order;
+    std::vector<aabb> ref_boxes;    // Box of each entry of `order`, clipped by spatial splits
+    std::vector<char> clipped;      // Whether that box is smaller than the whole primitive's
+    bvh_build_stats stats;
+
+    bvh_builder(const std::vector<aabb>& bounds, const bvh_build_options& options = {},
+                clip_function clip = nullptr)
+      : options(options), clip(std::move(clip))
+    {
+        profile_scope scope("BVH build");
+        auto start = std::chrono::steady_clock::now();
+        auto count = bounds.size();
+        stats.primitives = count;
+        if (count == 0) return;
+
+        auto threads = options.threads > 0 ? options.threads
+                                           : static_cast<int>(std::thread::hardware_concurrency());
+        threads = std::max(threads, 1);
+        while ((1 << spawn_depth) < threads) spawn_depth++;
+        if (threads > 1) spawn_depth++;     // Twice the tasks, to balance uneven subtrees
+        this->threads = threads;
+
+        refs.resize(count);
+        parallel_for(count, [&](size_t i) { refs[i] = make_ref(bounds[i], static_cast<int>(i), false); });
+
+        auto capacity = count;
+        size_t budget = 0;
+        if (options.method == bvh_method::sbvh) {
+            budget = static_cast<size_t>(count * std::max(options.duplication_budget, 0.0));
+            capacity += budget;
+        }
+
+        nodes.resize(2 * capacity - 1);
+        next_node = 1;
+        if (options.method == bvh_method::lbvh) {
+            sort_morton();
+            build_lbvh(0, 0, count, 0);
+        } else if (options.method == bvh_method::sbvh) {
+            root_area = surface_area(range_bounds(refs.data(), count));
+            std::vector<prim_ref> all;
+            all.swap(refs);
+            refs.resize(capacity);
+            build_sbvh(0, std::move(all), budget, 0);
+            refs.resize(next_ref);
+        } else {
+            build(0, 0, count, 0);
+        }
+        nodes.resize(next_node);
+
+        order.resize(refs.size());
+        ref_boxes.resize(refs.size());
+        clipped.resize(refs.size());
+        for (size_t i = 0; i < refs.size(); i++) {
+            order[i] = refs[i].index;
+            ref_boxes[i] = refs[i].box;
+            clipped[i] = refs[i].clipped;
+        }
+
+        stats.references = refs.size();
+        stats.nodes = nodes.size();
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+  private:
+    static constexpr int bins = 16;
+    static constexpr size_t task_size = 4096;       // Smaller ranges are built on one thread
+    static constexpr size_t chunk_size = 65536;     // Larger ranges are binned in parallel
+    static constexpr int balanced_depth = 30;       // Below this, only median splits
+    static constexpr double min_overlap = 1e-5;     // SBVH: child overlap, relative to the root,
+                                                    // worth trying a spatial split for
+
+    // Primitives are partitioned and sorted by value, so every pass over a range reads memory
+    // in order instead of hopping through an index array
+    struct prim_ref {
+        aabb box;
+        point3 centroid;
+        int index;
+        bool clipped;
+    };
+
+    bvh_build_options options;
+    clip_function clip;
+    std::vector<prim_ref> refs;
+    std::vector<uint32_t> codes;        // Morton codes of refs, for lbvh
+    std::atomic<int> next_node{0};
+    int spawn_depth = 0;
+    int threads = 1;
+
+    // SBVH state
+    std::atomic<size_t> next_ref{0};        // Next free slot of refs for a leaf's references
+    double root_area = 0;
+
+    static prim_ref make_ref(const aabb& box, int index, bool clipped) {
+        return { box, point3(box.x.min + box.x.max, box.y.min + box.y.max, box.z.min + box.z.max) / 2,
+                 index, clipped };
+    }
+
+    static double surface_area(const aabb& box) {
+        auto x = box.x.size(), y = box.y.size(), z = box.z.size();
+        return 2 * (x*y + y*z + z*x);
+    }
+
+    // Unpadded, so coincident centroids really have zero extent
+    static aabb point_box(const point3& p) {
+        aabb box;
+        box.x = interval(p.x(), p.x());
+        box.y = interval(p.y(), p.y());
+        box.z = interval(p.z(), p.z());
+        return box;
+    }
+
+    // Same as aabb(a, b), without fmin/fmax's NaN handling that keeps them from inlining
+    static aabb merge(const aabb& a, const aabb& b) {
+        aabb box;
+        box.x = interval(std::min(a.x.min, b.x.min), std::max(a.x.max, b.x.max));
+        box.y = interval(std::min(a.y.min, b.y.min), std::max(a.y.max, b.y.max));
+        box.z = interval(std::min(a.z.min, b.z.min), std::max(a.z.max, b.z.max));
+        return box;
+    }
+
+    template <typename F>
+    void parallel_for(size_t count, const F& body) const { ::parallel_for(count, threads, body); }
+
+    // Box and centroid box of count references, in parallel chunks for large ranges
+    void range_bounds(const prim_ref* first, size_t count, aabb& box, aabb& centroid_box) const {
+        struct partial { aabb box = aabb::empty, centroids = aabb::empty; };
+        auto gather = [&](size_t from, size_t to, partial& p) {
+            for (auto i = from; i < to; i++) {
+                p.box = merge(p.box, first[i].box);
+                p.centroids = merge(p.centroids, point_box(first[i].centroid));
+            }
+        };
+
+        auto chunks = std::min<size_t>(threads, count / chunk_size);
+        if (chunks <= 1) {
+            partial p;
+            gather(0, count, p);
+            box = p.box;
+            centroid_box = p.centroids;
+            return;
+        }
+
+        std::vector<partial> parts(chunks);
+        std::vector<std::thread> pool;
+        for (size_t c = 0; c < chunks; c++)
+            pool.emplace_back(gather, count*c/chunks, count*(c+1)/chunks, std::ref(parts[c]));
+        for (auto& thread : pool) thread.join();
+
+        box = centroid_box = aabb::empty;
+        for (const auto& p : parts) {
+            box = merge(box, p.box);
+            centroid_box = merge(centroid_box, p.centroids);
+        }
+    }
+
+    aabb range_bounds(const prim_ref* first, size_t count) const {
+        aabb box, centroid_box;
+        range_bounds(first, count, box, centroid_box);
+        return box;
+    }
+
+    int make_leaf(int index, size_t start, size_t end, const aabb& box) {
+        nodes[index].box = box;
+        nodes[index].first = static_cast<int>(start);
+        nodes[index].count = static_cast<int>(end - start);
+        return index;
+    }
+
+    // Allocates the two children of `index` and builds them with build_left(left index) and
+    // build_right(right index), the left one as a separate task near the top of the tree
+    template <typename Left, typename Right>
+    void build_children(int index, size_t count, int depth, const Left& build_left, const Right& build_right) {
+        auto left = next_node.fetch_add(2);
+        auto right = left + 1;
+        nodes[index].left = left;
+        nodes[index].right = right;
+
+        if (depth < spawn_depth && count > task_size) {
+            auto task = std::async(std::launch::async, [&] { build_left(left); });
+            build_right(right);
+            task.get();
+        } else {
+            build_left(left);
+            build_right(right);
+        }
+    }
+
+    /* Median and binned SAH */
+
+    void build(int index, size_t start, size_t end, int depth) {
+        aabb box, centroid_box;
+        range_bounds(&refs[start], end - start, box, centroid_box);
+        nodes[index].box = box;
+
+        auto count = end - start;
+        if (count == 1) { make_leaf(index, start, end, box); return; }
+
+        size_t mid = start + count / 2;
+        bool median = options.method == bvh_method::median || depth >= balanced_depth;
+
+        if (!median) {
+            int axis;
+            double position;
+            auto split_cost = surface_area(box) + find_split(&refs[start], count, centroid_box, axis, position);
+
+            // Intersecting every primitive here against one more box test and the children
+            if (count <= static_cast<size_t>(options.max_leaf_size) && count * surface_area(box) <= split_cost) {
+                make_leaf(index, start, end, box);
+                return;
+            }
+
+            if (axis >= 0) {
+                auto split = std::partition(refs.begin() + start, refs.begin() + end,
+                    [&](const prim_ref& r) { return r.centroid[axis] < position; });
+                mid = static_cast<size_t>(split - refs.begin());
+            }
+            median = axis < 0 || mid == start || mid == end;
+        }
+
+        if (median) {
+            mid = start + count / 2;
+            if (options.method == bvh_method::median) {
+                // Exactly bvh_node's split: pairs share a node, the rest sort by box minimum
+                if (count == 2) { make_leaf(index, start, end, box); return; }
+                auto axis = box.longest_axis();
+                std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
+                    [&](const prim_ref& a, const prim_ref& b) {
+                        return a.box.axis_interval(axis).min < b.box.axis_interval(axis).min;
+                    });
+            } else {
+                auto axis = centroid_box.longest_axis();
+                std::nth_element(refs.begin() + start, refs.begin() + mid, refs.begin() + end,
+                    [&](const prim_ref& a, const prim_ref& b) { return a.centroid[axis] < b.centroid[axis]; });
+            }
+        }
+
+        build_children(index, count, depth,
+            [&](int left) { build(left, start, mid, depth + 1); },
+            [&](int right) { build(right, mid, end, depth + 1); });
+    }
+
+    // Best binned SAH split of count references. Returns its cost, or infinity with axis -1 if
+    // the centroids all coincide. If `children` is given, it gets the boxes of both sides.
+    double find_split(const prim_ref* first, size_t count, const aabb& centroid_box, int& axis,
+                      double& position, aabb* children = nullptr) const {
+        struct bin { aabb box; size_t count; };
+        axis = -1;
+        position = 0;
+        auto best = infinity;
+
+        // Bin along all three axes in one pass over the range. Small ranges need fewer bins.
+        auto used = static_cast<int>(std::min<size_t>(bins, std::max<size_t>(count, 2)));
+        bin counts[3][bins];
+        double scale[3];
+        for (int a = 0; a < 3; a++) {
+            auto size = centroid_box.axis_interval(a).size();
+            scale[a] = size > 0 ? used / size : 0;
+            for (int b = 0; b < used; b++) counts[a][b] = { aabb::empty, 0 };
+        }
+        for (size_t i = 0; i < count; i++) {
+            const auto& r = first[i];
+            for (int a = 0; a < 3; a++) {
+                auto b = std::min(used - 1, static_cast<int>((r.centroid[a] - centroid_box.axis_interval(a).min) * scale[a]));
+                counts[a][b].box = merge(counts[a][b].box, r.box);
+                counts[a][b].count++;
+            }
+        }
+
+        for (int a = 0; a < 3; a++) {
+            if (scale[a] == 0) continue;
+
+            // Sweep from the right to get the area and count on that side of every plane
+            double right_cost[bins];
+            aabb right_box[bins];
+            auto right = aabb::empty;
+            size_t right_count = 0;
+            for (int b = used - 1; b > 0; b--) {
+                right = merge(right, counts[a][b].box);
+                right_count += counts[a][b].count;
+                right_cost[b] = right_count * surface_area(right);
+                right_box[b] = right;
+            }
+
+            auto left = aabb::empty;
+            size_t left_count = 0;
+            for (int b = 1; b < used; b++) {
+                left = merge(left, counts[a][b-1].box);
+                left_count += counts[a][b-1].count;
+                if (left_count == 0 || left_count == count) continue;
+
+                auto cost = left_count * surface_area(left) + right_cost[b];
+                if (cost < best) {
+                    best = cost;
+                    axis = a;
+                    position = centroid_box.axis_interval(a).min + b / scale[a];
+                    if (children) {
+                        children[0] = left;
+                        children[1] = right_box[b];
+                    }
+                }
+            }
+        }
+        return best;
+    }
+
+    /* SBVH */
+
+    // Each node owns its references, since spatial splits make the lists of the two children
+    // add up to more than their parent's. Leaves copy theirs into `refs`. `budget` is how many
+    // duplicates the subtree may still make; what a node leaves of it is shared between its
+    // children by their reference counts, so no single subtree can use it all up.
+    void build_sbvh(int index, std::vector<prim_ref> list, size_t budget, int depth) {
+        aabb box, centroid_box;
+        range_bounds(list.data(), list.size(), box, centroid_box);
+        nodes[index].box = box;
+
+        auto count = list.size();
+        if (count == 1) { sbvh_leaf(index, list); return; }
+
+        int axis = -1;
+        double position = 0;
+        aabb children[2];
+        bool median = depth >= balanced_depth;
+        bool spatial = false;
+
+        if (!median) {
+            auto best = find_split(list.data(), count, centroid_box, axis, position, children);
+
+            // Only worth cutting primitives where the object split leaves the children overlapping
+            auto shared = intersection(children[0], children[1]);
+            auto overlap = axis >= 0 && !is_empty(shared) ? surface_area(shared) : 0;
+            if (clip && budget > 0 && (axis < 0 || overlap > min_overlap * root_area)) {
+                int spatial_axis;
+                double spatial_position;
+                auto cost = find_spatial_split(list, box, spatial_axis, spatial_position);
+                if (cost < best) {
+                    best = cost;
+                    axis = spatial_axis;
+                    position = spatial_position;
+                    spatial = true;
+                }
+            }
+
+            auto split_cost = surface_area(box) + best;
+            if (count <= static_cast<size_t>(options.max_leaf_size) && count * surface_area(box) <= split_cost) {
+                sbvh_leaf(index, list);
+                return;
+            }
+            median = axis < 0;
+        }
+
+        std::vector<prim_ref> left, right;
+        if (!median) {
+            if (spatial) {
+                split_spatial(list, box, axis, position, budget, left, right);
+            } else {
+                for (const auto& r : list) (r.centroid[axis] < position ? left : right).push_back(r);
+            }
+            median = left.empty() || right.empty();
+        }
+        if (median) {
+            auto mid = count / 2;
+            auto longest = centroid_box.longest_axis();
+            std::nth_element(list.begin(), list.begin() + mid, list.end(),
+                [&](const prim_ref& a, const prim_ref& b) { return a.centroid[longest] < b.centroid[longest]; });
+            left.assign(list.begin(), list.begin() + mid);
+            right.assign(list.begin() + mid, list.end());
+        }
+        std::vector<prim_ref>().swap(list);
+
+        auto total = left.size() + right.size();
+        auto left_budget = budget * left.size() / total;
+        build_children(index, total, depth,
+            [&](int l) { build_sbvh(l, std::move(left), left_budget, depth + 1); },
+            [&](int r) { build_sbvh(r, std::move(right), budget - left_budget, depth + 1); });
+    }
+
+    void sbvh_leaf(int index, const std::vector<prim_ref>& list) {
+        auto first = next_ref.fetch_add(list.size());
+        std::copy(list.begin(), list.end(), refs.begin() + first);
+        make_leaf(index, first, first + list.size(), nodes[index].box);
+    }
+
+    // Box around the part of r inside the slab, or nothing if r can't be clipped
+    bool clip_ref(const prim_ref& r, int axis, double lo, double hi, aabb& box) const {
+        if (!clip(r.index, axis, lo, hi, box)) return false;
+        box = intersection(box, r.box);
+        return true;
+    }
+
+    // Best split of the node's box into two halves by a plane at one of the bin boundaries, with
+    // primitives straddling it clipped to each side. Returns its SAH cost like find_split().
+    double find_spatial_split(const std::vector<prim_ref>& list, const aabb& box, int& axis, double& position) const {
+        struct bin { aabb box = aabb::empty; size_t entries = 0, exits = 0; };
+        axis = -1;
+        position = 0;
+        auto best = infinity;
+
+        for (int a = 0; a < 3; a++) {
+            const auto& extent = box.axis_interval(a);
+            if (extent.size() <= 0) continue;
+            auto width = extent.size() / bins;
+
+            bin counts[bins];
+            for (const auto& r : list) {
+                int first, last;
+                spatial_bins(r, extent, a, first, last);
+
+                aabb part;
+                if (first == last || !clip_ref(r, a, -infinity, extent.min + (first + 1) * width, part)) {
+                    // Fits one bin or can't be cut: kept whole, in the bin of its centroid
+                    auto b = spatial_bin(r.centroid[a], extent);
+                    counts[b].box = merge(counts[b].box, r.box);
+                    counts[b].entries++;
+                    counts[b].exits++;
+                    continue;
+                }
+                for (int b = first; b <= last; b++) {
+                    auto hi = b == last ? infinity : extent.min + (b + 1) * width;
+                    if (b > first) clip_ref(r, a, extent.min + b * width, hi, part);
+                    if (!is_empty(part)) counts[b].box = merge(counts[b].box, part);
+                }
+                counts[first].entries++;
+                counts[last].exits++;
+            }
+
+            double right_cost[bins];
+            size_t right_counts[bins];
+            auto right = aabb::empty;
+            size_t right_count = 0;
+            for (int b = bins - 1; b > 0; b--) {
+                right = merge(right, counts[b].box);
+                right_count += counts[b].exits;
+                right_cost[b] = right_count * surface_area(right);
+                right_counts[b] = right_count;
+            }
+
+            auto left = aabb::empty;
+            size_t left_count = 0;
+            for (int b = 1; b < bins; b++) {
+                left = merge(left, counts[b-1].box);
+                left_count += counts[b-1].entries;
+                if (left_count == 0 || right_counts[b] == 0) continue;
+
+                auto cost = left_count * surface_area(left) + right_cost[b];
+                if (cost < best) {
+                    best = cost;
+                    axis = a;
+                    position = extent.min + b * width;
+                }
+            }
+        }
+        return best;
+    }
+
+    // Splits the references at the plane p[axis] = position. Straddling references are clipped
+    // into both sides while the budget lasts; the rest go by their centroid.
+    void split_spatial(const std::vector<prim_ref>& list, const aabb& box, int axis, double position,
+                       size_t& budget, std::vector<prim_ref>& left, std::vector<prim_ref>& right) const {
+        const auto& extent = box.axis_interval(axis);
+        auto split_bin = spatial_bin(position, extent);
+
+        for (const auto& r : list) {
+            int first, last;
+            spatial_bins(r, extent, axis, first, last);
+            if (last < split_bin) { left.push_back(r); continue; }
+            if (first >= split_bin) { right.push_back(r); continue; }
+
+            aabb below, above;
+            if (clip_ref(r, axis, -infinity, position, below) && clip_ref(r, axis, position, infinity, above)) {
+                if (is_empty(below)) { right.push_back(r); continue; }
+                if (is_empty(above)) { left.push_back(r); continue; }
+                if (budget > 0) {
+                    budget--;
+                    left.push_back(make_ref(below, r.index, true));
+                    right.push_back(make_ref(above, r.index, true));
+                    continue;
+                }
+            }
+            (spatial_bin(r.centroid[axis], extent) < split_bin ? left : right).push_back(r);
+        }
+    }
+
+    static int spatial_bin(double value, const interval& extent) {
+        auto b = static_cast<int>((value - extent.min) * bins / extent.size());
+        return std::clamp(b, 0, bins - 1);
+    }
+
+    static void spatial_bins(const prim_ref& r, const interval& extent, int axis, int& first, int& last) {
+        first = spatial_bin(r.box.axis_interval(axis).min, extent);
+        last = spatial_bin(r.box.axis_interval(axis).max, extent);
+    }
+
+    static aabb intersection(const aabb& a, const aabb& b) {
+        aabb box;
+        box.x = interval(std::max(a.x.min, b.x.min), std::min(a.x.max, b.x.max));
+        box.y = interval(std::max(a.y.min, b.y.min), std::min(a.y.max, b.y.max));
+        box.z = interval(std::max(a.z.min, b.z.min), std::min(a.z.max, b.z.max));
+        return box;
+    }
+
+    static bool is_empty(const aabb& box) {
+        return box.x.min > box.x.max || box.y.min > box.y.max || box.z.min > box.z.max;
+    }
+
+    /* LBVH */
+
+    // Spreads the low 10 bits of v out to every third bit
+    static uint32_t expand_bits(uint32_t v) {
+        v = (v * 0x00010001u) & 0xFF0000FFu;
+        v = (v * 0x00000101u) & 0x0F00F00Fu;
+        v = (v * 0x00000011u) & 0xC30C30C3u;
+        v = (v * 0x00000005u) & 0x49249249u;
+        return v;
+    }
+
+    void sort_morton() {
+        aabb box, centroid_box;
+        range_bounds(refs.data(), refs.size(), box, centroid_box);
+
+        auto count = refs.size();
+        std::vector<std::pair<uint32_t, int>> keyed(count);
+        parallel_for(count, [&](size_t i) {
+            uint32_t cell[3];
+            for (int a = 0; a < 3; a++) {
+                const auto& extent = centroid_box.axis_interval(a);
+                auto f = extent.size() > 0 ? (refs[i].centroid[a] - extent.min) / extent.size() : 0.5;
+                cell[a] = static_cast<uint32_t>(std::clamp(f * 1024, 0.0, 1023.0));
+            }
+            keyed[i] = { expand_bits(cell[0]) << 2 | expand_bits(cell[1]) << 1 | expand_bits(cell[2]),
+                         static_cast<int>(i) };
+        });
+
+        // Sort chunks in parallel, then merge them pairwise
+        auto chunks = std::max<size_t>(1, std::min<size_t>(threads, count / chunk_size));
+        std::vector<size_t> edges;
+        for (size_t c = 0; c <= chunks; c++) edges.push_back(count * c / chunks);
+        {
+            std::vector<std::thread> pool;
+            for (size_t c = 0; c < chunks; c++)
+                pool.emplace_back([&, c] { std::sort(keyed.begin() + edges[c], keyed.begin() + edges[c+1]); });
+            for (auto& thread : pool) thread.join();
+        }
+        for (size_t width = 1; width < chunks; width *= 2) {
+            for (size_t c = 0; c + width < chunks; c += 2 * width) {
+                auto last = std::min(c + 2 * width, chunks);
+                std::inplace_merge(keyed.begin() + edges[c], keyed.begin() + edges[c + width],
+                                   keyed.begin() + edges[last]);
+            }
+        }
+
+        codes.resize(count);
+        std::vector<prim_ref> sorted(count);
+        parallel_for(count, [&](size_t i) {
+            codes[i] = keyed[i].first;
+            sorted[i] = refs[keyed[i].second];
+        });
+        refs.swap(sorted);
+    }
+
+    aabb build_lbvh(int index, size_t start, size_t end, int depth) {
+        auto count = end - start;
+        if (count <= static_cast<size_t>(options.max_leaf_size)) {
+            auto box = aabb::empty;
+            for (auto i = start; i < end; i++) box = merge(box, refs[i].box);
+            return nodes[make_leaf(index, start, end, box)].box;
+        }
+
+        // Split where the highest bit that differs across the range turns from 0 to 1. Codes
+        // are sorted, so that is the first code in the range with the bit set.
+        auto first = codes[start], last = codes[end - 1];
+        size_t mid = start + count / 2;
+        if (first != last && depth < balanced_depth) {
+            auto bit = 31 - __builtin_clz(first ^ last);
+            auto split = std::partition_point(codes.begin() + start, codes.begin() + end,
+                [&](uint32_t code) { return !(code >> bit & 1); });
+            mid = static_cast<size_t>(split - codes.begin());
+        }
+
+        aabb boxes[2];
+        build_children(index, count, depth,
+            [&](int left) { boxes[0] = build_lbvh(left, start, mid, depth + 1); },
+            [&](int right) { boxes[1] = build_lbvh(right, mid, end, depth + 1); });
+        nodes[index].box = merge(boxes[0], boxes[1]);
+        return nodes[index].box;
+    }
+};
+
+#endif
@@ -6,8 +6,33 @@
 #include "hittable.h"
 /* Needed to resolve IDE warning */
 #include "material.h"
-
+#include "fog.h"
+#include "wavefront.h"
+#include "bdpt.h"
+#include "photon_map.h"
+#include "path_guiding.h"
+#include "radiance_cache.h"
+#include "nee.h"
+#include "denoise.h"
+#include "framebuffer.h"
+#include "stats.h"
+#include "profiler.h"
+
+#include <atomic>
+#include <functional>
 #include <iostream>
+#include <thread>
+#include <unordered_map>
+#include <vector>
+
+enum class render_mode {
+    recursive,      // Trace each path to completion with ray_color
+    wavefront,      // Advance batches of paths bounce by bounce, see wavefront_integrator
+    bdpt,           // Join camera and light subpaths, see bdpt_integrator
+    photons,        // Progressive photon mapping, see photon_integrator
+    guided,         // Path tracing guided by a learned radiance distribution, see guided_integrator
+    nee             // Path tracing with shadow rays to lights picked by a light_bvh, see nee_integrator
+};
 
 class camera {
   public:
@@ -18,6 +43,7 @@ class camera {
     int    samples_per_pixel = 10;  // Count of random samples for each pixel
     int    max_depth = 10;      // Maximum number of rays bouncing / reflecting
     color  background = color(0.70, 0.80, 1.00);              // Scene background color
+    homogeneous_fog fog;                // Global fog, handled analytically along every ray
 
     double vfov = 90;                   // Vertical view angle
     point3 lookfrom = point3(0,0,-1);   // Camera position (looking from)
@@ -27,35 +53,184 @@ class camera {
     double defocus_angle = 0;       // Variation angle of rays
     double focus_dist = 10;         // Distance from lookfrom to focus plane
 
+    render_mode mode = render_mode::recursive;  // Integrator used by render()
+    size_t wavefront_batch = 1 << 18;           // Paths in flight for render_mode::wavefront
+    int    threads = 0;                         // Render threads, 0 uses every hardware thread
+
+    // render_mode::photons runs one pass per sample, each with this many new photons
+    size_t photons_per_pass = 200000;
+    double photon_radius = 0;       // Lookup radius of the first pass, 0 for 1/100 of the scene's diagonal
+    double photon_alpha = 2.0/3;    // Radius shrink rate in (0, 1); lower shrinks faster
+
+    // render_mode::recursive can end paths in a radiance_cache after this many diffuse bounces,
+    // 0 for none. Fewer bounces render faster with more bias.
+    int    cache_depth = 0;
+    double cache_cell = 0;          // Cache cell size, 0 for 1/50 of the scene's diagonal
+
+    int    denoise_passes = 0;      // À-trous passes over the image before it is written, 0 for none
+    bool   collect_features = false;    // Fill `features` even without denoising
+    int    feature_samples = 8;     // Samples per pixel for the feature buffers, at most samples_per_pixel
+    feature_buffers features;       // First-hit features of the last render(world, out)
+
+    // If set, render() also fills it with the AOV layers listed at render_aovs(). They are
+    // gathered by the recursive integrator, which is then used in every mode.
+    framebuffer* aovs = nullptr;
+
+    // If set, and built with RT_STATS, render() fills it with ray statistics and the cost of
+    // every pixel. The wavefront integrator leaves the pixels empty, and photon mapping charges
+    // them only for camera paths, not for shooting photons.
+    stats_report* stats = nullptr;
+
+    // Part of the image to render, in pixels from the top left. A zero size means the whole image.
+    int    crop_x = 0, crop_y = 0, crop_width = 0, crop_height = 0;
+
+    // Called from a render thread each time a row of the crop window is finished. Returning
+    // false stops the render; rows not finished by then are left black. The wavefront,
+    // bidirectional, photon mapping and guided integrators only finish rows at the very end,
+    // so they can't be stopped early and returning false only stops the reporting.
+    using row_callback = std::function<bool(int row)>;
+
     /**
-     * @brief Render the image and output a ppm-coded image format to std::cout
+     * @brief Render the image and output a ppm-coded image format to `out`
      * 
      * @param world Objects to be checked for hitting inside the scene
      */
-    void render(const hittable& world) {
+    void render(const hittable& world, std::ostream& out = std::cout) {
+        std::vector<color> image;
+        render(world, image);
+
+        int x, y, width, height;
+        crop_window(x, y, width, height);
+        if (denoise_passes > 0 || collect_features)
+            features = render_features(world);
+        if (denoise_passes > 0) {
+            profile_scope scope("denoise");
+            for (auto& pixel_color : image) pixel_color /= samples_per_pixel;
+            atrous_denoiser denoiser;
+            denoiser.iterations = denoise_passes;
+            denoiser.threads = threads;
+            denoiser.apply(image, features);
+            for (auto& pixel_color : image) pixel_color *= samples_per_pixel;
+        }
+
+        {
+            profile_scope scope("write image");
+            out << "P3\n" << width << ' ' << height << "\n255\n";
+            for (const auto& pixel_color : image)
+                write_color(out, pixel_color, samples_per_pixel);
+        }
+
+        std::clog << "\rDone.                 \n";
+    }
+
+    /**
+     * @brief Render the crop window into `image`, row by row from the top, holding the sum of
+     * all samples of each pixel.
+     * 
+     */
+    void render(const hittable& world, std::vector<color>& image, const row_callback& row_done = nullptr) {
+        profile_scope scope("render");
         initialize();
 
-        std::cout << "P3\n" << image_width << ' ' << image_height << "\n255\n";
+        image.assign(static_cast<size_t>(frame_width) * frame_height, color(0,0,0));
+        if (stats)
+            stats->reset(frame_width, frame_height);
+        if (aovs)
+            render_aovs(world, image, row_done);
+        else if (mode == render_mode::wavefront)
+            render_wavefront(world, image, row_done);
+        else if (mode == render_mode::bdpt)
+            render_bdpt(world, image, row_done);
+        else if (mode == render_mode::photons)
+            render_photons(world, image, row_done);
+        else if (mode == render_mode::guided)
+            render_guided(world, image, row_done);
+        else if (mode == render_mode::nee)
+            render_nee(world, image, row_done);
+        else
+            render_recursive(world, image, row_done);
+    }
 
-        for (int j = 0; j < image_height; ++j) {
-            std::clog << "\rScanlines remaining: " << (image_height - j) << ' ' << std::flush;
-            for (int i = 0; i < image_width; ++i) {
-                color pixel_color(0,0,0);
-                for (int sample=0; sample<samples_per_pixel; ++sample) {
-                    ray r = get_ray(i, j);
-                    pixel_color += ray_color(r, max_depth, world);
+    /**
+     * @brief Albedo, normal and depth of what each pixel of the crop window sees first,
+     * averaged over feature_samples jittered rays. Fog is ignored.
+     *
+     */
+    feature_buffers render_features(const hittable& world) {
+        initialize();
+        feature_buffers f;
+        f.width = frame_width;
+        f.height = frame_height;
+        auto count = static_cast<size_t>(frame_width) * frame_height;
+        f.albedo.assign(count, color(0,0,0));
+        f.normal.assign(count, vec3(0,0,0));
+        f.depth.assign(count, infinity);
+
+        auto samples = std::max(1, std::min(feature_samples, samples_per_pixel));
+        std::atomic<int> next_row{0};
+        auto work = [&] {
+            for (int j = next_row++; j < frame_height; j = next_row++) {
+                profile_scope scope("feature row", j);
+                for (int i = 0; i < frame_width; i++) {
+                    auto p = static_cast<size_t>(j) * frame_width + i;
+                    double depth_sum = 0;
+                    int hits = 0;
+                    for (int s = 0; s < samples; s++) {
+                        color albedo;
+                        vec3 normal;
+                        double depth;
+                        if (first_hit(get_ray(frame_x + i, frame_y + j), world, albedo, normal, depth)) {
+                            depth_sum += depth;
+                            hits++;
+                        }
+                        f.albedo[p] += albedo / samples;
+                        f.normal[p] += normal / samples;
+                    }
+                    if (hits > 0) f.depth[p] = depth_sum / hits;
                 }
-                write_color(std::cout, pixel_color, samples_per_pixel);
             }
-        }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count(); t++)
+            workers.emplace_back(work);
+        work();
+        for (auto& worker : workers)
+            worker.join();
+        return f;
+    }
 
-        std::clog << "\rDone.                 \n";
+    // Random rays through random pixels of the crop window, the way render() shoots them
+    std::vector<ray> sample_rays(size_t count) {
+        initialize();
+        std::vector<ray> rays;
+        rays.reserve(count);
+        for (size_t n = 0; n < count; n++)
+            rays.push_back(get_ray(frame_x + random_int(0, frame_width - 1),
+                                   frame_y + random_int(0, frame_height - 1)));
+        return rays;
+    }
+
+    // Image height in pixels, from image_width and aspect_ratio
+    int image_height_for_width() const {
+        auto height = static_cast<int>(image_width / aspect_ratio);
+        return (height < 1) ? 1 : height;
+    }
+
+    // The crop window clamped to the image
+    void crop_window(int& x, int& y, int& width, int& height) const {
+        auto full_height = image_height_for_width();
+        x = std::min(std::max(crop_x, 0), image_width - 1);
+        y = std::min(std::max(crop_y, 0), full_height - 1);
+        width = (crop_width > 0) ? std::min(crop_width, image_width - x) : image_width - x;
+        height = (crop_height > 0) ? std::min(crop_height, full_height - y) : full_height - y;
     }
 
   private:
     /* Private Camera Variables Here */
 
     int    image_height;   // Rendered image height
+    int    frame_x, frame_y, frame_width, frame_height;    // Crop window being rendered
     point3 center;         // Camera center
     point3 pixel00_loc;    // Location of pixel 0, 0
     vec3   pixel_delta_u;  // Offset to pixel to the right
@@ -63,14 +238,15 @@ class camera {
     vec3   u, v, w;        // Camera frame basis
     vec3   defocus_disk_u;
     vec3   defocus_disk_v;
+    double pixel_spread;   // Angle subtended by one pixel, seeds the primary ray cones
 
     /**
      * @brief Compute the necessary private fields for the camera to render an image
      * 
      */
     void initialize() {
-        image_height = static_cast<int>(image_width / aspect_ratio);
-        image_height = (image_height < 1) ? 1 : image_height;
+        image_height = image_height_for_width();
+        crop_window(frame_x, frame_y, frame_width, frame_height);
 
         center = lookfrom;
 
@@ -98,6 +274,7 @@ class camera {
             center - focus_dist * w - viewport_u/2 - viewport_v/2;
         // Define pixels at middle of each u-v grid
         pixel00_loc = viewport_upper_left + 0.5 * (pixel_delta_u + pixel_delta_v);
+        pixel_spread = pixel_delta_u.length() / focus_dist;
 
         // Calculate defocus disk basis
         auto defocus_radius = focus_dist * tan(degrees_to_radians(defocus_angle / 2));
@@ -105,6 +282,423 @@ class camera {
         defocus_disk_v = v * defocus_radius;
     }
 
+    int thread_count() const {
+        if (threads > 0) return threads;
+        auto hardware = static_cast<int>(std::thread::hardware_concurrency());
+        return hardware > 0 ? hardware : 1;
+    }
+
+    /**
+     * @brief Render the crop window with ray_color, or with a cached_integrator per thread if
+     * cache_depth is set. Threads take whole scanlines from a shared counter and each pixel is
+     * written by exactly one thread.
+     * 
+     */
+    void render_recursive(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        std::atomic<int> next_row{0};
+        std::atomic<bool> stopped{false};
+
+        shared_ptr<radiance_cache> cache;
+        if (cache_depth > 0) {
+            auto cell = cache_cell;
+            if (cell <= 0) {
+                auto box = world.bounding_box();
+                cell = vec3(box.x.size(), box.y.size(), box.z.size()).length() / 50;
+            }
+            cache = make_shared<radiance_cache>(cell);
+        }
+
+        auto work = [&](bool show_progress) {
+            shared_ptr<cached_integrator> cached;
+            if (cache)
+                cached = make_shared<cached_integrator>(world, *cache, background, fog, max_depth, cache_depth);
+            stats_recorder recorder(stats);
+            for (int j = next_row++; j < frame_height && !stopped; j = next_row++) {
+                profile_scope scope("row", j);
+                if (show_progress)
+                    std::clog << "\rScanlines remaining: " << (frame_height - j) << ' ' << std::flush;
+                for (int i = 0; i < frame_width; ++i) {
+                    recorder.begin();
+                    color pixel_color(0,0,0);
+                    for (int sample=0; sample<samples_per_pixel; ++sample) {
+                        ray r = get_ray(frame_x + i, frame_y + j);
+                        pixel_color += cached ? cached->sample(r) : ray_color(r, max_depth, world);
+                    }
+                    recorder.end(static_cast<size_t>(j) * frame_width + i, samples_per_pixel);
+                    image[static_cast<size_t>(j) * frame_width + i] = pixel_color;
+                }
+                if (row_done && !row_done(j))
+                    stopped = true;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count(); t++)
+            workers.emplace_back(work, false);
+        work(true);
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    // First-hit values of one camera path, besides its light
+    struct path_aovs {
+        color light[3];         // Emitted at the first vertex, the second, and any later one
+        color albedo;
+        vec3 normal;
+        double depth = infinity;
+        const void* object = nullptr;
+        const material* mat = nullptr;
+    };
+
+    /**
+     * @brief Render the crop window like render_recursive, also filling `aovs` with these
+     * layers: the beauty (R, G, B), depth (Z, the nearest hit over the samples, infinite if none),
+     * normal (X, Y, Z), albedo, emission (light seen directly), direct (light one bounce away,
+     * sky included), indirect (the rest), object_id and material_id (the ID hit by most samples,
+     * 0 for none). Emission, direct and indirect add up to the beauty. Lines are distributed
+     * over threads the same way, and each sample draws the same random numbers as ray_color.
+     *
+     */
+    void render_aovs(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        auto& fb = *aovs;
+        fb.reset(frame_width, frame_height);
+        auto beauty = fb.add_layer("", {"R", "G", "B"});
+        auto depth = fb.add_layer("depth", {"Z"}, false, infinity);
+        auto normal = fb.add_layer("normal", {"X", "Y", "Z"});
+        auto albedo = fb.add_layer("albedo", {"R", "G", "B"});
+        auto emission = fb.add_layer("emission", {"R", "G", "B"});
+        auto direct = fb.add_layer("direct", {"R", "G", "B"});
+        auto indirect = fb.add_layer("indirect", {"R", "G", "B"});
+        auto object_id = fb.add_layer("object_id", {"id"}, false);
+        auto material_id = fb.add_layer("material_id", {"id"}, false);
+
+        id_registry object_ids, material_ids;
+        std::atomic<int> next_row{0};
+        std::atomic<bool> stopped{false};
+
+        auto work = [&](bool show_progress) {
+            std::unordered_map<const void*, uint32_t> known_objects, known_materials;
+            auto lookup = [](const void* key, id_registry& registry, std::unordered_map<const void*, uint32_t>& known) {
+                if (!key) return 0u;
+                auto found = known.find(key);
+                return found != known.end() ? found->second : (known[key] = registry.id(key));
+            };
+            std::vector<std::pair<uint32_t, int>> object_votes, material_votes;
+            auto vote = [](std::vector<std::pair<uint32_t, int>>& votes, uint32_t id) {
+                for (auto& v : votes) {
+                    if (v.first == id) { v.second++; return; }
+                }
+                votes.push_back({ id, 1 });
+            };
+            auto winner = [](const std::vector<std::pair<uint32_t, int>>& votes) {
+                std::pair<uint32_t, int> best{ 0, 0 };
+                for (const auto& v : votes) if (v.second > best.second) best = v;
+                return static_cast<float>(best.first);
+            };
+            auto add = [&](int layer, size_t p, const vec3& v) {
+                auto values = fb.at(layer, p);
+                for (int c = 0; c < 3; c++) values[c] += static_cast<float>(v[c]);
+            };
+
+            stats_recorder recorder(stats);
+            for (int j = next_row++; j < frame_height && !stopped; j = next_row++) {
+                profile_scope scope("row", j);
+                if (show_progress)
+                    std::clog << "\rScanlines remaining: " << (frame_height - j) << ' ' << std::flush;
+                for (int i = 0; i < frame_width; ++i) {
+                    auto p = static_cast<size_t>(j) * frame_width + i;
+                    color pixel_color(0,0,0);
+                    object_votes.clear();
+                    material_votes.clear();
+                    recorder.begin();
+                    for (int sample=0; sample<samples_per_pixel; ++sample) {
+                        ray r = get_ray(frame_x + i, frame_y + j);
+                        path_aovs path;
+                        pixel_color += ray_color_split(r, max_depth, world, 0, path);
+
+                        add(emission, p, path.light[0]);
+                        add(direct, p, path.light[1]);
+                        add(indirect, p, path.light[2]);
+                        add(albedo, p, path.albedo);
+                        add(normal, p, path.normal);
+                        auto z = fb.at(depth, p);
+                        *z = std::min(*z, static_cast<float>(path.depth));
+                        vote(object_votes, lookup(path.object, object_ids, known_objects));
+                        vote(material_votes, lookup(path.mat, material_ids, known_materials));
+                    }
+                    recorder.end(p, samples_per_pixel);
+                    image[p] = pixel_color;
+                    add(beauty, p, pixel_color);
+                    *fb.at(object_id, p) = winner(object_votes);
+                    *fb.at(material_id, p) = winner(material_votes);
+                    fb.samples[p] = static_cast<uint32_t>(samples_per_pixel);
+                }
+                if (row_done && !row_done(j))
+                    stopped = true;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count(); t++)
+            workers.emplace_back(work, false);
+        work(true);
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    /**
+     * @brief Render the crop window with the wavefront integrator. Every thread runs its own
+     * integrator over a contiguous range of pixels. Rows are only reported once all threads
+     * are done, since every row gets its samples in the last batches.
+     * 
+     */
+    void render_wavefront(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        auto pixel_count = image.size();
+        auto count = static_cast<size_t>(thread_count());
+        auto per_thread_batch = std::max<size_t>(wavefront_batch / count, 1);
+
+        auto work = [&](size_t first_pixel, size_t last_pixel, bool show_progress) {
+            wavefront_integrator integrator(world, background, fog, per_thread_batch);
+            integrator.show_progress = show_progress;
+
+            // Path index enumerates samples of the first pixel first, then the next one, ...
+            auto generate = [&](size_t index, ray& r, int& pixel) {
+                pixel = static_cast<int>(first_pixel + index / samples_per_pixel);
+                r = get_ray(frame_x + pixel % frame_width, frame_y + pixel / frame_width);
+            };
+            profile_scope scope("wavefront paths");
+            stats_recorder recorder(stats);
+            integrator.render((last_pixel - first_pixel) * samples_per_pixel, max_depth, generate, image);
+            recorder.add_samples((last_pixel - first_pixel) * samples_per_pixel);
+        };
+
+        std::vector<std::thread> workers;
+        for (size_t t = 1; t < count; t++)
+            workers.emplace_back(work, pixel_count * t / count, pixel_count * (t+1) / count, false);
+        work(0, pixel_count / count, true);
+        for (auto& worker : workers)
+            worker.join();
+
+        for (int j = 0; row_done && j < frame_height; j++)
+            if (!row_done(j)) break;
+    }
+
+    /**
+     * @brief Render the crop window with the bidirectional integrator. Rows are split between
+     * threads as in render_recursive, but light tracing adds to every pixel until the last
+     * thread is done, so rows are only reported at the end, as in render_wavefront, and the
+     * render can't be stopped early.
+     *
+     */
+    void render_bdpt(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        light_list lights(world);
+        if (lights.empty())
+            std::clog << "No lights to sample, bidirectional paths only start from the camera.\n";
+
+        bdpt_camera lens;
+        lens.center = center;
+        lens.w = w;
+        lens.pixel00_loc = pixel00_loc;
+        lens.pixel_delta_u = pixel_delta_u;
+        lens.pixel_delta_v = pixel_delta_v;
+        lens.defocus_disk_u = defocus_disk_u;
+        lens.defocus_disk_v = defocus_disk_v;
+        lens.thin_lens = defocus_angle > 0;
+        lens.focus_dist = focus_dist;
+        lens.frame_x = frame_x;
+        lens.frame_y = frame_y;
+        lens.frame_width = frame_width;
+        lens.frame_height = frame_height;
+
+        splat_film splats(image.size());
+        std::atomic<int> next_row{0};
+
+        auto work = [&](bool show_progress) {
+            bdpt_integrator integrator(world, lights, lens, background, fog, max_depth, splats);
+            stats_recorder recorder(stats);
+            for (int j = next_row++; j < frame_height; j = next_row++) {
+                profile_scope scope("row", j);
+                if (show_progress)
+                    std::clog << "\rScanlines remaining: " << (frame_height - j) << ' ' << std::flush;
+                for (int i = 0; i < frame_width; ++i) {
+                    recorder.begin();
+                    color pixel_color(0,0,0);
+                    for (int sample=0; sample<samples_per_pixel; ++sample)
+                        pixel_color += integrator.sample(get_ray(frame_x + i, frame_y + j));
+                    recorder.end(static_cast<size_t>(j) * frame_width + i, samples_per_pixel);
+                    image[static_cast<size_t>(j) * frame_width + i] = pixel_color;
+                }
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count(); t++)
+            workers.emplace_back(work, false);
+        work(true);
+        for (auto& worker : workers)
+            worker.join();
+
+        // One light subpath was traced per camera sample, so the splats share its 1/spp
+        for (size_t p = 0; p < image.size(); p++)
+            image[p] += splats.at(p);
+
+        for (int j = 0; row_done && j < frame_height; j++)
+            if (!row_done(j)) break;
+    }
+
+    /**
+     * @brief Render the crop window with progressive photon mapping, one pass per sample. Each
+     * pass shoots photons from every thread, then splits the rows between them for one camera
+     * path per pixel. Rows are only reported once the last pass is done, so the render can't be
+     * stopped early.
+     *
+     */
+    void render_photons(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        light_list lights(world);
+        if (lights.empty())
+            std::clog << "No lights to shoot photons from.\n";
+
+        auto radius = photon_radius;
+        if (radius <= 0) {
+            auto box = world.bounding_box();
+            radius = vec3(box.x.size(), box.y.size(), box.z.size()).length() / 100;
+        }
+        auto alpha = std::min(std::max(photon_alpha, 0.01), 1.0);
+
+        photon_integrator integrator(world, lights, background, fog, max_depth);
+        for (int pass = 1; pass <= samples_per_pixel; pass++) {
+            std::clog << "\rPhoton passes remaining: " << (samples_per_pixel - pass + 1) << ' ' << std::flush;
+            {
+                profile_scope scope("shoot photons", pass);
+                integrator.shoot(photons_per_pass, radius, thread_count(), stats);
+            }
+
+            std::atomic<int> next_row{0};
+            auto work = [&] {
+                stats_recorder recorder(stats);
+                for (int j = next_row++; j < frame_height; j = next_row++) {
+                    profile_scope scope("row", j);
+                    for (int i = 0; i < frame_width; ++i) {
+                        auto p = static_cast<size_t>(j) * frame_width + i;
+                        recorder.begin();
+                        image[p] += integrator.radiance(get_ray(frame_x + i, frame_y + j));
+                        recorder.end(p, 1);
+                    }
+                }
+            };
+            std::vector<std::thread> workers;
+            for (int t = 1; t < thread_count(); t++)
+                workers.emplace_back(work);
+            work();
+            for (auto& worker : workers)
+                worker.join();
+
+            radius *= sqrt((pass + alpha) / (pass + 1));
+        }
+
+        for (int j = 0; row_done && j < frame_height; j++)
+            if (!row_done(j)) break;
+    }
+
+    /**
+     * @brief Render the crop window with next event estimation, splitting rows between threads
+     * as in render_recursive.
+     *
+     */
+    void render_nee(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        light_list lights(world);
+        light_bvh sampler(lights);
+        if (lights.empty())
+            std::clog << "No lights to sample, light is only found by bounces.\n";
+
+        std::atomic<int> next_row{0};
+        std::atomic<bool> stopped{false};
+
+        auto work = [&](bool show_progress) {
+            nee_integrator integrator(world, lights, sampler, background, fog, max_depth);
+            stats_recorder recorder(stats);
+            for (int j = next_row++; j < frame_height && !stopped; j = next_row++) {
+                profile_scope scope("row", j);
+                if (show_progress)
+                    std::clog << "\rScanlines remaining: " << (frame_height - j) << ' ' << std::flush;
+                for (int i = 0; i < frame_width; ++i) {
+                    recorder.begin();
+                    color pixel_color(0,0,0);
+                    for (int sample=0; sample<samples_per_pixel; ++sample)
+                        pixel_color += integrator.sample(get_ray(frame_x + i, frame_y + j));
+                    recorder.end(static_cast<size_t>(j) * frame_width + i, samples_per_pixel);
+                    image[static_cast<size_t>(j) * frame_width + i] = pixel_color;
+                }
+                if (row_done && !row_done(j))
+                    stopped = true;
+            }
+        };
+
+        std::vector<std::thread> workers;
+        for (int t = 1; t < thread_count(); t++)
+            workers.emplace_back(work, false);
+        work(true);
+        for (auto& worker : workers)
+            worker.join();
+    }
+
+    /**
+     * @brief Render the crop window with path guiding. Training passes of 1, 2, 4, ... samples
+     * per pixel teach a guiding_tree where light comes from, refining it after each pass, while
+     * at least the last half of the samples go to the final pass that makes the image. Rows are
+     * only reported once it is done.
+     *
+     */
+    void render_guided(const hittable& world, std::vector<color>& image, const row_callback& row_done) const {
+        guiding_tree tree(world.bounding_box());
+
+        // Train while the samples left after a pass still cover the next, doubled pass
+        int remaining = samples_per_pixel, pass_spp = 1;
+        while (true) {
+            bool final = remaining - pass_spp < 2*pass_spp;
+            if (final) pass_spp = remaining;
+            std::clog << "\rGuiding pass of " << pass_spp << (final ? " final" : " training")
+                      << " samples, " << tree.leaf_count() << " regions " << std::flush;
+
+            std::atomic<int> next_row{0};
+            auto work = [&] {
+                guided_integrator integrator(world, tree, background, fog, max_depth);
+                stats_recorder recorder(stats);
+                for (int j = next_row++; j < frame_height; j = next_row++) {
+                    profile_scope scope("row", j);
+                    for (int i = 0; i < frame_width; ++i) {
+                        recorder.begin();
+                        color pixel_color(0,0,0);
+                        for (int sample = 0; sample < pass_spp; ++sample)
+                            pixel_color += integrator.sample(get_ray(frame_x + i, frame_y + j), !final);
+                        recorder.end(static_cast<size_t>(j) * frame_width + i, pass_spp);
+                        if (final) image[static_cast<size_t>(j) * frame_width + i] = pixel_color;
+                    }
+                }
+            };
+            std::vector<std::thread> workers;
+            for (int t = 1; t < thread_count(); t++)
+                workers.emplace_back(work);
+            work();
+            for (auto& worker : workers)
+                worker.join();
+
+            if (final) break;
+            profile_scope scope("refine guiding tree", pass_spp);
+            tree.refine(pass_spp);
+            remaining -= pass_spp;
+            pass_spp *= 2;
+        }
+
+        // The image is written as a sum over samples_per_pixel samples
+        auto scale = static_cast<double>(samples_per_pixel) / std::max(pass_spp, 1);
+        for (auto& pixel : image)
+            pixel *= scale;
+
+        for (int j = 0; row_done && j < frame_height; j++)
+            if (!row_done(j)) break;
+    }
+
     /**
      * @brief Cast the ray into the scene and determine the color at this pixel
      * 
@@ -120,7 +714,18 @@ class camera {
 
         // Set tmin=0.001 to ignore possible ray origins below the surface due to round off errors
         // aka "shadow acne"
-        if (!world.hit(r, interval(0.001, infinity), rec)) {
+        bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+        RT_STAT(rays);
+
+        // The ray may scatter in the fog before it reaches the surface (or the background)
+        double t_fog;
+        if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+            ray scattered(r.at(t_fog), random_unit_vector(), r.time());
+            scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+            return fog.albedo * ray_color(scattered, depth-1, world);
+        }
+
+        if (!hit_anything) {
             // Return background color if doesn't hit anything in the scene
             return background;
         }
@@ -134,10 +739,104 @@ class camera {
             return color_from_emission;
         }
 
+        // Secondary rays keep growing the cone from its width at the hit point
+        scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+
         color color_from_scatter = attenuation * ray_color(scattered, depth-1, world);
         return color_from_emission + color_from_scatter;
     }
 
+    // Albedo of a surface whose scatter() failed. Metal absorbs rays scattered below its
+    // surface but still sets its albedo; lights set none and stand in with their emission,
+    // clamped to the range of an albedo.
+    static color unscattered_albedo(const color& attenuation, const color& emitted) {
+        color albedo;
+        for (int c = 0; c < 3; c++) albedo[c] = std::max(attenuation[c], std::min(emitted[c], 1.0));
+        return albedo;
+    }
+
+    // Features of the first surface along `r`; returns false, with the background as albedo,
+    // if there is none
+    bool first_hit(const ray& r, const hittable& world, color& albedo, vec3& normal, double& depth) const {
+        hit_record rec;
+        if (!world.hit(r, interval(0.001, infinity), rec)) {
+            albedo = background;
+            normal = vec3(0,0,0);
+            return false;
+        }
+
+        ray scattered;
+        albedo = color(0,0,0);
+        if (!rec.mat->scatter(r, rec, albedo, scattered))
+            albedo = unscattered_albedo(albedo, rec.mat->emitted(rec.u, rec.v, rec.p));
+        normal = rec.normal;
+        depth = rec.t * r.direction().length();
+        return true;
+    }
+
+    /**
+     * @brief ray_color, also splitting its result by the vertex the light was emitted at into
+     * path.light (see path_aovs) and recording the first hit in `path`. `vertex` counts the
+     * vertices before `r`. Draws the same random numbers and does the same arithmetic as
+     * ray_color, so both return the same color.
+     *
+     */
+    color ray_color_split(const ray& r, int depth, const hittable& world, int vertex, path_aovs& path) const {
+        if (vertex >= 2) {
+            path.light[2] = ray_color(r, depth, world);
+            return path.light[2];
+        }
+        if (depth <= 0)
+            return color(0,0,0);
+
+        hit_record rec;
+        bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+        RT_STAT(rays);
+        if (vertex == 0 && hit_anything) {
+            path.depth = rec.t * r.direction().length();
+            path.normal = rec.normal;
+            path.object = rec.object;
+            path.mat = rec.mat.get();
+        }
+
+        // Light found further along is attenuated by this vertex before it lands in `path`
+        auto follow = [&](const ray& next, const color& attenuation) {
+            path_aovs rest;
+            auto c = ray_color_split(next, depth-1, world, vertex+1, rest);
+            for (int k = vertex + 1; k < 3; k++) path.light[k] = attenuation * rest.light[k];
+            return c;
+        };
+
+        double t_fog;
+        if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+            ray scattered(r.at(t_fog), random_unit_vector(), r.time());
+            scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+            return fog.albedo * follow(scattered, fog.albedo);
+        }
+
+        if (!hit_anything) {
+            if (vertex == 0) path.albedo = background;
+            path.light[vertex] = background;
+            return background;
+        }
+
+        ray scattered;
+        color attenuation(0,0,0);
+        color color_from_emission = rec.mat->emitted(rec.u, rec.v, rec.p);
+        path.light[vertex] = color_from_emission;
+
+        bool scatters = rec.mat->scatter(r, rec, attenuation, scattered);
+        if (vertex == 0)
+            path.albedo = scatters ? attenuation : unscattered_albedo(attenuation, color_from_emission);
+        if (!scatters)
+            return color_from_emission;
+
+        scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+
+        color color_from_scatter = attenuation * follow(scattered, attenuation);
+        return color_from_emission + color_from_scatter;
+    }
+
     /**
      * @brief Get a randomly sampled ray for the pixel at location i, j
      * originating from the defocus disk
@@ -151,7 +850,9 @@ class camera {
         auto ray_direction = pixel_sample - ray_origin;
         auto ray_time = random_double();
 
-        return ray(ray_origin, ray_direction, ray_time);
+        ray r(ray_origin, ray_direction, ray_time);
+        r.set_cone(0, pixel_spread);
+        return r;
     }
 
     /**
@@ -0,0 +1,268 @@
+#ifndef COMPRESSED_BVH_H
+#define COMPRESSED_BVH_H
+
+#include "utils.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_build.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief BVH for very large static scenes, with eight children per node and every child box
+ * quantized to 8 bits per side on a grid laid over its parent's box. A node is 80 bytes for up
+ * to eight children, against roughly 100 bytes of heap per bvh_node for each binary split, so
+ * the acceleration structure of a big mesh shrinks about tenfold.
+ *
+ * The grid of a node starts at a float origin and has a power of two cell size per axis, so
+ * decoding a child bound is one multiply-add that is exact in double precision. Bounds are
+ * rounded outwards when quantized: decoded boxes always contain the real ones, they are just up
+ * to one cell (1/255 of the parent) larger.
+ *
+ * The tree is built as a binary BVH by bvh_builder and collapsed into the wide one by repeatedly
+ * opening the child with the largest surface area. Moving objects are bounded by their boxes
+ * over the whole shutter interval; motion_bvh bounds them tighter.
+ *
+ */
+class compressed_bvh : public hittable {
+  public:
+    static constexpr int width = 8;
+
+    bvh_build_options options;
+    bvh_build_stats stats;
+
+    compressed_bvh(const std::vector<shared_ptr<hittable>>& objects, const bvh_build_options& options = {})
+      : options(options)
+    {
+        auto start = std::chrono::steady_clock::now();
+        std::vector<aabb> bounds(objects.size());
+        parallel_for(objects.size(), options.threads, [&](size_t i) { bounds[i] = objects[i]->bounding_box(); });
+
+        auto build = options;
+        build.max_leaf_size = std::clamp(build.max_leaf_size, 1, 127);     // Counts are 7 bits
+        bvh_builder tree(bounds, build, [&](int i, int axis, double lo, double hi, aabb& box) {
+            box = objects[i]->clipped_box(axis, lo, hi);
+            return true;
+        });
+
+        if (!objects.empty()) {
+            bbox = tree.nodes[0].box;
+            nodes.emplace_back();
+            std::vector<int> root_children{ 0 };
+            if (tree.nodes[0].left >= 0) root_children = gather(tree, 0);
+            fill(0, tree, root_children, objects);
+        }
+
+        stats = tree.stats;
+        stats.nodes = nodes.size();
+        stats.bytes = nodes.size() * sizeof(node) + this->objects.size() * sizeof(shared_ptr<hittable>);
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (nodes.empty()) return false;
+
+        double orig[3], invD[3];
+        for (int a = 0; a < 3; a++) {
+            orig[a] = r.origin()[a];
+            invD[a] = 1 / r.direction()[a];
+        }
+
+        struct entry { double t; uint32_t node; };
+        entry stack[64 * (width - 1)];
+        int top = 0;
+        stack[top++] = { ray_t.min, 0 };
+        bool hit_anything = false;
+
+        while (top > 0) {
+            auto current = stack[--top];
+            if (current.t > ray_t.max) continue;
+            const auto& n = nodes[current.node];
+            RT_STAT(bvh_nodes);
+
+            // Child bounds are origin + q * scale, so their slab distances are affine in q
+            double base[3], step[3];
+            for (int a = 0; a < 3; a++) {
+                base[a] = (n.origin[a] - orig[a]) * invD[a];
+                step[a] = power_of_two(n.exponent[a]) * invD[a];
+            }
+
+            entry inner[width];
+            int count = 0;
+            auto child = n.child_base;
+            auto prim = n.prim_base;
+            for (int c = 0; c < width && n.meta[c] != 0; c++) {
+                bool interior = n.meta[c] & interior_flag;
+                auto prims = n.meta[c] & count_mask;
+                RT_STAT(aabb_tests);
+
+                auto t_min = ray_t.min, t_max = ray_t.max;
+                for (int a = 0; a < 3; a++) {
+                    auto t0 = base[a] + n.lo[a][c] * step[a];
+                    auto t1 = base[a] + n.hi[a][c] * step[a];
+                    if (invD[a] < 0) std::swap(t0, t1);
+                    t_min = std::max(t_min, t0);
+                    t_max = std::min(t_max, t1);
+                }
+
+                if (t_min < t_max) {
+                    if (interior) {
+                        inner[count++] = { t_min, child };
+                    } else {
+                        for (auto i = prim; i < prim + prims; i++) {
+                            if (objects[i]->hit(r, ray_t, rec)) {
+                                hit_anything = true;
+                                ray_t.max = rec.t;
+                            }
+                        }
+                    }
+                }
+                if (interior) child++;
+                else prim += prims;
+            }
+
+            // Farthest first onto the stack, so the nearest child is opened next
+            for (int i = 1; i < count; i++)
+                for (int j = i; j > 0 && inner[j].t > inner[j-1].t; j--)
+                    std::swap(inner[j], inner[j-1]);
+            for (int i = 0; i < count; i++) stack[top++] = inner[i];
+        }
+        return hit_anything;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    // Leaf primitives in tree order; one cut by spatial splits is listed once per piece
+    const std::vector<shared_ptr<hittable>>& get_objects() const { return objects; }
+
+  private:
+    static constexpr uint8_t interior_flag = 0x80;
+    static constexpr uint8_t count_mask = 0x7f;
+
+    // Interior children are stored consecutively from child_base and the primitives of leaf
+    // children consecutively from prim_base, both in slot order, so a child's index is the
+    // count of its kind before it.
+    struct node {
+        float origin[3];            // Corner of the quantization grid
+        int8_t exponent[3];         // Grid cells are 2^exponent wide along each axis
+        uint8_t pad = 0;
+        uint32_t child_base;
+        uint32_t prim_base;
+        uint8_t meta[width];        // 0 for an empty slot, interior_flag, or a leaf's count
+        uint8_t lo[3][width];       // Child bounds, in grid cells from the origin
+        uint8_t hi[3][width];
+    };
+    static_assert(sizeof(node) == 80, "compressed_bvh::node should pack into 80 bytes");
+
+    std::vector<node> nodes;
+    std::vector<shared_ptr<hittable>> objects;      // Leaf primitives in tree order
+    aabb bbox;
+
+    // 2^e, built straight from its bits since ldexp is a library call
+    static double power_of_two(int e) {
+        auto bits = static_cast<uint64_t>(e + 1023) << 52;
+        double value;
+        std::memcpy(&value, &bits, sizeof(value));
+        return value;
+    }
+
+    static double surface_area(const aabb& box) {
+        auto x = box.x.size(), y = box.y.size(), z = box.z.size();
+        return 2 * (x*y + y*z + z*x);
+    }
+
+    // Up to `width` descendants of a binary node that together cover it, opening the largest
+    // interior one first
+    static std::vector<int> gather(const bvh_builder& tree, int source) {
+        std::vector<int> children{ tree.nodes[source].left, tree.nodes[source].right };
+        while (children.size() < width) {
+            int largest = -1;
+            double largest_area = -1;
+            for (size_t c = 0; c < children.size(); c++) {
+                const auto& n = tree.nodes[children[c]];
+                if (n.left < 0) continue;
+                auto area = surface_area(n.box);
+                if (area > largest_area) {
+                    largest_area = area;
+                    largest = static_cast<int>(c);
+                }
+            }
+            if (largest < 0) break;
+
+            const auto& n = tree.nodes[children[largest]];
+            children[largest] = n.left;
+            children.push_back(n.right);
+        }
+        return children;
+    }
+
+    void fill(uint32_t index, const bvh_builder& tree, const std::vector<int>& children,
+              const std::vector<shared_ptr<hittable>>& source) {
+        auto box = aabb::empty;
+        for (auto c : children) box = aabb(box, tree.nodes[c].box);
+
+        node n{};
+        quantize_frame(box, n);
+
+        std::vector<int> interior;
+        n.prim_base = static_cast<uint32_t>(objects.size());
+        for (size_t c = 0; c < children.size(); c++) {
+            const auto& child = tree.nodes[children[c]];
+            quantize_child(child.box, n, static_cast<int>(c));
+            if (child.left >= 0) {
+                n.meta[c] = interior_flag;
+                interior.push_back(children[c]);
+            } else {
+                n.meta[c] = static_cast<uint8_t>(child.count);
+                for (int i = child.first; i < child.first + child.count; i++)
+                    objects.push_back(source[tree.order[i]]);
+            }
+        }
+
+        n.child_base = static_cast<uint32_t>(nodes.size());
+        nodes[index] = n;
+        nodes.resize(nodes.size() + interior.size());
+        for (size_t i = 0; i < interior.size(); i++)
+            fill(n.child_base + static_cast<uint32_t>(i), tree, gather(tree, interior[i]), source);
+    }
+
+    // Picks the grid of a node: a float origin at or below the box's corner, and the smallest
+    // power of two cell size that fits the box in 255 cells
+    static void quantize_frame(const aabb& box, node& n) {
+        for (int a = 0; a < 3; a++) {
+            const auto& extent = box.axis_interval(a);
+            auto origin = static_cast<float>(extent.min);
+            if (origin > extent.min) origin = std::nextafter(origin, -INFINITY);
+            n.origin[a] = origin;
+
+            auto cells = (extent.max - origin) / 255;
+            int exponent = cells > 0 ? static_cast<int>(std::ceil(std::log2(cells))) : -128;
+            exponent = std::clamp(exponent, -128, 127);
+            while (exponent < 127 && std::ceil((extent.max - origin) / std::ldexp(1.0, exponent)) > 255)
+                exponent++;
+            n.exponent[a] = static_cast<int8_t>(exponent);
+        }
+    }
+
+    // Rounds a child box outwards to the node's grid
+    static void quantize_child(const aabb& box, node& n, int c) {
+        for (int a = 0; a < 3; a++) {
+            const auto& extent = box.axis_interval(a);
+            auto scale = std::ldexp(1.0, n.exponent[a]);
+            auto lo = std::clamp(std::floor((extent.min - n.origin[a]) / scale), 0.0, 255.0);
+            auto hi = std::clamp(std::ceil((extent.max - n.origin[a]) / scale), 0.0, 255.0);
+            if (lo > 0 && n.origin[a] + lo * scale > extent.min) lo--;
+            if (hi < 255 && n.origin[a] + hi * scale < extent.max) hi++;
+            n.lo[a][c] = static_cast<uint8_t>(lo);
+            n.hi[a][c] = static_cast<uint8_t>(hi);
+        }
+    }
+};
+
+#endif
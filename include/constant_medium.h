@@ -6,6 +6,7 @@
 #include "hittable.h"
 #include "material.h"
 #include "texture.h"
+#include "stats.h"
 
 class constant_medium : public hittable {
   public:
@@ -20,37 +21,35 @@ class constant_medium : public hittable {
     {}
 
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(medium_tests);
         // Print occasional samples when debugging. To enable, set enableDebug true.
         const bool enableDebug = false;
         const bool debugging = enableDebug && random_double() < 0.00001;
 
-        hit_record rec1, rec2;
-
-        if (!boundary->hit(r, interval::universe, rec1))
-            return false;
-
-        if (!boundary->hit(r, interval(rec1.t+0.0001, infinity), rec2))
+        // Entry and exit of the boundary in a single query
+        interval inside;
+        if (!boundary->hit_span(r, inside))
             return false;
 
-        if (debugging) std::clog << "\nt_min=" << rec1.t << ", t_max=" << rec2.t << '\n';
+        if (debugging) std::clog << "\nt_min=" << inside.min << ", t_max=" << inside.max << '\n';
 
-        if (rec1.t < ray_t.min) rec1.t = ray_t.min;
-        if (rec2.t > ray_t.max) rec2.t = ray_t.max;
+        if (inside.min < ray_t.min) inside.min = ray_t.min;
+        if (inside.max > ray_t.max) inside.max = ray_t.max;
 
-        if (rec1.t >= rec2.t)
+        if (inside.min >= inside.max)
             return false;
 
-        if (rec1.t < 0)
-            rec1.t = 0;
+        if (inside.min < 0)
+            inside.min = 0;
 
         auto ray_length = r.direction().length();
-        auto distance_inside_boundary = (rec2.t - rec1.t) * ray_length;
+        auto distance_inside_boundary = inside.size() * ray_length;
         auto hit_distance = neg_inv_density * log(random_double());
 
         if (hit_distance > distance_inside_boundary)
             return false;
 
-        rec.t = rec1.t + hit_distance / ray_length;
+        rec.t = inside.min + hit_distance / ray_length;
         rec.p = r.at(rec.t);
 
         if (debugging) {
@@ -59,15 +58,24 @@ class constant_medium : public hittable {
                       << "rec.p = " <<  rec.p << '\n';
         }
 
-        rec.normal = vec3(1,0,0);  // arbitrary
-        rec.front_face = true;     // also arbitrary
+        // Volumes have no surface; face the normal back along the ray so anything reading it
+        // sees a front-facing hit, and give the phase function well-defined texture coordinates.
+        rec.set_face_normal(r, -unit_vector(r.direction()));
+        rec.u = rec.v = 0;
+        rec.footprint = 0;
         rec.mat = phase_function;
+        rec.object = this;
+        rec.density = -1 / neg_inv_density;
 
         return true;
     }
 
     aabb bounding_box() const override { return boundary->bounding_box(); }
 
+    const shared_ptr<hittable>& get_boundary() const { return boundary; }
+    double get_density() const { return -1 / neg_inv_density; }
+    const shared_ptr<material>& get_phase_function() const { return phase_function; }
+
   private:
     shared_ptr<hittable> boundary;
     double neg_inv_density;
@@ -0,0 +1,205 @@
+#ifndef DENOISE_H
+#define DENOISE_H
+
+#include "utils.h"
+#include "color.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief What the camera sees first through each pixel, averaged over a few samples. Guides
+ * atrous_denoiser, which must not blur across the edges these buffers show.
+ *
+ */
+struct feature_buffers {
+    int width = 0, height = 0;
+    std::vector<color> albedo;      // Attenuation of the first surface hit, the background on a miss
+    std::vector<vec3> normal;       // Shading normal of the first hit, zero on a miss
+    std::vector<double> depth;      // Distance to the first hit, infinity if no sample hit
+
+    bool empty() const { return albedo.empty(); }
+};
+
+
+/**
+ * @brief Edge-avoiding à-trous wavelet filter (Dammertz et al. 2010), with the color test
+ * steered by luminance variance as in SVGF (Schied et al. 2017). Each pass blurs the image with
+ * a 5x5 B3 spline kernel whose taps lie `step` pixels apart, doubling the step every pass, so
+ * five passes cover 125x125 pixels at 25 taps each. Every tap is weighted down by how much its
+ * normal, depth and albedo differ from the center pixel, and by its luminance difference in
+ * units of the center's standard deviation: noisy regions blur a lot, clean ones barely.
+ *
+ * There is a single frame and no per-sample statistics, so the variance is first estimated over
+ * a 7x7 neighbourhood of similar pixels and then filtered along with the image, shrinking with
+ * the noise every pass. The color is divided by the albedo before filtering and multiplied back
+ * afterwards, so textures stay sharp while the lighting on them is smoothed.
+ *
+ * Channels are kept as separate float planes so the inner loops stream through contiguous
+ * memory; rows are split between threads.
+ *
+ */
+class atrous_denoiser {
+  public:
+    int iterations = 5;
+    int threads = 0;                // 0 for one per hardware thread
+    double sigma_luminance = 4;     // Tolerated luminance difference, in standard deviations
+    double sigma_normal = 0.3;      // Tolerated length of the difference of unit normals
+    double sigma_depth = 0.05;      // Tolerated relative depth difference per pixel of step
+    double sigma_albedo = 0.1;      // Tolerated albedo difference
+
+    /**
+     * @brief Filters `image`, which holds mean pixel colors, in place. Does nothing if the
+     * features are of another size.
+     *
+     */
+    void apply(std::vector<color>& image, const feature_buffers& features) {
+        auto count = static_cast<size_t>(features.width) * features.height;
+        if (iterations <= 0 || count == 0 || image.size() != count || features.albedo.size() != count)
+            return;
+
+        width = features.width;
+        height = features.height;
+        for (int c = 0; c < 3; c++) {
+            in[c].resize(count);
+            out[c].resize(count);
+            albedo[c].resize(count);
+            normal[c].resize(count);
+        }
+        depth.resize(count);
+        variance.resize(count);
+        variance_out.resize(count);
+
+        for (size_t i = 0; i < count; i++) {
+            for (int c = 0; c < 3; c++) {
+                albedo[c][i] = static_cast<float>(features.albedo[i][c]);
+                normal[c][i] = static_cast<float>(features.normal[i][c]);
+                in[c][i] = static_cast<float>(image[i][c] / (features.albedo[i][c] + demodulation_epsilon));
+            }
+            depth[i] = static_cast<float>(std::min(features.depth[i], 1e30));
+        }
+
+        for_rows([&](int y) { estimate_variance(y); });
+        for (int pass = 0; pass < iterations; pass++) {
+            for_rows([&](int y) { filter_row(y, 1 << pass); });
+            for (int c = 0; c < 3; c++) in[c].swap(out[c]);
+            variance.swap(variance_out);
+        }
+
+        for (size_t i = 0; i < count; i++)
+            for (int c = 0; c < 3; c++)
+                image[i][c] = in[c][i] * (features.albedo[i][c] + demodulation_epsilon);
+    }
+
+  private:
+    static constexpr double demodulation_epsilon = 1e-3;
+
+    // Planes of the image being filtered, kept between calls
+    int width = 0, height = 0;
+    std::vector<float> in[3], out[3], albedo[3], normal[3], depth, variance, variance_out;
+
+    template <typename F>
+    void for_rows(const F& body) const {
+        std::atomic<int> next_row{0};
+        auto work = [&] {
+            for (int y = next_row++; y < height; y = next_row++) body(y);
+        };
+
+        auto count = threads > 0 ? threads : static_cast<int>(std::thread::hardware_concurrency());
+        count = std::clamp(count, 1, height);
+        std::vector<std::thread> workers;
+        for (int t = 1; t < count; t++) workers.emplace_back(work);
+        work();
+        for (auto& worker : workers) worker.join();
+    }
+
+    float luminance(size_t p) const {
+        return 0.2126f * in[0][p] + 0.7152f * in[1][p] + 0.0722f * in[2][p];
+    }
+
+    // exp(-distance) of the features at p and q, for taps `step` pixels apart
+    float feature_weight(size_t p, size_t q, int step) const {
+        float normal_distance = 0, albedo_distance = 0;
+        for (int c = 0; c < 3; c++) {
+            auto dn = normal[c][q] - normal[c][p];
+            auto da = albedo[c][q] - albedo[c][p];
+            normal_distance += dn * dn;
+            albedo_distance += da * da;
+        }
+        auto depth_tolerance = static_cast<float>(sigma_depth * step) * depth[p] + 1e-4f;
+        auto depth_distance = std::fabs(depth[q] - depth[p]) / depth_tolerance;
+        return std::exp(-(normal_distance * static_cast<float>(1 / (sigma_normal * sigma_normal))
+                          + albedo_distance * static_cast<float>(1 / (sigma_albedo * sigma_albedo))
+                          + depth_distance));
+    }
+
+    // Luminance variance around each pixel, over the neighbours that look like the same surface
+    void estimate_variance(int y) {
+        for (int x = 0; x < width; x++) {
+            auto p = static_cast<size_t>(y) * width + x;
+            float sum = 0, sum_squares = 0, total = 0;
+            for (int qy = std::max(y - 3, 0); qy <= std::min(y + 3, height - 1); qy++) {
+                for (int qx = std::max(x - 3, 0); qx <= std::min(x + 3, width - 1); qx++) {
+                    auto q = static_cast<size_t>(qy) * width + qx;
+                    auto w = feature_weight(p, q, 1);
+                    auto l = luminance(q);
+                    sum += w * l;
+                    sum_squares += w * l * l;
+                    total += w;
+                }
+            }
+            auto mean = sum / total;
+            variance[p] = std::max(sum_squares / total - mean * mean, 0.f);
+        }
+    }
+
+    void filter_row(int y, int step) {
+        static const float kernel[5] = { 1.f/16, 1.f/4, 3.f/8, 1.f/4, 1.f/16 };
+        static const float blur[3] = { 1.f/4, 1.f/2, 1.f/4 };
+
+        for (int x = 0; x < width; x++) {
+            auto p = static_cast<size_t>(y) * width + x;
+
+            // The variance itself is noisy; smooth it a little before trusting it
+            float local_variance = 0, blur_total = 0;
+            for (int dy = -1; dy <= 1; dy++) {
+                for (int dx = -1; dx <= 1; dx++) {
+                    auto qx = x + dx, qy = y + dy;
+                    if (qx < 0 || qx >= width || qy < 0 || qy >= height) continue;
+                    auto w = blur[dx + 1] * blur[dy + 1];
+                    local_variance += w * variance[static_cast<size_t>(qy) * width + qx];
+                    blur_total += w;
+                }
+            }
+            auto luminance_scale = 1 / (static_cast<float>(sigma_luminance) * std::sqrt(local_variance / blur_total) + 1e-4f);
+            auto l0 = luminance(p);
+
+            float sum[3] = { 0, 0, 0 };
+            float sum_variance = 0, total = 0;
+            for (int dy = -2; dy <= 2; dy++) {
+                auto qy = y + dy * step;
+                if (qy < 0 || qy >= height) continue;
+                for (int dx = -2; dx <= 2; dx++) {
+                    auto qx = x + dx * step;
+                    if (qx < 0 || qx >= width) continue;
+                    auto q = static_cast<size_t>(qy) * width + qx;
+
+                    auto w = kernel[dx + 2] * kernel[dy + 2] * feature_weight(p, q, step)
+                           * std::exp(-std::fabs(luminance(q) - l0) * luminance_scale);
+                    for (int c = 0; c < 3; c++) sum[c] += w * in[c][q];
+                    sum_variance += w * w * variance[q];
+                    total += w;
+                }
+            }
+
+            // The center tap always has weight 9/64, so total is never zero
+            for (int c = 0; c < 3; c++) out[c][p] = sum[c] / total;
+            variance_out[p] = sum_variance / (total * total);
+        }
+    }
+};
+
+#endif
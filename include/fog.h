@@ -0,0 +1,70 @@
+#ifndef FOG_H
+#define FOG_H
+
+#include "utils.h"
+#include "color.h"
+
+/**
+ * @brief Homogeneous participating medium filling the whole scene, or a sphere around `center`
+ * when `radius` is finite. It is not part of the world: the integrator asks it for a free-flight
+ * distance along every ray segment, so no boundary has to be intersected and the scattering
+ * needs one random number per segment.
+ *
+ */
+class homogeneous_fog {
+  public:
+    double density = 0;             // Scattering events per unit length; 0 disables the fog
+    color  albedo = color(1,1,1);   // Isotropic scattering albedo
+    point3 center = point3(0,0,0);
+    double radius = infinity;
+
+    homogeneous_fog() {}
+
+    homogeneous_fog(double density, const color& albedo, const point3& center = point3(0,0,0),
+                    double radius = infinity)
+      : density(density), albedo(albedo), center(center), radius(radius) {}
+
+    bool enabled() const { return density > 0; }
+
+    /**
+     * @brief Samples where a ray segment over ray_t first scatters in the fog. Returns false if
+     * it passes through without scattering.
+     *
+     */
+    bool sample_distance(const ray& r, interval ray_t, double& t) const {
+        if (!enabled() || !clip(r, ray_t))
+            return false;
+
+        auto hit_distance = -log(random_double()) / density;
+        t = ray_t.min + hit_distance / r.direction().length();
+        return t < ray_t.max;
+    }
+
+    // Fraction of light that crosses the segment of r over ray_t without scattering
+    double transmittance(const ray& r, interval ray_t) const {
+        if (!enabled() || !clip(r, ray_t))
+            return 1;
+        return exp(-density * ray_t.size() * r.direction().length());
+    }
+
+  private:
+    bool clip(const ray& r, interval& ray_t) const {
+        // Restricts ray_t to the part of the ray inside the fog sphere
+        if (radius < infinity) {
+            vec3 oc = r.origin() - center;
+            auto a = r.direction().length_squared();
+            auto half_b = dot(oc, r.direction());
+            auto c = oc.length_squared() - radius*radius;
+
+            auto discriminant = half_b*half_b - a*c;
+            if (discriminant <= 0) return false;
+            auto sqrtd = sqrt(discriminant);
+
+            ray_t.min = fmax(ray_t.min, (-half_b - sqrtd) / a);
+            ray_t.max = fmin(ray_t.max, (-half_b + sqrtd) / a);
+        }
+        return ray_t.min < ray_t.max;
+    }
+};
+
+#endif
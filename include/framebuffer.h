@@ -0,0 +1,188 @@
+#ifndef FRAMEBUFFER_H
+#define FRAMEBUFFER_H
+
+#include "utils.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <mutex>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Image made of any number of named float layers, written together as one multi-layer
+ * OpenEXR file.
+ *
+ * Each pixel also has a sample count. Layers marked `average` hold sums over the samples and are
+ * divided by the count when written; the others (depth, IDs) hold their final values. The count
+ * itself is written as the layer "samples".
+ *
+ */
+class framebuffer {
+  public:
+    struct layer {
+        std::string name;                   // Empty for the beauty layer, whose channels are R, G, B
+        std::vector<std::string> channels;
+        bool average;
+        std::vector<float> data;            // channels.size() values per pixel
+    };
+
+    int width = 0, height = 0;
+    std::vector<layer> layers;
+    std::vector<uint32_t> samples;
+
+    // Sets the size and drops every layer
+    void reset(int w, int h) {
+        width = w;
+        height = h;
+        layers.clear();
+        samples.assign(pixel_count(), 0);
+    }
+
+    // Adds a layer filled with `fill`, returning its index
+    int add_layer(const std::string& name, std::vector<std::string> channels, bool average = true, float fill = 0) {
+        layer l{ name, std::move(channels), average, {} };
+        l.data.assign(pixel_count() * l.channels.size(), fill);
+        layers.push_back(std::move(l));
+        return static_cast<int>(layers.size()) - 1;
+    }
+
+    float* at(int index, size_t pixel) {
+        auto& l = layers[index];
+        return &l.data[pixel * l.channels.size()];
+    }
+
+    /**
+     * @brief Writes every layer to `filename` as an uncompressed scanline OpenEXR file of 32-bit
+     * float channels named "<layer>.<channel>". Returns false, after printing why, if the file
+     * can't be written. Like snapshots, the file is written in host byte order, which has to be
+     * little-endian for EXR readers.
+     *
+     */
+    bool write_exr(const std::string& filename) const {
+        // Channels have to be listed, and stored in each scanline, sorted by name
+        struct channel { std::string name; int layer, index; };
+        std::vector<channel> list;
+        for (size_t l = 0; l < layers.size(); l++) {
+            for (size_t c = 0; c < layers[l].channels.size(); c++) {
+                auto prefix = layers[l].name.empty() ? "" : layers[l].name + ".";
+                list.push_back({ prefix + layers[l].channels[c], static_cast<int>(l), static_cast<int>(c) });
+            }
+        }
+        list.push_back({ "samples.count", -1, 0 });
+        std::sort(list.begin(), list.end(), [](const channel& a, const channel& b) { return a.name < b.name; });
+
+        std::vector<char> header;
+        auto put = [&](const void* data, size_t size) {
+            header.insert(header.end(), static_cast<const char*>(data), static_cast<const char*>(data) + size);
+        };
+        auto put_int = [&](int32_t v) { put(&v, 4); };
+        auto put_float = [&](float v) { put(&v, 4); };
+        auto attribute = [&](const char* name, const char* type, int32_t size) {
+            put(name, strlen(name) + 1);
+            put(type, strlen(type) + 1);
+            put_int(size);
+        };
+
+        put_int(20000630);      // Magic number
+        put_int(2);             // Version 2, single-part scanline file
+
+        int32_t list_size = 1;
+        for (const auto& c : list) list_size += static_cast<int32_t>(c.name.size()) + 1 + 16;
+        attribute("channels", "chlist", list_size);
+        for (const auto& c : list) {
+            put(c.name.c_str(), c.name.size() + 1);
+            put_int(2);                                 // FLOAT
+            put("\0\0\0\0", 4);                         // pLinear and reserved
+            put_int(1);                                 // x and y sampling
+            put_int(1);
+        }
+        header.push_back(0);
+
+        attribute("compression", "compression", 1);
+        header.push_back(0);                            // NO_COMPRESSION
+        for (auto name : { "dataWindow", "displayWindow" }) {
+            attribute(name, "box2i", 16);
+            put_int(0);
+            put_int(0);
+            put_int(width - 1);
+            put_int(height - 1);
+        }
+        attribute("lineOrder", "lineOrder", 1);
+        header.push_back(0);                            // INCREASING_Y
+        attribute("pixelAspectRatio", "float", 4);
+        put_float(1);
+        attribute("screenWindowCenter", "v2f", 8);
+        put_float(0);
+        put_float(0);
+        attribute("screenWindowWidth", "float", 4);
+        put_float(1);
+        header.push_back(0);                            // End of header
+
+        auto file = fopen(filename.c_str(), "wb");
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << filename << "'.\n";
+            return false;
+        }
+
+        // Offset table, then one block per scanline: y, byte count, then each channel's row
+        auto row_bytes = static_cast<uint64_t>(width) * list.size() * sizeof(float);
+        auto first_block = header.size() + static_cast<uint64_t>(height) * sizeof(uint64_t);
+        bool ok = fwrite(header.data(), 1, header.size(), file) == header.size();
+        for (int y = 0; ok && y < height; y++) {
+            uint64_t offset = first_block + y * (8 + row_bytes);
+            ok = fwrite(&offset, sizeof offset, 1, file) == 1;
+        }
+
+        std::vector<float> row(static_cast<size_t>(width) * list.size());
+        for (int y = 0; ok && y < height; y++) {
+            size_t k = 0;
+            for (const auto& c : list) {
+                for (int x = 0; x < width; x++) {
+                    auto p = static_cast<size_t>(y) * width + x;
+                    if (c.layer < 0) {
+                        row[k++] = static_cast<float>(samples[p]);
+                        continue;
+                    }
+                    const auto& l = layers[c.layer];
+                    auto value = l.data[p * l.channels.size() + c.index];
+                    row[k++] = l.average && samples[p] > 0 ? value / samples[p] : value;
+                }
+            }
+            int32_t block[2] = { y, static_cast<int32_t>(row_bytes) };
+            ok = fwrite(block, sizeof block, 1, file) == 1
+              && fwrite(row.data(), sizeof(float), row.size(), file) == row.size();
+        }
+
+        ok = (fclose(file) == 0) && ok;
+        if (!ok) std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+        return ok;
+    }
+
+  private:
+    size_t pixel_count() const { return static_cast<size_t>(width) * height; }
+};
+
+
+/**
+ * @brief Dense IDs from 1 up for pointers, in the order they are first seen, shared by all
+ * render threads. Callers keep their own cache in front of it to stay off the lock.
+ *
+ */
+class id_registry {
+  public:
+    uint32_t id(const void* key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto next = static_cast<uint32_t>(ids.size()) + 1;
+        return ids.emplace(key, next).first->second;
+    }
+
+  private:
+    std::mutex mutex;
+    std::unordered_map<const void*, uint32_t> ids;
+};
+
+#endif
@@ -0,0 +1,336 @@
+#ifndef GRID_MEDIUM_H
+#define GRID_MEDIUM_H
+
+#include "utils.h"
+
+#include "hittable.h"
+#include "material.h"
+#include "texture.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <functional>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Density values on a regular voxel grid, sampled with trilinear interpolation between
+ * voxel centers.
+ *
+ */
+class density_grid {
+  public:
+    int nx, ny, nz;
+    std::vector<float> values;  // x fastest, then y, then z
+
+    density_grid(int nx, int ny, int nz) : nx(nx), ny(ny), nz(nz) {
+        values.assign(static_cast<size_t>(nx) * ny * nz, 0.0f);
+    }
+
+    // Fills the grid from f(x,y,z), evaluated at voxel centers given in [0,1]^3
+    density_grid(int nx, int ny, int nz, const std::function<double(double, double, double)>& f)
+      : density_grid(nx, ny, nz)
+    {
+        for (int k = 0; k < nz; k++)
+            for (int j = 0; j < ny; j++)
+                for (int i = 0; i < nx; i++)
+                    at(i, j, k) = static_cast<float>(f((i+0.5)/nx, (j+0.5)/ny, (k+0.5)/nz));
+    }
+
+    /**
+     * @brief Loads nx*ny*nz little-endian float32 densities, x varying fastest. On failure the
+     * grid is left empty (all zero) and an error is printed.
+     *
+     */
+    static shared_ptr<density_grid> load_raw(const std::string& filename, int nx, int ny, int nz) {
+        auto grid = make_shared<density_grid>(nx, ny, nz);
+        std::ifstream in(filename, std::ios::binary);
+        auto bytes = static_cast<std::streamsize>(grid->values.size() * sizeof(float));
+        if (!in.read(reinterpret_cast<char*>(grid->values.data()), bytes)) {
+            std::cerr << "ERROR: Could not read " << bytes << " bytes of density from '" << filename << "'.\n";
+            grid->values.assign(grid->values.size(), 0.0f);
+        }
+        return grid;
+    }
+
+    /**
+     * @brief Loads a sparse text grid: a header line "nx ny nz" followed by one "i j k density"
+     * line per non-empty voxel. Voxels not listed are empty.
+     *
+     */
+    static shared_ptr<density_grid> load_sparse(const std::string& filename) {
+        std::ifstream in(filename);
+        int nx = 0, ny = 0, nz = 0;
+        if (!(in >> nx >> ny >> nz) || nx <= 0 || ny <= 0 || nz <= 0) {
+            std::cerr << "ERROR: Could not read sparse density grid '" << filename << "'.\n";
+            return make_shared<density_grid>(1, 1, 1);
+        }
+
+        auto grid = make_shared<density_grid>(nx, ny, nz);
+        int i, j, k;
+        double d;
+        while (in >> i >> j >> k >> d) {
+            if (i >= 0 && i < nx && j >= 0 && j < ny && k >= 0 && k < nz)
+                grid->at(i, j, k) = static_cast<float>(d);
+        }
+        return grid;
+    }
+
+    float& at(int i, int j, int k) { return values[index(i, j, k)]; }
+    float at(int i, int j, int k) const { return values[index(i, j, k)]; }
+
+    // Density at grid-space position g, where voxel (i,j,k) covers [i,i+1) x [j,j+1) x [k,k+1)
+    double sample(double gx, double gy, double gz) const {
+        gx -= 0.5; gy -= 0.5; gz -= 0.5;
+        auto i = static_cast<int>(std::floor(gx));
+        auto j = static_cast<int>(std::floor(gy));
+        auto k = static_cast<int>(std::floor(gz));
+        auto u = gx - i, v = gy - j, w = gz - k;
+
+        auto accum = 0.0;
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++)
+                    accum += lerp(1-u, u, di) * lerp(1-v, v, dj) * lerp(1-w, w, dk)
+                           * clamped(i+di, j+dj, k+dk);
+        return accum;
+    }
+
+    // Largest voxel value in the inclusive index box, clamped to the grid
+    float max_in(int i0, int j0, int k0, int i1, int j1, int k1) const {
+        float m = 0;
+        for (int k = std::max(k0, 0); k <= std::min(k1, nz-1); k++)
+            for (int j = std::max(j0, 0); j <= std::min(j1, ny-1); j++)
+                for (int i = std::max(i0, 0); i <= std::min(i1, nx-1); i++)
+                    m = std::max(m, at(i, j, k));
+        return m;
+    }
+
+  private:
+    size_t index(int i, int j, int k) const {
+        return (static_cast<size_t>(k) * ny + j) * nx + i;
+    }
+
+    float clamped(int i, int j, int k) const {
+        return at(std::min(std::max(i, 0), nx-1), std::min(std::max(j, 0), ny-1), std::min(std::max(k, 0), nz-1));
+    }
+};
+
+/**
+ * @brief Turns grid media transparent to the rays this thread traces while the scope is alive,
+ * for shadow rays. A grid medium such a ray passes through multiplies its ratio-tracked
+ * transmittance into transmittance() instead of sampling a collision, so a shadow ray through
+ * smoke carries part of the light rather than all or none of it. The value only means anything
+ * if the ray reached its end unblocked.
+ *
+ */
+class shadow_ray_scope {
+  public:
+    shadow_ray_scope() : previous(current()) { current() = this; }
+    ~shadow_ray_scope() { current() = previous; }
+
+    shadow_ray_scope(const shadow_ray_scope&) = delete;
+    shadow_ray_scope& operator=(const shadow_ray_scope&) = delete;
+
+    double transmittance() const { return tr; }
+
+    static shadow_ray_scope*& current() {
+        thread_local shadow_ray_scope* scope = nullptr;
+        return scope;
+    }
+
+  private:
+    friend class grid_medium;
+
+    shadow_ray_scope* previous;
+    double tr = 1;
+    std::vector<const void*> tracked;   // Spatial splits can put one medium in several leaves
+};
+
+
+/**
+ * @brief Heterogeneous participating medium over the box `bounds`, with density taken from a
+ * voxel grid times `density_scale`.
+ *
+ * Free-flight distances are sampled with delta tracking against a coarse majorant grid, each
+ * cell holding an upper bound of the density inside it. The ray walks the majorant cells with
+ * a 3D DDA and cells with a zero majorant are skipped without sampling, so the cost follows the
+ * occupied part of the volume rather than its bounding box. Inside a shadow_ray_scope the
+ * medium is ratio tracked instead.
+ */
+class grid_medium : public hittable {
+  public:
+    grid_medium(shared_ptr<density_grid> grid, const aabb& bounds, double density_scale,
+                shared_ptr<texture> tex, int voxels_per_cell = 8)
+      : grid(grid), bounds(bounds), density_scale(density_scale),
+        phase_function(make_shared<isotropic>(tex))
+    {
+        build_majorants(voxels_per_cell);
+    }
+
+    grid_medium(shared_ptr<density_grid> grid, const aabb& bounds, double density_scale,
+                const color& albedo, int voxels_per_cell = 8)
+      : grid_medium(grid, bounds, density_scale, make_shared<solid_color>(albedo), voxels_per_cell) {}
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (auto shadow = shadow_ray_scope::current()) {
+            auto& tracked = shadow->tracked;
+            if (std::find(tracked.begin(), tracked.end(), this) == tracked.end()) {
+                tracked.push_back(this);
+                shadow->tr *= transmittance(r, ray_t);
+            }
+            return false;
+        }
+
+        double t;
+        if (!track(r, ray_t, true, t))
+            return false;
+
+        rec.t = t;
+        rec.p = r.at(t);
+        rec.set_face_normal(r, -unit_vector(r.direction()));
+        rec.u = rec.v = 0;
+        rec.footprint = 0;
+        rec.mat = phase_function;
+        rec.object = this;
+        rec.density = density(rec.p);
+        return true;
+    }
+
+    aabb bounding_box() const override { return bounds; }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        span = interval::universe;
+        return bounds.hit_span(r, span);
+    }
+
+    /**
+     * @brief Estimated transmittance along the ray over ray_t, using ratio tracking through the
+     * same majorant grid. Unbiased, and never zero unless the ray hits fully opaque voxels.
+     *
+     */
+    double transmittance(const ray& r, interval ray_t) const {
+        double t;
+        double tr = 1;
+        track(r, ray_t, false, t, &tr);
+        return tr;
+    }
+
+  private:
+    shared_ptr<density_grid> grid;
+    aabb bounds;
+    double density_scale;
+    shared_ptr<material> phase_function;
+
+    int mx, my, mz;                 // Majorant grid resolution
+    int cell_voxels;                // Voxels per majorant cell along each axis
+    std::vector<float> majorants;   // Already multiplied by density_scale
+
+    void build_majorants(int voxels_per_cell) {
+        cell_voxels = voxels_per_cell > 0 ? voxels_per_cell : 1;
+        mx = (grid->nx + cell_voxels - 1) / cell_voxels;
+        my = (grid->ny + cell_voxels - 1) / cell_voxels;
+        mz = (grid->nz + cell_voxels - 1) / cell_voxels;
+        majorants.resize(static_cast<size_t>(mx) * my * mz);
+
+        // Trilinear filtering reaches one voxel past the cell on each side
+        for (int k = 0; k < mz; k++)
+            for (int j = 0; j < my; j++)
+                for (int i = 0; i < mx; i++) {
+                    auto m = grid->max_in(i*cell_voxels - 1, j*cell_voxels - 1, k*cell_voxels - 1,
+                                          (i+1)*cell_voxels, (j+1)*cell_voxels, (k+1)*cell_voxels);
+                    majorants[(static_cast<size_t>(k) * my + j) * mx + i] = static_cast<float>(m * density_scale);
+                }
+    }
+
+    double density(const point3& p) const {
+        auto gx = (p.x() - bounds.x.min) / bounds.x.size() * grid->nx;
+        auto gy = (p.y() - bounds.y.min) / bounds.y.size() * grid->ny;
+        auto gz = (p.z() - bounds.z.min) / bounds.z.size() * grid->nz;
+        return density_scale * grid->sample(gx, gy, gz);
+    }
+
+    /**
+     * @brief Walks the majorant cells along the ray. With `scatter` set, runs delta tracking and
+     * returns true with the collision in t. Otherwise runs ratio tracking and multiplies the
+     * transmittance estimate into *tr.
+     *
+     */
+    bool track(const ray& r, interval ray_t, bool scatter, double& t, double* tr = nullptr) const {
+        interval span = ray_t;
+        if (!bounds.hit_span(r, span))
+            return false;
+
+        // Ray in majorant-grid coordinates, where cell (i,j,k) covers [i,i+1) x [j,j+1) x [k,k+1).
+        // The last cell along an axis may reach past the bounds when it is only partly filled.
+        double scale[3] = { static_cast<double>(grid->nx) / (cell_voxels * bounds.x.size()),
+                            static_cast<double>(grid->ny) / (cell_voxels * bounds.y.size()),
+                            static_cast<double>(grid->nz) / (cell_voxels * bounds.z.size()) };
+        double mins[3] = { bounds.x.min, bounds.y.min, bounds.z.min };
+        int res[3] = { mx, my, mz };
+
+        auto entry = r.at(span.min);
+        int cell[3], step[3];
+        double t_next[3], t_delta[3];
+        for (int a = 0; a < 3; a++) {
+            auto g = (entry[a] - mins[a]) * scale[a];
+            cell[a] = std::min(std::max(static_cast<int>(g), 0), res[a] - 1);
+            auto d = r.direction()[a] * scale[a];   // Grid units per unit of t
+
+            if (d > 0) {
+                step[a] = 1;
+                t_delta[a] = 1 / d;
+                t_next[a] = span.min + (cell[a] + 1 - g) / d;
+            } else if (d < 0) {
+                step[a] = -1;
+                t_delta[a] = -1 / d;
+                t_next[a] = span.min + (cell[a] - g) / d;
+            } else {
+                step[a] = 0;
+                t_delta[a] = infinity;
+                t_next[a] = infinity;
+            }
+        }
+
+        auto ray_length = r.direction().length();
+        auto t_cell = span.min;
+        while (t_cell < span.max) {
+            int axis = (t_next[0] < t_next[1])
+                     ? (t_next[0] < t_next[2] ? 0 : 2)
+                     : (t_next[1] < t_next[2] ? 1 : 2);
+            auto t_exit = std::min(t_next[axis], span.max);
+            auto majorant = majorants[(static_cast<size_t>(cell[2]) * my + cell[1]) * mx + cell[0]];
+
+            if (majorant > 0) {
+                // Tentative collisions at rate `majorant` inside this cell. The exponential is
+                // memoryless, so restarting at the next cell boundary is exact.
+                auto t_sample = t_cell;
+                while (true) {
+                    t_sample -= log(1 - random_double()) / (majorant * ray_length);
+                    if (t_sample >= t_exit) break;
+
+                    auto real = density(r.at(t_sample)) / majorant;
+                    if (scatter) {
+                        if (random_double() < real) {
+                            t = t_sample;
+                            return true;
+                        }
+                    } else {
+                        *tr *= 1 - real;
+                    }
+                }
+            }
+
+            t_cell = t_exit;
+            cell[axis] += step[axis];
+            if (cell[axis] < 0 || cell[axis] >= res[axis])
+                break;
+            t_next[axis] += t_delta[axis];
+        }
+
+        return false;
+    }
+};
+
+#endif
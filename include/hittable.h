@@ -5,6 +5,8 @@
 #include "ray.h"
 #include "aabb.h"
 
+#include <vector>
+
 class material;         // Defined externally
 
 class hit_record {
@@ -16,6 +18,9 @@ class hit_record {
     bool front_face;    // Which side of the surface did the ray hit
     double u;
     double v;        // Texture coordinates
+    double footprint = 0;   // Width of the ray footprint in texture coordinates
+    const void* object = nullptr;   // Primitive that was hit, for primitive ID outputs
+    double density = 0;     // Extinction per unit length at a collision in a medium
 
     void set_face_normal(const ray& r, const vec3& outward_normal) {
         // Sets the hit record normal vector
@@ -34,6 +39,48 @@ class hittable {
 
     // Returns the bounding box of the hittable object
     virtual aabb bounding_box() const = 0;
+
+    // Traces many rays at once, setting hits[i] and recs[i] as hit() would for rays[i]. Worlds
+    // that can share work between rays override it; the default traces them one by one.
+    virtual void hit_batch(const std::vector<ray>& rays, interval ray_t, std::vector<hit_record>& recs,
+                           std::vector<char>& hits) const {
+        recs.resize(rays.size());
+        hits.resize(rays.size());
+        for (size_t i = 0; i < rays.size(); i++)
+            hits[i] = hit(rays[i], ray_t, recs[i]);
+    }
+
+    // Boxes b0 and b1 whose linear blend bounds the object at every ray time between t0 and t1
+    // (in 0..1). Anything that moves should override this; the default holds still.
+    virtual void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const {
+        (void)t0; (void)t1;
+        b0 = b1 = bounding_box();
+    }
+
+    // Box around the part of the object inside the slab lo <= p[axis] <= hi, empty along `axis`
+    // if nothing is. Spatial-split BVHs cut large primitives down with it; the default trims the
+    // bounding box to the slab.
+    virtual aabb clipped_box(int axis, double lo, double hi) const {
+        auto box = bounding_box();
+        auto& extent = axis == 0 ? box.x : axis == 1 ? box.y : box.z;
+        extent = interval(fmax(extent.min, lo), fmin(extent.max, hi));
+        return box;
+    }
+
+    // Parameter interval [entry, exit] over which the ray is inside this (convex) object. The
+    // default finds both ends with two hit() calls; shapes that can do better override it.
+    virtual bool hit_span(const ray& r, interval& span) const {
+        hit_record rec1, rec2;
+
+        if (!hit(r, interval::universe, rec1))
+            return false;
+
+        if (!hit(r, interval(rec1.t+0.0001, infinity), rec2))
+            return false;
+
+        span = interval(rec1.t, rec2.t);
+        return true;
+    }
 };
 
 
@@ -48,6 +95,7 @@ class translate : public hittable {
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
         // Move the ray backwards by the offset
         ray offset_r(r.origin() - offset, r.direction(), r.time());
+        offset_r.set_cone(r.cone_width(), r.cone_spread());
 
         // Determine whether an intersection exists along the offset ray (and if so, where)
         if (!object->hit(offset_r, ray_t, rec))
@@ -61,6 +109,24 @@ class translate : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        object->motion_bounds(t0, t1, b0, b1);
+        b0 = b0 + offset;
+        b1 = b1 + offset;
+    }
+
+    aabb clipped_box(int axis, double lo, double hi) const override {
+        return object->clipped_box(axis, lo - offset[axis], hi - offset[axis]) + offset;
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        ray offset_r(r.origin() - offset, r.direction(), r.time());
+        return object->hit_span(offset_r, span);
+    }
+
+    const shared_ptr<hittable>& get_object() const { return object; }
+    const vec3& get_offset() const { return offset; }
+
   private:
     shared_ptr<hittable> object;
     vec3 offset;
@@ -75,17 +141,74 @@ class rotate_y : public hittable {
         auto radians = degrees_to_radians(angle_deg);
         sin_theta = sin(radians);
         cos_theta = cos(radians);
-        bbox = object->bounding_box();
+        bbox = rotated(object->bounding_box());
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        // Change the ray from world space to object space
+        auto rotated_r = to_object(r);
+
+        // Determine whether an intersection exists in object space (and if so, where)
+        if (!object->hit(rotated_r, ray_t, rec))
+            return false;
 
+        // Change the intersection point from object space to world space
+        auto p = rec.p;
+        p[0] =  cos_theta*rec.p[0] + sin_theta*rec.p[2];
+        p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
+
+        // Change the normal from object space to world space
+        auto normal = rec.normal;
+        normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
+        normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
+
+        rec.p = p;
+        rec.normal = normal;
+
+        return true;
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        // Each corner of the rotated box is linear in the corners of the original, so the blend
+        // of the rotated boxes still bounds the rotated blend
+        object->motion_bounds(t0, t1, b0, b1);
+        b0 = rotated(b0);
+        b1 = rotated(b1);
+    }
+
+    aabb clipped_box(int axis, double lo, double hi) const override {
+        // Rotation about y keeps y slabs intact; x and z slabs just trim the bounding box
+        if (axis != 1) return hittable::clipped_box(axis, lo, hi);
+        auto box = object->clipped_box(axis, lo, hi);
+        return box.y.size() < 0 ? box : rotated(box);
+    }
+
+    bool hit_span(const ray& r, interval& span) const override {
+        return object->hit_span(to_object(r), span);
+    }
+
+    const shared_ptr<hittable>& get_object() const { return object; }
+    double get_sin_theta() const { return sin_theta; }
+    double get_cos_theta() const { return cos_theta; }
+
+  private:
+    shared_ptr<hittable> object;
+    double sin_theta;
+    double cos_theta;
+    aabb bbox;
+
+    aabb rotated(const aabb& box) const {
         point3 min( infinity,  infinity,  infinity);
         point3 max(-infinity, -infinity, -infinity);
 
         for (int i = 0; i < 2; i++) {
             for (int j = 0; j < 2; j++) {
                 for (int k = 0; k < 2; k++) {
-                    auto x = i*bbox.x.max + (1-i)*bbox.x.min;
-                    auto y = j*bbox.y.max + (1-j)*bbox.y.min;
-                    auto z = k*bbox.z.max + (1-k)*bbox.z.min;
+                    auto x = i*box.x.max + (1-i)*box.x.min;
+                    auto y = j*box.y.max + (1-j)*box.y.min;
+                    auto z = k*box.z.max + (1-k)*box.z.min;
 
                     auto newx =  cos_theta*x + sin_theta*z;
                     auto newz = -sin_theta*x + cos_theta*z;
@@ -100,11 +223,10 @@ class rotate_y : public hittable {
             }
         }
 
-        bbox = aabb(min, max);
+        return aabb(min, max);
     }
 
-    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
-        // Change the ray from world space to object space
+    ray to_object(const ray& r) const {
         auto origin = r.origin();
         auto direction = r.direction();
 
@@ -115,34 +237,9 @@ class rotate_y : public hittable {
         direction[2] = sin_theta*r.direction()[0] + cos_theta*r.direction()[2];
 
         ray rotated_r(origin, direction, r.time());
-
-        // Determine whether an intersection exists in object space (and if so, where)
-        if (!object->hit(rotated_r, ray_t, rec))
-            return false;
-
-        // Change the intersection point from object space to world space
-        auto p = rec.p;
-        p[0] =  cos_theta*rec.p[0] + sin_theta*rec.p[2];
-        p[2] = -sin_theta*rec.p[0] + cos_theta*rec.p[2];
-
-        // Change the normal from object space to world space
-        auto normal = rec.normal;
-        normal[0] =  cos_theta*rec.normal[0] + sin_theta*rec.normal[2];
-        normal[2] = -sin_theta*rec.normal[0] + cos_theta*rec.normal[2];
-
-        rec.p = p;
-        rec.normal = normal;
-
-        return true;
+        rotated_r.set_cone(r.cone_width(), r.cone_spread());
+        return rotated_r;
     }
-
-    aabb bounding_box() const override { return bbox; }
-
-  private:
-    shared_ptr<hittable> object;
-    double sin_theta;
-    double cos_theta;
-    aabb bbox;
 };
 
 #endif
\ No newline at end of file
@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "aabb.h"
+#include "stats.h"
 
 #include <memory>
 #include <vector>
@@ -19,6 +20,25 @@ class hittable_list : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        b0 = b1 = aabb::empty;
+        for (const auto& object : objects) {
+            aabb o0, o1;
+            object->motion_bounds(t0, t1, o0, o1);
+            b0 = aabb(b0, o0);
+            b1 = aabb(b1, o1);
+        }
+    }
+
+    aabb clipped_box(int axis, double lo, double hi) const override {
+        auto box = aabb::empty;
+        for (const auto& object : objects) {
+            auto part = object->clipped_box(axis, lo, hi);
+            if (part.axis_interval(axis).size() >= 0) box = aabb(box, part);
+        }
+        return box;
+    }
+
     void clear() { objects.clear(); }
 
     void add(shared_ptr<hittable> object) {
@@ -33,6 +53,7 @@ class hittable_list : public hittable {
         auto closest_so_far = ray_t.max;
 
         for (const auto& object : objects) {
+            RT_STAT(list_objects);
             if (object->hit(r, interval(ray_t.min, closest_so_far), temp_rec)) {
                 hit_anything = true;
                 closest_so_far = temp_rec.t;
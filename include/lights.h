@@ -0,0 +1,531 @@
+#ifndef LIGHTS_H
+#define LIGHTS_H
+
+#include "utils.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "motion_bvh.h"
+#include "compressed_bvh.h"
+#include "material.h"
+#include "quad.h"
+#include "mesh.h"
+#include "sphere.h"
+#include "constant_medium.h"
+#include "grid_medium.h"
+
+#include <algorithm>
+#include <iostream>
+#include <string>
+#include <typeinfo>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief Every emissive quad, triangle and sphere of a scene, flattened to world space so that
+ * points on them can be sampled directly. The scene graph is walked the way scene_snapshot
+ * flattens it, baking the translate and rotate_y wrappers above each light into its record.
+ *
+ * Lights are picked in proportion to their power, estimated from the emission at their center
+ * times their area. diffuse_light emits from both faces, so every light does too.
+ *
+ */
+class light_list {
+  public:
+    enum light_shape { quad_light, tri_light, sphere_light };
+
+    struct area_light {
+        light_shape shape;
+        point3 Q;                       // Planar lights: corner, edges and unit normal
+        vec3 u, v, normal;
+        point3 center;                  // Spheres: center at time 0, motion over the shutter
+        vec3 center_vec;
+        double radius = 0;
+        double cos_theta = 1, sin_theta = 0;    // Rotation about y into world space, for the UVs
+        double area = 0;
+        const material* mat = nullptr;
+        const void* object = nullptr;   // Primitive a hit_record names when it hits the light
+    };
+
+    // Point sampled on a light
+    struct light_sample {
+        point3 p;
+        vec3 normal;        // Unit, pointing out of the front face
+        double u, v;
+        color emitted;
+    };
+
+    std::vector<area_light> lights;
+
+    explicit light_list(const hittable& world) {
+        add_object(world, transform());
+
+        double total = 0;
+        cdf.reserve(lights.size());
+        for (const auto& l : lights) {
+            auto e = l.mat->emitted(0.5, 0.5, l.shape == sphere_light ? l.center : l.Q + 0.5*(l.u + l.v));
+            total += std::max(0.2126*e.x() + 0.7152*e.y() + 0.0722*e.z(), 1e-6) * l.area;
+            cdf.push_back(total);
+        }
+        for (auto& c : cdf) c /= total;
+
+        for (size_t i = 0; i < lights.size(); i++)
+            index.emplace(lights[i].object, static_cast<int>(i));
+    }
+
+    bool empty() const { return lights.empty(); }
+
+    // Picks a light in proportion to its power, setting `pmf` to the chance of that pick
+    const area_light& pick(double r, double& pmf) const {
+        auto i = std::min<size_t>(std::lower_bound(cdf.begin(), cdf.end(), r) - cdf.begin(), cdf.size() - 1);
+        pmf = this->pmf(i);
+        return lights[i];
+    }
+
+    double pmf(size_t i) const {
+        return cdf[i] - (i > 0 ? cdf[i-1] : 0);
+    }
+
+    // The light a hit_record's object belongs to, or null if it isn't one
+    const area_light* find(const void* object, double& pmf) const {
+        auto it = index.find(object);
+        if (it == index.end()) return nullptr;
+        pmf = this->pmf(it->second);
+        return &lights[it->second];
+    }
+
+    // Point uniformly distributed over the area of `l`, at `time` for moving spheres
+    static light_sample sample(const area_light& l, double time) {
+        light_sample s;
+        if (l.shape == sphere_light) {
+            s.normal = random_unit_vector();
+            s.p = l.center + time * l.center_vec + l.radius * s.normal;
+
+            // Same UVs as sphere::hit, taken from the object space normal
+            vec3 n(l.cos_theta*s.normal.x() - l.sin_theta*s.normal.z(), s.normal.y(),
+                   l.sin_theta*s.normal.x() + l.cos_theta*s.normal.z());
+            s.u = (atan2(-n.z(), n.x()) + pi) / (2*pi);
+            s.v = acos(-n.y()) / pi;
+        } else {
+            s.u = random_double();
+            s.v = random_double();
+            if (l.shape == tri_light && s.u + s.v > 1) {
+                s.u = 1 - s.u;
+                s.v = 1 - s.v;
+            }
+            s.p = l.Q + s.u * l.u + s.v * l.v;
+            s.normal = l.normal;
+        }
+        s.emitted = l.mat->emitted(s.u, s.v, s.p);
+        return s;
+    }
+
+  private:
+    std::vector<double> cdf;
+    std::unordered_map<const void*, int> index;
+    std::unordered_set<std::string> reported;   // Object types already reported as not walked
+
+    // Object to world mapping built from nested rotate_y and translate, as in scene_snapshot
+    struct transform {
+        double cos_theta = 1, sin_theta = 0;
+        vec3 offset = vec3(0,0,0);
+
+        vec3 rotate(const vec3& v) const {
+            return vec3(cos_theta*v.x() + sin_theta*v.z(), v.y(), -sin_theta*v.x() + cos_theta*v.z());
+        }
+        point3 apply(const point3& p) const { return rotate(p) + offset; }
+    };
+
+    void add_object(const hittable& object, const transform& xf) {
+        if (auto list = dynamic_cast<const hittable_list*>(&object)) {
+            for (const auto& child : list->objects)
+                add_object(*child, xf);
+        } else if (auto node = dynamic_cast<const bvh_node*>(&object)) {
+            add_object(*node->get_left(), xf);
+            if (node->get_right() != node->get_left())
+                add_object(*node->get_right(), xf);
+        } else if (auto motion = dynamic_cast<const motion_bvh*>(&object)) {
+            add_unique(motion->get_objects(), xf);
+        } else if (auto compressed = dynamic_cast<const compressed_bvh*>(&object)) {
+            add_unique(compressed->get_objects(), xf);
+        } else if (auto moved = dynamic_cast<const translate*>(&object)) {
+            auto inner = xf;
+            inner.offset = xf.offset + xf.rotate(moved->get_offset());
+            add_object(*moved->get_object(), inner);
+        } else if (auto rotated = dynamic_cast<const rotate_y*>(&object)) {
+            auto inner = xf;
+            auto cos_theta = rotated->get_cos_theta(), sin_theta = rotated->get_sin_theta();
+            inner.cos_theta = xf.cos_theta*cos_theta - xf.sin_theta*sin_theta;
+            inner.sin_theta = xf.sin_theta*cos_theta + xf.cos_theta*sin_theta;
+            add_object(*rotated->get_object(), inner);
+        } else if (auto s = dynamic_cast<const sphere*>(&object)) {
+            if (!emits(s->get_material().get())) return;
+            area_light l{};
+            l.shape = sphere_light;
+            l.center = xf.apply(s->center_at(0));
+            l.center_vec = xf.rotate(s->center_at(1) - s->center_at(0));
+            l.radius = s->get_radius();
+            l.cos_theta = xf.cos_theta;
+            l.sin_theta = xf.sin_theta;
+            l.area = 4*pi * l.radius * l.radius;
+            l.mat = s->get_material().get();
+            l.object = s;
+            lights.push_back(l);
+        } else if (auto q = dynamic_cast<const quad*>(&object)) {
+            if (!emits(q->get_material().get())) return;
+            area_light l{};
+            l.shape = dynamic_cast<const tri*>(q) ? tri_light : quad_light;
+            l.Q = xf.apply(q->get_Q());
+            l.u = xf.rotate(q->get_u());
+            l.v = xf.rotate(q->get_v());
+            l.normal = xf.rotate(q->get_normal());
+            l.area = cross(l.u, l.v).length() * (l.shape == tri_light ? 0.5 : 1);
+            l.mat = q->get_material().get();
+            l.object = q;
+            lights.push_back(l);
+        } else if (dynamic_cast<const constant_medium*>(&object) || dynamic_cast<const grid_medium*>(&object)) {
+            return;     // Media never emit
+        } else if (reported.insert(typeid(object).name()).second) {
+            // Lights inside other objects can still be hit, they just aren't sampled
+            std::clog << "Lights inside " << typeid(object).name() << " are not sampled.\n";
+        }
+    }
+
+    void add_unique(const std::vector<shared_ptr<hittable>>& objects, const transform& xf) {
+        std::unordered_set<const hittable*> seen;
+        for (const auto& child : objects)
+            if (seen.insert(child.get()).second)
+                add_object(*child, xf);
+    }
+
+    static bool emits(const material* m) {
+        return dynamic_cast<const diffuse_light*>(m) != nullptr;
+    }
+};
+
+
+/**
+ * @brief Bounding volume hierarchy over the lights of a light_list for many-light sampling
+ * (Conty Estevez and Kulla 2018, as in PBRT-v4). Every node bounds the power, positions and
+ * emission directions of the lights below it, so that a walk from the root can pick a light
+ * in proportion to an estimate of what it gives a shading point: its power over the squared
+ * distance, fading with how far it faces away from the point and how far the point's normal
+ * faces away from it. Distant or hidden clusters of lights are then rarely picked, and many
+ * lights cost about as much as a few.
+ *
+ * Every light here emits from both faces and nothing else. The orientation cones are kept
+ * general anyway, but mostly the normal of the shading point prunes them.
+ *
+ */
+class light_bvh {
+  public:
+    explicit light_bvh(const light_list& lights) : lights(lights), trails(lights.lights.size(), 0) {
+        std::vector<light_bounds> leaves;
+        std::vector<int> order;
+        for (size_t i = 0; i < lights.lights.size(); i++) {
+            auto b = bounds_of(lights.lights[i], lights.pmf(i));
+            if (!(b.power > 0)) continue;
+            leaves.push_back(b);
+            order.push_back(static_cast<int>(i));
+        }
+        if (!order.empty()) build(leaves, order, 0, order.size(), 0, 0);
+    }
+
+    bool empty() const { return nodes.empty(); }
+
+    /**
+     * @brief Picks a light for the shading point p with unit normal n, or a zero normal in a
+     * medium, setting `pmf` to the chance of that pick. Returns null if no light can reach p.
+     *
+     */
+    const light_list::area_light* pick(const point3& p, const vec3& n, double r, double& pmf) const {
+        pmf = 0;
+        if (nodes.empty()) return nullptr;
+
+        double chance = 1;
+        int i = 0;
+        while (nodes[i].light < 0) {
+            auto c0 = importance(nodes[i + 1].bounds, p, n);
+            auto c1 = importance(nodes[nodes[i].second].bounds, p, n);
+            if (!(c0 + c1 > 0)) return nullptr;
+
+            auto p0 = c0 / (c0 + c1);
+            if (r < p0) {
+                chance *= p0;
+                r = std::min(r / p0, 1 - 1e-12);
+                i = i + 1;
+            } else {
+                chance *= 1 - p0;
+                r = std::min((r - p0) / (1 - p0), 1 - 1e-12);
+                i = nodes[i].second;
+            }
+        }
+        if (i == 0 && !(importance(nodes[0].bounds, p, n) > 0)) return nullptr;
+        pmf = chance;
+        return &lights.lights[nodes[i].light];
+    }
+
+    // Chance that pick() at (p, n) returns the light `l` of the light_list
+    double pmf(const point3& p, const vec3& n, const light_list::area_light& l) const {
+        auto index = static_cast<size_t>(&l - lights.lights.data());
+        if (nodes.empty() || index >= trails.size() || trails[index] == 0) return 0;
+
+        // The trail holds the side taken at every level below a leading 1
+        auto trail = trails[index];
+        int depth = 63;
+        while (!(trail >> depth & 1)) depth--;
+
+        double chance = 1;
+        int i = 0;
+        for (int level = depth - 1; level >= 0; level--) {
+            auto c0 = importance(nodes[i + 1].bounds, p, n);
+            auto c1 = importance(nodes[nodes[i].second].bounds, p, n);
+            if (!(c0 + c1 > 0)) return 0;
+
+            bool second = trail >> level & 1;
+            chance *= (second ? c1 : c0) / (c0 + c1);
+            i = second ? nodes[i].second : i + 1;
+        }
+        return chance;
+    }
+
+  private:
+    // Power, positions and emission directions of a group of lights. Emission leaves within
+    // theta_e of some direction within theta_o of `axis`, or of its opposite if two-sided.
+    struct light_bounds {
+        aabb box;
+        double power = 0;
+        vec3 axis = vec3(0,0,1);
+        double cos_theta_o = 1, cos_theta_e = 0;
+        bool two_sided = false;
+    };
+
+    // Nodes in depth-first order: an interior node's first child follows it
+    struct node {
+        light_bounds bounds;
+        int second = 0;     // Interior nodes: index of the second child
+        int light = -1;     // Leaves: index into the light_list
+    };
+
+    const light_list& lights;
+    std::vector<node> nodes;
+    std::vector<uint64_t> trails;   // Per light, the path to its leaf, see pmf()
+
+    static light_bounds bounds_of(const light_list::area_light& l, double power) {
+        light_bounds b;
+        b.power = power;
+        b.two_sided = true;
+        if (l.shape == light_list::sphere_light) {
+            vec3 r(l.radius, l.radius, l.radius);
+            b.box = aabb(aabb(l.center - r, l.center + r), aabb(l.center + l.center_vec - r, l.center + l.center_vec + r));
+            b.cos_theta_o = -1;
+        } else {
+            b.box = aabb(aabb(l.Q, l.Q + l.u), aabb(l.Q + l.v, l.shape == light_list::tri_light ? l.Q : l.Q + l.u + l.v));
+            b.axis = l.normal;
+        }
+        return b;
+    }
+
+    static light_bounds merge(const light_bounds& a, const light_bounds& b) {
+        if (!(a.power > 0)) return b;
+        if (!(b.power > 0)) return a;
+
+        light_bounds m;
+        m.box = aabb(a.box, b.box);
+        m.power = a.power + b.power;
+        m.cos_theta_e = std::min(a.cos_theta_e, b.cos_theta_e);
+        m.two_sided = a.two_sided || b.two_sided;
+
+        // Smallest cone holding both cones
+        auto theta_a = acos(std::clamp(a.cos_theta_o, -1.0, 1.0));
+        auto theta_b = acos(std::clamp(b.cos_theta_o, -1.0, 1.0));
+        auto theta_d = acos(std::clamp(dot(a.axis, b.axis), -1.0, 1.0));
+        if (std::min(theta_d + theta_b, pi) <= theta_a) {
+            m.axis = a.axis;
+            m.cos_theta_o = a.cos_theta_o;
+        } else if (std::min(theta_d + theta_a, pi) <= theta_b) {
+            m.axis = b.axis;
+            m.cos_theta_o = b.cos_theta_o;
+        } else {
+            auto theta_o = (theta_a + theta_d + theta_b) / 2;
+            auto k = cross(a.axis, b.axis);
+            if (theta_o >= pi || k.length_squared() < 1e-12) {
+                m.axis = a.axis;
+                m.cos_theta_o = -1;
+            } else {
+                // Rotate a's axis towards b's by theta_o - theta_a (Rodrigues' formula)
+                k = unit_vector(k);
+                auto theta_r = theta_o - theta_a;
+                m.axis = unit_vector(a.axis * cos(theta_r) + cross(k, a.axis) * sin(theta_r)
+                                     + k * dot(k, a.axis) * (1 - cos(theta_r)));
+                m.cos_theta_o = cos(theta_o);
+            }
+        }
+        return m;
+    }
+
+    // cos(max(0, a - b)) and sin(max(0, a - b)) from the sines and cosines of a and b
+    static double cos_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 1 : cos_a*cos_b + sin_a*sin_b;
+    }
+    static double sin_sub_clamped(double sin_a, double cos_a, double sin_b, double cos_b) {
+        return cos_a > cos_b ? 0 : sin_a*cos_b - cos_a*sin_b;
+    }
+
+    static double safe_sqrt(double x) { return sqrt(std::max(x, 0.0)); }
+
+    /**
+     * @brief Upper-bound flavoured estimate of what the lights in `b` give the point p with
+     * unit normal n (zero in a medium): power over squared distance, times the cosines of the
+     * smallest angles the bounds allow between the emission cone and p, and between n and the
+     * direction to the lights. Distances are clamped to half the box's diagonal so points near
+     * or inside a cluster don't blow up.
+     *
+     */
+    static double importance(const light_bounds& b, const point3& p, const vec3& n) {
+        point3 center((b.box.x.min + b.box.x.max) / 2, (b.box.y.min + b.box.y.max) / 2, (b.box.z.min + b.box.z.max) / 2);
+        vec3 diagonal(b.box.x.size(), b.box.y.size(), b.box.z.size());
+        auto d2 = std::max((p - center).length_squared(), diagonal.length() / 2);
+
+        auto to_p = p - center;
+        auto len = to_p.length();
+        auto wi = len > 0 ? to_p / len : vec3(0,0,1);
+
+        auto cos_w = dot(b.axis, wi);
+        if (b.two_sided) cos_w = fabs(cos_w);
+        auto sin_w = safe_sqrt(1 - cos_w*cos_w);
+
+        // Half-angle of the cone from p that holds the box's bounding sphere
+        auto radius2 = diagonal.length_squared() / 4;
+        double cos_b = -1, sin_b = 0;
+        if (len*len >= radius2) {
+            auto sin2 = radius2 / (len*len);
+            cos_b = safe_sqrt(1 - sin2);
+            sin_b = sqrt(sin2);
+        }
+
+        auto sin_o = safe_sqrt(1 - b.cos_theta_o*b.cos_theta_o);
+        auto cos_x = cos_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+        auto sin_x = sin_sub_clamped(sin_w, cos_w, sin_o, b.cos_theta_o);
+        auto cos_p = cos_sub_clamped(sin_x, cos_x, sin_b, cos_b);
+        if (cos_p <= b.cos_theta_e) return 0;
+
+        auto result = b.power * cos_p / d2;
+        if (n.length_squared() > 0) {
+            auto cos_i = fabs(dot(wi, n));
+            auto sin_i = safe_sqrt(1 - cos_i*cos_i);
+            result *= cos_sub_clamped(sin_i, cos_i, sin_b, cos_b);
+        }
+        return std::max(result, 0.0);
+    }
+
+    // Solid angle measure of a cone of emission directions, the orientation term of the cost
+    static double orientation_measure(const light_bounds& b) {
+        auto theta_o = acos(std::clamp(b.cos_theta_o, -1.0, 1.0));
+        auto theta_e = acos(std::clamp(b.cos_theta_e, -1.0, 1.0));
+        auto theta_w = std::min(theta_o + theta_e, pi);
+        auto sin_o = sin(theta_o);
+        return 2*pi * (1 - b.cos_theta_o)
+             + pi/2 * (2*theta_w*sin_o - cos(theta_o - 2*theta_w) - 2*theta_o*sin_o + b.cos_theta_o);
+    }
+
+    static double surface_area(const aabb& box) {
+        auto x = box.x.size(), y = box.y.size(), z = box.z.size();
+        return 2 * (x*y + y*z + z*x);
+    }
+
+    /**
+     * @brief Builds the subtree over order[begin, end), splitting at the bucket boundary along
+     * any axis with the least cost: power times orientation measure times surface area per
+     * side, scaled by how thin the box is along the split axis.
+     *
+     */
+    int build(std::vector<light_bounds>& leaves, std::vector<int>& order, size_t begin, size_t end,
+              uint64_t trail, int depth) {
+        auto index = static_cast<int>(nodes.size());
+        nodes.emplace_back();
+
+        if (end - begin == 1 || depth >= 62) {
+            // Too deep for a trail only when thousands of lights sit in one spot; merge them
+            light_bounds b;
+            for (size_t k = begin; k < end; k++) b = merge(b, leaves[k]);
+            nodes[index].bounds = b;
+            nodes[index].light = order[begin];
+            trails[order[begin]] = trail | (uint64_t(1) << depth);
+            return index;
+        }
+
+        aabb centroids;
+        for (size_t k = begin; k < end; k++) {
+            const auto& box = leaves[k].box;
+            point3 c((box.x.min + box.x.max) / 2, (box.y.min + box.y.max) / 2, (box.z.min + box.z.max) / 2);
+            centroids = aabb(centroids, aabb(c, c));
+        }
+
+        constexpr int buckets = 12;
+        double best_cost = infinity;
+        int best_axis = -1, best_bucket = 0;
+        aabb box;
+        for (size_t k = begin; k < end; k++) box = aabb(box, leaves[k].box);
+        double extent[3] = { box.x.size(), box.y.size(), box.z.size() };
+        auto max_extent = std::max({ extent[0], extent[1], extent[2] });
+
+        auto bucket_of = [&](const light_bounds& b, int axis) {
+            const auto& range = centroids.axis_interval(axis);
+            auto c = (b.box.axis_interval(axis).min + b.box.axis_interval(axis).max) / 2;
+            auto i = static_cast<int>(buckets * (c - range.min) / range.size());
+            return std::clamp(i, 0, buckets - 1);
+        };
+
+        for (int axis = 0; axis < 3; axis++) {
+            if (!(centroids.axis_interval(axis).size() > 0)) continue;
+
+            light_bounds bucket[buckets];
+            for (size_t k = begin; k < end; k++) {
+                auto& target = bucket[bucket_of(leaves[k], axis)];
+                target = merge(target, leaves[k]);
+            }
+
+            auto kr = max_extent / std::max(extent[axis], 1e-12);
+            for (int split = 0; split < buckets - 1; split++) {
+                light_bounds below, above;
+                for (int i = 0; i <= split; i++) below = merge(below, bucket[i]);
+                for (int i = split + 1; i < buckets; i++) above = merge(above, bucket[i]);
+                if (!(below.power > 0) || !(above.power > 0)) continue;
+
+                auto cost = kr * (below.power * orientation_measure(below) * surface_area(below.box)
+                                + above.power * orientation_measure(above) * surface_area(above.box));
+                if (cost < best_cost) {
+                    best_cost = cost;
+                    best_axis = axis;
+                    best_bucket = split;
+                }
+            }
+        }
+
+        size_t mid;
+        if (best_axis < 0) {
+            mid = (begin + end) / 2;     // Every centroid in one spot
+        } else {
+            std::vector<std::pair<light_bounds, int>> items;
+            for (size_t k = begin; k < end; k++) items.emplace_back(leaves[k], order[k]);
+            auto split = std::partition(items.begin(), items.end(), [&](const std::pair<light_bounds, int>& item) {
+                return bucket_of(item.first, best_axis) <= best_bucket;
+            });
+            mid = begin + (split - items.begin());
+            for (size_t k = begin; k < end; k++) {
+                leaves[k] = items[k - begin].first;
+                order[k] = items[k - begin].second;
+            }
+        }
+
+        build(leaves, order, begin, mid, trail << 1, depth + 1);
+        auto second = build(leaves, order, mid, end, (trail << 1) | 1, depth + 1);
+        nodes[index].second = second;
+        nodes[index].bounds = merge(nodes[index + 1].bounds, nodes[second].bounds);
+        return index;
+    }
+};
+
+#endif
@@ -30,6 +30,43 @@ class material {
       const {
         return color(0, 0, 0);
       }
+
+    /* Bidirectional integrators also connect paths and weigh strategies against each other,
+       which needs the distribution behind scatter(), not just samples of it. */
+
+    // True if scatter() draws from a distribution described by scattering() and
+    // scattering_pdf(). Mirrors, glass and lights can't be connected to.
+    virtual bool connectible() const { return false; }
+
+    // True for the phase functions of participating media, which have no surface whose
+    // cosine weighs the light passing through.
+    virtual bool is_volumetric() const { return false; }
+
+    // BSDF (or phase function) for light leaving along `direction`, when the path arrived from
+    // the side rec.normal faces
+    virtual color scattering(
+      [[maybe_unused]] const hit_record& rec,
+      [[maybe_unused]] const vec3& direction)
+      const {
+        return color(0, 0, 0);
+      }
+
+    // Solid angle density of scatter() picking `direction`
+    virtual double scattering_pdf(
+      [[maybe_unused]] const hit_record& rec,
+      [[maybe_unused]] const vec3& direction)
+      const {
+        return 0;
+      }
+
+    // Factor on top of the attenuation for paths that carry importance from the lights instead
+    // of radiance from the camera, for scattering that isn't symmetric
+    virtual double importance_scale(
+      [[maybe_unused]] const hit_record& rec,
+      [[maybe_unused]] const vec3& direction)
+      const {
+        return 1;
+      }
 };
 
 class lambertian : public material {
@@ -46,10 +83,24 @@ class lambertian : public material {
           scatter_direction = rec.normal;
 
         scattered = ray(rec.p, scatter_direction, r_in.time());
-        attenuation = albedo->value(rec.u, rec.v, rec.p);
+        attenuation = albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint);
         return true;
     }
 
+    bool connectible() const override { return true; }
+
+    color scattering(const hit_record& rec, const vec3& direction) const override {
+        if (dot(direction, rec.normal) <= 0) return color(0,0,0);
+        return albedo->filtered_value(rec.u, rec.v, rec.p, rec.footprint) / pi;
+    }
+
+    double scattering_pdf(const hit_record& rec, const vec3& direction) const override {
+        // normal + random_unit_vector() is cosine distributed
+        return fmax(dot(unit_vector(direction), rec.normal), 0) / pi;
+    }
+
+    const shared_ptr<texture>& get_albedo() const { return albedo; }
+
   private:
     shared_ptr<texture> albedo;
 };
@@ -65,6 +116,9 @@ class metal : public material {
         attenuation = albedo;
         return (dot(scattered.direction(), rec.normal) > 0);
     }
+
+    const color& get_albedo() const { return albedo; }
+    double get_fuzz() const { return fuzz; }
   
   private:
     color albedo;
@@ -97,6 +151,16 @@ class dielectric : public material {
       return true;
     }
 
+    double importance_scale(const hit_record& rec, const vec3& direction) const override {
+      // Radiance crosses the surface unchanged, so importance is compressed along with the
+      // solid angle it refracts into
+      if (dot(direction, rec.normal) >= 0) return 1;
+      double refraction_ratio = rec.front_face ? (1.0/ir) : ir;
+      return refraction_ratio * refraction_ratio;
+    }
+
+    double get_ir() const { return ir; }
+
   private:
     double ir;
 
@@ -116,6 +180,8 @@ class diffuse_light : public material {
     color emitted(double u, double v, const point3& p) const override {
       return tex->value(u, v, p);
     }
+
+    const shared_ptr<texture>& get_texture() const { return tex; }
   
   private:
     shared_ptr<texture> tex;
@@ -133,6 +199,20 @@ class isotropic : public material {
         return true;
     }
 
+    bool connectible() const override { return true; }
+    bool is_volumetric() const override { return true; }
+
+    color scattering(const hit_record& rec, [[maybe_unused]] const vec3& direction) const override {
+        return tex->value(rec.u, rec.v, rec.p) / (4*pi);
+    }
+
+    double scattering_pdf([[maybe_unused]] const hit_record& rec, [[maybe_unused]] const vec3& direction)
+    const override {
+        return 1 / (4*pi);
+    }
+
+    const shared_ptr<texture>& get_texture() const { return tex; }
+
   private:
     shared_ptr<texture> tex;
 };
@@ -0,0 +1,123 @@
+#ifndef MESH_H
+#define MESH_H
+
+#include "utils.h"
+#include "hittable_list.h"
+#include "quad.h"
+
+#include <fstream>
+#include <sstream>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Triangle with corners Q, Q+u and Q+v. It reuses the plane intersection of quad and
+ * only narrows down which (alpha, beta) lie inside.
+ *
+ */
+class tri : public quad {
+    public:
+        tri(const point3& Q, const vec3& u, const vec3& v, shared_ptr<material> mat)
+            : quad(Q, u, v, mat) {
+                set_bounding_box();     // quad's constructor only sees its own version
+            }
+
+        void set_bounding_box() override {
+            bbox = aabb(aabb(Q, Q + u), aabb(Q, Q + v));
+        }
+
+        int corners(point3* corner) const override {
+            corner[0] = Q;
+            corner[1] = Q + u;
+            corner[2] = Q + v;
+            return 3;
+        }
+
+        bool is_interior(double alpha, double beta, hit_record& rec) const override {
+            if (alpha < 0 || beta < 0 || alpha + beta > 1) {
+                return false;
+            }
+
+            rec.u = alpha;
+            rec.v = beta;
+            return true;
+        }
+};
+
+
+/**
+ * @brief Vertex positions and triangle indices of a mesh, as read from a file.
+ *
+ */
+struct mesh_data {
+    std::vector<point3> positions;
+    std::vector<int> indices;       // Three per triangle
+};
+
+/**
+ * @brief Reads the vertices and faces of a Wavefront OBJ file. Polygons are fan-triangulated;
+ * normals, texture coordinates, groups and materials are ignored. Returns false if the file
+ * can't be opened.
+ *
+ */
+inline bool load_obj(const std::string& filename, mesh_data& mesh) {
+    std::ifstream in(filename);
+    if (!in) return false;
+
+    std::string line;
+    std::vector<int> face;
+    while (std::getline(in, line)) {
+        if (line.size() < 2) continue;
+
+        if (line[0] == 'v' && line[1] == ' ') {
+            double x = 0, y = 0, z = 0;
+            std::istringstream(line.substr(2)) >> x >> y >> z;
+            mesh.positions.emplace_back(x, y, z);
+        } else if (line[0] == 'f' && line[1] == ' ') {
+            // Each vertex is "i", "i/t", "i//n" or "i/t/n"; only i matters. Negative indices
+            // count back from the last vertex read so far.
+            face.clear();
+            std::istringstream words(line.substr(2));
+            std::string word;
+            while (words >> word) {
+                int index = std::atoi(word.c_str());
+                if (index < 0) index += static_cast<int>(mesh.positions.size()) + 1;
+                face.push_back(index - 1);
+            }
+            for (size_t i = 2; i < face.size(); i++) {
+                mesh.indices.push_back(face[0]);
+                mesh.indices.push_back(face[i-1]);
+                mesh.indices.push_back(face[i]);
+            }
+        }
+    }
+    return true;
+}
+
+/**
+ * @brief Builds the triangles of a mesh, scaled by `scale`, all with the same material.
+ * Triangles with out-of-range indices are skipped.
+ *
+ */
+inline shared_ptr<hittable_list> mesh_triangles(const mesh_data& mesh, shared_ptr<material> mat,
+                                                double scale = 1) {
+    auto triangles = make_shared<hittable_list>();
+    auto count = static_cast<int>(mesh.positions.size());
+
+    for (size_t i = 0; i + 2 < mesh.indices.size(); i += 3) {
+        auto a = mesh.indices[i], b = mesh.indices[i+1], c = mesh.indices[i+2];
+        if (a < 0 || b < 0 || c < 0 || a >= count || b >= count || c >= count)
+            continue;
+
+        auto p0 = scale * mesh.positions[a];
+        auto p1 = scale * mesh.positions[b];
+        auto p2 = scale * mesh.positions[c];
+        if (cross(p1 - p0, p2 - p0).near_zero())
+            continue;   // Degenerate triangles have no plane
+
+        triangles->add(make_shared<tri>(p0, p1 - p0, p2 - p0, mat));
+    }
+    return triangles;
+}
+
+#endif
@@ -0,0 +1,284 @@
+#ifndef MOTION_BVH_H
+#define MOTION_BVH_H
+
+#include "utils.h"
+#include "hittable.h"
+#include "hittable_list.h"
+#include "bvh_build.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <vector>
+
+/**
+ * @brief BVH whose node bounds move with the objects in them. The shutter interval is cut into
+ * `segments` equal pieces, and every node keeps a box at the start and end of each piece; a ray
+ * tests the box blended linearly to its own time(). A moving sphere then only costs the space
+ * it covers at that instant instead of its whole swept path, in every ancestor node too.
+ *
+ * Boxes come from hittable::motion_bounds(), so linear motion is bounded exactly with one
+ * segment; more segments follow curved or keyframed motion more tightly.
+ *
+ * The tree's shape comes from bvh_builder, binned SAH unless options say otherwise. With sbvh an
+ * object cut by spatial splits is listed in several leaves, each boxed around its own piece;
+ * refit() loses those cuts and falls back to whole-object boxes. Nodes live
+ * in one array in depth-first order: the left child directly follows its parent,
+ * so refit() can recompute every box bottom-up in a single backward pass.
+ *
+ */
+class motion_bvh : public hittable {
+  public:
+    static constexpr int max_segments = 16;
+
+    bvh_build_options options;
+    bvh_build_stats stats;      // Of the last build()
+
+    motion_bvh(hittable_list& list, int segments = 1, const bvh_build_options& options = {})
+      : motion_bvh(list.objects, segments, options) {}
+
+    motion_bvh(std::vector<shared_ptr<hittable>> objects, int segments = 1,
+               const bvh_build_options& options = {})
+      : options(options), objects(std::move(objects)), segments(std::clamp(segments, 1, max_segments))
+    {
+        build();
+    }
+
+    // Rebuilds the tree from the objects' current motion bounds
+    void build() {
+        auto start = std::chrono::steady_clock::now();
+        nodes.clear();
+        boxes.clear();
+
+        auto slots = 2 * segments;
+        auto count = objects.size();
+        std::vector<aabb> prim_boxes(count * slots);
+        std::vector<aabb> swept(count);
+        parallel_for(count, options.threads, [&](size_t i) {
+            object_boxes(*objects[i], &prim_boxes[i * slots]);
+            swept[i] = aabb::empty;
+            for (int s = 0; s < slots; s++) swept[i] = aabb(swept[i], prim_boxes[i * slots + s]);
+        });
+
+        // Spatial splits may only cut objects that hold still: a clipped box is the same at
+        // every time
+        auto clip = [&](int i, int axis, double lo, double hi, aabb& box) {
+            for (int s = 0; s < slots; s++)
+                if (!same_box(prim_boxes[i * slots + s], swept[i])) return false;
+            box = objects[i]->clipped_box(axis, lo, hi);
+            return true;
+        };
+
+        // The tree is built over the boxes for the whole shutter interval, then flattened in
+        // depth-first order with the per-segment boxes filled in
+        bvh_builder tree(swept, options, clip);
+        if (count > 0) {
+            nodes.reserve(tree.nodes.size());
+            boxes.reserve(tree.nodes.size() * slots);
+            flatten(tree, 0, prim_boxes);
+
+            // Objects cut by spatial splits sit in more than one leaf
+            std::vector<shared_ptr<hittable>> sorted(tree.order.size());
+            for (size_t i = 0; i < sorted.size(); i++) sorted[i] = objects[tree.order[i]];
+            objects.swap(sorted);
+        }
+
+        stats = tree.stats;
+        stats.bytes = nodes.size() * sizeof(node) + boxes.size() * sizeof(aabb)
+                    + objects.size() * sizeof(shared_ptr<hittable>);
+        stats.seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+    }
+
+    // Recomputes every box from the objects' current motion bounds, keeping the tree's shape
+    void refit() {
+        for (auto i = nodes.size(); i-- > 0;) {
+            const auto& n = nodes[i];
+            auto slot = &boxes[i * 2 * segments];
+            if (n.count > 0) {
+                leaf_boxes(n.first, n.count, slot);
+            } else {
+                auto left = &boxes[(i + 1) * 2 * segments];
+                auto right = &boxes[n.right * 2 * segments];
+                for (int s = 0; s < 2 * segments; s++)
+                    slot[s] = aabb(left[s], right[s]);
+            }
+        }
+    }
+
+    // Expected number of node visits per ray, by the surface area heuristic over each node's
+    // box for the whole shutter interval
+    double cost() const {
+        if (nodes.empty()) return 0;
+        auto root = surface_area(swept_box(0));
+        if (root <= 0) return 1;
+
+        double total = 0;
+        for (size_t i = 0; i < nodes.size(); i++)
+            total += surface_area(swept_box(i));
+        return total / root;
+    }
+
+    // While set, every node whose box a hit() tests is counted here, including those of BVHs
+    // nested inside the objects. For reports only: it is shared by all threads.
+    static inline size_t* visit_counter = nullptr;
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return traverse(r, ray_t, rec, visit_counter);
+    }
+
+    aabb bounding_box() const override { return nodes.empty() ? aabb::empty : swept_box(0); }
+
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        // Exact within one segment, where the root box moves linearly
+        auto segment = std::min(static_cast<int>(t0 * segments), segments - 1);
+        if (nodes.empty() || t1 * segments > segment + 1) {
+            b0 = b1 = bounding_box();
+            return;
+        }
+        b0 = blend(boxes[2 * segment], boxes[2 * segment + 1], t0 * segments - segment);
+        b1 = blend(boxes[2 * segment], boxes[2 * segment + 1], t1 * segments - segment);
+    }
+
+    // Leaf objects in tree order; one cut by spatial splits is listed once per piece
+    const std::vector<shared_ptr<hittable>>& get_objects() const { return objects; }
+
+  protected:
+    struct node {
+        int right;      // Index of the right child; the left one directly follows its parent
+        int first;      // First object of a leaf
+        int count;      // Objects in a leaf, 0 for interior nodes
+    };
+
+    std::vector<shared_ptr<hittable>> objects;
+    std::vector<node> nodes;
+    std::vector<aabb> boxes;    // 2 * segments per node: start and end of each segment
+    int segments;
+
+    static double surface_area(const aabb& box) {
+        auto x = box.x.size(), y = box.y.size(), z = box.z.size();
+        return 2 * (x*y + y*z + z*x);
+    }
+
+  private:
+    bool traverse(const ray& r, interval ray_t, hit_record& rec, size_t* visits) const {
+        if (nodes.empty()) return false;
+
+        // The segment holding the ray's time, and how far into it the ray is
+        auto t = r.time() * segments;
+        auto segment = std::min(static_cast<int>(t), segments - 1);
+        auto f = t - segment;
+        auto offset = 2 * segment;
+
+        int stack[64];
+        int top = 0;
+        stack[top++] = 0;
+        bool hit_anything = false;
+
+        while (top > 0) {
+            auto index = stack[--top];
+            if (visits) ++*visits;
+            RT_STAT(bvh_nodes);
+            RT_STAT(aabb_tests);
+            auto slot = &boxes[index * 2 * segments + offset];
+            if (!hit_blended(slot[0], slot[1], f, r, ray_t)) continue;
+
+            const auto& n = nodes[index];
+            if (n.count > 0) {
+                for (int i = n.first; i < n.first + n.count; i++) {
+                    if (objects[i]->hit(r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                    }
+                }
+                continue;
+            }
+
+            stack[top++] = n.right;
+            stack[top++] = index + 1;
+        }
+        return hit_anything;
+    }
+
+    // Start and end boxes of every segment of one object
+    void object_boxes(const hittable& object, aabb* slot) const {
+        for (int s = 0; s < segments; s++)
+            object.motion_bounds(double(s) / segments, double(s + 1) / segments, slot[2*s], slot[2*s + 1]);
+    }
+
+    void leaf_boxes(int first, int count, aabb* slot) const {
+        aabb object_slot[2 * max_segments];
+        auto slots = 2 * segments;
+        for (int s = 0; s < slots; s++) slot[s] = aabb::empty;
+        for (int i = first; i < first + count; i++) {
+            object_boxes(*objects[i], object_slot);
+            for (int s = 0; s < slots; s++) slot[s] = aabb(slot[s], object_slot[s]);
+        }
+    }
+
+    aabb swept_box(size_t index) const {
+        auto box = aabb::empty;
+        for (int s = 0; s < 2 * segments; s++) box = aabb(box, boxes[index * 2 * segments + s]);
+        return box;
+    }
+
+    static bool same_box(const aabb& a, const aabb& b) {
+        return a.x.min == b.x.min && a.x.max == b.x.max && a.y.min == b.y.min && a.y.max == b.y.max
+            && a.z.min == b.z.min && a.z.max == b.z.max;
+    }
+
+    static aabb blend(const aabb& b0, const aabb& b1, double f) {
+        return aabb(interval((1-f) * b0.x.min + f * b1.x.min, (1-f) * b0.x.max + f * b1.x.max),
+                    interval((1-f) * b0.y.min + f * b1.y.min, (1-f) * b0.y.max + f * b1.y.max),
+                    interval((1-f) * b0.z.min + f * b1.z.min, (1-f) * b0.z.max + f * b1.z.max));
+    }
+
+    static bool hit_blended(const aabb& b0, const aabb& b1, double f, const ray& r, interval ray_t) {
+        for (int a = 0; a < 3; a++) {
+            const auto& i0 = b0.axis_interval(a);
+            const auto& i1 = b1.axis_interval(a);
+            auto invD = 1 / r.direction()[a];
+            auto orig = r.origin()[a];
+
+            auto t0 = ((1-f) * i0.min + f * i1.min - orig) * invD;
+            auto t1 = ((1-f) * i0.max + f * i1.max - orig) * invD;
+
+            if (invD < 0)
+                std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+
+            if (ray_t.max <= ray_t.min)
+                return false;
+        }
+        return true;
+    }
+
+    int flatten(const bvh_builder& tree, int source, const std::vector<aabb>& prim_boxes) {
+        const auto& from = tree.nodes[source];
+        auto slots = 2 * segments;
+        auto index = static_cast<int>(nodes.size());
+        nodes.push_back(node{-1, from.first, from.count});
+        boxes.resize(boxes.size() + slots, aabb::empty);
+
+        if (from.left < 0) {
+            for (int i = from.first; i < from.first + from.count; i++) {
+                for (int s = 0; s < slots; s++) {
+                    const auto& box = tree.clipped[i] ? tree.ref_boxes[i] : prim_boxes[tree.order[i] * slots + s];
+                    boxes[index * slots + s] = aabb(boxes[index * slots + s], box);
+                }
+            }
+            return index;
+        }
+
+        flatten(tree, from.left, prim_boxes);
+        auto right = flatten(tree, from.right, prim_boxes);
+        nodes[index].right = right;
+        nodes[index].count = 0;
+        for (int s = 0; s < slots; s++)
+            boxes[index * slots + s] = aabb(boxes[(index + 1) * slots + s], boxes[right * slots + s]);
+        return index;
+    }
+};
+
+#endif
@@ -0,0 +1,161 @@
+#ifndef NEE_H
+#define NEE_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+#include "lights.h"
+#include "grid_medium.h"
+
+#include <cmath>
+
+/**
+ * @brief Path tracer with next event estimation: at every diffuse surface and every point that
+ * scatters in a medium, one shadow ray goes to a point on a light picked by a light_bvh for
+ * that point, besides the bounce sampled from the material. Light found both ways is weighed
+ * by the power heuristic. Glass, mirrors and metal are traced like ray_color, and light seen
+ * through them is counted in full, as is light from emitters the light_list doesn't know and
+ * the background.
+ *
+ * Not thread-safe: each render thread runs its own integrator.
+ *
+ */
+class nee_integrator {
+  public:
+    nee_integrator(const hittable& world, const light_list& lights, const light_bvh& sampler,
+                   const color& background, const homogeneous_fog& fog, int max_depth)
+      : world(world), lights(lights), sampler(sampler), background(background), fog(fog),
+        max_depth(max_depth) {}
+
+    color sample(ray r) {
+        color L(0,0,0), beta(1,1,1);
+
+        // Where the last bounce came from, for weighing the light it finds
+        bool counted = true;    // The last bounce couldn't have been sampled by a shadow ray
+        point3 from;
+        vec3 from_normal;
+        double from_pdf = 0;
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                auto p = r.at(t_fog);
+                L += beta * direct(p, vec3(0,0,0), nullptr, r.time());
+                beta = beta * fog.albedo;
+
+                ray scattered(p, random_unit_vector(), r.time());
+                scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+                counted = false;
+                from = p;
+                from_normal = vec3(0,0,0);
+                from_pdf = 1 / (4*pi);
+                r = scattered;
+                continue;
+            }
+            if (!hit_anything) {
+                L += beta * background;
+                break;
+            }
+
+            auto emitted = rec.mat->emitted(rec.u, rec.v, rec.p);
+            if (!is_black(emitted))
+                L += beta * emitted * (counted ? 1 : bounce_weight(r, rec, from, from_normal, from_pdf));
+
+            color attenuation;
+            ray scattered;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                break;
+            scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+
+            counted = !rec.mat->connectible();
+            if (!counted) {
+                auto normal = rec.mat->is_volumetric() ? vec3(0,0,0) : rec.normal;
+                L += beta * direct(rec.p, normal, &rec, r.time());
+                from = rec.p;
+                from_normal = normal;
+                from_pdf = rec.mat->scattering_pdf(rec, scattered.direction());
+            }
+
+            beta = beta * attenuation;
+            r = scattered;
+        }
+        return L;
+    }
+
+  private:
+    const hittable& world;
+    const light_list& lights;
+    const light_bvh& sampler;
+    color background;
+    const homogeneous_fog& fog;
+    int max_depth;
+
+    static bool is_black(const color& c) { return c.x() <= 0 && c.y() <= 0 && c.z() <= 0; }
+
+    static double power_heuristic(double f, double g) {
+        return f*f / (f*f + g*g);
+    }
+
+    /**
+     * @brief Light reaching p from a point sampled on a light, scattered by the material of
+     * `rec`, or by the fog if it's null, and weighed against finding it by a bounce.
+     *
+     */
+    color direct(const point3& p, const vec3& normal, const hit_record* rec, double time) const {
+        double pmf;
+        auto light = sampler.pick(p, normal, random_double(), pmf);
+        if (!light) return color(0,0,0);
+
+        auto sample = light_list::sample(*light, time);
+        auto d = sample.p - p;
+        auto distance = d.length();
+        auto direction = d / distance;
+        auto cos_light = fabs(dot(sample.normal, direction));
+        if (cos_light == 0 || distance < 0.002) return color(0,0,0);
+
+        color f;
+        double bounce_pdf;
+        if (rec) {
+            f = rec->mat->scattering(*rec, direction);
+            if (!rec->mat->is_volumetric()) f = f * fabs(dot(direction, rec->normal));
+            bounce_pdf = rec->mat->scattering_pdf(*rec, direction);
+        } else {
+            f = fog.albedo / (4*pi);
+            bounce_pdf = 1 / (4*pi);
+        }
+        if (is_black(f)) return color(0,0,0);
+
+        ray shadow(p, direction, time);
+        hit_record blocker;
+        shadow_ray_scope media;     // Grid media are ratio tracked, other blockers are binary
+        RT_STAT(rays);
+        RT_STAT(shadow_rays);
+        if (world.hit(shadow, interval(0.001, distance - 0.001), blocker)) return color(0,0,0);
+
+        auto light_pdf = pmf * distance * distance / (cos_light * light->area);
+        auto tr = media.transmittance() * fog.transmittance(shadow, interval(0, distance));
+        return f * sample.emitted * (tr * power_heuristic(light_pdf, bounce_pdf) / light_pdf);
+    }
+
+    // Weight of light found by a bounce from `from`, against finding it with a shadow ray
+    double bounce_weight(const ray& r, const hit_record& rec, const point3& from, const vec3& from_normal,
+                         double from_pdf) const {
+        double unused;
+        auto light = lights.find(rec.object, unused);
+        if (!light) return 1;
+
+        auto d = rec.p - from;
+        auto cos_light = fabs(dot(rec.normal, unit_vector(r.direction())));
+        if (cos_light == 0) return 1;
+        auto light_pdf = sampler.pmf(from, from_normal, *light) * d.length_squared() / (cos_light * light->area);
+        return power_heuristic(from_pdf, light_pdf);
+    }
+};
+
+#endif
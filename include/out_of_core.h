@@ -0,0 +1,372 @@
+#ifndef OUT_OF_CORE_H
+#define OUT_OF_CORE_H
+
+#include "utils.h"
+#include "hittable.h"
+#include "snapshot.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <fcntl.h>
+#include <iomanip>
+#include <list>
+#include <mutex>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief World of a scene snapshot traced without holding its geometry in memory.
+ *
+ * The snapshot's world tree is cut into clusters, subtrees of at most `cluster_prims`
+ * primitives. Only the few nodes above the clusters are copied into memory; a cluster's nodes
+ * and primitives are mapped from the file when a ray first reaches it, and clusters are unmapped
+ * least recently used first once the mapped ones take more than the memory cap. A cluster in use
+ * by a trace stays mapped until that trace is done, so the cap can be exceeded by the clusters
+ * threads are working in at the same moment.
+ *
+ * hit() pages in whatever a single ray needs. hit_batch(), which the wavefront integrator calls,
+ * instead queues each ray on the clusters it enters, nearest first, and traces every queued
+ * cluster once for all its rays before moving on, so each page-in is shared by many rays.
+ *
+ */
+class streamed_scene : public hittable {
+  public:
+    struct cache_stats {
+        size_t clusters = 0;
+        size_t page_ins = 0;        // Clusters mapped from the file
+        size_t evictions = 0;       // Clusters unmapped to stay under the cap
+        size_t resident_bytes = 0;
+        size_t peak_bytes = 0;      // Most cluster bytes mapped at once, before evicting
+    };
+
+    /**
+     * @brief Opens the snapshot in `filename` with at most `memory_cap` bytes of clusters mapped,
+     * and sets up `cam` from it. Throws std::runtime_error like scene_snapshot::load().
+     *
+     */
+    streamed_scene(const std::string& filename, camera& cam, size_t memory_cap, uint32_t cluster_prims = 4096)
+      : memory_cap(memory_cap), cluster_prims(std::max<uint32_t>(cluster_prims, 1))
+    {
+        scene = scene_snapshot::map(filename, cam);
+        const auto& h = *scene->header;
+        if (h.nodes.count > 0) {
+            split(0);
+            const auto& root = scene->nodes[0];
+            bbox = aabb(point3(root.min[0], root.min[1], root.min[2]),
+                        point3(root.max[0], root.max[1], root.max[2]));
+        } else {
+            bbox = aabb::empty;
+        }
+
+        // From here on the world's nodes and prims are only read through cluster mappings
+        scene->release(h.nodes.offset, h.nodes.count * sizeof(snapshot_format::node));
+        scene->release(h.prims.offset, h.prims.count * sizeof(snapshot_format::prim));
+
+        fd = open(filename.c_str(), O_RDONLY);
+        if (fd < 0)
+            throw std::runtime_error("Could not open snapshot '" + filename + "'");
+        stats.clusters = clusters.size();
+    }
+
+    ~streamed_scene() {
+        resident.clear();
+        if (fd >= 0) close(fd);
+    }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        if (top.empty()) return false;
+
+        double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+        bool hit_anything = false;
+
+        while (sp > 0) {
+            const auto& n = top[stack[--sp]];
+            double t_enter;
+            RT_STAT(bvh_nodes);
+            RT_STAT(aabb_tests);
+            if (!box_hit(n, r, inv_dir, ray_t, t_enter)) continue;
+
+            if (n.cluster >= 0) {
+                auto pages = acquire(n.cluster);
+                if (trace(*pages, n.cluster, r, ray_t, rec)) {
+                    hit_anything = true;
+                    ray_t.max = rec.t;
+                }
+            } else {
+                auto first = static_cast<int>(&n - top.data()) + 1;
+                auto second = n.right;
+                if (inv_dir[n.axis] < 0) std::swap(first, second);
+                stack[sp++] = second;
+                stack[sp++] = first;
+            }
+        }
+        return hit_anything;
+    }
+
+    void hit_batch(const std::vector<ray>& rays, interval ray_t, std::vector<hit_record>& recs,
+                   std::vector<char>& hits) const override {
+        recs.resize(rays.size());
+        hits.assign(rays.size(), 0);
+        if (top.empty()) return;
+
+        // Every cluster each ray enters, sorted by ray and then by entry distance
+        struct entry { double t; int cluster; };
+        std::vector<entry> entries;
+        std::vector<size_t> first(rays.size() + 1);
+        for (size_t i = 0; i < rays.size(); i++) {
+            first[i] = entries.size();
+            gather(rays[i], ray_t, entries);
+            std::sort(entries.begin() + first[i], entries.end(),
+                      [](const entry& a, const entry& b) { return a.t < b.t; });
+        }
+        first[rays.size()] = entries.size();
+
+        std::vector<double> nearest(rays.size(), ray_t.max);
+        std::vector<size_t> next(first.begin(), first.end() - 1);
+        std::vector<std::pair<int, size_t>> queue;      // (cluster, ray)
+
+        // Each round queues the next cluster of every ray that could still hold a nearer hit
+        while (true) {
+            queue.clear();
+            for (size_t i = 0; i < rays.size(); i++) {
+                if (next[i] < first[i+1] && entries[next[i]].t < nearest[i])
+                    queue.push_back({ entries[next[i]++].cluster, i });
+            }
+            if (queue.empty()) break;
+            std::sort(queue.begin(), queue.end());
+
+            for (size_t q = 0; q < queue.size();) {
+                auto cluster = queue[q].first;
+                auto pages = acquire(cluster);
+                for (; q < queue.size() && queue[q].first == cluster; q++) {
+                    auto i = queue[q].second;
+                    if (trace(*pages, cluster, rays[i], interval(ray_t.min, nearest[i]), recs[i])) {
+                        hits[i] = 1;
+                        nearest[i] = recs[i].t;
+                    }
+                }
+            }
+        }
+    }
+
+    aabb bounding_box() const override { return bbox; }
+
+    cache_stats statistics() const {
+        std::lock_guard<std::mutex> lock(mutex);
+        return stats;
+    }
+
+    void report(std::ostream& out) const {
+        auto s = statistics();
+        out << "Streamed geometry: " << s.clusters << " clusters, " << s.page_ins << " page-ins, "
+            << s.evictions << " evictions, peak " << std::fixed << std::setprecision(1)
+            << s.peak_bytes / (1024.0*1024.0) << " of " << memory_cap / (1024.0*1024.0) << " MB\n";
+        out.unsetf(std::ios::fixed);
+    }
+
+  private:
+    // Node above the clusters. Its first child follows it, like in the snapshot.
+    struct top_node {
+        double min[3], max[3];
+        int right;
+        int cluster;            // Cluster this node stands for, -1 for an interior node
+        uint32_t axis;
+    };
+
+    // Where a cluster's subtree lies in the snapshot: nodes [node_first, node_end) with its
+    // root first, and prims [prim_first, prim_end)
+    struct cluster_range {
+        uint32_t node_first, node_end;
+        uint32_t prim_first, prim_end;
+    };
+
+    // Mapping of one cluster's nodes and prims, unmapped when the last user lets go of it
+    struct cluster_pages {
+        void* node_map = MAP_FAILED;
+        void* prim_map = MAP_FAILED;
+        size_t node_bytes = 0, prim_bytes = 0;
+        const snapshot_format::node* nodes = nullptr;
+        const snapshot_format::prim* prims = nullptr;
+
+        size_t bytes() const { return node_bytes + prim_bytes; }
+
+        ~cluster_pages() {
+            if (node_map != MAP_FAILED) munmap(node_map, node_bytes);
+            if (prim_map != MAP_FAILED) munmap(prim_map, prim_bytes);
+        }
+    };
+
+    struct resident_cluster {
+        shared_ptr<const cluster_pages> pages;
+        std::list<int>::iterator lru_position;
+    };
+
+    shared_ptr<scene_snapshot::mapped_scene> scene;
+    std::vector<top_node> top;
+    std::vector<cluster_range> clusters;
+    size_t memory_cap;
+    uint32_t cluster_prims;
+    int fd = -1;
+    aabb bbox;
+
+    mutable std::mutex mutex;
+    mutable std::unordered_map<int, resident_cluster> resident;
+    mutable std::list<int> lru;                 // Most recently used cluster at the front
+    mutable cache_stats stats;
+
+    // Copies the tree at snapshot node `index` into `top` down to the clusters. Returns the
+    // extent of the subtree in the snapshot.
+    cluster_range split(uint32_t index) {
+        auto at = static_cast<int>(top.size());
+        const auto& n = scene->nodes[index];
+        top_node t;
+        for (int a = 0; a < 3; a++) {
+            t.min[a] = n.min[a];
+            t.max[a] = n.max[a];
+        }
+        t.axis = n.axis;
+        t.right = -1;
+        t.cluster = -1;
+        top.push_back(t);
+
+        auto range = measure(index);
+        if (range.prim_end - range.prim_first <= cluster_prims) {
+            top[at].cluster = static_cast<int>(clusters.size());
+            clusters.push_back(range);
+            return range;
+        }
+
+        split(index + 1);
+        auto right = static_cast<int>(top.size());
+        split(n.index);
+        top[at].right = right;
+        return range;
+    }
+
+    // Node and prim extent of the subtree at `index`. Subtrees are stored contiguously in
+    // depth-first order, with their prims in leaf order.
+    cluster_range measure(uint32_t index) const {
+        cluster_range range{ index, index + 1, UINT32_MAX, 0 };
+        std::vector<uint32_t> stack{ index };
+        while (!stack.empty()) {
+            auto i = stack.back();
+            stack.pop_back();
+            const auto& n = scene->nodes[i];
+            range.node_end = std::max(range.node_end, i + 1);
+            if (n.count > 0) {
+                range.prim_first = std::min(range.prim_first, n.index);
+                range.prim_end = std::max(range.prim_end, n.index + n.count);
+            } else {
+                stack.push_back(i + 1);
+                stack.push_back(n.index);
+            }
+        }
+        if (range.prim_first > range.prim_end) range.prim_first = range.prim_end;
+        return range;
+    }
+
+    static bool box_hit(const top_node& n, const ray& r, const double* inv_dir, interval ray_t, double& t_enter) {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (n.min[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (n.max[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0) std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min) return false;
+        }
+        t_enter = ray_t.min;
+        return true;
+    }
+
+    template <typename Entry>
+    void gather(const ray& r, interval ray_t, std::vector<Entry>& entries) const {
+        double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+        int stack[64];
+        int sp = 0;
+        stack[sp++] = 0;
+        while (sp > 0) {
+            const auto& n = top[stack[--sp]];
+            double t_enter;
+            RT_STAT(bvh_nodes);
+            RT_STAT(aabb_tests);
+            if (!box_hit(n, r, inv_dir, ray_t, t_enter)) continue;
+            if (n.cluster >= 0) {
+                entries.push_back({ t_enter, n.cluster });
+            } else {
+                stack[sp++] = n.right;
+                stack[sp++] = static_cast<int>(&n - top.data()) + 1;
+            }
+        }
+    }
+
+    bool trace(const cluster_pages& pages, int cluster, const ray& r, interval ray_t, hit_record& rec) const {
+        const auto& c = clusters[cluster];
+        return scene_snapshot::flat_bvh::trace(*scene, pages.nodes, c.node_first, pages.prims, c.prim_first,
+                                               c.node_first, r, ray_t, rec);
+    }
+
+    // Maps [offset, offset + length) of the file, reading it in right away. Returns the start
+    // of the range inside the mapping.
+    const void* map_range(uint64_t offset, uint64_t length, void*& map, size_t& bytes) const {
+        auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        auto start = offset / page * page;
+        bytes = static_cast<size_t>(offset + length - start);
+        map = mmap(nullptr, bytes, PROT_READ, MAP_PRIVATE | MAP_POPULATE, fd, static_cast<off_t>(start));
+        if (map == MAP_FAILED)
+            throw std::runtime_error("Could not map a cluster of the snapshot");
+        return static_cast<const char*>(map) + (offset - start);
+    }
+
+    shared_ptr<const cluster_pages> acquire(int cluster) const {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto found = resident.find(cluster);
+        if (found != resident.end()) {
+            lru.splice(lru.begin(), lru, found->second.lru_position);
+            return found->second.pages;
+        }
+
+        const auto& h = *scene->header;
+        const auto& c = clusters[cluster];
+        auto pages = make_shared<cluster_pages>();
+        pages->nodes = static_cast<const snapshot_format::node*>(
+            map_range(h.nodes.offset + uint64_t(c.node_first) * sizeof(snapshot_format::node),
+                      uint64_t(c.node_end - c.node_first) * sizeof(snapshot_format::node),
+                      pages->node_map, pages->node_bytes));
+        if (c.prim_end > c.prim_first) {
+            pages->prims = static_cast<const snapshot_format::prim*>(
+                map_range(h.prims.offset + uint64_t(c.prim_first) * sizeof(snapshot_format::prim),
+                          uint64_t(c.prim_end - c.prim_first) * sizeof(snapshot_format::prim),
+                          pages->prim_map, pages->prim_bytes));
+        }
+
+        stats.page_ins++;
+        stats.resident_bytes += pages->bytes();
+        lru.push_front(cluster);
+        resident[cluster] = { pages, lru.begin() };
+        stats.peak_bytes = std::max(stats.peak_bytes, stats.resident_bytes);
+        evict_to_cap();
+        return pages;
+    }
+
+    void evict_to_cap() const {
+        // Keep at least the cluster just paged in, however small the cap
+        while (stats.resident_bytes > memory_cap && lru.size() > 1) {
+            auto cluster = lru.back();
+            lru.pop_back();
+            stats.resident_bytes -= resident[cluster].pages->bytes();
+            resident.erase(cluster);
+            stats.evictions++;
+        }
+    }
+};
+
+#endif
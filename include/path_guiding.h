@@ -0,0 +1,380 @@
+#ifndef PATH_GUIDING_H
+#define PATH_GUIDING_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
+/**
+ * @brief Distribution over directions as a quadtree on the unit square, which maps to the
+ * sphere by (cos theta, phi) without distorting area. Each node holds the energy of its four
+ * quadrants; quadrants with more energy are subdivided deeper, so the leaves have roughly equal
+ * shares of it.
+ *
+ * Energy is added from any thread with atomic floats while the tree's shape stays fixed; the
+ * shape only changes in refined(), between passes.
+ *
+ */
+class directional_tree {
+  public:
+    struct node {
+        std::atomic<float> sum[4];
+        uint32_t child[4] = { 0, 0, 0, 0 };     // 0 for a leaf quadrant; the root is never a child
+
+        node() { for (auto& s : sum) s.store(0, std::memory_order_relaxed); }
+        node(const node& other) { *this = other; }
+        node& operator=(const node& other) {
+            for (int q = 0; q < 4; q++) {
+                sum[q].store(other.sum[q].load(std::memory_order_relaxed), std::memory_order_relaxed);
+                child[q] = other.child[q];
+            }
+            return *this;
+        }
+    };
+
+    directional_tree() : nodes(1) {}
+
+    double total() const {
+        double t = 0;
+        for (const auto& s : nodes[0].sum) t += s.load(std::memory_order_relaxed);
+        return t;
+    }
+
+    bool empty() const { return !(total() > 0); }
+
+    // Unit square coordinates of a unit direction, and back
+    static void to_square(const vec3& d, double& u, double& v) {
+        u = std::clamp((d.z() + 1) / 2, 0.0, 1.0);
+        auto phi = atan2(d.y(), d.x());
+        v = std::clamp((phi + pi) / (2*pi), 0.0, 1.0);
+    }
+
+    static vec3 from_square(double u, double v) {
+        auto z = 2*u - 1;
+        auto r = sqrt(std::max(0.0, 1 - z*z));
+        auto phi = 2*pi*v - pi;
+        return vec3(r * cos(phi), r * sin(phi), z);
+    }
+
+    void record(double u, double v, float value) {
+        uint32_t n = 0;
+        while (true) {
+            auto q = quadrant(u, v);
+            auto& s = nodes[n].sum[q];
+            auto current = s.load(std::memory_order_relaxed);
+            while (!s.compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+            if (!nodes[n].child[q]) return;
+            n = nodes[n].child[q];
+        }
+    }
+
+    vec3 sample() const {
+        uint32_t n = 0;
+        double x = 0, y = 0, size = 1;
+        while (true) {
+            const auto& nd = nodes[n];
+            float s[4];
+            double total = 0;
+            for (int q = 0; q < 4; q++) total += s[q] = nd.sum[q].load(std::memory_order_relaxed);
+
+            auto r = random_double() * total;
+            int q = 0;
+            while (q < 3 && (r -= s[q]) >= 0) q++;
+            while (s[q] <= 0 && q > 0) q--;     // Rounding may land on an empty quadrant
+
+            size /= 2;
+            x += (q & 1) * size;
+            y += (q >> 1) * size;
+            if (!nd.child[q]) return from_square(x + random_double() * size, y + random_double() * size);
+            n = nd.child[q];
+        }
+    }
+
+    // Solid angle density of sample() picking the unit direction d
+    double pdf(const vec3& d) const {
+        double u, v;
+        to_square(d, u, v);
+        double p = 1 / (4*pi);
+        uint32_t n = 0;
+        while (true) {
+            const auto& nd = nodes[n];
+            double total = 0;
+            for (const auto& s : nd.sum) total += s.load(std::memory_order_relaxed);
+            if (!(total > 0)) return 0;
+
+            auto q = quadrant(u, v);
+            p *= 4 * nd.sum[q].load(std::memory_order_relaxed) / total;
+            if (!nd.child[q]) return p;
+            n = nd.child[q];
+        }
+    }
+
+    /**
+     * @brief An empty tree for the next pass, whose quadrants are split wherever this tree has
+     * more than `threshold` of its energy in them. Energy in a leaf quadrant is taken as spread
+     * evenly over it.
+     *
+     */
+    directional_tree refined(double threshold, int max_depth = 20) const {
+        directional_tree out;
+        auto t = total();
+        if (!(t > 0)) return out;
+
+        double energy[4];
+        for (int q = 0; q < 4; q++) energy[q] = nodes[0].sum[q].load(std::memory_order_relaxed);
+        refine(out, 0, &nodes[0], energy, threshold * t, 1, max_depth);
+        return out;
+    }
+
+  private:
+    std::vector<node> nodes;
+
+    // Quadrant of (u, v), which are then rescaled to that quadrant
+    static int quadrant(double& u, double& v) {
+        int qx = u >= 0.5, qy = v >= 0.5;
+        u = std::min(u * 2 - qx, 1.0);
+        v = std::min(v * 2 - qy, 1.0);
+        return qx + 2*qy;
+    }
+
+    void refine(directional_tree& out, uint32_t n, const node* old, const double* energy,
+                double limit, int depth, int max_depth) const {
+        for (int q = 0; q < 4; q++) {
+            if (energy[q] <= limit || depth >= max_depth) continue;
+
+            auto c = static_cast<uint32_t>(out.nodes.size());
+            out.nodes.emplace_back();
+            out.nodes[n].child[q] = c;
+
+            const node* old_child = old && old->child[q] ? &nodes[old->child[q]] : nullptr;
+            double sub[4];
+            for (int k = 0; k < 4; k++)
+                sub[k] = old_child ? old_child->sum[k].load(std::memory_order_relaxed) : energy[q] / 4;
+            refine(out, c, old_child, sub, limit, depth + 1, max_depth);
+        }
+    }
+};
+
+
+/**
+ * @brief Spatial-directional tree of "Practical Path Guiding" (Müller et al. 2017): a binary
+ * tree over the scene's bounding cube, halving cells along x, y and z in turn, with two
+ * directional_trees per leaf. One is sampled from during a pass, the other learns the incident
+ * radiance recorded in that pass. Between passes, leaves that received many records are split
+ * and the learned distribution becomes the sampled one.
+ *
+ */
+class guiding_tree {
+  public:
+    double bsdf_fraction = 0.5;         // Share of directions still sampled from the BSDF
+    double spatial_threshold = 12000;   // Records in a leaf before it splits, times sqrt(pass spp)
+    double directional_threshold = 0.01;    // Energy share of a quadrant before it splits
+
+    struct leaf {
+        directional_tree sampling, building;
+        std::atomic<uint32_t> records{0};
+
+        leaf() {}
+        leaf(const leaf& other) : sampling(other.sampling), building(other.building),
+                                  records(other.records.load(std::memory_order_relaxed)) {}
+    };
+
+    explicit guiding_tree(const aabb& box) : nodes(1), leaves(1) {
+        // A cube, so cells halve into equal proportions on every axis
+        size = std::max({ box.x.size(), box.y.size(), box.z.size(), 1e-6 }) * 1.001;
+        origin = point3(box.x.min, box.y.min, box.z.min) - 0.0005 * vec3(size, size, size);
+        nodes[0].leaf = 0;
+    }
+
+    leaf& find(const point3& p) {
+        double x[3];
+        for (int a = 0; a < 3; a++) x[a] = std::clamp((p[a] - origin[a]) / size, 0.0, 1.0);
+        uint32_t n = 0;
+        while (nodes[n].leaf < 0) {
+            auto a = nodes[n].axis;
+            int side = x[a] >= 0.5;
+            x[a] = x[a] * 2 - side;
+            n = nodes[n].child[side];
+        }
+        return leaves[nodes[n].leaf];
+    }
+
+    size_t leaf_count() const { return leaves.size(); }
+
+    /**
+     * @brief Ends a pass of `pass_spp` samples per pixel: splits busy leaves, then makes what
+     * every leaf learned its sampling distribution and gives it a refined empty one to learn in.
+     * Not thread-safe.
+     *
+     */
+    void refine(int pass_spp) {
+        auto threshold = spatial_threshold * sqrt(static_cast<double>(pass_spp));
+        for (size_t i = 0; i < nodes.size(); i++) {
+            if (nodes[i].leaf < 0) continue;
+            auto& l = leaves[nodes[i].leaf];
+            if (l.records.load() <= threshold) continue;
+
+            // Both halves start from the parent's distributions and half its records, so a
+            // leaf that is still too busy is split again further down the loop
+            l.records = l.records.load() / 2;
+            auto axis = (nodes[i].axis + 1) % 3;
+            auto first = static_cast<uint32_t>(nodes.size());
+            for (int side = 0; side < 2; side++) {
+                node child;
+                child.axis = axis;
+                child.leaf = side == 0 ? nodes[i].leaf : static_cast<int>(leaves.size());
+                if (side == 1) leaves.push_back(leaves[nodes[i].leaf]);
+                nodes.push_back(child);
+            }
+            nodes[i].leaf = -1;
+            nodes[i].child[0] = first;
+            nodes[i].child[1] = first + 1;
+        }
+
+        for (auto& l : leaves) {
+            l.sampling = l.building;
+            l.building = l.sampling.refined(directional_threshold);
+            l.records = 0;
+        }
+    }
+
+  private:
+    struct node {
+        int axis = 0;               // Axis this node halves, if interior
+        int leaf = -1;              // Index into leaves, or -1 for an interior node
+        uint32_t child[2] = { 0, 0 };
+    };
+
+    std::vector<node> nodes;
+    std::vector<leaf> leaves;
+    point3 origin;
+    double size;
+};
+
+
+/**
+ * @brief Path tracer that samples directions at diffuse surfaces and in media from a
+ * guiding_tree, mixed with the BSDF by one-sample MIS, and optionally trains the tree with the
+ * radiance each path finds. Otherwise it traces paths like ray_color. Each thread runs its own
+ * integrator over the shared tree.
+ *
+ */
+class guided_integrator {
+  public:
+    guided_integrator(const hittable& world, guiding_tree& tree, const color& background,
+                      const homogeneous_fog& fog, int max_depth)
+      : world(world), tree(tree), background(background), fog(fog), max_depth(max_depth),
+        vertices(std::max(max_depth, 1)) {}
+
+    color sample(ray r, bool train) {
+        color L(0,0,0), beta(1,1,1);
+        int count = 0;
+
+        // Radiance found later along the path is also radiance arriving at every guided vertex
+        // before it, divided by the throughput up to that vertex
+        auto add = [&](const color& contribution) {
+            L += contribution;
+            if (!train) return;
+            for (int k = 0; k < count; k++)
+                for (int c = 0; c < 3; c++)
+                    if (vertices[k].beta[c] > 0) vertices[k].radiance[c] += contribution[c] / vertices[k].beta[c];
+        };
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                ray scattered(r.at(t_fog), random_unit_vector(), r.time());
+                scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+                beta = beta * fog.albedo;
+                r = scattered;
+                continue;
+            }
+            if (!hit_anything) {
+                add(beta * background);
+                break;
+            }
+            add(beta * rec.mat->emitted(rec.u, rec.v, rec.p));
+
+            color attenuation;
+            ray scattered;
+            if (!rec.mat->connectible()) {
+                if (!rec.mat->scatter(r, rec, attenuation, scattered)) break;
+                scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+                beta = beta * attenuation;
+                r = scattered;
+                continue;
+            }
+
+            auto& leaf = tree.find(rec.p);
+            bool guided = !leaf.sampling.empty();
+            auto fraction = guided ? tree.bsdf_fraction : 1;
+
+            vec3 direction;
+            if (random_double() < fraction) {
+                if (!rec.mat->scatter(r, rec, attenuation, scattered)) break;
+                direction = unit_vector(scattered.direction());
+            } else {
+                direction = leaf.sampling.sample();
+            }
+
+            auto pdf = fraction * rec.mat->scattering_pdf(rec, direction)
+                     + (guided ? (1 - fraction) * leaf.sampling.pdf(direction) : 0);
+            auto cosine = rec.mat->is_volumetric() ? 1 : dot(direction, rec.normal);
+            if (!(pdf > 0) || cosine <= 0) break;
+            beta = beta * rec.mat->scattering(rec, direction) * (cosine / pdf);
+
+            if (train) {
+                auto& v = vertices[count++];
+                v.leaf = &leaf;
+                v.direction = direction;
+                v.pdf = pdf;
+                v.beta = beta;
+                v.radiance = color(0,0,0);
+            }
+
+            ray next(rec.p, direction, r.time());
+            next.set_cone(r.footprint(rec.t), r.cone_spread());
+            r = next;
+        }
+
+        for (int k = 0; k < count; k++) {
+            const auto& v = vertices[k];
+            double u, w;
+            directional_tree::to_square(v.direction, u, w);
+            auto luminance = 0.2126*v.radiance.x() + 0.7152*v.radiance.y() + 0.0722*v.radiance.z();
+            v.leaf->building.record(u, w, static_cast<float>(luminance / v.pdf));
+            v.leaf->records.fetch_add(1, std::memory_order_relaxed);
+        }
+        return L;
+    }
+
+  private:
+    struct guided_vertex {
+        guiding_tree::leaf* leaf;
+        vec3 direction;
+        double pdf;
+        color beta;             // Throughput including this vertex's scattering
+        color radiance;         // Arriving along `direction`
+    };
+
+    const hittable& world;
+    guiding_tree& tree;
+    color background;
+    const homogeneous_fog& fog;
+    int max_depth;
+    std::vector<guided_vertex> vertices;
+};
+
+#endif
@@ -2,83 +2,171 @@
 #define PERLIN_H
 
 #include "utils.h"
-
+#include "aabb.h"
+
+#include <cstdint>
+#include <cstring>
+#include <vector>
+
+/**
+ * @brief Gradient noise on a 256^3 periodic lattice.
+ *
+ * Gradients are kept as three float tables (structure of arrays) and every lookup first gathers
+ * the eight lattice corners into small float arrays, then runs the weighting as straight-line
+ * loops the compiler can vectorize. turb() gathers the corners of all its octaves before doing
+ * any arithmetic, so the table lookups of one octave overlap with those of the next.
+ */
 class perlin {
   public:
+    static const int max_octaves = 16;
+    static const int point_count = 256;
+
     perlin() {
-        ranvec = new vec3[point_count];
         for (int i = 0; i < point_count; ++i) {
-            ranvec[i] = unit_vector(vec3::random(-1,1));
+            auto g = unit_vector(vec3::random(-1,1));
+            grad_x[i] = static_cast<float>(g.x());
+            grad_y[i] = static_cast<float>(g.y());
+            grad_z[i] = static_cast<float>(g.z());
         }
 
-        perm_x = perlin_generate_perm();
-        perm_y = perlin_generate_perm();
-        perm_z = perlin_generate_perm();
+        perlin_generate_perm(perm_x);
+        perlin_generate_perm(perm_y);
+        perlin_generate_perm(perm_z);
     }
 
-    ~perlin() {
-        delete[] ranvec;
-        delete[] perm_x;
-        delete[] perm_y;
-        delete[] perm_z;
+    // The gradient tables, then the permutation tables, as stored by scene_snapshot
+    static const size_t table_bytes = 3 * point_count * (sizeof(float) + sizeof(uint8_t));
+
+    explicit perlin(const unsigned char* tables) {
+        for (auto table : { grad_x, grad_y, grad_z }) {
+            memcpy(table, tables, sizeof grad_x);
+            tables += sizeof grad_x;
+        }
+        for (auto table : { perm_x, perm_y, perm_z }) {
+            memcpy(table, tables, sizeof perm_x);
+            tables += sizeof perm_x;
+        }
+    }
+
+    void copy_tables(unsigned char* tables) const {
+        for (auto table : { grad_x, grad_y, grad_z }) {
+            memcpy(tables, table, sizeof grad_x);
+            tables += sizeof grad_x;
+        }
+        for (auto table : { perm_x, perm_y, perm_z }) {
+            memcpy(tables, table, sizeof perm_x);
+            tables += sizeof perm_x;
+        }
     }
 
     double noise(const point3& p) const {
-        auto u = p.x() - floor(p.x());
-        auto v = p.y() - floor(p.y());
-        auto w = p.z() - floor(p.z());
-        // Hermite cubic
-        u = u*u*(3-2*u);
-        v = v*v*(3-2*v);
-        w = w*w*(3-2*w);
-
-        auto i = static_cast<int>(floor(p.x()));
-        auto j = static_cast<int>(floor(p.y()));
-        auto k = static_cast<int>(floor(p.z()));
-        vec3 c[2][2][2];
-
-        for (int di=0; di < 2; di++)
-            for (int dj=0; dj < 2; dj++)
-                for (int dk=0; dk < 2; dk++)
-                    c[di][dj][dk] = ranvec[
-                        perm_x[(i+di) & 255] ^
-                        perm_y[(j+dj) & 255] ^
-                        perm_z[(k+dk) & 255]
-                    ];
-
-        return trilinear_interp(c, u, v, w);
+        corner_set c;
+        gather(p, c, 0);
+
+        float value[1];
+        evaluate(c, 1, value);
+        return value[0];
     }
 
     double turb(const point3& p, int depth=7) const {
-        auto accum = 0.0;
+        depth = depth < max_octaves ? depth : max_octaves;
+
+        corner_set c;
         auto temp_p = p;
-        auto weight = 1.0;
+        for (int i = 0; i < depth; i++) {
+            gather(temp_p, c, i);
+            temp_p *= 2;
+        }
 
+        float octave[max_octaves];
+        evaluate(c, depth, octave);
+
+        auto accum = 0.0;
+        auto weight = 1.0;
         for (int i = 0; i < depth; i++) {
-            accum += weight*noise(temp_p);
+            accum += weight*octave[i];
             weight *= 0.5;
-            temp_p *= 2;
         }
 
         return fabs(accum);
     }
 
   private:
-    static const int point_count = 256;
-    vec3* ranvec;
-    int* perm_x;
-    int* perm_y;
-    int* perm_z;
+    float grad_x[point_count], grad_y[point_count], grad_z[point_count];
+    uint8_t perm_x[point_count], perm_y[point_count], perm_z[point_count];
+
+    // Per octave: gradients of the 8 lattice corners (index di*4 + dj*2 + dk) and the fractional
+    // position inside the lattice cell.
+    struct corner_set {
+        float x[max_octaves*8], y[max_octaves*8], z[max_octaves*8];
+        float u[max_octaves], v[max_octaves], w[max_octaves];
+    };
+
+    void gather(const point3& p, corner_set& c, int octave) const {
+        auto i = fast_floor(p.x());
+        auto j = fast_floor(p.y());
+        auto k = fast_floor(p.z());
+        c.u[octave] = static_cast<float>(p.x() - i);
+        c.v[octave] = static_cast<float>(p.y() - j);
+        c.w[octave] = static_cast<float>(p.z() - k);
+
+        // Six permutation lookups cover all eight corners
+        int px[2] = { perm_x[i & 255], perm_x[(i+1) & 255] };
+        int py[2] = { perm_y[j & 255], perm_y[(j+1) & 255] };
+        int pz[2] = { perm_z[k & 255], perm_z[(k+1) & 255] };
+
+        auto gx = c.x + octave*8, gy = c.y + octave*8, gz = c.z + octave*8;
+        for (int corner = 0; corner < 8; corner++) {
+            auto g = px[corner >> 2] ^ py[(corner >> 1) & 1] ^ pz[corner & 1];
+            gx[corner] = grad_x[g];
+            gy[corner] = grad_y[g];
+            gz[corner] = grad_z[g];
+        }
+    }
+
+    static int fast_floor(double x) {
+        // floor() is a library call unless the target has SSE4.1; truncate and correct instead
+        auto i = static_cast<int>(x);
+        return x < i ? i - 1 : i;
+    }
 
-    static int* perlin_generate_perm() {
-        auto p = new int[point_count];
+    static void evaluate(const corner_set& c, int octaves, float* out) {
+        // Hermite-smoothed trilinear blend of the corner gradients dotted with the offsets from
+        // each corner. The corner loop has a fixed trip count of 8 and no branches, so it is
+        // compiled to vector instructions.
+        static const float di[8] = { 0, 0, 0, 0, 1, 1, 1, 1 };
+        static const float dj[8] = { 0, 0, 1, 1, 0, 0, 1, 1 };
+        static const float dk[8] = { 0, 1, 0, 1, 0, 1, 0, 1 };
+
+        for (int o = 0; o < octaves; o++) {
+            float u = c.u[o], v = c.v[o], w = c.w[o];
+            float uu = u*u*(3-2*u);
+            float vv = v*v*(3-2*v);
+            float ww = w*w*(3-2*w);
+
+            auto gx = c.x + o*8, gy = c.y + o*8, gz = c.z + o*8;
+            float contribution[8];
+            for (int n = 0; n < 8; n++) {
+                float weight = (1 - uu + di[n]*(2*uu - 1))
+                             * (1 - vv + dj[n]*(2*vv - 1))
+                             * (1 - ww + dk[n]*(2*ww - 1));
+                contribution[n] = weight * (gx[n]*(u-di[n]) + gy[n]*(v-dj[n]) + gz[n]*(w-dk[n]));
+            }
+
+            out[o] = ((contribution[0] + contribution[1]) + (contribution[2] + contribution[3]))
+                   + ((contribution[4] + contribution[5]) + (contribution[6] + contribution[7]));
+        }
+    }
 
-        for (int i = 0; i < perlin::point_count; i++)
-            p[i] = i;
+    static void perlin_generate_perm(uint8_t* p) {
+        int values[point_count];
+        for (int i = 0; i < point_count; i++)
+            values[i] = i;
 
-        permute(p, point_count);
+        permute(values, point_count);
 
-        return p;
+        for (int i = 0; i < point_count; i++)
+            p[i] = static_cast<uint8_t>(values[i]);
     }
 
     static void permute(int* p, int n) {
@@ -89,25 +177,72 @@ class perlin {
             p[target] = tmp;
         }
     }
+};
 
-    static double trilinear_interp(vec3 c[2][2][2], double u, double v, double w) {
-        auto uu = u*u*(3-2*u);
-        auto vv = v*v*(3-2*v);
-        auto ww = w*w*(3-2*w);
-        auto accum = 0.0;
+/**
+ * @brief Turbulence of a perlin generator sampled once on a regular grid over a box and read
+ * back with trilinear interpolation. Meant for static scenes where the same region is shaded
+ * millions of times; the grid resolution bounds the finest detail that survives baking.
+ *
+ */
+class baked_turbulence {
+  public:
+    baked_turbulence(const perlin& noise, const aabb& bounds, int resolution, int depth=7)
+      : bounds(bounds), res(resolution > 1 ? resolution : 2)
+    {
+        values.resize(static_cast<size_t>(res) * res * res);
+        for (int k = 0; k < res; k++)
+            for (int j = 0; j < res; j++)
+                for (int i = 0; i < res; i++)
+                    values[index(i, j, k)] = static_cast<float>(noise.turb(grid_point(i, j, k), depth));
+    }
+
+    // Turbulence already sampled, res^3 values in x-fastest order
+    baked_turbulence(const aabb& bounds, int res, std::vector<float> values)
+      : bounds(bounds), res(res), values(std::move(values)) {}
 
-        for (int i=0; i < 2; i++)
-            for (int j=0; j < 2; j++)
-                for (int k=0; k < 2; k++) {
-                    vec3 weight_v(u-i, v-j, w-k);
-                    accum += lerp(1-uu, uu, i)
-                           * lerp(1-vv, vv, j)
-                           * lerp(1-ww, ww, k)
-                           * dot(c[i][j][k], weight_v);
-                }
+    bool contains(const point3& p) const {
+        return bounds.x.contains(p.x()) && bounds.y.contains(p.y()) && bounds.z.contains(p.z());
+    }
+
+    // Interpolated turbulence at p, which must lie inside the baked bounds
+    double turb(const point3& p) const {
+        auto gx = (p.x() - bounds.x.min) / bounds.x.size() * (res - 1);
+        auto gy = (p.y() - bounds.y.min) / bounds.y.size() * (res - 1);
+        auto gz = (p.z() - bounds.z.min) / bounds.z.size() * (res - 1);
+
+        auto i = std::min(static_cast<int>(gx), res - 2);
+        auto j = std::min(static_cast<int>(gy), res - 2);
+        auto k = std::min(static_cast<int>(gz), res - 2);
+        auto u = gx - i, v = gy - j, w = gz - k;
 
+        auto accum = 0.0;
+        for (int di = 0; di < 2; di++)
+            for (int dj = 0; dj < 2; dj++)
+                for (int dk = 0; dk < 2; dk++)
+                    accum += lerp(1-u, u, di) * lerp(1-v, v, dj) * lerp(1-w, w, dk)
+                           * values[index(i+di, j+dj, k+dk)];
         return accum;
     }
+
+    const aabb& get_bounds() const { return bounds; }
+    int get_res() const { return res; }
+    const std::vector<float>& get_values() const { return values; }
+
+  private:
+    aabb bounds;
+    int res;
+    std::vector<float> values;
+
+    size_t index(int i, int j, int k) const {
+        return (static_cast<size_t>(k) * res + j) * res + i;
+    }
+
+    point3 grid_point(int i, int j, int k) const {
+        return point3(bounds.x.min + bounds.x.size() * i / (res - 1),
+                      bounds.y.min + bounds.y.size() * j / (res - 1),
+                      bounds.z.min + bounds.z.size() * k / (res - 1));
+    }
 };
 
-#endif
\ No newline at end of file
+#endif
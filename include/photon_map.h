@@ -0,0 +1,337 @@
+#ifndef PHOTON_MAP_H
+#define PHOTON_MAP_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+#include "lights.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief A photon as stored in a photon_map: float position, power in Ward's shared exponent
+ * format and the direction it travelled along, octahedrally mapped to a byte per coordinate.
+ *
+ */
+struct photon {
+    float p[3];
+    uint8_t power[4];       // RGBE
+    uint8_t direction[2];   // Octahedral
+    uint8_t pad[2] = { 0, 0 };
+
+    photon() {}
+
+    photon(const point3& position, const color& c, const vec3& d) {
+        for (int a = 0; a < 3; a++) p[a] = static_cast<float>(position[a]);
+        encode_power(c);
+        encode_direction(unit_vector(d));
+    }
+
+    point3 position() const { return point3(p[0], p[1], p[2]); }
+
+    color get_power() const {
+        if (power[3] == 0) return color(0,0,0);
+        auto f = std::ldexp(1.0, power[3] - (128 + 8));
+        return color((power[0] + 0.5) * f, (power[1] + 0.5) * f, (power[2] + 0.5) * f);
+    }
+
+    vec3 get_direction() const {
+        auto u = direction[0] / 127.5 - 1, v = direction[1] / 127.5 - 1;
+        auto z = 1 - std::fabs(u) - std::fabs(v);
+        if (z < 0) {
+            auto fu = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+            auto fv = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+            u = fu;
+            v = fv;
+        }
+        return unit_vector(vec3(u, v, z));
+    }
+
+  private:
+    void encode_power(const color& c) {
+        auto largest = std::max(c.x(), std::max(c.y(), c.z()));
+        if (!(largest > 1e-32)) {
+            power[0] = power[1] = power[2] = power[3] = 0;
+            return;
+        }
+        int e;
+        auto scale = std::frexp(largest, &e) * 256 / largest;
+        for (int k = 0; k < 3; k++)
+            power[k] = static_cast<uint8_t>(std::min(std::max(c[k], 0.0) * scale, 255.0));
+        power[3] = static_cast<uint8_t>(std::clamp(e + 128, 1, 255));
+    }
+
+    void encode_direction(const vec3& d) {
+        auto l1 = std::fabs(d.x()) + std::fabs(d.y()) + std::fabs(d.z());
+        auto u = d.x() / l1, v = d.y() / l1;
+        if (d.z() < 0) {
+            auto fu = (1 - std::fabs(v)) * (u < 0 ? -1 : 1);
+            auto fv = (1 - std::fabs(u)) * (v < 0 ? -1 : 1);
+            u = fu;
+            v = fv;
+        }
+        direction[0] = static_cast<uint8_t>(std::lround((u + 1) * 127.5));
+        direction[1] = static_cast<uint8_t>(std::lround((v + 1) * 127.5));
+    }
+};
+
+static_assert(sizeof(photon) == 20, "photon should pack into 20 bytes");
+
+
+/**
+ * @brief Photons sorted by the cell of a hashed grid, so the photons of a cell are contiguous
+ * and a lookup reads a few short runs of memory. Cells are twice the lookup radius wide, so a
+ * sphere of that radius touches at most 2x2x2 of them.
+ *
+ */
+class photon_map {
+  public:
+    std::vector<photon> photons;
+
+    void build(double radius) {
+        cell_size = 2 * radius;
+        inv_cell_size = 1 / cell_size;
+        size_t table = 1;
+        while (table < 2 * photons.size()) table *= 2;
+        mask = table - 1;
+
+        std::vector<uint32_t> keys(photons.size());
+        start.assign(table + 1, 0);
+        for (size_t i = 0; i < photons.size(); i++) {
+            keys[i] = bucket(cell(photons[i].p[0]), cell(photons[i].p[1]), cell(photons[i].p[2]));
+            start[keys[i] + 1]++;
+        }
+        for (size_t b = 0; b < table; b++) start[b + 1] += start[b];
+
+        std::vector<photon> sorted(photons.size());
+        std::vector<uint32_t> next(start.begin(), start.end() - 1);
+        for (size_t i = 0; i < photons.size(); i++)
+            sorted[next[keys[i]]++] = photons[i];
+        photons.swap(sorted);
+    }
+
+    // Calls visit(photon, squared distance) for every photon within the radius given to build()
+    template <typename F>
+    void gather(const point3& x, const F& visit) const {
+        if (photons.empty()) return;
+        auto radius = cell_size / 2;
+        int base[3];
+        for (int a = 0; a < 3; a++) base[a] = cell(x[a] - radius);
+
+        // Distinct cells may share a bucket, which must only be read once
+        uint32_t visited[8];
+        int count = 0;
+        for (int dz = 0; dz < 2; dz++) {
+            for (int dy = 0; dy < 2; dy++) {
+                for (int dx = 0; dx < 2; dx++) {
+                    auto b = bucket(base[0] + dx, base[1] + dy, base[2] + dz);
+                    if (std::find(visited, visited + count, b) != visited + count) continue;
+                    visited[count++] = b;
+
+                    for (auto i = start[b]; i < start[b + 1]; i++) {
+                        const auto& ph = photons[i];
+                        auto d = ph.position() - x;
+                        auto distance_squared = d.length_squared();
+                        if (distance_squared <= radius * radius) visit(ph, distance_squared);
+                    }
+                }
+            }
+        }
+    }
+
+  private:
+    double cell_size = 1, inv_cell_size = 1;
+    size_t mask = 0;
+    std::vector<uint32_t> start;    // Photons of bucket b are [start[b], start[b+1])
+
+    int cell(double x) const { return static_cast<int>(std::floor(x * inv_cell_size)); }
+
+    uint32_t bucket(int x, int y, int z) const {
+        auto h = static_cast<uint32_t>(x) * 73856093u ^ static_cast<uint32_t>(y) * 19349663u
+               ^ static_cast<uint32_t>(z) * 83492791u;
+        return static_cast<uint32_t>(h & mask);
+    }
+};
+
+
+/**
+ * @brief Progressive photon mapping (Knaus and Zwicker 2011). Every pass shoots a fresh batch
+ * of photons from the lights of a light_list, keeping the ones that land on diffuse surfaces
+ * and in media, then traces one camera path per pixel through glass and mirrors to its first
+ * diffuse or volumetric vertex, where the radiance is estimated from the photons around it.
+ * Passes are independent and averaged, with a radius shrinking as r² ∝ pass^(alpha - 1): each
+ * pass is biased, and the bias vanishes faster than the noise grows.
+ *
+ * Surface photons are divided by the area of the lookup disc. A photon stored at a collision in
+ * a medium is divided by the extinction there, which makes the volume photons an estimate of
+ * the fluence rather than of the collision density, so media of different densities can share
+ * one map. Light from the background only reaches the image through specular chains.
+ *
+ */
+class photon_integrator {
+  public:
+    photon_integrator(const hittable& world, const light_list& lights, const color& background,
+                      const homogeneous_fog& fog, int max_depth)
+      : world(world), lights(lights), background(background), fog(fog), max_depth(max_depth) {}
+
+    double radius = 1;      // Of the current pass
+
+    /**
+     * @brief Replaces the photons with `count` new ones, shot from `threads` threads, and
+     * indexes them for lookups within `pass_radius`.
+     *
+     */
+    void shoot(size_t count, double pass_radius, int threads, stats_report* stats = nullptr) {
+        radius = pass_radius;
+        surface.photons.clear();
+        volume.photons.clear();
+
+        if (!lights.empty() && count > 0) {
+            threads = std::max(1, std::min<int>(threads, static_cast<int>(count)));
+            std::vector<std::vector<photon>> surface_part(threads), volume_part(threads);
+            std::vector<std::thread> workers;
+            for (int t = 0; t < threads; t++) {
+                workers.emplace_back([&, t] {
+                    stats_recorder recorder(stats);
+                    auto first = count * t / threads, last = count * (t + 1) / threads;
+                    for (auto i = first; i < last; i++)
+                        trace_photon(count, surface_part[t], volume_part[t]);
+                });
+            }
+            for (auto& worker : workers) worker.join();
+
+            for (int t = 0; t < threads; t++) {
+                surface.photons.insert(surface.photons.end(), surface_part[t].begin(), surface_part[t].end());
+                volume.photons.insert(volume.photons.end(), volume_part[t].begin(), volume_part[t].end());
+            }
+        }
+        surface.build(radius);
+        volume.build(radius);
+    }
+
+    size_t photon_count() const { return surface.photons.size() + volume.photons.size(); }
+
+    /**
+     * @brief Radiance along the camera ray r: emission and background picked up through glass and
+     * mirrors, then the photon estimate at the first vertex that scatters diffusely.
+     *
+     */
+    color radiance(ray r) const {
+        color L(0,0,0), beta(1,1,1);
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                auto phase = fog.albedo / (4*pi);
+                return L + beta * volume_estimate(r.at(t_fog), [&](const vec3&) { return phase; });
+            }
+            if (!hit_anything)
+                return L + beta * background;
+
+            L += beta * rec.mat->emitted(rec.u, rec.v, rec.p);
+            if (rec.mat->connectible()) {
+                auto f = [&](const vec3& to_light) { return rec.mat->scattering(rec, to_light); };
+                if (rec.mat->is_volumetric())
+                    return L + beta * volume_estimate(rec.p, f);
+                return L + beta * surface_estimate(rec.p, f);
+            }
+
+            color attenuation;
+            ray scattered;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return L;
+            scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+            beta = beta * attenuation;
+            r = scattered;
+        }
+        return L;
+    }
+
+  private:
+    const hittable& world;
+    const light_list& lights;
+    color background;
+    const homogeneous_fog& fog;
+    int max_depth;
+    photon_map surface, volume;
+
+    // Emits one of `count` photons and follows it, the way a BDPT light subpath is traced
+    void trace_photon(size_t count, std::vector<photon>& surface_out, std::vector<photon>& volume_out) const {
+        double pmf;
+        const auto& light = lights.pick(random_double(), pmf);
+        auto sample = light_list::sample(light, random_double());
+
+        // Cosine distributed about the normal of a random face, so the cosine cancels
+        auto normal = random_double() < 0.5 ? sample.normal : -sample.normal;
+        auto direction = normal + random_unit_vector();
+        if (direction.near_zero()) direction = normal;
+        auto power = sample.emitted * (2*pi * light.area / (pmf * count));
+        ray r(sample.p, direction, random_double());
+
+        for (int depth = 0; depth < max_depth; depth++) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                auto p = r.at(t_fog);
+                volume_out.emplace_back(p, power / fog.density, r.direction());
+                if (!survive(fog.albedo, power)) return;
+                r = ray(p, random_unit_vector(), r.time());
+                continue;
+            }
+            if (!hit_anything) return;
+
+            if (rec.mat->connectible()) {
+                if (rec.mat->is_volumetric()) {
+                    if (rec.density > 0) volume_out.emplace_back(rec.p, power / rec.density, r.direction());
+                } else {
+                    surface_out.emplace_back(rec.p, power, r.direction());
+                }
+            }
+
+            color attenuation;
+            ray scattered;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered)) return;
+            if (!rec.mat->connectible())
+                attenuation *= rec.mat->importance_scale(rec, scattered.direction());
+            if (!survive(attenuation, power)) return;
+            r = scattered;
+        }
+    }
+
+    // Russian roulette on the attenuation, keeping the power of surviving photons about level
+    static bool survive(const color& attenuation, color& power) {
+        auto q = std::min(1.0, std::max(attenuation.x(), std::max(attenuation.y(), attenuation.z())));
+        if (q <= 0 || random_double() >= q) return false;
+        power = power * attenuation / q;
+        return true;
+    }
+
+    template <typename F>
+    color surface_estimate(const point3& p, const F& f) const {
+        color sum(0,0,0);
+        surface.gather(p, [&](const photon& ph, double) { sum += f(-ph.get_direction()) * ph.get_power(); });
+        return sum / (pi * radius * radius);
+    }
+
+    template <typename F>
+    color volume_estimate(const point3& p, const F& f) const {
+        color sum(0,0,0);
+        volume.gather(p, [&](const photon& ph, double) { sum += f(-ph.get_direction()) * ph.get_power(); });
+        return sum / (4.0/3 * pi * radius * radius * radius);
+    }
+};
+
+#endif
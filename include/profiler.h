@@ -0,0 +1,145 @@
+#ifndef PROFILER_H
+#define PROFILER_H
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <iostream>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+#include <vector>
+
+/**
+ * @brief Wall-clock timings of named scopes on every thread, written as a Chrome trace that
+ * chrome://tracing and ui.perfetto.dev show as one timeline per thread, nested scopes stacked.
+ *
+ * Off until enable() is called. While off a profile_scope costs one relaxed atomic load, so
+ * scopes are placed around whole phases, rows and batches, never around single rays. Each
+ * thread appends to its own buffer, which the profiler owns, so threads never contend; the
+ * trace is written once all of them are done.
+ *
+ */
+class profiler {
+  public:
+    static profiler& global() {
+        static profiler instance;
+        return instance;
+    }
+
+    // Starts recording; the calling thread is named "main" in the trace
+    void enable() {
+        main_thread = std::this_thread::get_id();
+        origin = clock::now();
+        on.store(true, std::memory_order_release);
+    }
+
+    bool enabled() const { return on.load(std::memory_order_relaxed); }
+
+    // Nanoseconds since enable()
+    int64_t now() const {
+        return std::chrono::duration_cast<std::chrono::nanoseconds>(clock::now() - origin).count();
+    }
+
+    // Records a scope of the calling thread; `name` has to outlive the profiler
+    void record(const char* name, int64_t start, int64_t end, int64_t index) {
+        thread_local thread_buffer* buffer = nullptr;
+        if (!buffer) {
+            std::lock_guard<std::mutex> lock(mutex);
+            buffers.push_back(std::make_unique<thread_buffer>());
+            buffer = buffers.back().get();
+            buffer->id = static_cast<int>(buffers.size());
+            buffer->main = std::this_thread::get_id() == main_thread;
+        }
+        buffer->events.push_back({ name, start, end - start, index });
+    }
+
+    /**
+     * @brief Writes every recorded scope as a complete ("X") event of the JSON trace event
+     * format, with times in microseconds and the row or batch index, if any, as an argument.
+     * Returns false, after printing why, if the file can't be written. Not thread-safe with
+     * record().
+     *
+     */
+    bool write_chrome_trace(const std::string& filename) const {
+        auto file = fopen(filename.c_str(), "w");
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << filename << "'.\n";
+            return false;
+        }
+
+        size_t count = 0;
+        fprintf(file, "{\"displayTimeUnit\":\"ms\",\"traceEvents\":[\n");
+        for (const auto& buffer : buffers) {
+            auto name = buffer->main ? std::string("main") : "thread " + std::to_string(buffer->id);
+            fprintf(file, "%s{\"name\":\"thread_name\",\"ph\":\"M\",\"pid\":1,\"tid\":%d,"
+                          "\"args\":{\"name\":\"%s\"}}",
+                    count++ ? ",\n" : "", buffer->id, name.c_str());
+            for (const auto& e : buffer->events) {
+                fprintf(file, ",\n{\"name\":\"%s\",\"ph\":\"X\",\"pid\":1,\"tid\":%d,\"ts\":%.3f,\"dur\":%.3f",
+                        e.name, buffer->id, e.start / 1e3, e.duration / 1e3);
+                if (e.index >= 0) fprintf(file, ",\"args\":{\"index\":%lld}", static_cast<long long>(e.index));
+                fprintf(file, "}");
+                count++;
+            }
+        }
+        fprintf(file, "\n]}\n");
+
+        bool ok = !ferror(file);
+        ok = (fclose(file) == 0) && ok;
+        if (!ok) std::cerr << "ERROR: Could not write '" << filename << "'.\n";
+        else std::clog << "Wrote " << count - buffers.size() << " profile scopes to " << filename << "\n";
+        return ok;
+    }
+
+  private:
+    using clock = std::chrono::steady_clock;
+
+    struct event {
+        const char* name;
+        int64_t start, duration;    // Nanoseconds
+        int64_t index;              // Row, batch or pass, -1 for none
+    };
+
+    struct thread_buffer {
+        int id;
+        bool main;
+        std::vector<event> events;
+    };
+
+    std::atomic<bool> on{false};
+    clock::time_point origin = clock::now();
+    std::thread::id main_thread;
+    std::mutex mutex;
+    std::vector<std::unique_ptr<thread_buffer>> buffers;
+};
+
+
+/**
+ * @brief Times the rest of the enclosing block as a scope named `name` of the global profiler,
+ * if it is enabled. `index` tells rows, batches or passes of the same name apart.
+ *
+ */
+class profile_scope {
+  public:
+    explicit profile_scope(const char* name, int64_t index = -1)
+      : name(profiler::global().enabled() ? name : nullptr), index(index) {
+        if (this->name) start = profiler::global().now();
+    }
+
+    ~profile_scope() {
+        if (name) profiler::global().record(name, start, profiler::global().now(), index);
+    }
+
+    profile_scope(const profile_scope&) = delete;
+    profile_scope& operator=(const profile_scope&) = delete;
+
+  private:
+    const char* name;
+    int64_t index;
+    int64_t start = 0;
+};
+
+#endif
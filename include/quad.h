@@ -4,6 +4,7 @@
 #include "utils.h"
 #include "hittable.h"
 #include "hittable_list.h"
+#include "stats.h"
 
 class quad : public hittable {
     public:
@@ -15,6 +16,7 @@ class quad : public hittable {
                 normal = unit_vector(n);
                 D = dot(normal, Q);
                 w = n / dot(n, n);
+                inv_edge = 1 / sqrt(fmin(u.length_squared(), v.length_squared()));
             }
 
         aabb bounding_box() const override {
@@ -22,6 +24,7 @@ class quad : public hittable {
         }
 
         bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+            RT_STAT(quad_tests);
             // If ray is (near) parallel to the plane,
             auto denom = dot(r.direction(), normal);
             if (fabs(denom) < 1e-8) {
@@ -46,12 +49,50 @@ class quad : public hittable {
             // Intersection point falls inside the shape
             rec.t = t;
             rec.p = intersection;
+            rec.footprint = r.footprint(t) * inv_edge;
             rec.mat = mat;
+            rec.object = this;
             rec.set_face_normal(r, normal);
 
             return true;
         }
 
+        aabb clipped_box(int axis, double lo, double hi) const override {
+            // The shape is convex, so its part inside the slab is bounded by the corners inside
+            // the slab and the points where the edges cross the slab's planes
+            point3 corner[4];
+            auto count = corners(corner);
+            point3 min( infinity,  infinity,  infinity);
+            point3 max(-infinity, -infinity, -infinity);
+            auto add = [&](const point3& p) {
+                for (int c = 0; c < 3; c++) {
+                    min[c] = fmin(min[c], p[c]);
+                    max[c] = fmax(max[c], p[c]);
+                }
+            };
+
+            for (int i = 0; i < count; i++) {
+                const auto& a = corner[i];
+                const auto& b = corner[(i + 1) % count];
+                if (a[axis] >= lo && a[axis] <= hi) add(a);
+                for (auto plane : { lo, hi })
+                    if ((a[axis] < plane) != (b[axis] < plane))
+                        add(a + (plane - a[axis]) / (b[axis] - a[axis]) * (b - a));
+            }
+
+            if (min[0] > max[0]) return aabb::empty;
+            return aabb(min, max);
+        }
+
+        // Corners in order around the outline; returns how many there are
+        virtual int corners(point3* corner) const {
+            corner[0] = Q;
+            corner[1] = Q + u;
+            corner[2] = Q + u + v;
+            corner[3] = Q + v;
+            return 4;
+        }
+
         virtual void set_bounding_box() {
             auto bbox_diag1 = aabb(Q, Q + u + v);
             auto bbox_diag2 = aabb(Q + u, Q + v);
@@ -68,14 +109,25 @@ class quad : public hittable {
             return true;
         }
 
-    private:
+        const point3& get_Q() const { return Q; }
+        const vec3& get_u() const { return u; }
+        const vec3& get_v() const { return v; }
+        const vec3& get_w() const { return w; }
+        const vec3& get_normal() const { return normal; }
+        double get_inv_edge() const { return inv_edge; }
+        const shared_ptr<material>& get_material() const { return mat; }
+
+    protected:
         point3 Q;
         vec3 u, v;
+        aabb bbox;
+
+    private:
         vec3 w;                 // For basis factorization
         shared_ptr<material> mat;
-        aabb bbox;
         vec3 normal;            // Normal to the plane
         double D;               // Distance from the origin to the plane
+        double inv_edge;        // Inverse length of the shorter edge, maps widths to texture space
 };
 
 
@@ -0,0 +1,181 @@
+#ifndef RADIANCE_CACHE_H
+#define RADIANCE_CACHE_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+
+#include <algorithm>
+#include <atomic>
+#include <cmath>
+#include <cstdint>
+#include <memory>
+
+/**
+ * @brief World-space cache of the radiance arriving at diffuse surfaces, cosine weighted over
+ * the hemisphere, so that a white lambertian surface there would reflect the cell's mean.
+ *
+ * Cells are a hashed grid over position and the axis the normal mostly points along, so the
+ * two sides of a wall or the faces of a box corner don't share a cell. The table has a fixed
+ * size with linear probing; claiming and adding to cells is lock-free. A full table just stops
+ * caching new cells.
+ *
+ */
+class radiance_cache {
+  public:
+    struct cell {
+        std::atomic<uint64_t> key{0};
+        std::atomic<float> sum[3];
+        std::atomic<uint32_t> count{0};
+
+        cell() { for (auto& s : sum) s.store(0, std::memory_order_relaxed); }
+
+        color mean() const {
+            auto n = std::max<uint32_t>(count.load(std::memory_order_relaxed), 1);
+            return color(sum[0].load(std::memory_order_relaxed), sum[1].load(std::memory_order_relaxed),
+                         sum[2].load(std::memory_order_relaxed)) / n;
+        }
+
+        void add(const color& radiance) {
+            for (int c = 0; c < 3; c++) {
+                // A single firefly would stay in the cell for the rest of the render
+                auto value = static_cast<float>(std::min(radiance[c], 1e3));
+                auto current = sum[c].load(std::memory_order_relaxed);
+                while (!sum[c].compare_exchange_weak(current, current + value, std::memory_order_relaxed)) {}
+            }
+            count.fetch_add(1, std::memory_order_relaxed);
+        }
+    };
+
+    radiance_cache(double cell_size, size_t capacity = size_t(1) << 20)
+      : cell_size(cell_size), capacity(capacity), cells(new cell[capacity]) {}
+
+    /**
+     * @brief The cell for point `p` with unit normal `n`, or null if the table is full. The
+     * point is jittered by up to half a cell first, which blends neighbouring cells over many
+     * samples instead of showing their edges.
+     *
+     */
+    cell* find(const point3& p, const vec3& n) {
+        int64_t i[3];
+        for (int a = 0; a < 3; a++)
+            i[a] = static_cast<int64_t>(std::floor(p[a] / cell_size + random_double() - 0.5));
+
+        int axis = 0;
+        for (int a = 1; a < 3; a++)
+            if (std::fabs(n[a]) > std::fabs(n[axis])) axis = a;
+        auto orientation = static_cast<uint64_t>(2*axis + (n[axis] < 0));
+
+        // 0 marks an empty slot, so keys always have their top bit set
+        uint64_t key = orientation;
+        for (int a = 0; a < 3; a++)
+            key = (key ^ static_cast<uint64_t>(i[a])) * 0x9e3779b97f4a7c15ull;
+        key = (key ^ (key >> 29)) | (uint64_t(1) << 63);
+
+        for (size_t probe = 0, slot = key % capacity; probe < max_probes; probe++, slot = (slot + 1) % capacity) {
+            auto& c = cells[slot];
+            auto current = c.key.load(std::memory_order_acquire);
+            if (current == key) return &c;
+            if (current == 0) {
+                if (c.key.compare_exchange_strong(current, key, std::memory_order_acq_rel) || current == key)
+                    return &c;
+            }
+        }
+        return nullptr;
+    }
+
+  private:
+    static constexpr size_t max_probes = 16;
+
+    double cell_size;
+    size_t capacity;
+    std::unique_ptr<cell[]> cells;
+};
+
+
+/**
+ * @brief Path tracer that stops at the diffuse surface after `cache_bounces` diffuse bounces
+ * and takes the rest of the path from a radiance_cache. A cell with fewer than `min_samples`
+ * samples traces the rest of the path itself and adds it to the cell; a filled one still
+ * traces one now and then, less often the more samples it has, so cells keep refining over
+ * the render.
+ *
+ * The paths that fill cells end at the next diffuse surface in the cache again, so light
+ * bounces between cells instead of along full paths, and keeps bouncing past max_depth.
+ * Lower `cache_bounces` is faster and more biased: 0 would read the cache at the first surface
+ * the camera sees and show the cells.
+ *
+ */
+class cached_integrator {
+  public:
+    int min_samples = 16;
+
+    cached_integrator(const hittable& world, radiance_cache& cache, const color& background,
+                      const homogeneous_fog& fog, int max_depth, int cache_bounces)
+      : world(world), cache(cache), background(background), fog(fog), max_depth(max_depth),
+        cache_bounces(cache_bounces) {}
+
+    color sample(const ray& r) {
+        return trace(r, max_depth, 0);
+    }
+
+  private:
+    const hittable& world;
+    radiance_cache& cache;
+    color background;
+    const homogeneous_fog& fog;
+    int max_depth;
+    int cache_bounces;
+
+    color trace(ray r, int depth, int diffuse_bounces) {
+        color L(0,0,0), beta(1,1,1);
+        for (; depth > 0; depth--) {
+            hit_record rec;
+            bool hit_anything = world.hit(r, interval(0.001, infinity), rec);
+            RT_STAT(rays);
+
+            double t_fog;
+            if (fog.sample_distance(r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                ray scattered(r.at(t_fog), random_unit_vector(), r.time());
+                scattered.set_cone(r.footprint(t_fog), r.cone_spread());
+                beta = beta * fog.albedo;
+                r = scattered;
+                continue;
+            }
+            if (!hit_anything)
+                return L + beta * background;
+            L += beta * rec.mat->emitted(rec.u, rec.v, rec.p);
+
+            color attenuation;
+            ray scattered;
+            if (!rec.mat->scatter(r, rec, attenuation, scattered))
+                return L;
+            scattered.set_cone(r.footprint(rec.t), r.cone_spread());
+
+            bool diffuse = rec.mat->connectible() && !rec.mat->is_volumetric();
+            if (diffuse && diffuse_bounces >= cache_bounces) {
+                // Paths out of depth would add nothing but darkness to the cell
+                auto c = depth > 1 ? cache.find(rec.p, rec.normal) : nullptr;
+                auto count = c ? c->count.load(std::memory_order_relaxed) : 0;
+                if (c && count >= static_cast<uint32_t>(min_samples)) {
+                    if (random_double() * count < min_samples)
+                        c->add(trace(scattered, depth - 1, cache_bounces - 1));
+                    return L + beta * attenuation * c->mean();
+                }
+
+                auto incoming = trace(scattered, depth - 1, cache_bounces - 1);
+                if (c) c->add(incoming);
+                return L + beta * attenuation * incoming;
+            }
+
+            diffuse_bounces += diffuse;
+            beta = beta * attenuation;
+            r = scattered;
+        }
+        return L;
+    }
+};
+
+#endif
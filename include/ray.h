@@ -19,10 +19,26 @@ class ray {
         return orig + t*dir;
     }
 
+    /* Ray cone: an estimate of the footprint the ray stands for, used to filter textures */
+    double cone_width() const  { return width; }
+    double cone_spread() const { return spread; }
+
+    void set_cone(double cone_width, double cone_spread) {
+        width = cone_width;
+        spread = cone_spread;
+    }
+
+    double footprint(double t) const {
+        // World-space width of the cone at parameter t
+        return width + t * dir.length() * spread;
+    }
+
   private:
     point3 orig;
     vec3 dir;
     double tm;    // Time of ray
+    double width = 0;   // Cone width at the origin
+    double spread = 0;  // Cone width growth per unit distance (radians)
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,509 @@
+#ifndef RENDER_SERVER_H
+#define RENDER_SERVER_H
+
+#include "utils.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "scene_file.h"
+#include "snapshot.h"
+#include "texture_cache.h"
+
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <condition_variable>
+#include <csignal>
+#include <list>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <thread>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Settings of one render request. Unset values keep what the scene specifies.
+ *
+ * On the wire a job is one line, "render" followed by key=value words (no spaces in values):
+ *   scene=<path> width=<n> spp=<n> depth=<n> threads=<n> priority=<n>
+ *   region=<x>,<y>,<width>,<height> lookfrom=<x>,<y>,<z> lookat=<x>,<y>,<z> vfov=<degrees>
+ */
+struct render_request {
+    std::string scene;
+    int image_width = 0;
+    int samples_per_pixel = 0;
+    int max_depth = 0;
+    int threads = -1;
+    int priority = 0;               // Higher runs first; equal priorities run in arrival order
+    int region[4] = { 0, 0, 0, 0 };
+    bool has_lookfrom = false, has_lookat = false;
+    point3 lookfrom, lookat;
+    double vfov = 0;
+
+    void apply(camera& cam) const {
+        if (image_width > 0)        cam.image_width = image_width;
+        if (samples_per_pixel > 0)  cam.samples_per_pixel = samples_per_pixel;
+        if (max_depth > 0)          cam.max_depth = max_depth;
+        if (threads >= 0)           cam.threads = threads;
+        if (has_lookfrom)           cam.lookfrom = lookfrom;
+        if (has_lookat)             cam.lookat = lookat;
+        if (vfov > 0)               cam.vfov = vfov;
+        if (region[2] > 0 && region[3] > 0) {
+            cam.crop_x = region[0];
+            cam.crop_y = region[1];
+            cam.crop_width = region[2];
+            cam.crop_height = region[3];
+        }
+    }
+
+    std::string to_line() const {
+        std::ostringstream line;
+        line << "render scene=" << scene;
+        if (image_width > 0)        line << " width=" << image_width;
+        if (samples_per_pixel > 0)  line << " spp=" << samples_per_pixel;
+        if (max_depth > 0)          line << " depth=" << max_depth;
+        if (threads >= 0)           line << " threads=" << threads;
+        if (priority != 0)          line << " priority=" << priority;
+        if (region[2] > 0 && region[3] > 0)
+            line << " region=" << region[0] << ',' << region[1] << ',' << region[2] << ',' << region[3];
+        if (has_lookfrom)   line << " lookfrom=" << lookfrom.x() << ',' << lookfrom.y() << ',' << lookfrom.z();
+        if (has_lookat)     line << " lookat=" << lookat.x() << ',' << lookat.y() << ',' << lookat.z();
+        if (vfov > 0)       line << " vfov=" << vfov;
+        return line.str();
+    }
+
+    // Parses the words after "render". Returns false with a message on a malformed request.
+    bool parse(std::istream& words, std::string& error) {
+        std::string word;
+        while (words >> word) {
+            auto eq = word.find('=');
+            if (eq == std::string::npos) {
+                error = "expected key=value, got '" + word + "'";
+                return false;
+            }
+            auto key = word.substr(0, eq);
+            auto value = word.substr(eq + 1);
+
+            bool ok = true;
+            if      (key == "scene")    scene = value;
+            else if (key == "width")    ok = parse_numbers(value, &image_width, 1);
+            else if (key == "spp")      ok = parse_numbers(value, &samples_per_pixel, 1);
+            else if (key == "depth")    ok = parse_numbers(value, &max_depth, 1);
+            else if (key == "threads")  ok = parse_numbers(value, &threads, 1);
+            else if (key == "priority") ok = parse_numbers(value, &priority, 1);
+            else if (key == "region")   ok = parse_numbers(value, region, 4);
+            else if (key == "vfov")     ok = parse_numbers(value, &vfov, 1);
+            else if (key == "lookfrom") ok = has_lookfrom = parse_point(value, lookfrom);
+            else if (key == "lookat")   ok = has_lookat = parse_point(value, lookat);
+            else {
+                error = "unknown key '" + key + "'";
+                return false;
+            }
+
+            if (!ok) {
+                error = "bad value for '" + key + "'";
+                return false;
+            }
+        }
+
+        if (scene.empty()) {
+            error = "missing scene=";
+            return false;
+        }
+        return true;
+    }
+
+    // Reads `count` comma separated numbers
+    template <typename T>
+    static bool parse_numbers(const std::string& text, T* out, int count) {
+        std::istringstream in(text);
+        for (int i = 0; i < count; i++) {
+            char comma;
+            if (i > 0 && !(in >> comma && comma == ',')) return false;
+            if (!(in >> out[i])) return false;
+        }
+        return in.peek() == EOF;
+    }
+
+    static bool parse_point(const std::string& text, point3& p) {
+        double xyz[3];
+        if (!parse_numbers(text, xyz, 3)) return false;
+        p = point3(xyz[0], xyz[1], xyz[2]);
+        return true;
+    }
+};
+
+
+/**
+ * @brief Long-running renderer listening on a UNIX socket.
+ *
+ * Clients send one command per line and get text lines back on the same connection:
+ *
+ *   render <key=value ...>   ->  queued <job> <jobs ahead>
+ *                                started <job> <width> <height> <scene setup seconds>
+ *                                row <job> <y>, then one "r g b" line per pixel of that row
+ *                                done <job> <render seconds>       or  error <job> <message>
+ *   cancel <job>             ->  cancelled <job>                   or  error - <message>
+ *   status                   ->  status running <job or -> queued <count>
+ *
+ * Rows are streamed as they finish, so a client sees the image fill in while it renders. The
+ * wavefront, bdpt, photons and guided integrators finish every row at the end, so their jobs
+ * stream nothing until then and a cancel only takes effect once they are done. Jobs
+ * run one at a time, highest priority first, each using all render threads. Loaded scenes stay
+ * in memory (up to `scene_capacity`, least recently used dropped first) and are reused as long
+ * as the scene file is unchanged, and textures stay in the process-wide texture cache, so
+ * consecutive jobs on the same scene skip parsing, asset loading and BVH construction.
+ */
+class render_server {
+  public:
+    render_server(const std::string& socket_path, size_t scene_capacity = 8)
+      : socket_path(socket_path), scene_capacity(scene_capacity > 0 ? scene_capacity : 1) {}
+
+    /**
+     * @brief Serves until the process is killed. Returns false if the socket can't be opened.
+     *
+     */
+    bool run() {
+        signal(SIGPIPE, SIG_IGN);   // A client hanging up must not kill the server
+
+        int listener = socket(AF_UNIX, SOCK_STREAM, 0);
+        sockaddr_un address = {};
+        address.sun_family = AF_UNIX;
+        if (listener < 0 || socket_path.size() >= sizeof address.sun_path) {
+            std::cerr << "ERROR: Could not create socket '" << socket_path << "'.\n";
+            return false;
+        }
+        strcpy(address.sun_path, socket_path.c_str());
+        unlink(socket_path.c_str());
+        if (bind(listener, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0
+                || listen(listener, 16) != 0) {
+            std::cerr << "ERROR: Could not listen on '" << socket_path << "'.\n";
+            close(listener);
+            return false;
+        }
+        std::clog << "Listening on " << socket_path << '\n';
+
+        std::thread(&render_server::render_loop, this).detach();
+        while (true) {
+            int fd = accept(listener, nullptr, nullptr);
+            if (fd < 0) continue;
+            std::thread(&render_server::serve_client, this, make_shared<connection>(fd)).detach();
+        }
+    }
+
+  private:
+    /**
+     * @brief A client socket. Render threads and the reading thread all write to it, one line
+     * group at a time.
+     *
+     */
+    struct connection {
+        int fd;
+        std::mutex write_mutex;
+        std::atomic<bool> open{true};
+
+        explicit connection(int fd) : fd(fd) {}
+        ~connection() { close(fd); }
+
+        bool send_text(const std::string& text) {
+            std::lock_guard<std::mutex> lock(write_mutex);
+            size_t sent = 0;
+            while (open && sent < text.size()) {
+                auto n = ::send(fd, text.data() + sent, text.size() - sent, MSG_NOSIGNAL);
+                if (n <= 0) open = false;
+                else sent += static_cast<size_t>(n);
+            }
+            return open;
+        }
+    };
+
+    struct job {
+        int id;
+        render_request request;
+        shared_ptr<connection> client;
+        std::atomic<bool> cancelled{false};
+    };
+
+    struct cached_scene {
+        std::string path;
+        time_t mtime;
+        camera cam;
+        shared_ptr<hittable> world;
+    };
+
+    std::string socket_path;
+    size_t scene_capacity;
+
+    std::mutex queue_mutex;
+    std::condition_variable queue_changed;
+    std::vector<shared_ptr<job>> queue;
+    shared_ptr<job> running;
+    int next_id = 1;
+
+    std::list<cached_scene> scenes;     // Most recently used first; only the render thread uses it
+
+    void serve_client(shared_ptr<connection> client) {
+        std::string pending;
+        char buffer[4096];
+        while (client->open) {
+            auto n = recv(client->fd, buffer, sizeof buffer, 0);
+            if (n <= 0) break;
+            pending.append(buffer, static_cast<size_t>(n));
+
+            size_t newline;
+            while ((newline = pending.find('\n')) != std::string::npos) {
+                auto line = pending.substr(0, newline);
+                pending.erase(0, newline + 1);
+                handle_command(client, line);
+            }
+        }
+        // Jobs keep the connection alive until they have finished writing to it
+    }
+
+    void handle_command(const shared_ptr<connection>& client, const std::string& line) {
+        std::istringstream words(line);
+        std::string command;
+        words >> command;
+
+        if (command == "render") {
+            auto j = make_shared<job>();
+            j->client = client;
+            std::string error;
+            if (!j->request.parse(words, error)) {
+                client->send_text("error - " + error + "\n");
+                return;
+            }
+
+            size_t ahead;
+            {
+                std::lock_guard<std::mutex> lock(queue_mutex);
+                j->id = next_id++;
+                ahead = std::count_if(queue.begin(), queue.end(), [&](const shared_ptr<job>& other) {
+                    return other->request.priority >= j->request.priority;
+                }) + (running ? 1 : 0);
+                queue.push_back(j);
+            }
+            queue_changed.notify_one();
+            client->send_text("queued " + std::to_string(j->id) + " " + std::to_string(ahead) + "\n");
+        } else if (command == "cancel") {
+            int id = 0;
+            words >> id;
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            auto found = std::find_if(queue.begin(), queue.end(), [id](const shared_ptr<job>& j) { return j->id == id; });
+            if (found != queue.end()) {
+                (*found)->cancelled = true;
+                queue.erase(found);
+            } else if (running && running->id == id) {
+                running->cancelled = true;
+            } else {
+                client->send_text("error - no job " + std::to_string(id) + "\n");
+                return;
+            }
+            client->send_text("cancelled " + std::to_string(id) + "\n");
+        } else if (command == "status") {
+            std::lock_guard<std::mutex> lock(queue_mutex);
+            client->send_text("status running " + (running ? std::to_string(running->id) : std::string("-"))
+                              + " queued " + std::to_string(queue.size()) + "\n");
+        } else if (!command.empty()) {
+            client->send_text("error - unknown command '" + command + "'\n");
+        }
+    }
+
+    shared_ptr<job> next_job() {
+        std::unique_lock<std::mutex> lock(queue_mutex);
+        running = nullptr;
+        queue_changed.wait(lock, [this] { return !queue.empty(); });
+
+        // Highest priority, then lowest id. The queue is short, so a scan beats a heap here:
+        // cancel can remove from the middle.
+        auto best = std::min_element(queue.begin(), queue.end(), [](const shared_ptr<job>& a, const shared_ptr<job>& b) {
+            return a->request.priority != b->request.priority ? a->request.priority > b->request.priority
+                                                              : a->id < b->id;
+        });
+        running = *best;
+        queue.erase(best);
+        return running;
+    }
+
+    void render_loop() {
+        while (true) {
+            auto j = next_job();
+            auto id = std::to_string(j->id);
+            try {
+                render_job(*j, id);
+            } catch (const std::exception& e) {
+                j->client->send_text("error " + id + " " + e.what() + "\n");
+            }
+        }
+    }
+
+    void render_job(job& j, const std::string& id) {
+        auto setup_start = std::chrono::steady_clock::now();
+        const auto& scene = load_scene(j.request.scene);
+        auto setup = std::chrono::duration<double>(std::chrono::steady_clock::now() - setup_start).count();
+
+        auto cam = scene.cam;
+        j.request.apply(cam);
+
+        int x, y, width, height;
+        cam.crop_window(x, y, width, height);
+        j.client->send_text("started " + id + " " + std::to_string(width) + " " + std::to_string(height)
+                            + " " + std::to_string(setup) + "\n");
+
+        auto start = std::chrono::steady_clock::now();
+        std::vector<color> image;
+        cam.render(*scene.world, image, [&](int row) {
+            std::ostringstream out;
+            out << "row " << id << ' ' << row << '\n';
+            for (int i = 0; i < width; i++)
+                write_color(out, image[static_cast<size_t>(row) * width + i], cam.samples_per_pixel);
+
+            // A client that went away cancels its job
+            return j.client->send_text(out.str()) && !j.cancelled;
+        });
+        auto seconds = std::chrono::duration<double>(std::chrono::steady_clock::now() - start).count();
+
+        if (j.cancelled || !j.client->open)
+            j.client->send_text("error " + id + " cancelled\n");
+        else
+            j.client->send_text("done " + id + " " + std::to_string(seconds) + "\n");
+
+        std::clog << "Job " << id << " (" << j.request.scene << "): " << setup << " s setup, "
+                  << seconds << " s render" << (j.cancelled ? ", cancelled" : "") << '\n';
+    }
+
+    const cached_scene& load_scene(const std::string& path) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0)
+            throw std::runtime_error("Could not open scene file '" + path + "'");
+
+        // Included files aren't tracked; touch the main file to force a reload after editing them.
+        // Textures are checked by texture_cache::load on every reload.
+        for (auto it = scenes.begin(); it != scenes.end(); ++it) {
+            if (it->path != path) continue;
+            if (it->mtime == st.st_mtime) {
+                scenes.splice(scenes.begin(), scenes, it);
+                return scenes.front();
+            }
+            scenes.erase(it);
+            break;
+        }
+
+        cached_scene entry;
+        entry.path = path;
+        entry.mtime = st.st_mtime;
+        if (path.size() > 5 && path.compare(path.size() - 5, 5, ".rtws") == 0) {
+            entry.world = scene_snapshot::load(path, entry.cam);
+        } else {
+            scene_file loaded(path);
+            entry.cam = loaded.cam;
+            entry.world = make_shared<hittable_list>(loaded.world);
+        }
+
+        scenes.push_front(entry);
+        while (scenes.size() > scene_capacity)
+            scenes.pop_back();
+
+        // Close the textures that only the scenes dropped above used
+        texture_cache::global().release_unused();
+        return scenes.front();
+    }
+};
+
+
+/**
+ * @brief Submits a request to a render server and writes the finished image to `out` as a ppm.
+ * Progress goes to std::clog. Returns false if the server can't be reached or the job fails.
+ *
+ */
+inline bool submit_render(const std::string& socket_path, const render_request& request, std::ostream& out) {
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    sockaddr_un address = {};
+    address.sun_family = AF_UNIX;
+    if (fd < 0 || socket_path.size() >= sizeof address.sun_path) {
+        std::cerr << "ERROR: Could not create socket.\n";
+        return false;
+    }
+    strcpy(address.sun_path, socket_path.c_str());
+    if (connect(fd, reinterpret_cast<sockaddr*>(&address), sizeof address) != 0) {
+        std::cerr << "ERROR: Could not connect to render server at '" << socket_path << "'.\n";
+        close(fd);
+        return false;
+    }
+
+    auto line = request.to_line() + "\n";
+    if (send(fd, line.data(), line.size(), MSG_NOSIGNAL) != static_cast<ssize_t>(line.size())) {
+        close(fd);
+        return false;
+    }
+
+    // Read the reply line by line; rows arrive in whatever order the render threads finish them
+    std::string pending;
+    char buffer[65536];
+    int width = 0, height = 0, rows_received = 0;
+    std::vector<std::string> rows;
+    int current_row = -1, pixels_left = 0;      // Row whose pixel lines are being read
+    bool ok = false, finished = false;
+
+    while (!finished) {
+        auto n = recv(fd, buffer, sizeof buffer, 0);
+        if (n <= 0) break;
+        pending.append(buffer, static_cast<size_t>(n));
+
+        size_t start = 0, newline;
+        while (!finished && (newline = pending.find('\n', start)) != std::string::npos) {
+            auto text = pending.substr(start, newline - start);
+            start = newline + 1;
+
+            if (current_row >= 0) {
+                rows[current_row] += text + "\n";
+                if (--pixels_left == 0) current_row = -1;
+                continue;
+            }
+
+            std::istringstream words(text);
+            std::string kind, id;
+            words >> kind >> id;
+            if (kind == "started") {
+                double setup;
+                words >> width >> height >> setup;
+                if (width <= 0 || height <= 0) break;
+                rows.assign(height, std::string());
+                std::clog << "Job " << id << " started, " << width << 'x' << height
+                          << ", scene setup " << setup << " s\n";
+            } else if (kind == "row") {
+                int row = -1;
+                words >> row;
+                if (row < 0 || row >= height) break;
+                current_row = row;
+                pixels_left = width;
+                std::clog << "\rRows remaining: " << (height - ++rows_received) << ' ' << std::flush;
+            } else if (kind == "done") {
+                std::clog << "\rDone.                 \n";
+                ok = finished = true;
+            } else if (kind == "error") {
+                std::string message;
+                std::getline(words, message);
+                std::cerr << "ERROR: Render server:" << message << '\n';
+                finished = true;
+            } else if (kind == "queued") {
+                std::clog << "Job " << id << " queued\n";
+            }
+        }
+        pending.erase(0, start);
+    }
+    close(fd);
+
+    if (!ok) return false;
+    out << "P3\n" << width << ' ' << rows.size() << "\n255\n";
+    for (const auto& row : rows)
+        out << row;
+    return true;
+}
+
+#endif
@@ -10,67 +10,238 @@
 #define STBI_FAILURE_USERMSG
 #include "external/stb_image.h"
 
+#include "utils.h"
+#include "color.h"
+
+#include <algorithm>
+#include <cmath>
 #include <cstdlib>
+#include <fstream>
 #include <iostream>
+#include <utility>
+#include <vector>
+
+struct texel {
+    float r, g, b;
+};
+
+/**
+ * @brief Source of tiles for an image whose pyramid is not held in memory, see texture_cache.
+ *
+ */
+class tile_provider {
+  public:
+    virtual ~tile_provider() = default;
 
+    // Returns the tile_size x tile_size texels of the given tile of a mip level. The pointer
+    // stays valid until the calling thread's next call.
+    virtual const texel* tile(int level, size_t tile_index) const = 0;
+};
+
+/**
+ * @brief Image loaded into a mip pyramid of linear float texels. Every level is stored in
+ * square tiles of tile_size x tile_size texels so that filtered lookups touch one or two
+ * cache-resident tiles instead of rows that are a whole image width apart.
+ *
+ */
 class rtw_image {
   public:
-    rtw_image() : data(nullptr) {}
+    static constexpr int tile_size = 8;
+    static constexpr int texels_per_tile = tile_size * tile_size;
+
+    rtw_image(bool srgb_decode = false) : srgb_decode(srgb_decode) {}
+
+    rtw_image(const char* image_filename, bool srgb_decode = false) : srgb_decode(srgb_decode) {
+        auto path = find_file(image_filename);
+        if (path.empty() || !load(path))
+            std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
+    }
 
-    rtw_image(const char* image_filename) {
-        // Loads image data from the specified file. If the RTW_IMAGES environment variable is
-        // defined, looks only in that directory for the image file. If the image was not found,
-        // searches for the specified image file first from the current directory, then in the
-        // images/ subdirectory, then the _parent's_ images/ subdirectory, and then _that_
-        // parent, on so on, for six levels up. If the image was not loaded successfully,
-        // width() and height() will return 0.
+    static std::string find_file(const char* image_filename) {
+        // Returns the path of the specified image file, or an empty string if it can't be found.
+        // If the RTW_IMAGES environment variable is defined, looks first in that directory for
+        // the image file. If the image was not found, searches for the specified image file
+        // first from the current directory, then in the images/ subdirectory, then the
+        // _parent's_ images/ subdirectory, and then _that_ parent, on so on, for six levels up.
 
         auto filename = std::string(image_filename);
         auto imagedir = getenv("RTW_IMAGES");
 
+        std::vector<std::string> candidates;
+        if (imagedir) candidates.push_back(std::string(imagedir) + "/" + filename);
+        candidates.push_back(filename);
+        std::string prefix = "images/";
+        for (int up = 0; up < 7; up++, prefix = "../" + prefix)
+            candidates.push_back(prefix + filename);
+
         // Hunt for the image file in some likely locations.
-        if (imagedir && load(std::string(imagedir) + "/" + image_filename)) return;
-        if (load(filename)) return;
-        if (load("images/" + filename)) return;
-        if (load("../images/" + filename)) return;
-        if (load("../../images/" + filename)) return;
-        if (load("../../../images/" + filename)) return;
-        if (load("../../../../images/" + filename)) return;
-        if (load("../../../../../images/" + filename)) return;
-        if (load("../../../../../../images/" + filename)) return;
-
-        std::cerr << "ERROR: Could not load image file '" << image_filename << "'.\n";
-    }
+        for (const auto& candidate : candidates)
+            if (std::ifstream(candidate).good()) return candidate;
 
-    ~rtw_image() { STBI_FREE(data); }
+        return "";
+    }
 
     bool load(const std::string filename) {
-        // Loads image data from the given file name. Returns true if the load succeeded.
+        // Loads image data from the given file name and builds its mip pyramid. Returns true if
+        // the load succeeded.
+        int w, h;
         auto n = bytes_per_pixel; // Dummy out parameter: original components per pixel
-        data = stbi_load(filename.c_str(), &image_width, &image_height, &n, bytes_per_pixel);
-        bytes_per_scanline = image_width * bytes_per_pixel;
-        return data != nullptr;
+        auto data = stbi_load(filename.c_str(), &w, &h, &n, bytes_per_pixel);
+        if (data == nullptr) return false;
+
+        build_pyramid(data, w, h);
+        STBI_FREE(data);
+        return true;
     }
 
-    int width()  const { return (data == nullptr) ? 0 : image_width; }
-    int height() const { return (data == nullptr) ? 0 : image_height; }
+    int width()  const { return levels.empty() ? 0 : levels[0].width; }
+    int height() const { return levels.empty() ? 0 : levels[0].height; }
+    int level_count() const { return static_cast<int>(levels.size()); }
 
-    const unsigned char* pixel_data(int x, int y) const {
-        // Return the address of the three bytes of the pixel at x,y (or magenta if no data).
-        static unsigned char magenta[] = { 255, 0, 255 };
-        if (data == nullptr) return magenta;
+    texel fetch(int level, int x, int y) const {
+        // Return the texel at x,y of the given mip level, clamping x,y to the level extent.
+        const auto& l = levels[level];
+        x = clamp(x, 0, l.width);
+        y = clamp(y, 0, l.height);
+        auto index = tiled_index(l, x, y);
 
-        x = clamp(x, 0, image_width);
-        y = clamp(y, 0, image_height);
+        if (!pager) return l.texels[index];
+        return pager->tile(level, index / texels_per_tile)[index % texels_per_tile];
+    }
 
-        return data + y*bytes_per_scanline + x*bytes_per_pixel;
+    /**
+     * @brief Bilinearly filtered lookup of one mip level. s,t are image coordinates in [0,1]
+     * with t=0 at the top row.
+     *
+     */
+    color bilinear(int level, double s, double t) const {
+        const auto& l = levels[level];
+        auto x = s * l.width - 0.5;
+        auto y = t * l.height - 0.5;
+        auto x0 = static_cast<int>(std::floor(x));
+        auto y0 = static_cast<int>(std::floor(y));
+        auto fx = x - x0;
+        auto fy = y - y0;
+
+        auto mix = [&](const texel& a, const texel& b, double f) {
+            return color((1-f)*a.r + f*b.r, (1-f)*a.g + f*b.g, (1-f)*a.b + f*b.b);
+        };
+
+        auto top    = mix(fetch(level, x0, y0),   fetch(level, x0+1, y0),   fx);
+        auto bottom = mix(fetch(level, x0, y0+1), fetch(level, x0+1, y0+1), fx);
+        return lerp(top, bottom, fy);
+    }
+
+    /**
+     * @brief Trilinearly filtered lookup. `width` is the footprint of the lookup in [0,1] image
+     * coordinates; it selects the pair of mip levels whose texel size brackets it.
+     *
+     */
+    color trilinear(double s, double t, double width) const {
+        auto texels_covered = width * std::max(width_at(0), height_at(0));
+        if (!(texels_covered > 1))
+            return bilinear(0, s, t);
+
+        auto level = std::log2(texels_covered);
+        auto last = level_count() - 1;
+        if (level >= last)
+            return bilinear(last, s, t);
+
+        auto l0 = static_cast<int>(level);
+        return lerp(bilinear(l0, s, t), bilinear(l0+1, s, t), level - l0);
     }
 
   private:
+    friend class texture_cache;     // Writes pyramids to disk and pages them back in
+
+    struct mip_level {
+        int width, height;
+        int tiles_x;                // Tiles per row
+        std::vector<texel> texels;  // Tile-major, row-major inside each tile; empty when paged
+    };
+
     const int bytes_per_pixel = 3;
-    unsigned char *data;
-    int image_width, image_height;
-    int bytes_per_scanline;
+    bool srgb_decode = false;       // Convert 8-bit sRGB to linear instead of plain x/255
+    std::vector<mip_level> levels;
+    shared_ptr<tile_provider> pager;    // When set, texels are fetched through it
+
+    int width_at(int level) const  { return levels[level].width; }
+    int height_at(int level) const { return levels[level].height; }
+
+    static size_t tiled_index(const mip_level& l, int x, int y) {
+        auto tile = static_cast<size_t>(y / tile_size) * l.tiles_x + (x / tile_size);
+        return tile * tile_size * tile_size + (y % tile_size) * tile_size + (x % tile_size);
+    }
+
+    static mip_level make_level(int w, int h) {
+        mip_level l;
+        l.width = w;
+        l.height = h;
+        l.tiles_x = (w + tile_size - 1) / tile_size;
+        auto tiles_y = (h + tile_size - 1) / tile_size;
+        l.texels.resize(static_cast<size_t>(l.tiles_x) * tiles_y * tile_size * tile_size);
+        return l;
+    }
+
+    float decode(unsigned char c) const {
+        auto x = c / 255.0f;
+        if (!srgb_decode) return x;
+        return x <= 0.04045f ? x / 12.92f : std::pow((x + 0.055f) / 1.055f, 2.4f);
+    }
+
+    void build_pyramid(const unsigned char* data, int w, int h) {
+        levels.clear();
+
+        // Level 0 is the converted source image
+        auto base = make_level(w, h);
+        for (int y = 0; y < h; y++) {
+            for (int x = 0; x < w; x++) {
+                auto p = data + (static_cast<size_t>(y)*w + x) * bytes_per_pixel;
+                base.texels[tiled_index(base, x, y)] = { decode(p[0]), decode(p[1]), decode(p[2]) };
+            }
+        }
+        levels.push_back(std::move(base));
+
+        // Each further level box-filters the previous one, down to 1x1. Odd sizes don't halve
+        // evenly: a texel then averages the source area it covers, weighting the texels cut by
+        // its edges by the part it covers, so the last row and column still contribute.
+        while (levels.back().width > 1 || levels.back().height > 1) {
+            int src = level_count() - 1;
+            auto next = make_level(std::max(1, width_at(src) / 2), std::max(1, height_at(src) / 2));
+            auto taps_x = box_taps(width_at(src), next.width);
+            auto taps_y = box_taps(height_at(src), next.height);
+
+            for (int y = 0; y < next.height; y++) {
+                for (int x = 0; x < next.width; x++) {
+                    texel sum = { 0, 0, 0 };
+                    for (const auto& [sy, wy] : taps_y[y]) {
+                        for (const auto& [sx, wx] : taps_x[x]) {
+                            auto t = fetch(src, sx, sy);
+                            auto w = wx * wy;
+                            sum.r += w * t.r; sum.g += w * t.g; sum.b += w * t.b;
+                        }
+                    }
+                    next.texels[tiled_index(next, x, y)] = sum;
+                }
+            }
+            levels.push_back(std::move(next));
+        }
+    }
+
+    static std::vector<std::vector<std::pair<int, float>>> box_taps(int src_size, int dst_size) {
+        // For each texel of a row (or column) of dst_size texels, the source texels under it and
+        // the normalized share of it each one covers; two halves when src_size is even.
+        std::vector<std::vector<std::pair<int, float>>> taps(dst_size);
+        auto ratio = static_cast<double>(src_size) / dst_size;
+        for (int i = 0; i < dst_size; i++) {
+            auto a = i * ratio, b = (i + 1) * ratio;
+            for (int s = static_cast<int>(a); s < src_size && s < b; s++) {
+                auto covered = std::min<double>(b, s + 1) - std::max<double>(a, s);
+                if (covered > 1e-9) taps[i].push_back({ s, static_cast<float>(covered / ratio) });
+            }
+        }
+        return taps;
+    }
 
     static int clamp(int x, int low, int high) {
         // Return the value clamped to the range [low, high).
@@ -0,0 +1,668 @@
+#ifndef SCENE_FILE_H
+#define SCENE_FILE_H
+
+#include "utils.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "compressed_bvh.h"
+#include "sphere.h"
+#include "quad.h"
+#include "mesh.h"
+#include "texture.h"
+#include "material.h"
+#include "constant_medium.h"
+#include "grid_medium.h"
+#include "animation.h"
+
+#include <cctype>
+#include <cerrno>
+#include <fstream>
+#include <future>
+#include <sstream>
+#include <stdexcept>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Loads a scene (camera plus world) from a text file.
+ *
+ * The format is a free-form sequence of whitespace separated words; line breaks carry no
+ * meaning, `#` starts a comment and strings with spaces go in double quotes. Statements:
+ *
+ *   include "other.scene"                  Splices another file in at this point
+ *   camera { width 400 spp 100 ... }       Camera settings, see parse_camera()
+ *   fog { density .0001 radius 5000 }      Global fog, see homogeneous_fog
+ *   texture <name> <type> { ... }          solid, checker, image, noise, perlin
+ *   material <name> <type> { ... }         lambertian, metal, dielectric, diffuse_light, isotropic
+ *   define <name> <object>                 Builds an object without adding it to the world
+ *   <object>                               Adds an object to the world
+ *   animation { frames 48 fps 24 ... }     Frame sequence settings, see parse_animation()
+ *   animated { <object> key 0 ... }        Adds an object moved by keyframes, see parse_animated()
+ *
+ * Objects are sphere, quad, triangle, box, mesh, constant_medium, grid_medium, group and
+ * instance, each followed by a { } block of attributes. Every object block also takes
+ * `rotate_y <degrees>` and `translate <x y z>`, applied in that order. Vectors and colors are
+ * three numbers. Wherever a texture is expected, three numbers make a solid color instead.
+ *
+ * Animated objects sit in their own BVH, refit every frame; everything else is built into one
+ * static BVH that all frames share. The world, meshes, groups and the contents of animated
+ * objects are built with bvh_builder, by the method in the bvh_build_options given; objects
+ * moving within a frame's shutter interval are bounded at each ray's time, see motion_bvh.
+ * With options.compressed they are built as compressed_bvh instead, unless the scene asks for
+ * more than one motion segment.
+ *
+ * Relative paths are looked up next to the file that names them first, then from the working
+ * directory. Images and meshes are loaded in parallel before the scene is built.
+ *
+ * Any error throws std::runtime_error naming the file and line.
+ */
+class scene_file {
+  public:
+    camera cam;
+    hittable_list world;
+    animation_sequence animation;
+
+    bvh_build_stats bvh_stats;      // Summed over every BVH built for the scene
+
+    explicit scene_file(const std::string& filename, const bvh_build_options& bvh = {})
+      : bvh_options(bvh)
+    {
+        profile_scope scope("parse scene");
+        tokenize(filename, 0);
+        start_asset_loads();
+
+        while (pos < tokens.size())
+            statement();
+
+        // Wait for loads that were never referenced so their errors still surface
+        for (auto& load : image_loads) load.wait();
+
+        if (!world.objects.empty())
+            world = hittable_list(build_bvh(world.objects, animation.motion_segments));
+        if (auto moving = animation.finish())
+            world.add(moving);
+    }
+
+  private:
+    struct token {
+        std::string text;
+        bool quoted;
+        int file;       // Index into files
+        int line;
+    };
+
+    bvh_build_options bvh_options;
+
+    std::vector<std::string> files;
+    std::vector<token> tokens;
+    size_t pos = 0;
+
+    std::unordered_map<std::string, shared_ptr<texture>> textures;
+    std::unordered_map<std::string, shared_ptr<material>> materials;
+    std::unordered_map<std::string, shared_ptr<hittable>> objects;
+
+    std::vector<std::future<void>> image_loads;
+    std::unordered_map<std::string, std::shared_future<shared_ptr<mesh_data>>> mesh_loads;
+
+    /* Tokenizer */
+
+    static std::string directory_of(const std::string& path) {
+        auto slash = path.find_last_of('/');
+        return slash == std::string::npos ? "" : path.substr(0, slash + 1);
+    }
+
+    static bool file_exists(const std::string& path) {
+        return std::ifstream(path).good();
+    }
+
+    // Resolves a path written in the file that `t` comes from
+    std::string resolve(const token& t) const {
+        if (t.text.empty() || t.text[0] == '/') return t.text;
+        auto local = directory_of(files[t.file]) + t.text;
+        return file_exists(local) ? local : t.text;
+    }
+
+    void tokenize(const std::string& filename, int depth) {
+        std::ifstream in(filename, std::ios::binary);
+        if (!in)
+            throw std::runtime_error("Could not open scene file '" + filename + "'");
+
+        std::stringstream buffer;
+        buffer << in.rdbuf();
+        auto text = buffer.str();
+
+        auto file = static_cast<int>(files.size());
+        files.push_back(filename);
+
+        int line = 1;
+        size_t i = 0, n = text.size();
+        while (i < n) {
+            auto c = text[i];
+            if (c == '\n') {
+                line++; i++;
+            } else if (isspace(static_cast<unsigned char>(c))) {
+                i++;
+            } else if (c == '#') {
+                while (i < n && text[i] != '\n') i++;
+            } else if (c == '"') {
+                auto end = text.find('"', i + 1);
+                if (end == std::string::npos)
+                    throw std::runtime_error(filename + ":" + std::to_string(line) + ": unterminated string");
+                tokens.push_back({ text.substr(i + 1, end - i - 1), true, file, line });
+                line += static_cast<int>(std::count(text.begin() + i, text.begin() + end, '\n'));
+                i = end + 1;
+            } else if (c == '{' || c == '}') {
+                tokens.push_back({ std::string(1, c), false, file, line });
+                i++;
+            } else {
+                auto start = i;
+                while (i < n && !isspace(static_cast<unsigned char>(text[i]))
+                       && text[i] != '{' && text[i] != '}' && text[i] != '#' && text[i] != '"')
+                    i++;
+                tokens.push_back({ text.substr(start, i - start), false, file, line });
+            }
+
+            // Splice included files in place of the include statement
+            auto count = tokens.size();
+            if (count >= 2 && tokens[count-1].quoted && !tokens[count-2].quoted
+                    && tokens[count-2].text == "include") {
+                auto path = resolve(tokens[count-1]);
+                if (depth >= 16)
+                    throw std::runtime_error(filename + ":" + std::to_string(line) + ": includes nested too deeply");
+                tokens.resize(count - 2);
+                tokenize(path, depth + 1);
+            }
+        }
+    }
+
+    /**
+     * @brief Scans the tokens for image textures and meshes and starts loading them all on
+     * worker threads, so decoding overlaps with parsing and with each other.
+     *
+     */
+    void start_asset_loads() {
+        std::vector<std::string> blocks;        // Word before each open {
+        std::string file;
+        bool srgb = false;
+
+        for (size_t i = 0; i < tokens.size(); i++) {
+            const auto& t = tokens[i];
+            if (t.quoted) continue;
+
+            if (t.text == "{") {
+                blocks.push_back(i > 0 ? tokens[i-1].text : "");
+                file.clear();
+                srgb = false;
+            } else if (t.text == "}" && !blocks.empty()) {
+                if (!file.empty() && blocks.back() == "image") {
+                    image_loads.push_back(std::async(std::launch::async, [file, srgb] {
+                        texture_cache::global().load(file.c_str(), srgb);
+                    }));
+                } else if (!file.empty() && blocks.back() == "mesh" && !mesh_loads.count(file)) {
+                    mesh_loads[file] = std::async(std::launch::async, [file] {
+                        auto mesh = make_shared<mesh_data>();
+                        if (!load_obj(file, *mesh))
+                            std::cerr << "ERROR: Could not load mesh file '" << file << "'.\n";
+                        return mesh;
+                    }).share();
+                }
+                blocks.pop_back();
+                file.clear();
+            } else if (t.text == "file" && i + 1 < tokens.size()) {
+                file = resolve(tokens[i+1]);
+            } else if (t.text == "srgb" && i + 1 < tokens.size()) {
+                srgb = tokens[i+1].text == "true";
+            }
+        }
+    }
+
+    /* Token access */
+
+    [[noreturn]] void error(const std::string& message) const {
+        const auto& t = tokens[pos < tokens.size() ? pos : tokens.size() - 1];
+        throw std::runtime_error(files[t.file] + ":" + std::to_string(t.line) + ": " + message);
+    }
+
+    const token& next() {
+        if (pos >= tokens.size()) {
+            if (tokens.empty()) throw std::runtime_error("empty scene file");
+            error("unexpected end of file");
+        }
+        return tokens[pos++];
+    }
+
+    bool peek(const char* text) const {
+        return pos < tokens.size() && !tokens[pos].quoted && tokens[pos].text == text;
+    }
+
+    bool peek_number() const {
+        if (pos >= tokens.size() || tokens[pos].quoted) return false;
+        auto c = tokens[pos].text[0];
+        return isdigit(static_cast<unsigned char>(c)) || c == '-' || c == '+' || c == '.';
+    }
+
+    void expect(const char* text) {
+        if (!peek(text)) error(std::string("expected '") + text + "'");
+        pos++;
+    }
+
+    // True at the closing brace of a block, which is consumed
+    bool block_end() {
+        if (peek("}")) { pos++; return true; }
+        if (pos >= tokens.size()) error("missing '}'");
+        return false;
+    }
+
+    std::string word() { return next().text; }
+
+    double number() {
+        const auto& t = next();
+        char* end;
+        errno = 0;
+        auto value = strtod(t.text.c_str(), &end);
+        if (t.quoted || t.text.empty() || *end != '\0' || errno == ERANGE) {
+            pos--;
+            error("expected a number, got '" + t.text + "'");
+        }
+        return value;
+    }
+
+    int integer() {
+        auto value = number();
+        if (value != static_cast<int>(value)) {
+            pos--;
+            error("expected an integer");
+        }
+        return static_cast<int>(value);
+    }
+
+    bool boolean() {
+        auto value = word();
+        if (value == "true") return true;
+        if (value == "false") return false;
+        pos--;
+        error("expected true or false");
+    }
+
+    vec3 vector() {
+        auto x = number();
+        auto y = number();
+        auto z = number();
+        return vec3(x, y, z);
+    }
+
+    [[noreturn]] void unknown(const std::string& what, const std::string& key) {
+        pos--;
+        error("unknown " + what + " attribute '" + key + "'");
+    }
+
+    /* Statements */
+
+    void statement() {
+        auto kind = word();
+        if (kind == "camera") {
+            parse_camera();
+        } else if (kind == "fog") {
+            parse_fog();
+        } else if (kind == "texture") {
+            auto name = word();
+            textures[name] = parse_texture_block(word());
+        } else if (kind == "material") {
+            auto name = word();
+            materials[name] = parse_material(word());
+        } else if (kind == "define") {
+            auto name = word();
+            objects[name] = parse_object(word());
+        } else if (kind == "animation") {
+            parse_animation();
+        } else if (kind == "animated") {
+            animation.objects.push_back(parse_animated());
+        } else {
+            world.add(parse_object(kind));
+        }
+    }
+
+    void parse_camera() {
+        expect("{");
+        while (!block_end()) {
+            auto key = word();
+            if      (key == "aspect")           cam.aspect_ratio = number();
+            else if (key == "width")            cam.image_width = integer();
+            else if (key == "spp")              cam.samples_per_pixel = integer();
+            else if (key == "depth")            cam.max_depth = integer();
+            else if (key == "background")       cam.background = vector();
+            else if (key == "vfov")             cam.vfov = number();
+            else if (key == "lookfrom")         cam.lookfrom = vector();
+            else if (key == "lookat")           cam.lookat = vector();
+            else if (key == "vup")              cam.vup = vector();
+            else if (key == "defocus_angle")    cam.defocus_angle = number();
+            else if (key == "focus_dist")       cam.focus_dist = number();
+            else if (key == "threads")          cam.threads = integer();
+            else if (key == "wavefront_batch")  cam.wavefront_batch = static_cast<size_t>(integer());
+            else if (key == "photons")          cam.photons_per_pass = static_cast<size_t>(integer());
+            else if (key == "photon_radius")    cam.photon_radius = number();
+            else if (key == "photon_alpha")     cam.photon_alpha = number();
+            else if (key == "cache")            cam.cache_depth = integer();
+            else if (key == "cache_cell")       cam.cache_cell = number();
+            else if (key == "mode") {
+                auto mode = word();
+                if      (mode == "recursive")   cam.mode = render_mode::recursive;
+                else if (mode == "wavefront")   cam.mode = render_mode::wavefront;
+                else if (mode == "bdpt")        cam.mode = render_mode::bdpt;
+                else if (mode == "photons")     cam.mode = render_mode::photons;
+                else if (mode == "guided")      cam.mode = render_mode::guided;
+                else if (mode == "nee")         cam.mode = render_mode::nee;
+                else { pos--; error("unknown render mode '" + mode + "'"); }
+            }
+            else unknown("camera", key);
+        }
+    }
+
+    void parse_fog() {
+        expect("{");
+        while (!block_end()) {
+            auto key = word();
+            if      (key == "density")  cam.fog.density = number();
+            else if (key == "albedo")   cam.fog.albedo = vector();
+            else if (key == "center")   cam.fog.center = vector();
+            else if (key == "radius")   cam.fog.radius = number();
+            else unknown("fog", key);
+        }
+    }
+
+    /* Textures and materials */
+
+    // A texture reference: a texture name, or three numbers for a solid color
+    shared_ptr<texture> texture_value() {
+        if (peek_number())
+            return make_shared<solid_color>(vector());
+
+        auto name = word();
+        auto found = textures.find(name);
+        if (found == textures.end()) { pos--; error("unknown texture '" + name + "'"); }
+        return found->second;
+    }
+
+    shared_ptr<material> material_value() {
+        auto name = word();
+        auto found = materials.find(name);
+        if (found == materials.end()) { pos--; error("unknown material '" + name + "'"); }
+        return found->second;
+    }
+
+    shared_ptr<texture> parse_texture_block(const std::string& type) {
+        expect("{");
+        shared_ptr<texture> even, odd;
+        color value(1,1,1);
+        double scale = 1;
+        std::string file;
+        bool srgb = false;
+        bool bake = false;
+        point3 bake_min, bake_max;
+        int bake_resolution = 64;
+
+        while (!block_end()) {
+            auto key = word();
+            if      (key == "color")    value = vector();
+            else if (key == "scale")    scale = number();
+            else if (key == "even")     even = texture_value();
+            else if (key == "odd")      odd = texture_value();
+            else if (key == "file")     file = resolve(next());
+            else if (key == "srgb")     srgb = boolean();
+            else if (key == "bake")     { bake = true; bake_min = vector(); bake_max = vector(); }
+            else if (key == "bake_resolution") bake_resolution = integer();
+            else unknown(type + " texture", key);
+        }
+
+        if (type == "solid")    return make_shared<solid_color>(value);
+        if (type == "checker") {
+            if (!even || !odd) error("checker texture needs 'even' and 'odd'");
+            return make_shared<checker_texture>(scale, even, odd);
+        }
+        if (type == "image") {
+            if (file.empty()) error("image texture needs a 'file'");
+            return make_shared<image_texture>(file.c_str(), srgb);
+        }
+        if (type == "noise")    return make_shared<tiled_noise_texture>(scale);
+        if (type == "perlin") {
+            if (bake)
+                return make_shared<perlin_noise_texture>(scale, aabb(bake_min, bake_max), bake_resolution);
+            return make_shared<perlin_noise_texture>(scale);
+        }
+        error("unknown texture type '" + type + "'");
+    }
+
+    shared_ptr<material> parse_material(const std::string& type) {
+        expect("{");
+        shared_ptr<texture> tex = make_shared<solid_color>(color(1,1,1));
+        color albedo(1,1,1);
+        double fuzz = 0;
+        double ior = 1.5;
+
+        while (!block_end()) {
+            auto key = word();
+            if      (key == "albedo" && type == "metal")    albedo = vector();
+            else if (key == "albedo" || key == "emit")      tex = texture_value();
+            else if (key == "fuzz")                         fuzz = number();
+            else if (key == "ior")                          ior = number();
+            else unknown(type + " material", key);
+        }
+
+        if (type == "lambertian")       return make_shared<lambertian>(tex);
+        if (type == "metal")            return make_shared<metal>(albedo, fuzz);
+        if (type == "dielectric")       return make_shared<dielectric>(ior);
+        if (type == "diffuse_light")    return make_shared<diffuse_light>(tex);
+        if (type == "isotropic")        return make_shared<isotropic>(tex);
+        error("unknown material type '" + type + "'");
+    }
+
+    /* Animation */
+
+    void parse_animation() {
+        expect("{");
+        while (!block_end()) {
+            auto key = word();
+            if      (key == "frames")               animation.frames = integer();
+            else if (key == "fps")                  animation.fps = number();
+            else if (key == "shutter")              animation.shutter = number();
+            else if (key == "rebuild_threshold")    animation.rebuild_threshold = number();
+            else if (key == "motion_segments")      animation.motion_segments = integer();
+            else if (key == "camera_key") {
+                // camera_key <seconds> lookfrom <x y z> lookat <x y z>
+                animation_sequence::camera_key k{number(), cam.lookfrom, cam.lookat};
+                while (peek("lookfrom") || peek("lookat")) {
+                    auto& target = word() == "lookfrom" ? k.lookfrom : k.lookat;
+                    target = vector();
+                }
+                animation.add_camera_key(k);
+            }
+            else unknown("animation", key);
+        }
+        if (animation.frames < 1) error("animation needs at least one frame");
+        if (animation.fps <= 0) error("animation fps must be positive");
+    }
+
+    // animated { <object> key <seconds> rotate_y <degrees> translate <x y z> ... }
+    shared_ptr<animated> parse_animated() {
+        expect("{");
+        auto start = pos;
+        hittable_list members;
+        keyframe_track track;
+
+        while (!block_end()) {
+            auto key = word();
+            if (key != "key") {
+                members.add(parse_object(key));
+                continue;
+            }
+
+            auto time = number();
+            double angle = 0;
+            vec3 offset(0,0,0);
+            while (peek("rotate_y") || peek("translate"))
+                transform_attribute(word(), angle, offset);
+            track.add(time, offset, angle);
+        }
+
+        auto end = pos;
+        pos = start;
+        if (members.objects.empty()) error("animated needs an object");
+        if (track.empty()) error("animated needs at least one 'key'");
+        pos = end;
+
+        shared_ptr<hittable> object = members.objects.size() == 1 ? members.objects[0]
+                                                                  : build_bvh(members.objects, 1);
+        return make_shared<animated>(object, std::move(track));
+    }
+
+    /* Objects */
+
+    shared_ptr<hittable> build_bvh(const std::vector<shared_ptr<hittable>>& objects, int segments) {
+        if (bvh_options.compressed && segments == 1) {
+            auto tree = make_shared<compressed_bvh>(objects, bvh_options);
+            bvh_stats.add(tree->stats);
+            return tree;
+        }
+        auto tree = make_shared<motion_bvh>(objects, segments, bvh_options);
+        bvh_stats.add(tree->stats);
+        return tree;
+    }
+
+    // Handles the attributes every object takes. Returns false if `key` isn't one of them.
+    bool transform_attribute(const std::string& key, double& angle, vec3& offset) {
+        if (key == "rotate_y")  { angle = number(); return true; }
+        if (key == "translate") { offset = vector(); return true; }
+        return false;
+    }
+
+    static shared_ptr<hittable> transformed(shared_ptr<hittable> object, double angle, const vec3& offset) {
+        if (angle != 0) object = make_shared<rotate_y>(object, angle);
+        if (offset.length_squared() > 0) object = make_shared<translate>(object, offset);
+        return object;
+    }
+
+    shared_ptr<hittable> parse_object(const std::string& kind) {
+        if (kind == "group")    return parse_group();
+        if (kind == "instance") return parse_instance();
+        if (kind == "animated") { pos--; error("animated objects can only be placed at the top level"); }
+
+        expect("{");
+        double angle = 0;
+        vec3 offset(0,0,0);
+        shared_ptr<material> mat;
+        shared_ptr<hittable> boundary;
+        shared_ptr<texture> albedo = make_shared<solid_color>(color(1,1,1));
+        point3 a(0,0,0), b(0,0,0), c(0,0,0), center2;
+        bool moving = false;
+        double radius = 1, scale = 1, density = 1;
+        std::string file;
+        int voxels_per_cell = 8;
+        int dims[3] = { 0, 0, 0 };
+        auto start = pos;
+
+        while (!block_end()) {
+            auto key = word();
+            if (transform_attribute(key, angle, offset)) continue;
+
+            if      (key == "material")             mat = material_value();
+            else if (key == "center" || key == "q" || key == "a" || key == "min")   a = vector();
+            else if (key == "u" || key == "b" || key == "max")                      b = vector();
+            else if (key == "v" || key == "c")      c = vector();
+            else if (key == "center2")              { center2 = vector(); moving = true; }
+            else if (key == "radius")               radius = number();
+            else if (key == "scale")                scale = number();
+            else if (key == "file")                 file = resolve(next());
+            else if (key == "density")              density = number();
+            else if (key == "albedo")               albedo = texture_value();
+            else if (key == "boundary")             boundary = parse_object(word());
+            else if (key == "voxels_per_cell")      voxels_per_cell = integer();
+            else if (key == "dims")                 { dims[0] = integer(); dims[1] = integer(); dims[2] = integer(); }
+            else unknown(kind, key);
+        }
+
+        auto end = pos;
+        pos = start;    // Errors below point at the object's first line
+        auto needs_material = [&] { if (!mat) error(kind + " needs a 'material'"); };
+
+        shared_ptr<hittable> object;
+        if (kind == "sphere") {
+            needs_material();
+            if (radius <= 0) error("sphere needs a positive 'radius'");
+            object = moving ? make_shared<sphere>(a, center2, radius, mat) : make_shared<sphere>(a, radius, mat);
+        } else if (kind == "quad") {
+            needs_material();
+            if (cross(b, c).near_zero()) error("degenerate quad");
+            object = make_shared<quad>(a, b, c, mat);
+        } else if (kind == "triangle") {
+            needs_material();
+            if (cross(b - a, c - a).near_zero()) error("degenerate triangle");
+            object = make_shared<tri>(a, b - a, c - a, mat);
+        } else if (kind == "box") {
+            needs_material();
+            if (!(a.x() < b.x() && a.y() < b.y() && a.z() < b.z())) error("box 'min' must be below 'max' on every axis");
+            object = box(a, b, mat);
+        } else if (kind == "mesh") {
+            needs_material();
+            if (file.empty()) error("mesh needs a 'file'");
+            auto triangles = mesh_triangles(*mesh_loads.at(file).get(), mat, scale);
+            if (triangles->objects.empty()) error("mesh '" + file + "' has no triangles");
+            object = build_bvh(triangles->objects, 1);
+        } else if (kind == "constant_medium") {
+            if (!boundary) error("constant_medium needs a 'boundary' object");
+            object = make_shared<constant_medium>(boundary, density, albedo);
+        } else if (kind == "grid_medium") {
+            if (file.empty()) error("grid_medium needs a 'file'");
+            auto grid = (dims[0] > 0 && dims[1] > 0 && dims[2] > 0)
+                      ? density_grid::load_raw(file, dims[0], dims[1], dims[2])
+                      : density_grid::load_sparse(file);
+            object = make_shared<grid_medium>(grid, aabb(a, b), density, albedo, voxels_per_cell);
+        } else {
+            error("unknown object type '" + kind + "'");
+        }
+
+        pos = end;
+        return transformed(object, angle, offset);
+    }
+
+    shared_ptr<hittable> parse_group() {
+        expect("{");
+        double angle = 0;
+        vec3 offset(0,0,0);
+        hittable_list members;
+
+        while (!block_end()) {
+            auto key = word();
+            if (!transform_attribute(key, angle, offset))
+                members.add(parse_object(key));
+        }
+
+        if (members.objects.empty()) error("empty group");
+        return transformed(build_bvh(members.objects, 1), angle, offset);
+    }
+
+    shared_ptr<hittable> parse_instance() {
+        expect("{");
+        double angle = 0;
+        vec3 offset(0,0,0);
+        shared_ptr<hittable> object;
+
+        while (!block_end()) {
+            auto key = word();
+            if (transform_attribute(key, angle, offset)) continue;
+            if (key != "object") unknown("instance", key);
+
+            auto name = word();
+            auto found = objects.find(name);
+            if (found == objects.end()) { pos--; error("unknown object '" + name + "'"); }
+            object = found->second;
+        }
+
+        if (!object) error("instance needs an 'object'");
+        return transformed(object, angle, offset);
+    }
+};
+
+#endif
@@ -0,0 +1,875 @@
+#ifndef SNAPSHOT_H
+#define SNAPSHOT_H
+
+#include "utils.h"
+
+#include "camera.h"
+#include "hittable_list.h"
+#include "bvh.h"
+#include "motion_bvh.h"
+#include "compressed_bvh.h"
+#include "sphere.h"
+#include "quad.h"
+#include "mesh.h"
+#include "texture.h"
+#include "material.h"
+#include "constant_medium.h"
+#include "stats.h"
+
+#include <climits>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <stdexcept>
+#include <string>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <typeinfo>
+#include <unistd.h>
+#include <unordered_map>
+#include <unordered_set>
+#include <vector>
+
+/**
+ * @brief On-disk records of a scene snapshot. Everything is plain data in host byte order and
+ * refers to other records by index or by byte offset from the start of the file, so a mapped
+ * file is used in place.
+ *
+ */
+namespace snapshot_format {
+    constexpr uint32_t magic = 0x53575452;      // "RTWS"
+    constexpr uint32_t version = 1;
+
+    enum prim_type : uint32_t { sphere_prim, quad_prim, tri_prim, medium_prim };
+    enum material_type : uint32_t { lambertian_mat, metal_mat, dielectric_mat, light_mat, isotropic_mat };
+    enum texture_type : uint32_t { solid_tex, checker_tex, image_tex, tiled_noise_tex, perlin_tex };
+
+    struct section {
+        uint64_t offset, count;
+    };
+
+    struct camera_record {
+        double aspect_ratio, vfov, defocus_angle, focus_dist;
+        double lookfrom[3], lookat[3], vup[3], background[3];
+        double fog_density, fog_albedo[3], fog_center[3], fog_radius;
+        int32_t image_width, samples_per_pixel, max_depth, mode;
+        uint64_t wavefront_batch;
+    };
+
+    struct header {
+        uint32_t magic, version;
+        uint64_t file_size;
+        section nodes, prims, media, materials, textures, blob;
+        camera_record camera;
+    };
+
+    // BVH node in depth-first order. An interior node (count == 0) has its first child right
+    // after it and its second child at `index`; a leaf holds prims [index, index + count).
+    struct node {
+        double min[3], max[3];
+        uint32_t index, count, axis, pad;
+    };
+
+    // Sphere: center, center_vec, radius, cos and sin of the y rotation applied to its uv frame.
+    // Quad and triangle: Q, u, v, w, normal, D, inv_edge, as in class quad.
+    struct prim {
+        uint32_t type;
+        uint32_t index;         // Material, or medium for medium_prim
+        double data[17];
+    };
+
+    struct medium {
+        uint32_t root;          // Node of the boundary's own BVH
+        uint32_t texture;
+        double density;
+    };
+
+    struct material_record {
+        uint32_t type;
+        uint32_t texture;
+        double params[4];       // metal: albedo, fuzz; dielectric: index of refraction
+    };
+
+    struct texture_record {
+        uint32_t type;
+        uint32_t even, odd;     // Child textures of a checker
+        uint32_t pad;
+        double params[8];
+        uint64_t blob_offset, blob_size;
+    };
+}
+
+/**
+ * @brief Writes a scene to a compact binary snapshot and maps it back for rendering.
+ *
+ * Writing flattens the hittable graph: transforms are baked into the primitives, materials and
+ * textures are stored once each, and one BVH is built over all primitives. Loading maps the
+ * file and traces directly against the mapped nodes and primitives; only the few materials,
+ * textures and media are rebuilt as objects. Image textures are stored by path and go through
+ * the texture cache as usual.
+ *
+ * Spheres, quads, triangles, boxes, meshes, lists, BVHs, translate, rotate_y and constant media
+ * with such boundaries can be stored. Other objects (for example grid_medium) make write()
+ * fail, in which case the scene has to be rendered from its source.
+ */
+class scene_snapshot {
+  public:
+    /**
+     * @brief Writes `world` and `cam` to `filename`. Returns false, after printing why, if the
+     * world holds something a snapshot can't represent or the file can't be written.
+     *
+     */
+    static bool write(const std::string& filename, const hittable& world, const camera& cam) {
+        scene_snapshot s;
+        try {
+            s.add_object(world, transform(), s.top_prims, s.top_bounds);
+        } catch (const std::runtime_error& e) {
+            std::cerr << "ERROR: Can't snapshot the scene: " << e.what() << "\n";
+            return false;
+        }
+        return s.save(filename, cam);
+    }
+
+    /**
+     * @brief Maps the snapshot in `filename`, sets up `cam` from it and returns the world.
+     * Throws std::runtime_error if the file is missing, truncated or of another version.
+     *
+     */
+    static shared_ptr<hittable> load(const std::string& filename, camera& cam);
+
+  private:
+    // Object to world mapping built from nested rotate_y and translate: p -> R_y(theta) p + offset
+    struct transform {
+        double cos_theta = 1, sin_theta = 0;
+        vec3 offset = vec3(0,0,0);
+
+        vec3 rotate(const vec3& v) const {
+            return vec3(cos_theta*v.x() + sin_theta*v.z(), v.y(), -sin_theta*v.x() + cos_theta*v.z());
+        }
+        point3 apply(const point3& p) const { return rotate(p) + offset; }
+    };
+
+    struct build_prim {
+        snapshot_format::prim record;
+        aabb box;
+    };
+
+    std::vector<build_prim> prims;
+    std::vector<uint32_t> top_prims;
+    aabb top_bounds;
+    std::vector<snapshot_format::medium> media;
+    std::vector<std::vector<uint32_t>> medium_prims;
+    std::vector<snapshot_format::material_record> materials;
+    std::vector<snapshot_format::texture_record> textures;
+    std::vector<unsigned char> blob;
+    std::unordered_map<const void*, uint32_t> material_ids, texture_ids;
+
+    /* Flattening */
+
+    void add_object(const hittable& object, const transform& xf, std::vector<uint32_t>& out, aabb& bounds) {
+        if (auto list = dynamic_cast<const hittable_list*>(&object)) {
+            for (const auto& child : list->objects)
+                add_object(*child, xf, out, bounds);
+        } else if (auto node = dynamic_cast<const bvh_node*>(&object)) {
+            add_object(*node->get_left(), xf, out, bounds);
+            if (node->get_right() != node->get_left())
+                add_object(*node->get_right(), xf, out, bounds);
+        } else if (auto motion = dynamic_cast<const motion_bvh*>(&object)) {
+            add_unique(motion->get_objects(), xf, out, bounds);
+        } else if (auto compressed = dynamic_cast<const compressed_bvh*>(&object)) {
+            add_unique(compressed->get_objects(), xf, out, bounds);
+        } else if (auto moved = dynamic_cast<const translate*>(&object)) {
+            auto inner = xf;
+            inner.offset = xf.offset + xf.rotate(moved->get_offset());
+            add_object(*moved->get_object(), inner, out, bounds);
+        } else if (auto rotated = dynamic_cast<const rotate_y*>(&object)) {
+            auto inner = xf;
+            auto cos_theta = rotated->get_cos_theta(), sin_theta = rotated->get_sin_theta();
+            inner.cos_theta = xf.cos_theta*cos_theta - xf.sin_theta*sin_theta;
+            inner.sin_theta = xf.sin_theta*cos_theta + xf.cos_theta*sin_theta;
+            add_object(*rotated->get_object(), inner, out, bounds);
+        } else if (auto s = dynamic_cast<const sphere*>(&object)) {
+            add_sphere(*s, xf, out, bounds);
+        } else if (auto q = dynamic_cast<const quad*>(&object)) {
+            add_planar(*q, dynamic_cast<const tri*>(q) != nullptr, xf, out, bounds);
+        } else if (auto m = dynamic_cast<const constant_medium*>(&object)) {
+            add_medium(*m, xf, out, bounds);
+        } else {
+            throw std::runtime_error(std::string("unsupported object type ") + typeid(object).name());
+        }
+    }
+
+    // Objects cut by spatial splits are listed once per piece
+    void add_unique(const std::vector<shared_ptr<hittable>>& objects, const transform& xf,
+                    std::vector<uint32_t>& out, aabb& bounds) {
+        std::unordered_set<const hittable*> seen;
+        for (const auto& child : objects)
+            if (seen.insert(child.get()).second)
+                add_object(*child, xf, out, bounds);
+    }
+
+    void push_prim(const snapshot_format::prim& record, const aabb& box, std::vector<uint32_t>& out, aabb& bounds) {
+        out.push_back(static_cast<uint32_t>(prims.size()));
+        prims.push_back({ record, box });
+        bounds = aabb(bounds, box);
+    }
+
+    static void store(double* data, const vec3& v) {
+        data[0] = v.x(); data[1] = v.y(); data[2] = v.z();
+    }
+
+    void add_sphere(const sphere& s, const transform& xf, std::vector<uint32_t>& out, aabb& bounds) {
+        snapshot_format::prim record = {};
+        record.type = snapshot_format::sphere_prim;
+        record.index = material_id(s.get_material().get());
+
+        auto center1 = xf.apply(s.center_at(0));
+        auto center_vec = xf.rotate(s.center_at(1) - s.center_at(0));
+        store(record.data, center1);
+        store(record.data + 3, center_vec);
+        record.data[6] = s.get_radius();
+        record.data[7] = xf.cos_theta;
+        record.data[8] = xf.sin_theta;
+
+        vec3 rvec(s.get_radius(), s.get_radius(), s.get_radius());
+        auto center2 = center1 + center_vec;
+        push_prim(record, aabb(aabb(center1 - rvec, center1 + rvec), aabb(center2 - rvec, center2 + rvec)), out, bounds);
+    }
+
+    void add_planar(const quad& q, bool triangle, const transform& xf, std::vector<uint32_t>& out, aabb& bounds) {
+        snapshot_format::prim record = {};
+        record.type = triangle ? snapshot_format::tri_prim : snapshot_format::quad_prim;
+        record.index = material_id(q.get_material().get());
+
+        auto Q = xf.apply(q.get_Q());
+        auto u = xf.rotate(q.get_u());
+        auto v = xf.rotate(q.get_v());
+        auto normal = xf.rotate(q.get_normal());
+        store(record.data, Q);
+        store(record.data + 3, u);
+        store(record.data + 6, v);
+        store(record.data + 9, xf.rotate(q.get_w()));
+        store(record.data + 12, normal);
+        record.data[15] = dot(normal, Q);
+        record.data[16] = q.get_inv_edge();
+
+        auto box = triangle ? aabb(aabb(Q, Q + u), aabb(Q, Q + v))
+                            : aabb(aabb(Q, Q + u + v), aabb(Q + u, Q + v));
+        push_prim(record, box, out, bounds);
+    }
+
+    void add_medium(const constant_medium& m, const transform& xf, std::vector<uint32_t>& out, aabb& bounds) {
+        auto iso = dynamic_cast<const isotropic*>(m.get_phase_function().get());
+        if (!iso) throw std::runtime_error("constant_medium with a non-isotropic phase function");
+
+        auto index = static_cast<uint32_t>(media.size());
+        media.push_back({ 0, texture_id(iso->get_texture().get()), m.get_density() });
+        medium_prims.emplace_back();
+
+        std::vector<uint32_t> boundary;
+        aabb boundary_bounds;
+        add_object(*m.get_boundary(), xf, boundary, boundary_bounds);
+        if (boundary.empty()) throw std::runtime_error("constant_medium with an empty boundary");
+        medium_prims[index] = boundary;
+
+        snapshot_format::prim record = {};
+        record.type = snapshot_format::medium_prim;
+        record.index = index;
+        push_prim(record, boundary_bounds, out, bounds);
+    }
+
+    uint32_t material_id(const material* m) {
+        auto found = material_ids.find(m);
+        if (found != material_ids.end()) return found->second;
+
+        snapshot_format::material_record record = {};
+        if (auto l = dynamic_cast<const lambertian*>(m)) {
+            record.type = snapshot_format::lambertian_mat;
+            record.texture = texture_id(l->get_albedo().get());
+        } else if (auto mt = dynamic_cast<const metal*>(m)) {
+            record.type = snapshot_format::metal_mat;
+            store(record.params, mt->get_albedo());
+            record.params[3] = mt->get_fuzz();
+        } else if (auto d = dynamic_cast<const dielectric*>(m)) {
+            record.type = snapshot_format::dielectric_mat;
+            record.params[0] = d->get_ir();
+        } else if (auto light = dynamic_cast<const diffuse_light*>(m)) {
+            record.type = snapshot_format::light_mat;
+            record.texture = texture_id(light->get_texture().get());
+        } else if (auto iso = dynamic_cast<const isotropic*>(m)) {
+            record.type = snapshot_format::isotropic_mat;
+            record.texture = texture_id(iso->get_texture().get());
+        } else {
+            throw std::runtime_error(std::string("unsupported material ") + (m ? typeid(*m).name() : "null"));
+        }
+
+        auto id = static_cast<uint32_t>(materials.size());
+        materials.push_back(record);
+        material_ids[m] = id;
+        return id;
+    }
+
+    uint64_t add_blob(const void* data, size_t size) {
+        // Blob entries start on 8 byte boundaries so doubles in them can be read in place
+        auto offset = (blob.size() + 7) & ~size_t(7);
+        blob.resize(offset + size);
+        memcpy(blob.data() + offset, data, size);
+        return offset;
+    }
+
+    uint32_t texture_id(const texture* t) {
+        auto found = texture_ids.find(t);
+        if (found != texture_ids.end()) return found->second;
+
+        // Children first, so a texture only ever refers to earlier ones
+        snapshot_format::texture_record record = {};
+        if (auto solid = dynamic_cast<const solid_color*>(t)) {
+            record.type = snapshot_format::solid_tex;
+            store(record.params, solid->get_color());
+        } else if (auto checker = dynamic_cast<const checker_texture*>(t)) {
+            record.type = snapshot_format::checker_tex;
+            record.params[0] = checker->get_inv_scale();
+            record.even = texture_id(checker->get_even().get());
+            record.odd = texture_id(checker->get_odd().get());
+        } else if (auto image = dynamic_cast<const image_texture*>(t)) {
+            // Store an absolute path so the snapshot can be rendered from another directory
+            auto path = rtw_image::find_file(image->get_filename().c_str());
+            char resolved[PATH_MAX];
+            if (!path.empty() && realpath(path.c_str(), resolved)) path = resolved;
+            if (path.empty()) path = image->get_filename();
+
+            record.type = snapshot_format::image_tex;
+            record.params[0] = image->get_srgb() ? 1 : 0;
+            record.blob_offset = add_blob(path.data(), path.size());
+            record.blob_size = path.size();
+        } else if (auto tiled = dynamic_cast<const tiled_noise_texture*>(t)) {
+            record.type = snapshot_format::tiled_noise_tex;
+            const auto& colors = tiled->get_colors();
+            record.params[0] = tiled->get_inv_scale();
+            record.blob_offset = add_blob(colors.data(), colors.size() * sizeof(color));
+            record.blob_size = colors.size() * sizeof(color);
+        } else if (auto noise = dynamic_cast<const perlin_noise_texture*>(t)) {
+            record.type = snapshot_format::perlin_tex;
+            record.params[0] = noise->get_scale();
+
+            // Gradient and permutation tables, then the baked grid if there is one
+            std::vector<unsigned char> tables(perlin::table_bytes);
+            noise->get_noise().copy_tables(tables.data());
+            if (noise->get_baked()) {
+                const auto& b = *noise->get_baked();
+                const auto& box = b.get_bounds();
+                const auto& values = b.get_values();
+                record.params[1] = b.get_res();
+                record.params[2] = box.x.min; record.params[3] = box.y.min; record.params[4] = box.z.min;
+                record.params[5] = box.x.max; record.params[6] = box.y.max; record.params[7] = box.z.max;
+                auto bytes = reinterpret_cast<const unsigned char*>(values.data());
+                tables.insert(tables.end(), bytes, bytes + values.size() * sizeof(float));
+            }
+            record.blob_offset = add_blob(tables.data(), tables.size());
+            record.blob_size = tables.size();
+        } else {
+            throw std::runtime_error(std::string("unsupported texture ") + (t ? typeid(*t).name() : "null"));
+        }
+
+        auto id = static_cast<uint32_t>(textures.size());
+        textures.push_back(record);
+        texture_ids[t] = id;
+        return id;
+    }
+
+    /* BVH construction */
+
+    // Same median split as bvh_node, so a snapshot traces the same tree a live scene would
+    uint32_t build(std::vector<snapshot_format::node>& nodes, std::vector<uint32_t>& order,
+                   std::vector<uint32_t>& ids, size_t start, size_t end)
+    {
+        aabb box = aabb::empty;
+        for (auto i = start; i < end; i++)
+            box = aabb(box, prims[ids[i]].box);
+
+        auto index = static_cast<uint32_t>(nodes.size());
+        nodes.emplace_back();
+        auto axis = box.longest_axis();
+
+        snapshot_format::node n = {};
+        n.min[0] = box.x.min; n.min[1] = box.y.min; n.min[2] = box.z.min;
+        n.max[0] = box.x.max; n.max[1] = box.y.max; n.max[2] = box.z.max;
+        n.axis = static_cast<uint32_t>(axis);
+
+        if (end - start <= 2) {
+            n.index = static_cast<uint32_t>(order.size());
+            n.count = static_cast<uint32_t>(end - start);
+            for (auto i = start; i < end; i++)
+                order.push_back(ids[i]);
+        } else {
+            std::sort(ids.begin() + start, ids.begin() + end, [&](uint32_t a, uint32_t b) {
+                return prims[a].box.axis_interval(axis).min < prims[b].box.axis_interval(axis).min;
+            });
+            auto mid = start + (end - start) / 2;
+            build(nodes, order, ids, start, mid);
+            n.index = build(nodes, order, ids, mid, end);
+        }
+
+        nodes[index] = n;
+        return index;
+    }
+
+    static void put_section(snapshot_format::section& s, std::vector<unsigned char>& file, const void* data, size_t size, size_t count) {
+        auto offset = (file.size() + 7) & ~size_t(7);
+        file.resize(offset + size);
+        if (size > 0) memcpy(file.data() + offset, data, size);
+        s.offset = offset;
+        s.count = count;
+    }
+
+    bool save(const std::string& filename, const camera& cam) {
+        // One tree for the world, one per medium boundary. Prims are reordered into leaf order.
+        std::vector<snapshot_format::node> nodes;
+        std::vector<uint32_t> order;
+        if (!top_prims.empty())
+            build(nodes, order, top_prims, 0, top_prims.size());
+        for (size_t m = 0; m < media.size(); m++)
+            media[m].root = build(nodes, order, medium_prims[m], 0, medium_prims[m].size());
+
+        std::vector<snapshot_format::prim> ordered;
+        ordered.reserve(order.size());
+        for (auto id : order)
+            ordered.push_back(prims[id].record);
+
+        snapshot_format::header h = {};
+        h.magic = snapshot_format::magic;
+        h.version = snapshot_format::version;
+        store_camera(h.camera, cam);
+
+        std::vector<unsigned char> file(sizeof h);
+        put_section(h.nodes, file, nodes.data(), nodes.size() * sizeof(nodes[0]), nodes.size());
+        put_section(h.prims, file, ordered.data(), ordered.size() * sizeof(ordered[0]), ordered.size());
+        put_section(h.media, file, media.data(), media.size() * sizeof(media[0]), media.size());
+        put_section(h.materials, file, materials.data(), materials.size() * sizeof(materials[0]), materials.size());
+        put_section(h.textures, file, textures.data(), textures.size() * sizeof(textures[0]), textures.size());
+        put_section(h.blob, file, blob.data(), blob.size(), blob.size());
+        h.file_size = file.size();
+        memcpy(file.data(), &h, sizeof h);
+
+        auto temp = filename + ".tmp";
+        auto out = fopen(temp.c_str(), "wb");
+        bool ok = out && fwrite(file.data(), 1, file.size(), out) == file.size();
+        ok = out && fclose(out) == 0 && ok;
+        if (!ok || rename(temp.c_str(), filename.c_str()) != 0) {
+            remove(temp.c_str());
+            std::cerr << "ERROR: Could not write snapshot '" << filename << "'.\n";
+            return false;
+        }
+
+        std::clog << "Wrote snapshot " << filename << ": " << ordered.size() << " primitives, "
+                  << nodes.size() << " nodes, " << file.size() / 1024 << " KB\n";
+        return true;
+    }
+
+    static void store_camera(snapshot_format::camera_record& c, const camera& cam) {
+        c.aspect_ratio = cam.aspect_ratio;
+        c.vfov = cam.vfov;
+        c.defocus_angle = cam.defocus_angle;
+        c.focus_dist = cam.focus_dist;
+        store(c.lookfrom, cam.lookfrom);
+        store(c.lookat, cam.lookat);
+        store(c.vup, cam.vup);
+        store(c.background, cam.background);
+        c.fog_density = cam.fog.density;
+        store(c.fog_albedo, cam.fog.albedo);
+        store(c.fog_center, cam.fog.center);
+        c.fog_radius = cam.fog.radius;
+        c.image_width = cam.image_width;
+        c.samples_per_pixel = cam.samples_per_pixel;
+        c.max_depth = cam.max_depth;
+        c.mode = static_cast<int32_t>(cam.mode);
+        c.wavefront_batch = cam.wavefront_batch;
+    }
+
+    static vec3 load_vec(const double* d) { return vec3(d[0], d[1], d[2]); }
+
+    static void load_camera(const snapshot_format::camera_record& c, camera& cam) {
+        cam.aspect_ratio = c.aspect_ratio;
+        cam.vfov = c.vfov;
+        cam.defocus_angle = c.defocus_angle;
+        cam.focus_dist = c.focus_dist;
+        cam.lookfrom = load_vec(c.lookfrom);
+        cam.lookat = load_vec(c.lookat);
+        cam.vup = load_vec(c.vup);
+        cam.background = load_vec(c.background);
+        cam.fog = homogeneous_fog(c.fog_density, load_vec(c.fog_albedo), load_vec(c.fog_center), c.fog_radius);
+        cam.image_width = c.image_width;
+        cam.samples_per_pixel = c.samples_per_pixel;
+        cam.max_depth = c.max_depth;
+        cam.mode = static_cast<render_mode>(c.mode);
+        cam.wavefront_batch = c.wavefront_batch;
+    }
+
+    friend class streamed_scene;
+
+    class mapped_scene;
+    class flat_bvh;
+
+    static shared_ptr<mapped_scene> map(const std::string& filename, camera& cam);
+
+    static shared_ptr<texture> rebuild_texture(const snapshot_format::texture_record& t,
+                                               const std::vector<shared_ptr<texture>>& built,
+                                               const unsigned char* blob);
+};
+
+
+/**
+ * @brief A mapped snapshot file together with the objects rebuilt from it.
+ *
+ */
+class scene_snapshot::mapped_scene {
+  public:
+    const snapshot_format::header* header = nullptr;
+    const snapshot_format::node* nodes = nullptr;
+    const snapshot_format::prim* prims = nullptr;
+    std::vector<shared_ptr<material>> materials;
+    std::vector<shared_ptr<hittable>> media;
+
+    mapped_scene(void* base, size_t size) : base(base), size(size) {}
+    ~mapped_scene() { munmap(base, size); }
+
+    // Drops the pages of [offset, offset + length) of the file from memory. They are read back
+    // from the file if touched again.
+    void release(uint64_t offset, uint64_t length) const {
+        auto page = static_cast<uint64_t>(sysconf(_SC_PAGESIZE));
+        auto start = (offset + page - 1) / page * page;
+        auto end = std::min<uint64_t>(offset + length, size) / page * page;
+        if (end > start)
+            madvise(static_cast<char*>(base) + start, end - start, MADV_DONTNEED);
+    }
+
+  private:
+    void* base;
+    size_t size;
+};
+
+
+/**
+ * @brief Traces one tree of a mapped snapshot, reading nodes and primitives in place.
+ *
+ */
+class scene_snapshot::flat_bvh : public hittable {
+  public:
+    // `owner` keeps the mapping alive; views inside the scene itself (medium boundaries) pass
+    // none, as they would otherwise keep their own scene alive.
+    flat_bvh(const mapped_scene* scene, uint32_t root, shared_ptr<const mapped_scene> owner = nullptr)
+      : scene(scene), owner(owner), root(root)
+    {
+        const auto& n = scene->nodes[root];
+        bbox = aabb(point3(n.min[0], n.min[1], n.min[2]), point3(n.max[0], n.max[1], n.max[2]));
+    }
+
+    static constexpr int max_depth = 60;  // Keeps the traversal stack below 64 entries
+
+    aabb bounding_box() const override { return bbox; }
+
+    bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        return trace(*scene, scene->nodes, 0, scene->prims, 0, root, r, ray_t, rec);
+    }
+
+    // Traces the tree at node `root` through a window on the node and prim sections, where
+    // nodes[0] is node `node_base` of the file and prims[0] is prim `prim_base`. The whole tree
+    // has to lie inside the window.
+    static bool trace(const mapped_scene& scene, const snapshot_format::node* nodes, uint32_t node_base,
+                      const snapshot_format::prim* prims, uint32_t prim_base, uint32_t root,
+                      const ray& r, interval ray_t, hit_record& rec) {
+        double inv_dir[3] = { 1 / r.direction().x(), 1 / r.direction().y(), 1 / r.direction().z() };
+
+        uint32_t stack[64];
+        int top = 0;
+        stack[top++] = root;
+        bool hit_anything = false;
+
+        while (top > 0) {
+            auto index = stack[--top];
+            const auto& n = nodes[index - node_base];
+            RT_STAT(bvh_nodes);
+            RT_STAT(aabb_tests);
+            if (!box_hit(n, r, inv_dir, ray_t))
+                continue;
+
+            if (n.count > 0) {
+                for (uint32_t i = n.index; i < n.index + n.count; i++) {
+                    if (hit_prim(scene, prims[i - prim_base], r, ray_t, rec)) {
+                        hit_anything = true;
+                        ray_t.max = rec.t;
+                        rec.object = scene.prims + i;   // Same for every mapping of the prim
+                    }
+                }
+            } else {
+                // Visit the child nearer along the split axis first
+                auto first = index + 1;
+                auto second = n.index;
+                if (inv_dir[n.axis] < 0) std::swap(first, second);
+                stack[top++] = second;
+                stack[top++] = first;
+            }
+        }
+
+        return hit_anything;
+    }
+
+    static bool box_hit(const snapshot_format::node& n, const ray& r, const double* inv_dir, interval ray_t) {
+        for (int a = 0; a < 3; a++) {
+            auto t0 = (n.min[a] - r.origin()[a]) * inv_dir[a];
+            auto t1 = (n.max[a] - r.origin()[a]) * inv_dir[a];
+            if (inv_dir[a] < 0) std::swap(t0, t1);
+
+            if (t0 > ray_t.min) ray_t.min = t0;
+            if (t1 < ray_t.max) ray_t.max = t1;
+            if (ray_t.max <= ray_t.min) return false;
+        }
+        return true;
+    }
+
+  private:
+    const mapped_scene* scene;
+    shared_ptr<const mapped_scene> owner;
+    uint32_t root;
+    aabb bbox;
+
+    static bool hit_prim(const mapped_scene& scene, const snapshot_format::prim& p, const ray& r,
+                         interval ray_t, hit_record& rec) {
+        switch (p.type) {
+            case snapshot_format::sphere_prim:
+                RT_STAT(sphere_tests);
+                return hit_sphere(scene, p, r, ray_t, rec);
+            case snapshot_format::quad_prim:
+                RT_STAT(quad_tests);
+                return hit_planar(scene, p, false, r, ray_t, rec);
+            case snapshot_format::tri_prim:
+                RT_STAT(quad_tests);
+                return hit_planar(scene, p, true, r, ray_t, rec);
+            case snapshot_format::medium_prim:  return scene.media[p.index]->hit(r, ray_t, rec);
+        }
+        return false;
+    }
+
+    static bool hit_sphere(const mapped_scene& scene, const snapshot_format::prim& p, const ray& r,
+                           interval ray_t, hit_record& rec) {
+        // Same as sphere::hit
+        auto center = load_vec(p.data) + r.time() * load_vec(p.data + 3);
+        auto radius = p.data[6];
+        vec3 oc = r.origin() - center;
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant < 0) return false;
+        auto sqrtd = sqrt(discriminant);
+
+        auto root = (-half_b - sqrtd) / a;
+        if (!ray_t.surrounds(root)) {
+            root = (-half_b + sqrtd) / a;
+            if (!ray_t.surrounds(root))
+                return false;
+        }
+
+        rec.t = root;
+        rec.p = r.at(rec.t);
+        vec3 outward_normal = (rec.p - center) / radius;
+        rec.set_face_normal(r, outward_normal);
+
+        // Texture coordinates come from the normal in the sphere's own (unrotated) frame
+        auto cos_theta = p.data[7], sin_theta = p.data[8];
+        vec3 object_normal(cos_theta*outward_normal.x() - sin_theta*outward_normal.z(), outward_normal.y(),
+                           sin_theta*outward_normal.x() + cos_theta*outward_normal.z());
+        sphere::get_sphere_uv(object_normal, rec.u, rec.v);
+        rec.footprint = r.footprint(root) / (pi * radius);
+        rec.mat = scene.materials[p.index];
+        return true;
+    }
+
+    static bool hit_planar(const mapped_scene& scene, const snapshot_format::prim& p, bool triangle,
+                           const ray& r, interval ray_t, hit_record& rec) {
+        // Same as quad::hit, with tri::is_interior for triangles
+        auto normal = load_vec(p.data + 12);
+        auto denom = dot(r.direction(), normal);
+        if (fabs(denom) < 1e-8) return false;
+
+        auto t = (p.data[15] - dot(r.origin(), normal)) / denom;
+        if (!ray_t.contains(t)) return false;
+        auto intersection = r.at(t);
+
+        auto q = intersection - load_vec(p.data);
+        auto w = load_vec(p.data + 9);
+        auto alpha = dot(w, cross(q, load_vec(p.data + 6)));
+        auto beta  = dot(w, cross(load_vec(p.data + 3), q));
+        bool inside = triangle ? (alpha >= 0 && beta >= 0 && alpha + beta <= 1)
+                               : (interval::unit.contains(alpha) && interval::unit.contains(beta));
+        if (!inside) return false;
+
+        rec.u = alpha;
+        rec.v = beta;
+        rec.t = t;
+        rec.p = intersection;
+        rec.footprint = r.footprint(t) * p.data[16];
+        rec.mat = scene.materials[p.index];
+        rec.set_face_normal(r, normal);
+        return true;
+    }
+};
+
+
+inline shared_ptr<texture> scene_snapshot::rebuild_texture(const snapshot_format::texture_record& t,
+                                                           const std::vector<shared_ptr<texture>>& built,
+                                                           const unsigned char* blob)
+{
+    auto data = blob + t.blob_offset;
+    switch (t.type) {
+        case snapshot_format::solid_tex:
+            return make_shared<solid_color>(load_vec(t.params));
+
+        case snapshot_format::checker_tex:
+            if (t.even >= built.size() || t.odd >= built.size()) break;
+            return make_shared<checker_texture>(1 / t.params[0], built[t.even], built[t.odd]);
+
+        case snapshot_format::image_tex: {
+            std::string path(reinterpret_cast<const char*>(data), t.blob_size);
+            return make_shared<image_texture>(path.c_str(), t.params[0] != 0);
+        }
+
+        case snapshot_format::tiled_noise_tex: {
+            std::vector<color> colors(9);
+            if (t.blob_size != colors.size() * sizeof(color)) break;
+            memcpy(static_cast<void*>(colors.data()), data, t.blob_size);
+            return make_shared<tiled_noise_texture>(1 / t.params[0], colors);
+        }
+
+        case snapshot_format::perlin_tex: {
+            if (t.blob_size < perlin::table_bytes) break;
+            perlin noise(data);
+            data += perlin::table_bytes;
+
+            shared_ptr<baked_turbulence> baked;
+            auto res = static_cast<int>(t.params[1]);
+            if (res > 0) {
+                size_t count = static_cast<size_t>(res) * res * res;
+                if (t.blob_size != perlin::table_bytes + count * sizeof(float)) break;
+                std::vector<float> values(count);
+                memcpy(values.data(), data, count * sizeof(float));
+                aabb bounds(point3(t.params[2], t.params[3], t.params[4]), point3(t.params[5], t.params[6], t.params[7]));
+                baked = make_shared<baked_turbulence>(bounds, res, std::move(values));
+            }
+            return make_shared<perlin_noise_texture>(t.params[0], noise, baked);
+        }
+    }
+    throw std::runtime_error("corrupt texture record");
+}
+
+
+inline shared_ptr<hittable> scene_snapshot::load(const std::string& filename, camera& cam) {
+    profile_scope scope("map snapshot");
+    auto scene = map(filename, cam);
+    if (scene->header->nodes.count == 0)
+        return make_shared<hittable_list>();
+    return make_shared<flat_bvh>(scene.get(), 0, scene);
+}
+
+
+// Maps and checks a snapshot, rebuilds its materials, textures and media, and sets up `cam`
+inline shared_ptr<scene_snapshot::mapped_scene> scene_snapshot::map(const std::string& filename, camera& cam) {
+    int fd = open(filename.c_str(), O_RDONLY);
+    if (fd < 0)
+        throw std::runtime_error("Could not open snapshot '" + filename + "'");
+
+    struct stat st;
+    void* base = MAP_FAILED;
+    if (fstat(fd, &st) == 0 && static_cast<size_t>(st.st_size) >= sizeof(snapshot_format::header))
+        base = mmap(nullptr, static_cast<size_t>(st.st_size), PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (base == MAP_FAILED)
+        throw std::runtime_error("Could not map snapshot '" + filename + "'");
+
+    auto size = static_cast<size_t>(st.st_size);
+    auto scene = make_shared<mapped_scene>(base, size);
+    auto bytes = static_cast<const unsigned char*>(base);
+    const auto& h = *reinterpret_cast<const snapshot_format::header*>(bytes);
+
+    auto fail = [&](const char* why) {
+        throw std::runtime_error("Snapshot '" + filename + "' " + why);
+    };
+    if (h.magic != snapshot_format::magic) fail("is not a snapshot");
+    if (h.version != snapshot_format::version) fail("has an unsupported version");
+    if (h.file_size != size) fail("is truncated");
+
+    auto check = [&](const snapshot_format::section& s, size_t record_size) {
+        if (s.offset % 8 != 0 || s.offset > size || s.count > (size - s.offset) / record_size)
+            fail("has a corrupt section table");
+    };
+    check(h.nodes, sizeof(snapshot_format::node));
+    check(h.prims, sizeof(snapshot_format::prim));
+    check(h.media, sizeof(snapshot_format::medium));
+    check(h.materials, sizeof(snapshot_format::material_record));
+    check(h.textures, sizeof(snapshot_format::texture_record));
+    check(h.blob, 1);
+
+    scene->header = &h;
+    scene->nodes = reinterpret_cast<const snapshot_format::node*>(bytes + h.nodes.offset);
+    scene->prims = reinterpret_cast<const snapshot_format::prim*>(bytes + h.prims.offset);
+    auto media = reinterpret_cast<const snapshot_format::medium*>(bytes + h.media.offset);
+    auto material_records = reinterpret_cast<const snapshot_format::material_record*>(bytes + h.materials.offset);
+    auto texture_records = reinterpret_cast<const snapshot_format::texture_record*>(bytes + h.textures.offset);
+
+    // Nodes and prims are used in place; only check the indices they hold once. Children always
+    // come after their parent, so one forward pass also bounds the depth of every tree.
+    std::vector<uint8_t> depth(h.nodes.count, 0);
+    for (size_t i = 0; i < h.nodes.count; i++) {
+        const auto& n = scene->nodes[i];
+        bool ok = n.count > 0 ? (n.index + static_cast<uint64_t>(n.count) <= h.prims.count)
+                              : (n.index > i && n.index < h.nodes.count && i + 1 < h.nodes.count
+                                 && n.axis < 3 && depth[i] < flat_bvh::max_depth);
+        if (!ok) fail("has a corrupt node");
+        if (n.count == 0)
+            depth[i+1] = depth[n.index] = static_cast<uint8_t>(depth[i] + 1);
+    }
+    for (size_t i = 0; i < h.prims.count; i++) {
+        const auto& p = scene->prims[i];
+        auto limit = p.type == snapshot_format::medium_prim ? h.media.count : h.materials.count;
+        if (p.type > snapshot_format::medium_prim || p.index >= limit) fail("has a corrupt primitive");
+    }
+
+    std::vector<shared_ptr<texture>> textures;
+    for (size_t i = 0; i < h.textures.count; i++) {
+        const auto& t = texture_records[i];
+        if (t.blob_offset > h.blob.count || t.blob_size > h.blob.count - t.blob_offset)
+            fail("has a corrupt texture");
+        textures.push_back(rebuild_texture(t, textures, bytes + h.blob.offset));
+    }
+
+    for (size_t i = 0; i < h.materials.count; i++) {
+        const auto& m = material_records[i];
+        bool textured = m.type != snapshot_format::metal_mat && m.type != snapshot_format::dielectric_mat;
+        if (textured && m.texture >= textures.size()) fail("has a corrupt material");
+
+        shared_ptr<material> built;
+        switch (m.type) {
+            case snapshot_format::lambertian_mat:   built = make_shared<lambertian>(textures[m.texture]); break;
+            case snapshot_format::metal_mat:        built = make_shared<metal>(load_vec(m.params), m.params[3]); break;
+            case snapshot_format::dielectric_mat:   built = make_shared<dielectric>(m.params[0]); break;
+            case snapshot_format::light_mat:        built = make_shared<diffuse_light>(textures[m.texture]); break;
+            case snapshot_format::isotropic_mat:    built = make_shared<isotropic>(textures[m.texture]); break;
+            default: fail("has a corrupt material");
+        }
+        scene->materials.push_back(built);
+    }
+
+    for (size_t i = 0; i < h.media.count; i++) {
+        const auto& m = media[i];
+        if (m.root >= h.nodes.count || m.texture >= textures.size()) fail("has a corrupt medium");
+        auto boundary = make_shared<flat_bvh>(scene.get(), m.root);
+        scene->media.push_back(make_shared<constant_medium>(boundary, m.density, textures[m.texture]));
+    }
+
+    load_camera(h.camera, cam);
+    return scene;
+}
+
+#endif
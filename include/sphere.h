@@ -3,6 +3,7 @@
 
 #include "hittable.h"
 #include "vec3.h"
+#include "stats.h"
 
 class sphere : public hittable {
   public:
@@ -27,7 +28,15 @@ class sphere : public hittable {
 
     aabb bounding_box() const override { return bbox; }
 
+    void motion_bounds(double t0, double t1, aabb& b0, aabb& b1) const override {
+        // The center moves linearly, so the boxes at both ends are exact
+        vec3 rvec(radius, radius, radius);
+        b0 = aabb(center_at(t0) - rvec, center_at(t0) + rvec);
+        b1 = aabb(center_at(t1) - rvec, center_at(t1) + rvec);
+    }
+
     bool hit(const ray& r, interval ray_t, hit_record& rec) const override {
+        RT_STAT(sphere_tests);
         vec3 center = center_at(r.time());
         vec3 oc = r.origin() - center;
         auto a = r.direction().length_squared();
@@ -51,18 +60,27 @@ class sphere : public hittable {
         vec3 outward_normal = (rec.p - center) / radius;    // Points outward from surface
         rec.set_face_normal(r, outward_normal);
         get_sphere_uv(outward_normal, rec.u, rec.v);
+        rec.footprint = r.footprint(root) / (pi * radius);  // v spans half a great circle
         rec.mat = mat;
+        rec.object = this;
 
         return true;
     }
 
-  private:
-    point3 center1;
-    double radius;
-    shared_ptr<material> mat;
-    bool is_moving;
-    vec3 center_vec;
-    aabb bbox;
+    bool hit_span(const ray& r, interval& span) const override {
+        // Both roots of the intersection quadratic in one go
+        vec3 oc = r.origin() - center_at(r.time());
+        auto a = r.direction().length_squared();
+        auto half_b = dot(oc, r.direction());
+        auto c = oc.length_squared() - radius*radius;
+
+        auto discriminant = half_b*half_b - a*c;
+        if (discriminant <= 0) return false;
+        auto sqrtd = sqrt(discriminant);
+
+        span = interval((-half_b - sqrtd) / a, (-half_b + sqrtd) / a);
+        return true;
+    }
 
     point3 center_at(double time) const {
       // Linearly interpolate from center1 to center2 according to time, where t=0 yields
@@ -70,6 +88,9 @@ class sphere : public hittable {
       return is_moving ? (center1 + time*center_vec) : center1;
     }
 
+    double get_radius() const { return radius; }
+    const shared_ptr<material>& get_material() const { return mat; }
+
     static void get_sphere_uv(const point3& p, double& u, double& v) {
       // p: a given point on the sphere of radius one, centered at the origin.
       // u: returned value [0,1] of angle around the Y axis from X=-1.
@@ -84,6 +105,14 @@ class sphere : public hittable {
       u = phi / (2*pi);
       v = theta / pi;
     }
+
+  private:
+    point3 center1;
+    double radius;
+    shared_ptr<material> mat;
+    bool is_moving;
+    vec3 center_vec;
+    aabb bbox;
 };
 
 #endif
\ No newline at end of file
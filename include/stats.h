@@ -0,0 +1,205 @@
+#ifndef STATS_H
+#define STATS_H
+
+#include <algorithm>
+#include <cstdint>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <mutex>
+#include <string>
+#include <vector>
+
+/**
+ * @brief Counts of the work done to trace rays. Each thread adds to its own copy through
+ * RT_STAT, which only counts when built with RT_STATS defined (`make STATS=1`) and is
+ * otherwise compiled out.
+ *
+ */
+struct ray_stats {
+    uint64_t camera_samples = 0;
+    uint64_t rays = 0;              // Rays traced through the scene, shadow rays included
+    uint64_t shadow_rays = 0;
+    uint64_t bvh_nodes = 0;         // Nodes visited in the BVHs, snapshot ones included
+    uint64_t aabb_tests = 0;        // aabb::hit calls and the box tests of those BVHs
+    uint64_t list_objects = 0;      // Objects tested by hittable_list::hit
+    uint64_t sphere_tests = 0;
+    uint64_t quad_tests = 0;        // Triangles included
+    uint64_t medium_tests = 0;      // constant_medium::hit calls
+
+    uint64_t primitive_tests() const { return sphere_tests + quad_tests + medium_tests; }
+
+    ray_stats& operator+=(const ray_stats& o) {
+        camera_samples += o.camera_samples;
+        rays += o.rays;
+        shadow_rays += o.shadow_rays;
+        bvh_nodes += o.bvh_nodes;
+        aabb_tests += o.aabb_tests;
+        list_objects += o.list_objects;
+        sphere_tests += o.sphere_tests;
+        quad_tests += o.quad_tests;
+        medium_tests += o.medium_tests;
+        return *this;
+    }
+
+    ray_stats& operator-=(const ray_stats& o) {
+        camera_samples -= o.camera_samples;
+        rays -= o.rays;
+        shadow_rays -= o.shadow_rays;
+        bvh_nodes -= o.bvh_nodes;
+        aabb_tests -= o.aabb_tests;
+        list_objects -= o.list_objects;
+        sphere_tests -= o.sphere_tests;
+        quad_tests -= o.quad_tests;
+        medium_tests -= o.medium_tests;
+        return *this;
+    }
+};
+
+#ifdef RT_STATS
+constexpr bool stats_enabled = true;
+inline ray_stats& thread_stats() {
+    thread_local ray_stats stats;
+    return stats;
+}
+#define RT_STAT(counter) (++thread_stats().counter)
+#define RT_STAT_ADD(counter, n) (thread_stats().counter += (n))
+#else
+constexpr bool stats_enabled = false;
+inline ray_stats& thread_stats() {
+    static ray_stats unused;
+    return unused;
+}
+#define RT_STAT(counter) ((void)0)
+#define RT_STAT_ADD(counter, n) ((void)0)
+#endif
+
+
+/**
+ * @brief Statistics of one render: the totals over every thread, and per pixel the BVH nodes
+ * visited and primitives tested, summed over its samples.
+ *
+ */
+class stats_report {
+  public:
+    ray_stats total;
+    int width = 0, height = 0;
+    std::vector<uint64_t> nodes, tests;
+
+    void reset(int w, int h) {
+        total = ray_stats();
+        width = w;
+        height = h;
+        nodes.assign(static_cast<size_t>(w) * h, 0);
+        tests.assign(static_cast<size_t>(w) * h, 0);
+    }
+
+    void merge(const ray_stats& s) {
+        std::lock_guard<std::mutex> lock(mutex);
+        total += s;
+    }
+
+    void print(std::ostream& out, double seconds) const {
+        auto per = [](uint64_t a, uint64_t b) { return b > 0 ? static_cast<double>(a) / b : 0.0; };
+        auto& t = total;
+        out << std::fixed << std::setprecision(2)
+            << "Rays: " << t.rays << " (" << t.shadow_rays << " shadow), "
+            << t.rays / std::max(seconds, 1e-9) / 1e6 << " M rays/sec\n"
+            << "Per ray: " << per(t.bvh_nodes, t.rays) << " BVH nodes, "
+            << per(t.aabb_tests, t.rays) << " box tests, "
+            << per(t.primitive_tests(), t.rays) << " primitive tests ("
+            << per(t.sphere_tests, t.rays) << " spheres, " << per(t.quad_tests, t.rays) << " quads, "
+            << per(t.medium_tests, t.rays) << " media), "
+            << per(t.list_objects, t.rays) << " list objects\n"
+            << "Average path depth: " << per(t.rays - t.shadow_rays, t.camera_samples) << " rays per sample\n";
+        out.unsetf(std::ios::floatfield);
+    }
+
+    /**
+     * @brief Writes <prefix>_nodes.ppm and <prefix>_tests.ppm, false-color maps of the BVH nodes
+     * visited and primitives tested per pixel, from black through blue, red and yellow to white
+     * at the 99th percentile, so that a few outliers don't wash out the rest.
+     *
+     */
+    bool write_heatmaps(const std::string& prefix) const {
+        return write_heatmap(prefix + "_nodes.ppm", nodes) && write_heatmap(prefix + "_tests.ppm", tests);
+    }
+
+  private:
+    std::mutex mutex;
+
+    bool write_heatmap(const std::string& filename, const std::vector<uint64_t>& values) const {
+        std::ofstream file(filename);
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << filename << "'.\n";
+            return false;
+        }
+
+        auto sorted = values;
+        std::sort(sorted.begin(), sorted.end());
+        double high = sorted.empty() ? 1 : std::max<double>(sorted[sorted.size() * 99 / 100], 1);
+
+        static const double stops[5][3] = { {0,0,0}, {0,0,1}, {1,0,0}, {1,1,0}, {1,1,1} };
+        file << "P3\n" << width << ' ' << height << "\n255\n";
+        for (auto v : values) {
+            auto x = std::min(v / high, 1.0) * 4;
+            auto i = std::min(static_cast<int>(x), 3);
+            auto f = x - i;
+            for (int c = 0; c < 3; c++) {
+                auto value = stops[i][c] + f * (stops[i+1][c] - stops[i][c]);
+                file << static_cast<int>(255.999 * value) << (c < 2 ? ' ' : '\n');
+            }
+        }
+        std::clog << "Wrote " << filename << ", white at " << high << " per pixel\n";
+        return static_cast<bool>(file);
+    }
+};
+
+
+/**
+ * @brief One render thread's share of a stats_report: wrap each pixel in begin() and end() to
+ * charge it the thread's counters in between, adding up over passes. Totals are merged into
+ * the report when the recorder goes out of scope. Does nothing without RT_STATS or without a
+ * report.
+ *
+ */
+class stats_recorder {
+  public:
+    explicit stats_recorder(stats_report* report) : report(stats_enabled ? report : nullptr) {
+        if (this->report) start = thread_stats();
+    }
+
+    ~stats_recorder() {
+        if (!report) return;
+        auto delta = thread_stats();
+        delta -= start;
+        report->merge(delta);
+    }
+
+    void begin() {
+        if (!report) return;
+        auto& s = thread_stats();
+        pixel_nodes = s.bvh_nodes;
+        pixel_tests = s.primitive_tests();
+    }
+
+    void end(size_t pixel, int samples) {
+        if (!report) return;
+        auto& s = thread_stats();
+        s.camera_samples += samples;
+        report->nodes[pixel] += s.bvh_nodes - pixel_nodes;
+        report->tests[pixel] += s.primitive_tests() - pixel_tests;
+    }
+
+    // Counts camera samples of a thread that traces them without telling pixels apart
+    void add_samples(uint64_t samples) {
+        if (report) thread_stats().camera_samples += samples;
+    }
+
+  private:
+    stats_report* report;
+    ray_stats start;
+    uint64_t pixel_nodes = 0, pixel_tests = 0;
+};
+
+#endif
@@ -3,13 +3,23 @@
 
 #include "utils.h"
 #include "color.h"
-#include "rtw_stb_image.h"
+#include "texture_cache.h"
 #include "perlin.h"
 
+#include <string>
+#include <vector>
+
 class texture {
   public:
     virtual ~texture() = default;
     virtual color value(double u, double v, const point3& p) const = 0;
+
+    // Value averaged over a footprint of the given width in texture coordinates. Textures that
+    // can prefilter override this; everything else point-samples.
+    virtual color filtered_value(double u, double v, const point3& p, double footprint) const {
+        (void) footprint;
+        return value(u, v, p);
+    }
 };
 
 class solid_color: public texture {
@@ -21,6 +31,8 @@ class solid_color: public texture {
             (void) u; (void) v; (void) p;
             return color_value;
         }
+
+        const color& get_color() const { return color_value; }
     
     private:
         color color_value;
@@ -37,44 +49,62 @@ class checker_texture : public texture {
         {}
 
         color value(double u, double v, const point3& p) const override {
-            auto xFloor = static_cast<int>(std::floor(inv_scale * p.x()));
-            auto yFloor = static_cast<int>(std::floor(inv_scale * p.y()));
-            auto zFloor = static_cast<int>(std::floor(inv_scale * p.z()));
+            return is_even(p) ? even->value(u, v, p) : odd->value(u, v, p);
+        }
 
-            bool isEven = (xFloor + yFloor + zFloor) % 2 == 0;
-            return isEven ? even->value(u, v, p) : odd->value(u, v, p);
+        color filtered_value(double u, double v, const point3& p, double footprint) const override {
+            return is_even(p) ? even->filtered_value(u, v, p, footprint)
+                              : odd->filtered_value(u, v, p, footprint);
         }
 
+        double get_inv_scale() const { return inv_scale; }
+        const shared_ptr<texture>& get_even() const { return even; }
+        const shared_ptr<texture>& get_odd() const { return odd; }
+
     private:
         double inv_scale;
         shared_ptr<texture> even;
         shared_ptr<texture> odd;
+
+        bool is_even(const point3& p) const {
+            auto xFloor = static_cast<int>(std::floor(inv_scale * p.x()));
+            auto yFloor = static_cast<int>(std::floor(inv_scale * p.y()));
+            auto zFloor = static_cast<int>(std::floor(inv_scale * p.z()));
+
+            return (xFloor + yFloor + zFloor) % 2 == 0;
+        }
 };
 
 class image_texture : public texture {
   public:
-    image_texture(const char* filename) : image(filename) {}
+    // With srgb set, texels are decoded from sRGB to linear values at load time. Textures with
+    // the same file share one image through the global texture_cache.
+    image_texture(const char* filename, bool srgb = false)
+      : image(texture_cache::global().load(filename, srgb)), filename(filename), srgb(srgb) {}
 
     color value(double u, double v, const point3& p) const override {
+        return filtered_value(u, v, p, 0);
+    }
+
+    color filtered_value(double u, double v, const point3& p, double footprint) const override {
         (void) p;   // Suppress unused parameter warning
         // If we have no texture data, then return solid cyan as a debugging aid.
-        if (image.height() <= 0) return color(0,1,1);
+        if (image->height() <= 0) return color(0,1,1);
 
         // Clamp input texture coordinates to [0,1] x [1,0]
         u = interval(0,1).clamp(u);
         v = 1.0 - interval(0,1).clamp(v);  // Flip V to image coordinates
 
-        // u in [0,1] leads to i in [0,width-1], same for v and j
-        auto i = static_cast<int>(u * image.width());
-        auto j = static_cast<int>(v * image.height());
-        auto pixel = image.pixel_data(i,j);
-
-        auto color_scale = 1.0 / 255.0;
-        return color(color_scale*pixel[0], color_scale*pixel[1], color_scale*pixel[2]);
+        return image->trilinear(u, v, footprint);
     }
 
+    const std::string& get_filename() const { return filename; }
+    bool get_srgb() const { return srgb; }
+
   private:
-    rtw_image image;
+    shared_ptr<rtw_image> image;
+    std::string filename;
+    bool srgb;
 };
 
 /**
@@ -92,6 +122,10 @@ class tiled_noise_texture : public texture {
                     }
                 }
             }
+
+        // Rebuilds a texture from the nine colors of another
+        tiled_noise_texture(double _scale, const std::vector<color>& colors)
+            : inv_scale(1.0/_scale), c(colors) {}
     
         color value(double u, double v, const point3& p) const override {
             (void) u; (void) v;
@@ -100,6 +134,9 @@ class tiled_noise_texture : public texture {
 
             return c[(xFloor%3)*3 + (zFloor%3)];
         }
+
+        double get_inv_scale() const { return inv_scale; }
+        const std::vector<color>& get_colors() const { return c; }
     
     private:
         double inv_scale;
@@ -114,15 +151,33 @@ class perlin_noise_texture : public texture {
   public:
     perlin_noise_texture(double _scale): scale(_scale) {}
 
+    // Bakes the turbulence over bake_bounds (in world space) into a resolution^3 grid. Points
+    // outside the bounds still evaluate the noise directly.
+    perlin_noise_texture(double _scale, const aabb& bake_bounds, int resolution) : scale(_scale) {
+        auto scaled = aabb(scale * point3(bake_bounds.x.min, bake_bounds.y.min, bake_bounds.z.min),
+                           scale * point3(bake_bounds.x.max, bake_bounds.y.max, bake_bounds.z.max));
+        baked = make_shared<baked_turbulence>(noise, scaled, resolution);
+    }
+
+    // Rebuilds a texture from the generator and baked grid, if any, of another
+    perlin_noise_texture(double _scale, const perlin& noise, shared_ptr<baked_turbulence> baked)
+      : noise(noise), scale(_scale), baked(baked) {}
+
     color value(double u, double v, const point3& p) const override {
         (void) u; (void) v;
         auto s = scale * p;
-        return color(1,1,1) * 0.5 * (1 + sin(s.z() + 10*noise.turb(s)));
+        auto turbulence = (baked && baked->contains(s)) ? baked->turb(s) : noise.turb(s);
+        return color(1,1,1) * 0.5 * (1 + sin(s.z() + 10*turbulence));
     }
 
+    double get_scale() const { return scale; }
+    const perlin& get_noise() const { return noise; }
+    const shared_ptr<baked_turbulence>& get_baked() const { return baked; }
+
   private:
     perlin noise;
     double scale;
+    shared_ptr<baked_turbulence> baked;
 };
 
 #endif
\ No newline at end of file
@@ -0,0 +1,423 @@
+#ifndef TEXTURE_CACHE_H
+#define TEXTURE_CACHE_H
+
+#include "utils.h"
+#include "rtw_stb_image.h"
+#include "profiler.h"
+
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <fcntl.h>
+#include <functional>
+#include <future>
+#include <iomanip>
+#include <list>
+#include <mutex>
+#include <string>
+#include <sys/stat.h>
+#include <unistd.h>
+#include <unordered_map>
+#include <vector>
+
+/**
+ * @brief Process-wide cache of image textures.
+ *
+ * Every image is loaded once per (path, sRGB flag) for as long as its file keeps the same size
+ * and modification time; a changed file is loaded again. The first time an image is seen its
+ * mip pyramid is converted to a tiled file in the cache directory ($RTW_TEXTURE_CACHE, default
+ * .rtw_cache/), and from then on tiles are read from that file on demand. Resident tiles of all
+ * images share one memory budget ($RTW_TEXTURE_CACHE_MB, default 512) and are evicted least
+ * recently used first. If the tiled file can't be written the image simply stays in memory.
+ * Images stay loaded until release_unused() finds nothing else referring to them.
+ *
+ * Each thread also keeps the last few tiles it used in a small direct-mapped cache of its own,
+ * which serves most lookups without touching the shared cache or its lock; only a miss there
+ * locks. Tiles held by threads stay alive after the shared cache evicts them, so residency can
+ * exceed the budget by up to thread_tile_slots tiles per thread.
+ *
+ * Tiled file layout, all little-endian as written by the host:
+ *   header: magic "RTWT", version, source size, source mtime, sRGB flag, level count
+ *   per level: width, height, tiles_x, tiles_y, byte offset of its first tile
+ *   tiles: texels_per_tile texels each, level by level, in tile-major order
+ */
+class texture_cache {
+  public:
+    struct texture_stats {
+        std::string path;
+        size_t hits = 0;        // Tile requests served from memory, by a thread's own tiles or shared
+        size_t misses = 0;      // Tile requests that had to read the tiled file
+        size_t evictions = 0;   // Tiles of this texture dropped to stay under budget
+        size_t resident = 0;    // Tiles of this texture currently in memory
+    };
+
+    static texture_cache& global() {
+        static texture_cache cache;
+        return cache;
+    }
+
+    /**
+     * @brief Returns the shared image for the given file, loading and converting it on first use.
+     *
+     */
+    shared_ptr<rtw_image> load(const char* filename, bool srgb_decode = false) {
+        auto path = rtw_image::find_file(filename);
+        if (path.empty()) {
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+            return make_shared<rtw_image>(srgb_decode);
+        }
+
+        // The first caller of a key loads it; callers arriving meanwhile wait on its future.
+        // Decoding runs outside the lock, so different images can load on different threads.
+        // An entry loaded from an older version of the file is replaced; whoever already holds
+        // the old image keeps it.
+        auto key = path + (srgb_decode ? "#srgb" : "");
+        uint64_t size = 0, mtime = 0;
+        source_stat(path, size, mtime);
+        std::promise<shared_ptr<rtw_image>> loaded;
+        std::shared_future<shared_ptr<rtw_image>> pending, stale;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            auto found = images.find(key);
+            if (found != images.end() && found->second.size == size && found->second.mtime == mtime) {
+                pending = found->second.image;
+            } else {
+                // The stale image is destroyed outside the lock, which its tiled file takes
+                if (found != images.end()) stale = found->second.image;
+                images[key] = { size, mtime, loaded.get_future().share() };
+            }
+        }
+        if (pending.valid()) return pending.get();
+
+        profile_scope scope("load texture");
+        auto image = make_shared<rtw_image>(srgb_decode);
+        if (!open_tiled(path, *image) && image->load(path)) {
+            auto tiled = tiled_path(path, srgb_decode);
+            if (write_tiled(path, *image, tiled) && open_tiled(path, *image))
+                std::clog << "Converted texture '" << path << "' to " << tiled << '\n';
+        }
+        if (image->height() <= 0)
+            std::cerr << "ERROR: Could not load image file '" << filename << "'.\n";
+
+        loaded.set_value(image);
+        return image;
+    }
+
+    /**
+     * @brief Drops the images that nothing but the cache refers to any more, closing their tiled
+     * files and freeing their resident tiles. Call after releasing scenes that used textures.
+     *
+     */
+    void release_unused() {
+        std::vector<shared_ptr<rtw_image>> unused;
+        {
+            std::lock_guard<std::mutex> lock(mutex);
+            for (auto it = images.begin(); it != images.end();) {
+                const auto& image = it->second.image;
+                if (image.wait_for(std::chrono::seconds(0)) == std::future_status::ready
+                        && image.get().use_count() == 1) {
+                    unused.push_back(image.get());
+                    it = images.erase(it);
+                } else {
+                    ++it;
+                }
+            }
+        }
+        // The images are destroyed here, outside the lock their tiled files take to drop their tiles
+    }
+
+    void set_memory_budget(size_t bytes) {
+        std::lock_guard<std::mutex> lock(mutex);
+        memory_budget = bytes;
+        evict_to_budget();
+    }
+
+    void report(std::ostream& out) {
+        merge_thread_hits(thread_tiles());
+        std::lock_guard<std::mutex> lock(mutex);
+        if (stats.empty()) return;
+
+        out << "Texture cache: " << resident_bytes() / (1024*1024) << " of "
+            << memory_budget / (1024*1024) << " MB resident\n";
+        for (const auto& s : stats) {
+            auto requests = s.hits + s.misses;
+            auto hit_rate = requests > 0 ? 100.0 * s.hits / requests : 100.0;
+            out << "  " << s.path << ": " << s.hits << " hits, " << s.misses << " misses ("
+                << std::fixed << std::setprecision(2) << hit_rate << "% hit rate), "
+                << s.evictions << " evictions, " << s.resident << " tiles resident\n";
+            out.unsetf(std::ios::fixed);
+        }
+    }
+
+  private:
+    static constexpr uint32_t magic = 0x54575452;   // "RTWT"
+    static constexpr uint32_t version = 1;
+    static constexpr size_t tile_bytes = rtw_image::texels_per_tile * sizeof(texel);
+    static constexpr size_t thread_tile_slots = 64;
+
+    /**
+     * @brief Pages the tiles of one image in from its tiled file through the cache.
+     *
+     */
+    class tiled_file : public tile_provider {
+      public:
+        tiled_file(texture_cache& cache, int fd, uint32_t id, std::vector<uint64_t> level_offsets)
+          : cache(cache), fd(fd), id(id), level_offsets(std::move(level_offsets)) {}
+
+        ~tiled_file() {
+            cache.drop_tiles(id);
+            close(fd);
+        }
+
+        const texel* tile(int level, size_t tile_index) const override {
+            return cache.fetch_tile(*this, level, tile_index);
+        }
+
+        texture_cache& cache;
+        int fd;
+        uint32_t id;                            // Index into texture_cache::stats
+        std::vector<uint64_t> level_offsets;
+    };
+
+    struct resident_tile {
+        shared_ptr<const std::vector<texel>> texels;
+        std::list<uint64_t>::iterator lru_position;
+    };
+
+    // The tiles one thread used last, direct-mapped by key, with its hits not yet counted in stats
+    struct thread_tile_cache {
+        struct slot {
+            uint64_t key = ~uint64_t(0);
+            shared_ptr<const std::vector<texel>> texels;
+        };
+
+        slot slots[thread_tile_slots];
+        std::vector<size_t> hits;               // Per texture id
+
+        ~thread_tile_cache() { texture_cache::global().merge_thread_hits(*this); }
+    };
+
+    struct cached_image {
+        uint64_t size, mtime;                   // Of the source file the image was loaded from
+        std::shared_future<shared_ptr<rtw_image>> image;
+    };
+
+    mutable std::mutex mutex;
+    size_t memory_budget;
+    std::string cache_dir;
+    std::unordered_map<uint64_t, resident_tile> resident_tiles;
+    std::list<uint64_t> lru;                    // Most recently used tile key at the front
+    std::vector<texture_stats> stats;
+    // Last, so the images are destroyed first; their tiled files still drop their tiles
+    std::unordered_map<std::string, cached_image> images;
+
+    texture_cache() {
+        auto budget_mb = getenv("RTW_TEXTURE_CACHE_MB");
+        memory_budget = static_cast<size_t>(budget_mb ? atol(budget_mb) : 512) * 1024 * 1024;
+
+        auto dir = getenv("RTW_TEXTURE_CACHE");
+        cache_dir = dir ? dir : ".rtw_cache";
+    }
+
+    static uint64_t tile_key(uint32_t id, int level, size_t tile_index) {
+        // 20 bits of texture, 6 bits of level, 38 bits of tile
+        return (static_cast<uint64_t>(id) << 44) | (static_cast<uint64_t>(level) << 38) | tile_index;
+    }
+
+    static thread_tile_cache& thread_tiles() {
+        thread_local thread_tile_cache tiles;
+        return tiles;
+    }
+
+    const texel* fetch_tile(const tiled_file& file, int level, size_t tile_index) {
+        auto key = tile_key(file.id, level, tile_index);
+        auto& tiles = thread_tiles();
+        auto& slot = tiles.slots[(key * 0x9E3779B97F4A7C15ull) >> 58];
+        if (slot.key == key) {
+            if (tiles.hits.size() <= file.id) tiles.hits.resize(file.id + 1);
+            tiles.hits[file.id]++;
+            return slot.texels->data();
+        }
+
+        slot.texels = shared_tile(file, level, tile_index, key);
+        slot.key = key;
+        return slot.texels->data();
+    }
+
+    shared_ptr<const std::vector<texel>> shared_tile(const tiled_file& file, int level, size_t tile_index,
+                                                     uint64_t key) {
+        std::lock_guard<std::mutex> lock(mutex);
+        auto& s = stats[file.id];
+
+        auto found = resident_tiles.find(key);
+        if (found != resident_tiles.end()) {
+            s.hits++;
+            lru.splice(lru.begin(), lru, found->second.lru_position);
+            return found->second.texels;
+        }
+
+        s.misses++;
+        auto texels = make_shared<std::vector<texel>>(rtw_image::texels_per_tile);
+        auto offset = file.level_offsets[level] + tile_index * tile_bytes;
+        if (pread(file.fd, texels->data(), tile_bytes, static_cast<off_t>(offset))
+                != static_cast<ssize_t>(tile_bytes))
+            texels->assign(rtw_image::texels_per_tile, texel{1, 0, 1});    // Magenta marks a bad read
+
+        lru.push_front(key);
+        resident_tiles[key] = { texels, lru.begin() };
+        s.resident++;
+        evict_to_budget();
+
+        return texels;
+    }
+
+    void merge_thread_hits(thread_tile_cache& tiles) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (size_t id = 0; id < tiles.hits.size() && id < stats.size(); id++)
+            stats[id].hits += tiles.hits[id];
+        tiles.hits.clear();
+    }
+
+    // Frees the resident tiles of a texture whose tiled file is closing
+    void drop_tiles(uint32_t id) {
+        std::lock_guard<std::mutex> lock(mutex);
+        for (auto it = lru.begin(); it != lru.end();) {
+            if ((*it >> 44) != id) {
+                ++it;
+                continue;
+            }
+            resident_tiles.erase(*it);
+            stats[id].resident--;
+            it = lru.erase(it);
+        }
+    }
+
+    // Callers hold the lock
+    size_t resident_bytes() const { return resident_tiles.size() * tile_bytes; }
+
+    void evict_to_budget() {
+        // Keep at least one tile so the tile just fetched is still resident under a tiny budget
+        while (resident_bytes() > memory_budget && lru.size() > 1) {
+            auto key = lru.back();
+            lru.pop_back();
+            resident_tiles.erase(key);
+
+            auto& s = stats[key >> 44];
+            s.evictions++;
+            s.resident--;
+        }
+    }
+
+    std::string tiled_path(const std::string& path, bool srgb_decode) const {
+        auto name = std::to_string(std::hash<std::string>()(path));
+        return cache_dir + "/" + name + (srgb_decode ? ".srgb" : "") + ".rtwt";
+    }
+
+    static bool source_stat(const std::string& path, uint64_t& size, uint64_t& mtime) {
+        struct stat st;
+        if (stat(path.c_str(), &st) != 0) return false;
+        // In nanoseconds, so an edit within the same second as the load is still noticed
+        size = static_cast<uint64_t>(st.st_size);
+        mtime = static_cast<uint64_t>(st.st_mtim.tv_sec) * 1000000000 + static_cast<uint64_t>(st.st_mtim.tv_nsec);
+        return true;
+    }
+
+    bool write_tiled(const std::string& path, const rtw_image& image, const std::string& tiled) {
+        uint64_t size, mtime;
+        if (!source_stat(path, size, mtime)) return false;
+        ::mkdir(cache_dir.c_str(), 0755);
+
+        // Write to a unique temporary name first, so neither a crash nor another process converting
+        // the same image at the same time can leave a truncated or mixed tiled file behind
+        std::string temp = tiled + ".XXXXXX";
+        int fd = mkstemp(&temp[0]);
+        if (fd < 0) return false;
+        fchmod(fd, 0644);
+        auto file = fdopen(fd, "wb");
+        if (!file) {
+            close(fd);
+            remove(temp.c_str());
+            return false;
+        }
+
+        uint32_t srgb = image.srgb_decode ? 1 : 0;
+        uint32_t level_count = static_cast<uint32_t>(image.levels.size());
+        fwrite(&magic, sizeof magic, 1, file);
+        fwrite(&version, sizeof version, 1, file);
+        fwrite(&size, sizeof size, 1, file);
+        fwrite(&mtime, sizeof mtime, 1, file);
+        fwrite(&srgb, sizeof srgb, 1, file);
+        fwrite(&level_count, sizeof level_count, 1, file);
+
+        uint64_t offset = 4*sizeof(uint32_t) + 2*sizeof(uint64_t)
+                        + level_count * (4*sizeof(int32_t) + sizeof(uint64_t));
+        for (const auto& l : image.levels) {
+            int32_t dims[4] = { l.width, l.height, l.tiles_x,
+                                static_cast<int32_t>(l.texels.size() / rtw_image::texels_per_tile / l.tiles_x) };
+            fwrite(dims, sizeof dims, 1, file);
+            fwrite(&offset, sizeof offset, 1, file);
+            offset += l.texels.size() * sizeof(texel);
+        }
+
+        bool ok = true;
+        for (const auto& l : image.levels)
+            ok = ok && fwrite(l.texels.data(), sizeof(texel), l.texels.size(), file) == l.texels.size();
+        ok = (fclose(file) == 0) && ok;
+
+        if (!ok || rename(temp.c_str(), tiled.c_str()) != 0) {
+            remove(temp.c_str());
+            return false;
+        }
+        return true;
+    }
+
+    bool open_tiled(const std::string& path, rtw_image& image) {
+        // Switches the image over to paging from its tiled file. Returns false, leaving the image
+        // untouched, if there is no tiled file or it is stale.
+        uint64_t size, mtime;
+        if (!source_stat(path, size, mtime)) return false;
+
+        auto tiled = tiled_path(path, image.srgb_decode);
+        int fd = open(tiled.c_str(), O_RDONLY);
+        if (fd < 0) return false;
+
+        uint32_t header[2], srgb, level_count;
+        uint64_t file_size, file_mtime;
+        bool ok = read(fd, header, sizeof header) == sizeof header
+               && read(fd, &file_size, sizeof file_size) == sizeof file_size
+               && read(fd, &file_mtime, sizeof file_mtime) == sizeof file_mtime
+               && read(fd, &srgb, sizeof srgb) == sizeof srgb
+               && read(fd, &level_count, sizeof level_count) == sizeof level_count
+               && header[0] == magic && header[1] == version
+               && file_size == size && file_mtime == mtime
+               && srgb == (image.srgb_decode ? 1u : 0u) && level_count > 0 && level_count < 64;
+
+        std::vector<rtw_image::mip_level> levels(ok ? level_count : 0);
+        std::vector<uint64_t> offsets(levels.size());
+        for (size_t i = 0; ok && i < levels.size(); i++) {
+            int32_t dims[4];
+            ok = read(fd, dims, sizeof dims) == sizeof dims
+              && read(fd, &offsets[i], sizeof offsets[i]) == sizeof offsets[i];
+            levels[i].width = dims[0];
+            levels[i].height = dims[1];
+            levels[i].tiles_x = dims[2];
+        }
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!ok || stats.size() >= (1u << 20)) {
+            close(fd);
+            return false;
+        }
+
+        texture_stats s;
+        s.path = path;
+        stats.push_back(s);
+
+        image.levels = std::move(levels);
+        image.pager = make_shared<tiled_file>(*this, fd, static_cast<uint32_t>(stats.size() - 1), offsets);
+        return true;
+    }
+};
+
+#endif
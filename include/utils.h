@@ -6,6 +6,8 @@
 #include <memory>
 #include <algorithm>
 #include <cstdlib>
+#include <atomic>
+#include <random>
 
 // Usings
 
@@ -32,8 +34,12 @@ inline double degrees_to_radians(double degrees) {
  * @return double 
  */
 inline double random_double() {
-    // Returns a random real in [0,1).
-    return rand() / (RAND_MAX + 1.0);
+    // Returns a random real in [0,1). Each thread draws from its own generator; the first thread
+    // to ask gets the generator's default seed, later ones the seeds after it.
+    static std::atomic<unsigned> next_seed{std::mt19937::default_seed};
+    thread_local std::mt19937 generator(next_seed++);
+    thread_local std::uniform_real_distribution<double> distribution(0.0, 1.0);
+    return distribution(generator);
 }
 
 /**
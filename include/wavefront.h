@@ -0,0 +1,248 @@
+#ifndef WAVEFRONT_H
+#define WAVEFRONT_H
+
+#include "utils.h"
+#include "color.h"
+#include "hittable.h"
+#include "material.h"
+#include "fog.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <cstdint>
+#include <tuple>
+#include <typeindex>
+#include <typeinfo>
+#include <utility>
+#include <vector>
+
+/**
+ * @brief Spreads the lower 10 bits of v so that there are two zero bits between each of them.
+ *
+ */
+inline uint32_t expand_bits_10(uint32_t v) {
+    v = (v * 0x00010001u) & 0xFF0000FFu;
+    v = (v * 0x00000101u) & 0x0F00F00Fu;
+    v = (v * 0x00000011u) & 0xC30C30C3u;
+    v = (v * 0x00000005u) & 0x49249249u;
+    return v;
+}
+
+/**
+ * @brief 30-bit Morton code of a point given in the unit cube [0,1]^3.
+ *
+ */
+inline uint32_t morton3(double x, double y, double z) {
+    static const interval unit_range(0, 1023);
+    auto xi = static_cast<uint32_t>(unit_range.clamp(x * 1024));
+    auto yi = static_cast<uint32_t>(unit_range.clamp(y * 1024));
+    auto zi = static_cast<uint32_t>(unit_range.clamp(z * 1024));
+    return (expand_bits_10(xi) << 2) | (expand_bits_10(yi) << 1) | expand_bits_10(zi);
+}
+
+/**
+ * @brief Sort key grouping rays first by direction octant, then by origin Morton code
+ * inside the scene bounds. Rays with close keys tend to walk the same BVH nodes.
+ *
+ */
+inline uint32_t ray_sort_key(const ray& r, const aabb& bounds) {
+    auto d = r.direction();
+    uint32_t octant = (d.x() < 0 ? 4 : 0) | (d.y() < 0 ? 2 : 0) | (d.z() < 0 ? 1 : 0);
+
+    // Map the origin into [0,1]^3; degenerate or unbounded axes collapse to 0
+    auto normalized = [](double x, const interval& range) {
+        auto n = (x - range.min) / range.size();
+        return std::isfinite(n) ? n : 0.0;
+    };
+
+    auto o = r.origin();
+    auto m = morton3(normalized(o.x(), bounds.x), normalized(o.y(), bounds.y), normalized(o.z(), bounds.z));
+
+    return (octant << 29) | (m >> 1);
+}
+
+/**
+ * @brief State of one in-flight camera path.
+ *
+ */
+struct path_state {
+    ray r;                  // Next ray to be traced along this path
+    color throughput;       // Product of all attenuations so far
+    color radiance;         // Radiance gathered so far
+    int pixel;              // Index of the pixel the path contributes to
+    int depth;              // Remaining bounces, same meaning as in camera::ray_color
+};
+
+/**
+ * @brief Streaming path tracer. Instead of tracing every path to completion before starting the
+ * next one, it keeps a large batch of paths in flight and advances all of them one bounce at a
+ * time, running generate / intersect / shade / compact as separate stages. Rays are sorted by
+ * direction octant and origin Morton code before intersection, and hits are shaded grouped by
+ * material so that consecutive work touches the same BVH nodes, materials and textures.
+ *
+ * The integrator has no light sampling, so there is no shadow stage: lights are only found
+ * by paths that hit them, exactly like camera::ray_color.
+ */
+class wavefront_integrator {
+  public:
+    bool show_progress = true;      // Print the remaining path count to std::clog
+
+    wavefront_integrator(const hittable& world, const color& background, const homogeneous_fog& fog,
+                         size_t batch_size)
+      : world(world), background(background), fog(fog), batch_size(batch_size > 0 ? batch_size : 1)
+    {
+        bounds = world.bounding_box();
+    }
+
+    /**
+     * @brief Trace `path_count` paths and add their radiance into `accum`.
+     *
+     * @param generate Called as generate(index, r, pixel) to produce the primary ray of path `index`
+     */
+    template <typename Generator>
+    void render(size_t path_count, int max_depth, Generator generate, std::vector<color>& accum) {
+        size_t next_path = 0;
+
+        paths.clear();
+        paths.reserve(batch_size);
+
+        while (next_path < path_count || !paths.empty()) {
+            if (show_progress)
+                std::clog << "\rPaths remaining: " << (path_count - next_path + paths.size()) << "    "
+                          << std::flush;
+
+            // Generate: top the batch back up with fresh camera paths
+            while (paths.size() < batch_size && next_path < path_count) {
+                path_state path;
+                generate(next_path++, path.r, path.pixel);
+                path.throughput = color(1,1,1);
+                path.radiance = color(0,0,0);
+                path.depth = max_depth;
+                paths.push_back(path);
+            }
+
+            sort_paths();
+            intersect();
+            shade();
+            compact(accum);
+        }
+    }
+
+  private:
+    const hittable& world;
+    color background;
+    homogeneous_fog fog;
+    size_t batch_size;
+    aabb bounds;
+
+    std::vector<path_state> paths;
+    std::vector<bool> done;
+    std::vector<std::pair<uint64_t, size_t>> order;     // (sort key, index) scratch buffer
+    std::vector<std::tuple<size_t, const material*, size_t>> shade_order;  // (type, instance, hit)
+    std::vector<path_state> scratch;
+    std::vector<hit_record> hits;
+    std::vector<size_t> hit_paths;                      // Path index for each entry of hits
+    std::vector<ray> rays;                              // Rays of the live paths, in path order
+    std::vector<hit_record> ray_hits;
+    std::vector<char> ray_hit;
+
+    void sort_paths() {
+        order.resize(paths.size());
+        for (size_t i = 0; i < paths.size(); i++)
+            order[i] = { ray_sort_key(paths[i].r, bounds), i };
+        std::sort(order.begin(), order.end());
+
+        scratch.resize(paths.size());
+        for (size_t i = 0; i < order.size(); i++)
+            scratch[i] = paths[order[i].second];
+        paths.swap(scratch);
+    }
+
+    void intersect() {
+        done.assign(paths.size(), false);
+        hits.clear();
+        hit_paths.clear();
+
+        // Trace every live path in one batch, so the world can share work between rays
+        rays.clear();
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (paths[i].depth <= 0)
+                done[i] = true;     // Assume all light is absorbed after max_depth
+            else
+                rays.push_back(paths[i].r);
+        }
+        world.hit_batch(rays, interval(0.001, infinity), ray_hits, ray_hit);
+        RT_STAT_ADD(rays, rays.size());
+
+        for (size_t i = 0, k = 0; i < paths.size(); i++) {
+            if (done[i]) continue;
+            auto& path = paths[i];
+            const auto& rec = ray_hits[k];
+            bool hit_anything = ray_hit[k++];
+
+            // Fog scattering is shaded right here; it needs no material
+            double t_fog;
+            if (fog.sample_distance(path.r, interval(0.001, hit_anything ? rec.t : infinity), t_fog)) {
+                ray scattered(path.r.at(t_fog), random_unit_vector(), path.r.time());
+                scattered.set_cone(path.r.footprint(t_fog), path.r.cone_spread());
+                path.throughput = path.throughput * fog.albedo;
+                path.r = scattered;
+                path.depth--;
+                continue;
+            }
+
+            if (!hit_anything) {
+                path.radiance += path.throughput * background;
+                done[i] = true;
+                continue;
+            }
+
+            hits.push_back(rec);
+            hit_paths.push_back(i);
+        }
+    }
+
+    void shade() {
+        // Group hits by material type, then by material instance, so each run of shading
+        // executes the same scatter() code against the same textures.
+        shade_order.resize(hits.size());
+        for (size_t i = 0; i < hits.size(); i++) {
+            const auto& mat = *hits[i].mat;
+            shade_order[i] = { std::type_index(typeid(mat)).hash_code(), &mat, i };
+        }
+        std::sort(shade_order.begin(), shade_order.end());
+
+        for (const auto& entry : shade_order) {
+            auto hit_index = std::get<2>(entry);
+            const auto& rec = hits[hit_index];
+            auto& path = paths[hit_paths[hit_index]];
+
+            path.radiance += path.throughput * rec.mat->emitted(rec.u, rec.v, rec.p);
+
+            ray scattered;
+            color attenuation;
+            if (!rec.mat->scatter(path.r, rec, attenuation, scattered)) {
+                done[hit_paths[hit_index]] = true;
+                continue;
+            }
+
+            scattered.set_cone(path.r.footprint(rec.t), path.r.cone_spread());
+            path.throughput = path.throughput * attenuation;
+            path.r = scattered;
+            path.depth--;
+        }
+    }
+
+    void compact(std::vector<color>& accum) {
+        size_t alive = 0;
+        for (size_t i = 0; i < paths.size(); i++) {
+            if (done[i])
+                accum[paths[i].pixel] += paths[i].radiance;
+            else
+                paths[alive++] = paths[i];
+        }
+        paths.resize(alive);
+    }
+};
+
+#endif
@@ -0,0 +1,342 @@
+#include "utils.h"
+#include "color.h"
+#include "hittable_list.h"
+#include "sphere.h"
+#include "quad.h"
+#include "bvh.h"
+#include "motion_bvh.h"
+#include "material.h"
+#include "perlin.h"
+#include "texture.h"
+#include "stats.h"
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstring>
+#include <ctime>
+#include <iomanip>
+#include <iostream>
+#include <string>
+#include <vector>
+
+
+/**
+ * @brief Microbenchmarks of the kernels every render spends its time in: box, sphere and quad
+ * intersection, BVH traversal over synthetic scenes, Perlin turbulence, image texture lookups,
+ * random directions and pixel output. `make bench` builds and runs them and writes the results
+ * as JSON, so that runs on the same machine can be compared over time.
+ *
+ * Each benchmark calls its kernel on a fixed table of precomputed inputs, so that generating
+ * inputs isn't timed. The number of calls per repetition is doubled until one repetition takes
+ * at least --min-time, then a few warmup repetitions are discarded and the rest are timed.
+ *
+ */
+struct bench_options {
+    std::string output;         // JSON path, stdout if empty
+    std::string filter;         // Only benchmarks whose name contains this
+    int repetitions = 10;
+    int warmup = 2;
+    double min_time = 0.025;    // Seconds per repetition
+};
+
+struct bench_result {
+    std::string name;
+    size_t ops = 0;             // Calls per repetition
+    double mean = 0, stddev = 0, min = 0, max = 0;     // Nanoseconds per call
+    double hit_rate = -1;       // Fraction of calls that hit, -1 for kernels that don't trace
+};
+
+// Inputs are drawn once into tables of this size and cycled through
+const size_t table_size = 4096;
+
+// Keeps the compiler from optimizing away results that are otherwise unused
+volatile double bench_sink;
+
+
+class benchmark_runner {
+  public:
+    explicit benchmark_runner(const bench_options& options) : options(options) {}
+
+    std::vector<bench_result> results;
+
+    bool selected(const char* name) const {
+        return options.filter.empty() || strstr(name, options.filter.c_str()) != nullptr;
+    }
+
+    /**
+     * @brief Times `op(i)` for i = 0, 1, 2, ... and records the result under `name`. `op`
+     * returns a value that is summed, so its work can't be dropped; with `counts_hits` the
+     * value is 1 for a hit and 0 for a miss and the hit rate is reported too.
+     *
+     */
+    template <typename Op>
+    void run(const char* name, Op op, bool counts_hits = false) {
+        if (!selected(name)) return;
+
+        // Calibrate the repetition length; this doubles as the first warmup
+        size_t ops = 1024;
+        double sum = 0;
+        while (true) {
+            auto seconds = time_batch(op, ops, sum);
+            if (seconds >= options.min_time || ops >= (size_t(1) << 40)) break;
+            ops *= 2;
+        }
+        for (int i = 0; i < options.warmup; i++) time_batch(op, ops, sum);
+
+        std::vector<double> samples;
+        double hits = 0;
+        for (int i = 0; i < options.repetitions; i++) {
+            double rep_sum = 0;
+            samples.push_back(time_batch(op, ops, rep_sum) * 1e9 / ops);
+            hits += rep_sum;
+            sum += rep_sum;
+        }
+        bench_sink = sum;
+
+        bench_result r;
+        r.name = name;
+        r.ops = ops;
+        r.min = *std::min_element(samples.begin(), samples.end());
+        r.max = *std::max_element(samples.begin(), samples.end());
+        for (auto s : samples) r.mean += s;
+        r.mean /= samples.size();
+        for (auto s : samples) r.stddev += (s - r.mean) * (s - r.mean);
+        r.stddev = samples.size() > 1 ? std::sqrt(r.stddev / (samples.size() - 1)) : 0;
+        if (counts_hits) r.hit_rate = hits / (static_cast<double>(ops) * options.repetitions);
+
+        std::clog << std::left << std::setw(28) << name << std::right << std::fixed
+                  << std::setprecision(2) << std::setw(10) << r.mean << " ns/op  +- "
+                  << std::setw(6) << r.stddev << std::setw(10) << 1e3 / r.mean << " Mops/s\n";
+        std::clog.unsetf(std::ios::floatfield);
+        results.push_back(r);
+    }
+
+    // Writes the results as JSON; returns false, after printing why, if that fails
+    bool write_json() const {
+        auto file = options.output.empty() ? stdout : fopen(options.output.c_str(), "w");
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << options.output << "'.\n";
+            return false;
+        }
+
+        char date[32];
+        auto now = std::time(nullptr);
+        strftime(date, sizeof(date), "%Y-%m-%dT%H:%M:%SZ", gmtime(&now));
+
+        fprintf(file, "{\n  \"context\": {\"date\": \"%s\", \"compiler\": \"%s\", \"stats\": %s, "
+                      "\"repetitions\": %d, \"warmup\": %d, \"min_time\": %g},\n  \"benchmarks\": [",
+                date, __VERSION__, stats_enabled ? "true" : "false",
+                options.repetitions, options.warmup, options.min_time);
+        for (size_t i = 0; i < results.size(); i++) {
+            const auto& r = results[i];
+            fprintf(file, "%s\n    {\"name\": \"%s\", \"ops_per_repetition\": %zu, "
+                          "\"ns_per_op\": {\"mean\": %.4f, \"stddev\": %.4f, \"min\": %.4f, \"max\": %.4f}, "
+                          "\"ops_per_sec\": %.0f",
+                    i ? "," : "", r.name.c_str(), r.ops, r.mean, r.stddev, r.min, r.max, 1e9 / r.mean);
+            if (r.hit_rate >= 0) fprintf(file, ", \"hit_rate\": %.4f", r.hit_rate);
+            fprintf(file, "}");
+        }
+        fprintf(file, "\n  ]\n}\n");
+
+        bool ok = !ferror(file);
+        if (file != stdout) ok = (fclose(file) == 0) && ok;
+        if (!ok) std::cerr << "ERROR: Could not write '" << options.output << "'.\n";
+        else if (file != stdout) std::clog << "Wrote " << options.output << "\n";
+        return ok;
+    }
+
+  private:
+    const bench_options& options;
+
+    template <typename Op>
+    static double time_batch(Op& op, size_t ops, double& sum) {
+        auto start = std::chrono::steady_clock::now();
+        double local = 0;
+        for (size_t i = 0; i < ops; i++)
+            local += op(i);
+        auto end = std::chrono::steady_clock::now();
+        sum += local;
+        return std::chrono::duration<double>(end - start).count();
+    }
+};
+
+
+// Rays from random points on a sphere of radius `distance` toward random points in the cube of
+// half-width `spread`, so a share of them miss whatever is near the origin
+std::vector<ray> random_rays(double distance, double spread) {
+    std::vector<ray> rays;
+    rays.reserve(table_size);
+    for (size_t i = 0; i < table_size; i++) {
+        auto origin = distance * random_unit_vector();
+        auto target = vec3::random(-spread, spread);
+        rays.emplace_back(origin, unit_vector(target - origin));
+    }
+    return rays;
+}
+
+// Small spheres, uniform over a cube or gathered in a few tight clusters
+hittable_list sphere_cloud(size_t count, bool clustered, shared_ptr<material> mat) {
+    std::vector<point3> centers;
+    for (int i = 0; i < 16; i++)
+        centers.push_back(vec3::random(-8, 8));
+
+    hittable_list list;
+    for (size_t i = 0; i < count; i++) {
+        auto center = clustered ? centers[i % centers.size()] + 1.5 * random_in_unit_sphere()
+                                : vec3::random(-10, 10);
+        list.add(make_shared<sphere>(center, random_double(0.02, 0.1), mat));
+    }
+    return list;
+}
+
+// An ostream buffer that throws its contents away, to time formatting without the disk
+class discard_buffer : public std::streambuf {
+  public:
+    discard_buffer() { setp(data, data + sizeof(data)); }
+
+  protected:
+    int overflow(int c) override {
+        setp(data, data + sizeof(data));
+        if (c != traits_type::eof()) sputc(static_cast<char>(c));
+        return traits_type::not_eof(c);
+    }
+
+  private:
+    char data[4096];
+};
+
+
+void run_benchmarks(benchmark_runner& bench) {
+    const size_t mask = table_size - 1;
+    auto mat = make_shared<lambertian>(color(.5, .5, .5));
+
+    auto rays = random_rays(4, 2);
+    auto box = aabb(point3(-1,-1,-1), point3(1,1,1));
+    bench.run("aabb::hit", [&](size_t i) {
+        return box.hit(rays[i & mask], interval(0.001, infinity)) ? 1.0 : 0.0;
+    }, true);
+
+    auto ball = sphere(point3(0,0,0), 1, mat);
+    bench.run("sphere::hit", [&](size_t i) {
+        hit_record rec;
+        return ball.hit(rays[i & mask], interval(0.001, infinity), rec) ? 1.0 : 0.0;
+    }, true);
+
+    auto square = quad(point3(-1,-1,0), vec3(2,0,0), vec3(0,2,0), mat);
+    bench.run("quad::hit", [&](size_t i) {
+        hit_record rec;
+        return square.hit(rays[i & mask], interval(0.001, infinity), rec) ? 1.0 : 0.0;
+    }, true);
+
+    auto scene_rays = random_rays(30, 10);
+    for (bool clustered : { false, true }) {
+        auto bvh_name = clustered ? "bvh_node::hit clustered" : "bvh_node::hit uniform";
+        auto motion_name = clustered ? "motion_bvh::hit clustered" : "motion_bvh::hit uniform";
+        if (!bench.selected(bvh_name) && !bench.selected(motion_name)) continue;
+
+        auto list = sphere_cloud(20000, clustered, mat);
+        auto tree = bvh_node(list);
+        bench.run(bvh_name, [&](size_t i) {
+            hit_record rec;
+            return tree.hit(scene_rays[i & mask], interval(0.001, infinity), rec) ? 1.0 : 0.0;
+        }, true);
+
+        // The binned SAH BVH that built-in scenes and scene files use
+        auto sah = motion_bvh(list);
+        bench.run(motion_name, [&](size_t i) {
+            hit_record rec;
+            return sah.hit(scene_rays[i & mask], interval(0.001, infinity), rec) ? 1.0 : 0.0;
+        }, true);
+    }
+
+    std::vector<point3> points;
+    for (size_t i = 0; i < table_size; i++)
+        points.push_back(vec3::random(-4, 4));
+    auto noise = perlin();
+    bench.run("perlin::turb", [&](size_t i) {
+        return noise.turb(points[i & mask], 7);
+    });
+
+    if (bench.selected("image_texture::value")) {
+        if (rtw_image::find_file("image/earthmap.jpg").empty()) {
+            std::clog << "Skipping image_texture::value, image/earthmap.jpg not found\n";
+        } else {
+            auto earth = image_texture("image/earthmap.jpg");
+            std::vector<std::pair<double, double>> uvs;
+            for (size_t i = 0; i < table_size; i++)
+                uvs.emplace_back(random_double(), random_double());
+            bench.run("image_texture::value", [&](size_t i) {
+                const auto& uv = uvs[i & mask];
+                return earth.value(uv.first, uv.second, points[i & mask]).x();
+            });
+        }
+    }
+
+    bench.run("random_unit_vector", [](size_t) {
+        return random_unit_vector().x();
+    });
+
+    std::vector<color> pixels;
+    for (size_t i = 0; i < table_size; i++)
+        pixels.push_back(100 * color::random(0, 1.2));
+    discard_buffer buffer;
+    std::ostream out(&buffer);
+    bench.run("write_color", [&](size_t i) {
+        write_color(out, pixels[i & mask], 100);
+        return 0.0;
+    });
+}
+
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  -o, --output <file>      Write the JSON results to a file instead of stdout\n"
+              << "  -f, --filter <text>      Only run benchmarks whose name contains the text\n"
+              << "  -r, --repetitions <n>    Timed repetitions per benchmark (default 10)\n"
+              << "  -w, --warmup <n>         Untimed repetitions before those (default 2)\n"
+              << "  -m, --min-time <ms>      Shortest repetition (default 25)\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    bench_options options;
+
+    for (int i = 1; i < argc; i++) {
+        const char* flag = argv[i];
+        auto is = [flag](const char* short_name, const char* long_name) {
+            return strcmp(flag, short_name) == 0 || strcmp(flag, long_name) == 0;
+        };
+        if (is("-h", "--help")) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char* value = argv[++i];
+        if      (is("-o", "--output"))       options.output = value;
+        else if (is("-f", "--filter"))       options.filter = value;
+        else if (is("-r", "--repetitions"))  options.repetitions = atoi(value);
+        else if (is("-w", "--warmup"))       options.warmup = atoi(value);
+        else if (is("-m", "--min-time"))     options.min_time = atof(value) / 1000;
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (options.repetitions < 1 || options.warmup < 0) {
+        std::cerr << "ERROR: Need at least one repetition.\n";
+        return EXIT_FAILURE;
+    }
+    if (stats_enabled)
+        std::clog << "Built with STATS=1; the counters slow every kernel down\n";
+
+    benchmark_runner bench(options);
+    run_benchmarks(bench);
+    return bench.write_json() ? EXIT_SUCCESS : EXIT_FAILURE;
+}
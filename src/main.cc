@@ -3,25 +3,346 @@
 #include "sphere.h"
 #include "quad.h"
 #include "bvh.h"
+#include "motion_bvh.h"
+#include "compressed_bvh.h"
 #include "texture.h"
 #include "constant_medium.h"
+#include "grid_medium.h"
+#include "scene_file.h"
+#include "snapshot.h"
+#include "out_of_core.h"
+#include "render_server.h"
 
 #include <iostream>
+#include <fstream>
 #include <chrono>
+#include <cstring>
+#include <functional>
+#include <memory>
+#include <string>
+
+
+/**
+ * @brief Settings given on the command line. Unset overrides keep the scene's own values.
+ * 
+ */
+struct render_options {
+    std::string output;         // Image path, std::cout if empty
+    std::string save_snapshot;  // Also write the scene to this snapshot file before rendering
+    std::string remote;         // Render server socket; the scene is rendered there if set
+    render_request overrides;   // Camera and sampling overrides, same as a server job takes
+    int frames = 0;             // Frames of an animated scene to render, 0 for the scene's count
+    bvh_build_options bvh;      // How scene files and built-in scenes build their BVHs
+    int bvh_report = 0;         // Camera rays to compare BVH builders with instead of rendering
+    size_t out_of_core = 0;     // Memory cap in MB for streaming snapshot geometry, 0 to map it all
+    int denoise = 0;            // À-trous denoiser passes over the image, 0 for none
+    std::string features;       // Write albedo, normal and depth images with this path prefix
+    std::string aov;            // Also write every AOV layer to this OpenEXR file
+    int integrator = -1;        // render_mode to use instead of the scene's, -1 to keep it
+    size_t photons = 0;         // Photons per pass for render_mode::photons, 0 for the camera's
+    double photon_radius = 0;   // First photon lookup radius, 0 for the camera's
+    double photon_alpha = 0;    // Photon radius shrink rate, 0 for the camera's
+    int cache_depth = 0;        // Diffuse bounces before the radiance cache, 0 for the camera's
+    double cache_cell = 0;      // Radiance cache cell size, 0 for the camera's
+    std::string stats;          // Print ray statistics and write cost heatmaps with this prefix
+    std::string profile;        // Write a Chrome trace of the profiled scopes to this file
+};
+
+render_options options;
+
+// Objects of the BVH --bvh-report rebuilds with each method: the last one scene_bvh() built
+std::vector<shared_ptr<hittable>> report_objects;
+
+// Summed over every BVH build_bvh() built for a built-in scene
+bvh_build_stats builtin_bvh_stats;
+
+
+/**
+ * @brief BVH over objects of a built-in scene, built the way --bvh asks.
+ *
+ */
+shared_ptr<hittable> build_bvh(const hittable_list& objects) {
+    if (options.bvh.compressed) {
+        auto tree = make_shared<compressed_bvh>(objects.objects, options.bvh);
+        builtin_bvh_stats.add(tree->stats);
+        return tree;
+    }
+    auto tree = make_shared<motion_bvh>(objects.objects, 1, options.bvh);
+    builtin_bvh_stats.add(tree->stats);
+    return tree;
+}
+
+/**
+ * @brief Same as build_bvh(), for the one BVH of a built-in scene that --bvh-report compares.
+ *
+ */
+shared_ptr<hittable> scene_bvh(const hittable_list& objects) {
+    report_objects = objects.objects;
+    return build_bvh(objects);
+}
+
+
+/**
+ * @brief Prints how long the scene's BVHs took to build and how much memory they take.
+ *
+ */
+void print_bvh_stats(const bvh_build_stats& bvh) {
+    std::clog << "Built BVH (" << bvh_build_options::method_name(options.bvh.method) << ") over "
+              << bvh.primitives << " primitives in " << bvh.seconds << " seconds, "
+              << bvh.primitives_per_second() / 1e6 << "M primitives/s, "
+              << bvh.bytes / 1e6 << " MB\n";
+}
+
+
+/**
+ * @brief Builds the scene with binned SAH BVHs and with spatial splits, and prints how many BVH
+ * nodes each visits on average for random camera rays plus one diffuse bounce from each of their
+ * hits. `build` makes the scene's world with the given BVH options.
+ *
+ */
+using world_builder = std::function<shared_ptr<hittable>(const bvh_build_options&, bvh_build_stats&)>;
+
+void bvh_report(camera cam, const world_builder& build) {
+    options.overrides.apply(cam);
+
+    const bvh_method methods[] = { bvh_method::sah, bvh_method::sbvh };
+    std::vector<shared_ptr<hittable>> worlds;
+    std::vector<bvh_build_stats> stats(2);
+    for (int m = 0; m < 2; m++) {
+        auto bvh = options.bvh;
+        bvh.method = methods[m];
+        worlds.push_back(build(bvh, stats[m]));
+    }
+
+    auto rays = cam.sample_rays(options.bvh_report);
+    auto camera_rays = rays.size();
+    for (size_t i = 0; i < camera_rays; i++) {
+        hit_record rec;
+        if (worlds[0]->hit(rays[i], interval(0.001, infinity), rec))
+            rays.push_back(ray(rec.p, rec.normal + random_unit_vector(), rays[i].time()));
+    }
+
+    std::clog << "BVH node visits over " << camera_rays << " camera rays and "
+              << rays.size() - camera_rays << " bounce rays:\n";
+    double baseline = 0;
+    for (int m = 0; m < 2; m++) {
+        size_t visits = 0;
+        motion_bvh::visit_counter = &visits;
+        for (const auto& r : rays) {
+            hit_record rec;
+            worlds[m]->hit(r, interval(0.001, infinity), rec);
+        }
+        motion_bvh::visit_counter = nullptr;
+        auto per_ray = static_cast<double>(visits) / rays.size();
+
+        std::clog << "  " << bvh_build_options::method_name(methods[m]) << ": " << per_ray
+                  << " visits/ray, " << stats[m].nodes << " nodes, " << stats[m].references
+                  << " references to " << stats[m].primitives << " primitives, built in "
+                  << stats[m].seconds << " seconds";
+        if (m == 0)
+            baseline = per_ray;
+        else if (baseline > 0)
+            std::clog << ", " << 100 * (1 - per_ray / baseline) << "% fewer visits";
+        std::clog << "\n";
+    }
+}
+
+
+/**
+ * @brief Writes the feature buffers as <prefix>_albedo.ppm, <prefix>_normal.ppm (mapped from
+ * -1..1) and <prefix>_depth.ppm (black at the nearest hit, white at the farthest and for misses).
+ *
+ */
+void write_features(const std::string& prefix, const feature_buffers& f) {
+    double near = infinity, far = 0;
+    for (auto d : f.depth) {
+        if (d == infinity) continue;
+        near = std::min(near, d);
+        far = std::max(far, d);
+    }
+
+    auto write = [&](const std::string& name, const std::function<color(size_t)>& value) {
+        std::ofstream file(prefix + "_" + name + ".ppm");
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << prefix << "_" << name << ".ppm'.\n";
+            return;
+        }
+        file << "P3\n" << f.width << ' ' << f.height << "\n255\n";
+        static const interval intensity(0.000, 0.999);
+        for (size_t i = 0; i < f.albedo.size(); i++) {
+            auto c = value(i);
+            file << static_cast<int>(256 * intensity.clamp(c.x())) << ' '
+                 << static_cast<int>(256 * intensity.clamp(c.y())) << ' '
+                 << static_cast<int>(256 * intensity.clamp(c.z())) << '\n';
+        }
+    };
+
+    write("albedo", [&](size_t i) { return f.albedo[i]; });
+    write("normal", [&](size_t i) { return 0.5 * (f.normal[i] + vec3(1,1,1)); });
+    write("depth", [&](size_t i) {
+        auto d = f.depth[i] == infinity || far <= near ? 1.0 : (f.depth[i] - near) / (far - near);
+        return color(d, d, d);
+    });
+}
 
 
 /**
  * @brief Measures the time it takes to render the scene.
  * 
  */
-void timed_render(camera cam, hittable_list world) {
+void timed_render(camera cam, const hittable& world, const std::string& output = options.output) {
+    if (options.bvh_report > 0) {
+        if (report_objects.empty()) {
+            std::cerr << "ERROR: --bvh-report needs a built-in scene or a scene file.\n";
+            return;
+        }
+        bvh_report(cam, [](const bvh_build_options& bvh, bvh_build_stats& stats) {
+            auto tree = make_shared<motion_bvh>(report_objects, 1, bvh);
+            stats = tree->stats;
+            return tree;
+        });
+        return;
+    }
+
+    if (builtin_bvh_stats.primitives > 0)
+        print_bvh_stats(builtin_bvh_stats);
+
+    if (!options.save_snapshot.empty())
+        scene_snapshot::write(options.save_snapshot, world, cam);
+
+    options.overrides.apply(cam);
+    if (options.integrator >= 0) cam.mode = static_cast<render_mode>(options.integrator);
+    if (options.photons > 0) cam.photons_per_pass = options.photons;
+    if (options.photon_radius > 0) cam.photon_radius = options.photon_radius;
+    if (options.photon_alpha > 0) cam.photon_alpha = options.photon_alpha;
+    if (options.cache_depth > 0) cam.cache_depth = options.cache_depth;
+    if (options.cache_cell > 0) cam.cache_cell = options.cache_cell;
+    cam.denoise_passes = options.denoise;
+    cam.collect_features = !options.features.empty();
+    framebuffer aovs;
+    if (!options.aov.empty()) cam.aovs = &aovs;
+    stats_report stats;
+    if (!options.stats.empty()) cam.stats = &stats;
+
+    std::ofstream file;
+    if (!output.empty()) {
+        file.open(output);
+        if (!file) {
+            std::cerr << "ERROR: Could not open output file '" << output << "'.\n";
+            return;
+        }
+    }
+
     auto start = std::chrono::system_clock::now();
 
-    cam.render(world);
+    cam.render(world, output.empty() ? std::cout : file);
 
     auto end = std::chrono::system_clock::now();
     auto elapsed = std::chrono::duration_cast<std::chrono::seconds>(end - start);
     std::clog << "Render time: " << elapsed.count() << " seconds" << "\n";
+    texture_cache::global().report(std::clog);
+
+    if (!options.stats.empty()) {
+        stats.print(std::clog, std::chrono::duration<double>(end - start).count());
+        stats.write_heatmaps(options.stats);
+    }
+
+    if (!options.features.empty())
+        write_features(options.features, cam.features);
+    if (!options.aov.empty())
+        aovs.write_exr(options.aov);
+}
+
+
+/**
+ * @brief Output path of one frame. `pattern` may hold one %d, optionally with a zero flag and
+ * width as in %04d, and %% for a percent sign; without a %d the frame number goes in front of
+ * the extension. Returns false, leaving `path` unspecified, for any other use of %.
+ *
+ */
+bool frame_path(const std::string& pattern, int frame, std::string& path) {
+    path.clear();
+    bool numbered = false;
+    for (size_t i = 0; i < pattern.size(); i++) {
+        if (pattern[i] != '%') {
+            path += pattern[i];
+        } else if (i + 1 < pattern.size() && pattern[i+1] == '%') {
+            path += '%';
+            i++;
+        } else {
+            auto end = pattern.find_first_not_of("0123456789", i + 1);
+            if (numbered || end == std::string::npos || pattern[end] != 'd' || end - i > 3)
+                return false;
+
+            auto spec = pattern.substr(i + 1, end - i - 1);
+            auto width = spec.empty() ? 0 : static_cast<size_t>(std::stoi(spec));
+            auto number = std::to_string(frame);
+            if (number.size() < width)
+                number.insert(0, width - number.size(), spec[0] == '0' ? '0' : ' ');
+            path += number;
+            numbered = true;
+            i = end;
+        }
+    }
+
+    if (!numbered) {
+        auto dot = path.find_last_of('.');
+        auto slash = path.find_last_of('/');
+        if (dot == std::string::npos || (slash != std::string::npos && dot < slash))
+            dot = path.size();
+        auto number = std::to_string(frame);
+        path.insert(dot, "_" + std::string(number.size() < 4 ? 4 - number.size() : 0, '0') + number);
+    }
+    return true;
+}
+
+/**
+ * @brief Renders the frames of an animated scene back to back. Static geometry, textures and
+ * materials are loaded once; between frames only the animated objects move and their BVH is
+ * refit, or rebuilt when refitting has made it too slow.
+ *
+ */
+void render_sequence(scene_file& scene) {
+    auto& animation = scene.animation;
+    auto frames = options.frames > 0 ? options.frames : animation.frames;
+
+    if (options.output.empty()) {
+        std::cerr << "ERROR: Animations need --output, e.g. frame_%04d.ppm.\n";
+        return;
+    }
+    std::string path;
+    if (!frame_path(options.output, 0, path)) {
+        std::cerr << "ERROR: The output pattern '" << options.output
+                  << "' may only hold one %d (e.g. %04d) and %%.\n";
+        return;
+    }
+
+    auto start = std::chrono::steady_clock::now();
+    for (int frame = 0; frame < frames; frame++) {
+        auto update_start = std::chrono::steady_clock::now();
+        bool rebuilt = animation.set_frame(frame, scene.cam);
+        auto update = std::chrono::duration<double>(std::chrono::steady_clock::now() - update_start);
+
+        std::clog << "Frame " << frame + 1 << "/" << frames;
+        if (animation.bvh) {
+            std::clog << ": BVH " << (rebuilt ? "rebuilt" : "refit") << " in "
+                      << update.count() * 1000 << " ms, cost " << animation.bvh->cost()
+                      << " (" << animation.bvh->last_build_cost() << " when built)";
+        }
+        std::clog << "\n";
+
+        frame_path(options.output, frame, path);
+        timed_render(scene.cam, scene.world, path);
+        options.save_snapshot.clear();     // Only the first frame is saved
+    }
+
+    auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+    std::clog << "Rendered " << frames << " frames in " << elapsed.count() << " seconds";
+    if (animation.bvh) {
+        std::clog << " (" << animation.bvh->refits << " refits, "
+                  << animation.bvh->rebuilds << " rebuilds)";
+    }
+    std::clog << "\n";
 }
 
 
@@ -69,7 +390,8 @@ void random_spheres() {
     auto material3 = make_shared<metal>(color(0.7, 0.6, 0.5), 0.0);
     world.add(make_shared<sphere>(point3(4, 1, 0), 1.0, material3));
 
-    world = hittable_list(make_shared<bvh_node>(world));
+    // The bouncing spheres move during the exposure
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -97,7 +419,7 @@ void two_spheres() {
 
     world.add(make_shared<sphere>(point3(0,-10, 0), 10, make_shared<lambertian>(checker)));
     world.add(make_shared<sphere>(point3(0, 10, 0), 10, make_shared<lambertian>(checker)));
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -122,7 +444,7 @@ void earth() {
     auto earth_texture = make_shared<image_texture>("image/earthmap.jpg");
     auto earth_surface = make_shared<lambertian>(earth_texture);
     auto globe = make_shared<sphere>(point3(0,0,0), 2, earth_surface);
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -148,7 +470,7 @@ void two_noise_spheres() {
     auto noise_texture = make_shared<tiled_noise_texture>(0.2);
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(noise_texture)));
     world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(noise_texture)));
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -174,7 +496,7 @@ void two_perlin_spheres() {
     auto pertext = make_shared<perlin_noise_texture>(4);
     world.add(make_shared<sphere>(point3(0,-1000,0), 1000, make_shared<lambertian>(pertext)));
     world.add(make_shared<sphere>(point3(0,2,0), 2, make_shared<lambertian>(pertext)));
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -210,7 +532,7 @@ void quads() {
     world.add(make_shared<quad>(point3( 3,-2, 1), vec3(0, 0, 4), vec3(0, 4, 0), right_blue));
     world.add(make_shared<quad>(point3(-2, 3, 1), vec3(4, 0, 0), vec3(0, 0, 4), upper_orange));
     world.add(make_shared<quad>(point3(-2,-3, 5), vec3(4, 0, 0), vec3(0, 0,-4), lower_teal));
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -226,7 +548,7 @@ void quads() {
 
     cam.defocus_angle = 0;
 
-    cam.render(world);
+    timed_render(cam, world);
 }
 
 
@@ -239,7 +561,7 @@ void simple_light() {
 
     auto difflight = make_shared<diffuse_light>(color(4,4,4));
     world.add(make_shared<quad>(point3(3,1,-2), vec3(2,0,0), vec3(0,2,0), difflight));
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -256,7 +578,7 @@ void simple_light() {
 
     cam.defocus_angle = 0;
 
-    cam.render(world);
+    timed_render(cam, world);
 }
 
 
@@ -286,7 +608,7 @@ void cornell_box() {
     box2 = make_shared<rotate_y>(box2, -18);
     box2 = make_shared<translate>(box2, vec3(130,0,65));
     world.add(box2);
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -303,7 +625,7 @@ void cornell_box() {
 
     cam.defocus_angle = 0;
 
-    cam.render(world);
+    timed_render(cam, world);
 }
 
 void cornell_smoke() {
@@ -332,7 +654,7 @@ void cornell_smoke() {
     world.add(make_shared<constant_medium>(box1, 0.01, color(0,0,0)));
     world.add(make_shared<constant_medium>(box2, 0.01, color(1,1,1)));
     
-    world = hittable_list(make_shared<bvh_node>(world));
+    world = hittable_list(scene_bvh(world));
 
     camera cam;
 
@@ -349,7 +671,51 @@ void cornell_smoke() {
 
     cam.defocus_angle = 0;
 
-    cam.render(world);
+    timed_render(cam, world);
+}
+
+void cornell_cloud() {
+    hittable_list world;
+
+    auto red   = make_shared<lambertian>(color(.65, .05, .05));
+    auto white = make_shared<lambertian>(color(.73, .73, .73));
+    auto green = make_shared<lambertian>(color(.12, .45, .15));
+    auto light = make_shared<diffuse_light>(color(7, 7, 7));
+
+    world.add(make_shared<quad>(point3(555,0,0), vec3(0,555,0), vec3(0,0,555), green));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(0,555,0), vec3(0,0,555), red));
+    world.add(make_shared<quad>(point3(113,554,127), vec3(330,0,0), vec3(0,0,305), light));
+    world.add(make_shared<quad>(point3(0,555,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(0,0,0), vec3(555,0,0), vec3(0,0,555), white));
+    world.add(make_shared<quad>(point3(0,0,555), vec3(555,0,0), vec3(0,555,0), white));
+
+    // Procedural cloud: turbulence eroding a soft sphere, mostly empty towards the corners
+    perlin noise;
+    auto cloud = make_shared<density_grid>(96, 96, 96, [&](double x, double y, double z) {
+        auto r = (point3(x, y, z) - point3(0.5, 0.5, 0.5)).length() * 2;
+        auto d = (1 - r) + 0.6 * noise.turb(4 * point3(x, y, z)) - 0.3;
+        return d > 0 ? d : 0.0;
+    });
+    world.add(make_shared<grid_medium>(cloud, aabb(point3(128,50,128), point3(428,350,428)), 0.05, color(1,1,1)));
+
+    world = hittable_list(scene_bvh(world));
+
+    camera cam;
+
+    cam.aspect_ratio      = 1.0;
+    cam.image_width       = 600;
+    cam.samples_per_pixel = 200;
+    cam.max_depth         = 50;
+    cam.background        = color(0,0,0);
+
+    cam.vfov     = 40;
+    cam.lookfrom = point3(278, 278, -800);
+    cam.lookat   = point3(278, 278, 0);
+    cam.vup      = vec3(0,1,0);
+
+    cam.defocus_angle = 0;
+
+    timed_render(cam, world);
 }
 
 void final_scene(int image_width, int samples_per_pixel, int max_depth) {
@@ -373,7 +739,7 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
 
     hittable_list world;
 
-    world.add(make_shared<bvh_node>(boxes1));
+    world.add(scene_bvh(boxes1));
 
     auto light = make_shared<diffuse_light>(color(7, 7, 7));
     world.add(make_shared<quad>(point3(123,554,147), vec3(300,0,0), vec3(0,0,265), light));
@@ -391,8 +757,6 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     auto boundary = make_shared<sphere>(point3(360,150,145), 70, make_shared<dielectric>(1.5));
     world.add(boundary);
     world.add(make_shared<constant_medium>(boundary, 0.2, color(0.2, 0.4, 0.9)));
-    boundary = make_shared<sphere>(point3(0,0,0), 5000, make_shared<dielectric>(1.5));
-    world.add(make_shared<constant_medium>(boundary, .0001, color(1,1,1)));
 
     auto emat = make_shared<lambertian>(make_shared<image_texture>("image/earthmap.jpg"));
     world.add(make_shared<sphere>(point3(400,200,400), 100, emat));
@@ -408,7 +772,7 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
 
     world.add(make_shared<translate>(
         make_shared<rotate_y>(
-            make_shared<bvh_node>(boxes2), 15),
+            build_bvh(boxes2), 15),
             vec3(-100,270,395)
         )
     );
@@ -421,6 +785,9 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
     cam.max_depth         = max_depth;
     cam.background        = color(0,0,0);
 
+    // Thin atmosphere filling a sphere of radius 5000 around the scene
+    cam.fog = homogeneous_fog(.0001, color(1,1,1), point3(0,0,0), 5000);
+
     cam.vfov     = 40;
     cam.lookfrom = point3(478, 278, -600);
     cam.lookat   = point3(278, 278, 0);
@@ -428,12 +795,13 @@ void final_scene(int image_width, int samples_per_pixel, int max_depth) {
 
     cam.defocus_angle = 0;
 
-    cam.render(world);
+    timed_render(cam, world);
 }
 
 
-int main() {
-    int choice = 10;
+void builtin_scene(int choice) {
+    // Building the scene is the part of this scope before the render
+    profile_scope scope("built-in scene", choice);
     switch (choice) {
         case 1: random_spheres(); break;
         case 2: two_spheres();    break;
@@ -445,7 +813,200 @@ int main() {
         case 8: cornell_box();    break;
         case 9: cornell_smoke();  break;
         case 10: final_scene(800, 10000, 40); break;
+        case 11: cornell_cloud(); break;
         default: final_scene(400,   250,  4); break;
     }
+}
+
+
+void write_profile() {
+    if (!options.profile.empty())
+        profiler::global().write_chrome_trace(options.profile);
+}
+
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  -s, --scene <file>     Render a scene file\n"
+              << "  -S, --snapshot <file>  Render a binary scene snapshot\n"
+              << "      --save-snapshot <file>  Write the scene to a snapshot before rendering\n"
+              << "      --out-of-core <MB> Stream the snapshot's geometry from disk, keeping at most MB in memory\n"
+              << "  -b, --builtin <n>      Render built-in scene n (default 10)\n"
+              << "  -o, --output <file>    Write the image to a file instead of stdout\n"
+              << "      --frames <count>   Frames of an animated scene; -o names them, e.g. f_%04d.ppm\n"
+              << "      --bvh <method>     BVH builder: sah (default), sbvh, lbvh or median\n"
+              << "      --bvh-nodes <kind> BVH nodes: binary (default) or compressed, 8-wide with 8-bit bounds\n"
+              << "      --sbvh-budget <f>  Extra references sbvh may add, as a fraction of the primitives (default 0.3)\n"
+              << "      --bvh-report <rays>  Compare node visits of the sah and sbvh builders instead of rendering\n"
+              << "      --integrator <name>  recursive, wavefront, bdpt for bidirectional path tracing,\n"
+              << "                           photons, guided for path guiding, or nee for shadow\n"
+              << "                           rays to lights picked from a light BVH\n"
+              << "      --photons <count>  Photons per pass of progressive photon mapping, one pass per sample\n"
+              << "      --photon-radius <r>  First photon lookup radius (default 1/100 of the scene)\n"
+              << "      --photon-alpha <a> How fast the photon radius shrinks, in (0, 1) (default 2/3)\n"
+              << "      --cache <bounces>  End paths in a radiance cache after this many diffuse bounces (1 is fastest)\n"
+              << "      --cache-cell <size>  Radiance cache cell size (default 1/50 of the scene)\n"
+              << "      --denoise <passes> Filter the image with an edge-aware à-trous denoiser (5 passes is typical)\n"
+              << "      --features <prefix>  Also write first-hit albedo, normal and depth images\n"
+              << "      --aov <file.exr>   Also write depth, normal, albedo, IDs and the light split by bounce as EXR layers\n"
+              << "      --profile <file.json>  Write a Chrome trace of where the time went (chrome://tracing, ui.perfetto.dev)\n"
+              << "      --stats <prefix>   Print ray statistics and write <prefix>_nodes.ppm and _tests.ppm cost\n"
+              << "                         heatmaps; needs a build with make STATS=1\n"
+              << "  -w, --width <pixels>   Override the image width\n"
+              << "  -n, --spp <count>      Override the samples per pixel\n"
+              << "  -d, --depth <count>    Override the maximum bounce depth\n"
+              << "  -t, --threads <count>  Render threads, 0 for one per hardware thread\n"
+              << "      --region <x,y,w,h> Render only this part of the image\n"
+              << "      --lookfrom <x,y,z>, --lookat <x,y,z>, --vfov <degrees>  Move the camera\n"
+              << "  -r, --remote <socket>  Render the scene on a render server (bin/server)\n"
+              << "      --priority <n>     Job priority on the render server, higher first\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    std::string scene, snapshot;
+    int choice = 10;
+
+    for (int i = 1; i < argc; i++) {
+        const char* flag = argv[i];
+        auto is = [flag](const char* short_name, const char* long_name) {
+            return strcmp(flag, short_name) == 0 || strcmp(flag, long_name) == 0;
+        };
+        if (is("-h", "--help")) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char* value = argv[++i];
+        if      (is("-s", "--scene"))   scene = value;
+        else if (is("-S", "--snapshot")) snapshot = value;
+        else if (strcmp(flag, "--save-snapshot") == 0) options.save_snapshot = value;
+        else if (strcmp(flag, "--out-of-core") == 0 && atol(value) > 0) options.out_of_core = atol(value);
+        else if (is("-b", "--builtin")) choice = atoi(value);
+        else if (is("-o", "--output"))  options.output = value;
+        else if (is("-r", "--remote"))  options.remote = value;
+        else if (is("-w", "--width"))   options.overrides.image_width = atoi(value);
+        else if (is("-n", "--spp"))     options.overrides.samples_per_pixel = atoi(value);
+        else if (is("-d", "--depth"))   options.overrides.max_depth = atoi(value);
+        else if (is("-t", "--threads")) options.overrides.threads = atoi(value);
+        else if (strcmp(flag, "--frames") == 0) options.frames = atoi(value);
+        else if (strcmp(flag, "--bvh") == 0 && bvh_build_options::parse_method(value, options.bvh.method)) {}
+        else if (strcmp(flag, "--bvh-report") == 0) options.bvh_report = atoi(value);
+        else if (strcmp(flag, "--sbvh-budget") == 0) options.bvh.duplication_budget = atof(value);
+        else if (strcmp(flag, "--bvh-nodes") == 0 && (strcmp(value, "binary") == 0 || strcmp(value, "compressed") == 0))
+            options.bvh.compressed = strcmp(value, "compressed") == 0;
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "recursive") == 0)
+            options.integrator = static_cast<int>(render_mode::recursive);
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "wavefront") == 0)
+            options.integrator = static_cast<int>(render_mode::wavefront);
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "bdpt") == 0)
+            options.integrator = static_cast<int>(render_mode::bdpt);
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "photons") == 0)
+            options.integrator = static_cast<int>(render_mode::photons);
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "guided") == 0)
+            options.integrator = static_cast<int>(render_mode::guided);
+        else if (strcmp(flag, "--integrator") == 0 && strcmp(value, "nee") == 0)
+            options.integrator = static_cast<int>(render_mode::nee);
+        else if (strcmp(flag, "--photons") == 0) options.photons = static_cast<size_t>(atol(value));
+        else if (strcmp(flag, "--photon-radius") == 0) options.photon_radius = atof(value);
+        else if (strcmp(flag, "--photon-alpha") == 0) options.photon_alpha = atof(value);
+        else if (strcmp(flag, "--cache") == 0) options.cache_depth = atoi(value);
+        else if (strcmp(flag, "--cache-cell") == 0) options.cache_cell = atof(value);
+        else if (strcmp(flag, "--denoise") == 0) options.denoise = atoi(value);
+        else if (strcmp(flag, "--features") == 0) options.features = value;
+        else if (strcmp(flag, "--aov") == 0) options.aov = value;
+        else if (strcmp(flag, "--profile") == 0) {
+            options.profile = value;
+            profiler::global().enable();
+        }
+        else if (strcmp(flag, "--stats") == 0) {
+            if (!stats_enabled) {
+                std::cerr << "ERROR: --stats needs a build with statistics, see make STATS=1.\n";
+                return EXIT_FAILURE;
+            }
+            options.stats = value;
+        }
+        else if (strcmp(flag, "--priority") == 0) options.overrides.priority = atoi(value);
+        else if (strcmp(flag, "--vfov") == 0) options.overrides.vfov = atof(value);
+        else if (strcmp(flag, "--region") == 0 && render_request::parse_numbers(value, options.overrides.region, 4)) {}
+        else if (strcmp(flag, "--lookfrom") == 0 && render_request::parse_point(value, options.overrides.lookfrom))
+            options.overrides.has_lookfrom = true;
+        else if (strcmp(flag, "--lookat") == 0 && render_request::parse_point(value, options.overrides.lookat))
+            options.overrides.has_lookat = true;
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    if (!options.remote.empty()) {
+        // The server resolves paths from its own working directory
+        char resolved[PATH_MAX];
+        auto path = snapshot.empty() ? scene : snapshot;
+        if (path.empty() || !realpath(path.c_str(), resolved)) {
+            std::cerr << "ERROR: --remote needs an existing scene or snapshot file.\n";
+            return EXIT_FAILURE;
+        }
+        options.overrides.scene = resolved;
+
+        std::ofstream file;
+        if (!options.output.empty()) file.open(options.output);
+        bool ok = submit_render(options.remote, options.overrides, options.output.empty() ? std::cout : file);
+        return ok ? EXIT_SUCCESS : EXIT_FAILURE;
+    }
+
+    options.bvh.threads = options.overrides.threads > 0 ? options.overrides.threads : 0;
+
+    if (scene.empty() && snapshot.empty()) {
+        builtin_scene(choice);
+        write_profile();
+        return EXIT_SUCCESS;
+    }
+
+    try {
+        auto start = std::chrono::steady_clock::now();
+        camera cam;
+        shared_ptr<hittable> world;
+        std::unique_ptr<scene_file> loaded;
+        shared_ptr<streamed_scene> streamed;
+        if (!snapshot.empty() && options.out_of_core > 0) {
+            // Only the wavefront integrator traces in batches that share cluster page-ins
+            streamed = make_shared<streamed_scene>(snapshot, cam, options.out_of_core * 1024 * 1024);
+            cam.mode = render_mode::wavefront;
+            world = streamed;
+        } else if (!snapshot.empty()) {
+            world = scene_snapshot::load(snapshot, cam);
+        } else {
+            loaded = std::make_unique<scene_file>(scene, options.bvh);
+            cam = loaded->cam;
+            world = make_shared<hittable_list>(loaded->world);
+        }
+        auto elapsed = std::chrono::duration<double>(std::chrono::steady_clock::now() - start);
+        std::clog << "Loaded " << (snapshot.empty() ? scene : snapshot) << " in "
+                  << elapsed.count() << " seconds\n";
+        if (loaded && loaded->bvh_stats.primitives > 0)
+            print_bvh_stats(loaded->bvh_stats);
+
+        if (loaded && options.bvh_report > 0) {
+            bvh_report(cam, [&scene](const bvh_build_options& bvh, bvh_build_stats& stats) {
+                scene_file file(scene, bvh);
+                stats = file.bvh_stats;
+                return make_shared<hittable_list>(file.world);
+            });
+        } else if (loaded && (!loaded->animation.empty() || options.frames > 0))
+            render_sequence(*loaded);
+        else
+            timed_render(cam, *world);
+
+        if (streamed) streamed->report(std::clog);
+    } catch (const std::exception& e) {
+        std::cerr << "ERROR: " << e.what() << "\n";
+        return EXIT_FAILURE;
+    }
+    write_profile();
     return EXIT_SUCCESS;
-}
\ No newline at end of file
+}
@@ -0,0 +1,44 @@
+#include "render_server.h"
+
+#include <cstring>
+#include <iostream>
+#include <string>
+
+
+void usage(const char* program) {
+    std::cerr << "Usage: " << program << " [options]\n"
+              << "  -l, --listen <path>    UNIX socket to listen on (default /tmp/rtw.sock)\n"
+              << "  -c, --scenes <count>   Scenes kept loaded between jobs (default 8)\n";
+}
+
+
+int main(int argc, char* argv[]) {
+    std::string socket_path = "/tmp/rtw.sock";
+    int scene_capacity = 8;
+
+    for (int i = 1; i < argc; i++) {
+        const char* flag = argv[i];
+        auto is = [flag](const char* short_name, const char* long_name) {
+            return strcmp(flag, short_name) == 0 || strcmp(flag, long_name) == 0;
+        };
+        if (is("-h", "--help")) {
+            usage(argv[0]);
+            return EXIT_SUCCESS;
+        }
+        if (i + 1 >= argc) {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+
+        const char* value = argv[++i];
+        if      (is("-l", "--listen"))  socket_path = value;
+        else if (is("-c", "--scenes"))  scene_capacity = atoi(value);
+        else {
+            usage(argv[0]);
+            return EXIT_FAILURE;
+        }
+    }
+
+    render_server server(socket_path, static_cast<size_t>(scene_capacity));
+    return server.run() ? EXIT_SUCCESS : EXIT_FAILURE;
+}